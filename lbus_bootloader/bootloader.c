@@ -22,6 +22,7 @@
  */
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/scb.h>
@@ -62,6 +63,11 @@ uint16_t blink_interval = BOOTLOADER_BLINK_INTERVAL;
  */
 extern uint8_t lbus_address;
 
+#ifdef LBUS_SIM
+/* provided by the LBUS simulator, see lbus_sim/ */
+void sim_run_firmware(void) __attribute__((noreturn));
+#endif
+
 /* Test firmware consistency against its own stored CRC32
  *
  * @return 0 if tested OK, -1 for an impossible stored size, -2 for a
@@ -96,58 +102,105 @@ static int check_firmware(void) {
 static void handle_READ_MEMORY(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
 	LBUS_HANDLE_COMPLETE(static struct lbus_READ_MEMORY, d, p, rbyte) {
 		uint32_t *src = (uint32_t*) d.address;
-		lbus_start_tx();
+		const uint16_t length = header->length - p - sizeof(uint32_t);
 		CRC_CR = 1; /* reset */
-		for(uint16_t c = header->length - p - sizeof(uint32_t); c > 0; c-=4) {
-			CRC_DR = *src;
-			lbus_send32(src++);
+		/* exactly the bytes sent, the last word padded with zeros */
+		for(uint16_t c = 0; c < length; c+=4) {
+			uint32_t w = src[c/4];
+			if(length - c < 4)
+				w &= 0xFFFFFFFF >> (8 * (4 - (length - c)));
+			CRC_DR = w;
 		}
 		uint32_t crc = CRC_DR;
+		lbus_start_tx();
+		lbus_send_ref(src, length);
 		lbus_send32(&crc);
 		lbus_end_pkg();
 	}
 }
 
-/* LBUS handler for GET_DATA request */
+#ifndef LBUS_SMALL
+/* Commands handled by lbus_handler() below */
+static const uint8_t commands[] = {
+	PING, GET_DATA, ERASE_CONFIG, SET_ADDRESS, READ_MEMORY, FLASH_FIRMWARE,
+	RESET_TO_FIRMWARE, RESET_TO_BOOTLOADER
+};
+#endif
+
+/* Data for GET_DATA and GET_DATA_MULTI requests */
+unsigned int lbus_get_data(const uint16_t type, void *buf) {
+	uint8_t *b = buf;
+	uint32_t v;
+	switch(type) {
+		case LBUS_DATA_STATUS:
+			b[0] = LBUS_STATE_IN_BOOTLOADER;
+			return 1;
+		case LBUS_DATA_ADDRESS:
+			b[0] = lbus_address;
+			return 1;
+		case LBUS_DATA_FIRMWARE_VERSION:
+			v = firmware_config->version;
+			break;
+		case LBUS_DATA_BOOTLOADER_VERSION:
+			v = VERSION;
+			break;
+		case LBUS_DATA_FIRMWARE_NAME_LENGTH:
+			b[0] = lbus_name_length(firmware_config->name);
+			return 1;
+		case LBUS_DATA_FIRMWARE_NAME: {
+				const unsigned int l = lbus_name_length(firmware_config->name);
+				memcpy(buf, firmware_config->name, l);
+				return l;
+			}
+#ifndef LBUS_SMALL
+		case LBUS_DATA_CAPABILITIES: {
+				struct lbus_capabilities caps;
+				lbus_capabilities(&caps);
+				for(unsigned int i=0; i<sizeof(commands); i++)
+					lbus_cap_set_command(caps.commands, commands[i]);
+				memcpy(buf, &caps, sizeof(caps));
+				return sizeof(caps);
+			}
+#endif
+		default:
+			return 0;
+	}
+	memcpy(buf, &v, sizeof(v));
+	return sizeof(v);
+}
+
+/* LBUS handler for GET_DATA request
+ *
+ * Sends as much of the data as fits into the packet, padded with zeros
+ */
 static void handle_GET_DATA(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
 	LBUS_HANDLE_COMPLETE(static struct lbus_GET_DATA, d, p, rbyte) {
+		uint8_t buf[LBUS_DATA_MAX];
+		const unsigned int space = header->length - p;
+		unsigned int l = lbus_get_data(d.type, buf);
+		if(l > space)
+			l = space;
 		lbus_start_tx();
-		switch(d.type) {
-			case LBUS_DATA_STATUS:
-				lbus_send(LBUS_STATE_IN_BOOTLOADER);
-				break;
-			case LBUS_DATA_ADDRESS:
-				lbus_send(lbus_address);
-				break;
-			case LBUS_DATA_FIRMWARE_VERSION:
-				lbus_send32(&firmware_config->version);
-				break;
-			case LBUS_DATA_BOOTLOADER_VERSION:
-				{
-					uint32_t bootloader_version = VERSION;
-					lbus_send32(&bootloader_version);
-				}
-				break;
-			case LBUS_DATA_FIRMWARE_NAME_LENGTH:
-				{
-					uint8_t l=0;
-					for(const char* n=firmware_config->name; *n != '\0'; n++) 
-						l++;
-					lbus_send(l);
-				}
-				break;
-			case LBUS_DATA_FIRMWARE_NAME:
-				for(unsigned int i=0; i < header->length - p; i++)
-					lbus_send(firmware_config->name[i]);
-				break;
-			default:
-				for(int i=p; i<header->length; i++) 
-					lbus_send(0);
-		}
+		lbus_send_buf(buf, l);
+		for(; l < space; l++)
+			lbus_send(0);
 		lbus_end_pkg();
 	}
 }
 
+#ifdef LBUS_SCAN
+/* SCAN reply data, see LBUS_SCAN
+ *
+ * The firmware's config section might be erased, lbus_name_hash() does
+ * not run past LBUS_NAME_MAX characters then.
+ */
+void lbus_scan_info(struct lbus_scan *info) {
+	info->status = LBUS_STATE_IN_BOOTLOADER;
+	info->version = firmware_config->version;
+	info->name_hash = lbus_name_hash(firmware_config->name);
+}
+#endif
+
 /* LBUS handler for SET_ADDRESS request
  *
  * Will transmit back 1 status byte:
@@ -285,14 +338,21 @@ static void run_firmware(void) {
 	/* store bootloader version in BKP_DR2,3 */
 	BKP_DR2 = VERSION & 0xFFFF;
 	BKP_DR3 = VERSION >> 16;
+	/* tell the firmware that config banks may be switched */
+	BKP_DR4 = (VERSION & 0xFFFF) ^ BOOTINFO_CONFIG_BANKS;
 
 	/* Set vector table base address. */
 	SCB_VTOR = FW_ADDRESS & 0xFFFF;
+#ifdef LBUS_SIM
+	/* the simulator loads the firmware image instead */
+	sim_run_firmware();
+#else
 	/* Initialise master stack pointer. */
 	asm volatile("msr msp, %0"::"g"
 			 (*(volatile uint32_t *)FW_ADDRESS));
 	/* Jump to application. */
 	(*(void (**)())(FW_ADDRESS + 4))();
+#endif
 }
 
 /* blink timer ISR */
@@ -21,53 +21,368 @@
  * IN THE SOFTWARE.
  */
 #include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
 #include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/f1/bkp.h>
 #include "platform.h"
 #include "config.h"
 
-/* find configuration item in config space in flash
- * will return the last found matching item (except for CONFIG_UNSET type,
- * in which case it will return the "first" such item - i.e. the first
- * slot not yet filled with config data).
- * If no config for the given type is found, NULL will be returned.
+/* The config space is split into two banks of CONFIG_BANK_SIZE bytes.
+ * Items are appended to the active bank. When it is full, the latest item
+ * of each type is copied to the other bank, which then becomes the active
+ * one by a CONFIG_BANK item at its start that is written last: it holds a
+ * generation number, one more than the one of the bank it replaces. A
+ * bank without a complete CONFIG_BANK item is not used, so a power loss
+ * while copying leaves the old bank active. When neither bank has one
+ * (erased config space, or a log written before there were banks), the
+ * log starts at CONFIG_ADDRESS: such a log can only be copied to the other
+ * bank when it has not grown into it.
+ *
+ * Compacting takes a while, it runs within the config_write() or
+ * config_commit() that finds the active bank full: erasing the 8 pages of
+ * a bank (up to 40 msec each) and copying up to a bank of items (up to
+ * 70 usec per half word), about 610 msec at worst. LBUS requests that
+ * write config are given that long, see LBUS_CONFIG_WRITE_MAX_MS.
+ *
+ * Bootloaders from before there were banks read the config space as one
+ * log from its start. The store only switches banks when the bootloader
+ * has announced that it knows them (BOOTINFO_CONFIG_BANKS), otherwise it
+ * stays a single log over the whole config space, full when it ends.
+ *
+ * Built with CONFIG_SMALL (the bootloader), there is neither the RAM index
+ * nor compaction nor the batch API: items are found by scanning the active
+ * bank and config_write() fails when it is full.
  */
-struct config_item* config_find_item(const uint32_t type) {
-	struct config_item* found = NULL;
-	void *config = (void*)CONFIG_ADDRESS;
-	while(config < (void*)(CONFIG_ADDRESS + CONFIG_SIZE)) {
+#define BANK_ADDRESS(bank) ((void*)(CONFIG_ADDRESS + (bank) * CONFIG_BANK_SIZE))
+
+/* Index of the config items in flash
+ *
+ * Holds the latest item of each type, sorted by type, so lookups are a
+ * binary search instead of a scan through the whole config space. It is
+ * built by the first lookup and kept up to date by config_write().
+ * Types that do not fit into the index are looked up by scanning.
+ */
+static struct {
+	bool valid;
+	/* there are more types in flash than fit into the index */
+	bool overflow;
+	/* banks may be switched, see banks_supported() */
+	bool banks;
+	/* active bank and its generation, 0 for a log without CONFIG_BANK */
+	unsigned int bank;
+	uint16_t generation;
+	unsigned int count;
+	/* start of the log, first free slot and end of the space for it */
+	void *start;
+	void *end;
+	void *limit;
+#ifndef CONFIG_SMALL
+	struct {
+		uint32_t type;
+		struct config_item *item;
+	} entries[CONFIG_INDEX_SIZE];
+#endif
+} config_index;
+
+#ifdef CONFIG_SMALL
+static inline bool busy_enter(void) {
+	return true;
+}
+static inline void busy_leave(void) {
+}
+#else
+/* A lookup or write is in progress: when an ISR interrupts it (e.g. an
+ * LBUS handler while the main loop writes, see lbus_poll()), its own
+ * lookups and writes fail instead of seeing a half updated store.
+ */
+static volatile bool busy;
+/* the store has been compacted, config_compacted() is to be called */
+static bool compacted;
+
+static bool busy_enter(void) {
+	if(busy)
+		return false;
+	busy = true;
+	return true;
+}
+
+static void busy_leave(void) {
+	busy = false;
+	/* it looks items up again */
+	if(compacted) {
+		compacted = false;
+		config_compacted();
+	}
+}
+#endif
+
+/* size of an item in flash, data is padded to 4-byte alignment */
+static inline uint32_t item_size(const uint32_t length) {
+	return (length + sizeof(uint32_t)*2 + 3) & (~(3));
+}
+
+/* generation of a bank, 0 if it does not start with a complete CONFIG_BANK
+ * item: the generation is stored with its complement in the upper half
+ * word, so a partially programmed value does not count
+ */
+static uint16_t bank_generation(const unsigned int bank) {
+	const struct config_item *item = BANK_ADDRESS(bank);
+	const uint32_t v = *((uint32_t*)((void*)item + sizeof(struct config_item)));
+	if(item->type != CONFIG_BANK || item->length != sizeof(uint32_t)
+		|| (v >> 16) != (~v & 0xFFFF))
+	{
+		return 0;
+	}
+	return v & 0xFFFF;
+}
+
+#ifdef CONFIG_SMALL
+/* the bootloader knows about banks, it just does not switch them */
+#define banks_supported() true
+#else
+/* whether the bootloader has set BKP_DR4, see BOOTINFO_CONFIG_BANKS */
+static bool banks_supported(void) {
+	RCC_APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+	return BKP_DR4 == ((BKP_DR2 & 0xFFFF) ^ BOOTINFO_CONFIG_BANKS);
+}
+#endif
+
+/* whether the CONFIG_COMMIT item at commit completes the batch whose
+ * items start at batch
+ */
+static inline bool batch_complete(void *batch, void *commit) {
+	return batch != NULL && *((uint32_t*)(commit + sizeof(struct config_item))) == commit - batch;
+}
+
+#ifdef CONFIG_SMALL
+static inline void index_add(struct config_item *item) {
+}
+#else
+/* position of type in the index, or where it would have to be inserted */
+static unsigned int index_search(const uint32_t type) {
+	unsigned int lo = 0, hi = config_index.count;
+	while(lo < hi) {
+		const unsigned int mid = (lo + hi) / 2;
+		if(config_index.entries[mid].type < type)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* put an item into the index, replacing an earlier one of its type */
+static void index_add(struct config_item *item) {
+	const unsigned int i = index_search(item->type);
+	if(i < config_index.count && config_index.entries[i].type == item->type) {
+		config_index.entries[i].item = item;
+		return;
+	}
+	if(config_index.count == CONFIG_INDEX_SIZE) {
+		config_index.overflow = true;
+		return;
+	}
+	memmove(&config_index.entries[i+1], &config_index.entries[i],
+		(config_index.count - i) * sizeof(config_index.entries[0]));
+	config_index.entries[i].type = item->type;
+	config_index.entries[i].item = item;
+	config_index.count++;
+}
+#endif
+
+/* find the active bank, scan its log and build the index */
+static void index_build(void) {
+	const uint16_t gen0 = bank_generation(0);
+	const uint16_t gen1 = bank_generation(1);
+	config_index.banks = banks_supported();
+	config_index.bank = (gen1 != 0 && (gen0 == 0 || (int16_t)(gen1 - gen0) > 0)) ? 1 : 0;
+	config_index.generation = config_index.bank ? gen1 : gen0;
+	config_index.start = BANK_ADDRESS(config_index.bank);
+	/* a log without CONFIG_BANK might span the whole config space */
+	void *limit = config_index.generation ? BANK_ADDRESS(config_index.bank + 1)
+		: (void*)(CONFIG_ADDRESS + CONFIG_SIZE);
+	void *config = config_index.start;
+	void *batch = NULL;
+	config_index.count = 0;
+	config_index.overflow = false;
+	while(config < limit) {
 		struct config_item *item = (struct config_item *)config;
-		if(item->type == type)
-			found = item;
 		if(item->type == CONFIG_UNSET) // erased flash
 			break;
+		/* not at the start: the other bank's, incompletely written */
+		if(item->type == CONFIG_BANK && config != config_index.start)
+			break;
+		if(item->length > CONFIG_SIZE || config + item_size(item->length) > limit) {
+			/* broken item: the log ends here, no more writes to it */
+			limit = config;
+			break;
+		}
+		if(item->type == CONFIG_BATCH) {
+			batch = config + item_size(0);
+		} else if(item->type == CONFIG_COMMIT) {
+			/* the items of a batch count when it is complete */
+			if(batch_complete(batch, config))
+				for(void *b = batch; b < config; b += item_size(((struct config_item *)b)->length))
+					index_add((struct config_item *)b);
+			batch = NULL;
+		} else if(batch == NULL) {
+			index_add(item);
+		}
 		/* skip to next 4-byte aligned item */
-		config += (item->length + sizeof(uint32_t)*2 + 3) & (~(3));
+		config += item_size(item->length);
+	}
+	/* an incomplete batch ends the log, like a broken item */
+	if(batch != NULL)
+		limit = config;
+	config_index.end = config;
+	/* a single log for older bootloaders, see above */
+	if(config_index.banks && config <= BANK_ADDRESS(config_index.bank + 1)
+		&& limit > BANK_ADDRESS(config_index.bank + 1))
+		limit = BANK_ADDRESS(config_index.bank + 1);
+	config_index.limit = limit;
+	config_index.valid = true;
+}
+
+/* find the last item of a type by scanning the log, for types that did
+ * not fit into the index
+ */
+static struct config_item* config_scan(const uint32_t type) {
+	struct config_item* found = NULL;
+	struct config_item* in_batch = NULL;
+	void *batch = NULL;
+	for(void *config = config_index.start; config < config_index.end; ) {
+		struct config_item *item = (struct config_item *)config;
+		if(item->type == CONFIG_BATCH) {
+			batch = config + item_size(0);
+			in_batch = NULL;
+		} else if(item->type == CONFIG_COMMIT) {
+			if(in_batch != NULL && batch_complete(batch, config))
+				found = in_batch;
+			batch = NULL;
+		} else if(item->type == type) {
+			if(batch == NULL)
+				found = item;
+			else
+				in_batch = item;
+		}
+		config += item_size(item->length);
 	}
 	return found;
 }
 
-/* convenience function for accessing configuration consisting of one word of data */
-uint32_t config_get_uint32(const uint32_t type) {
-	void *dst = config_find_item(type);
-	if(dst == NULL) return 0;
-	return *((uint32_t*)(dst + sizeof(struct config_item)));
+/* config_find_item() without the busy check, for use while writing */
+static struct config_item* find_item(const uint32_t type) {
+	if(!config_index.valid)
+		index_build();
+	if(type == CONFIG_UNSET) {
+		if(config_index.end >= config_index.limit)
+			return NULL;
+		return config_index.end;
+	}
+#ifdef CONFIG_SMALL
+	return config_scan(type);
+#else
+	const unsigned int i = index_search(type);
+	if(i < config_index.count && config_index.entries[i].type == type)
+		return config_index.entries[i].item;
+	if(config_index.overflow)
+		return config_scan(type);
+	return NULL;
+#endif
 }
 
-/* write a new configuration item to config space in flash memory.
- * data will be 4-byte aligned when writing, but original length information
- * will be retained.
+/* find configuration item in config space in flash
+ * will return the last found matching item (except for CONFIG_UNSET type,
+ * in which case it will return the "first" such item - i.e. the first
+ * slot not yet filled with config data).
+ * If no config for the given type is found, NULL will be returned, as
+ * well as when called from an ISR that interrupted a config write.
+ * Items move when the config store is compacted, see config_compacted().
+ */
+struct config_item* config_find_item(const uint32_t type) {
+	if(!busy_enter())
+		return NULL;
+	struct config_item *item = find_item(type);
+	busy_leave();
+	return item;
+}
+
+#ifdef CONFIG_SMALL
+static inline int compact(const uint32_t room) {
+	return -2;
+}
+#else
+/* Default for applications that do not keep pointers to config items */
+__attribute__((weak)) void config_compacted(void) {
+}
+
+/* items of the active bank that are copied by compact() */
+static inline bool item_is_latest(struct config_item *item) {
+	return item->type < CONFIG_COMMIT && find_item(item->type) == item;
+}
+
+/* copy the latest items to the other bank and make that the active one
  *
- * @return 0 if successful, -2 when no space for storing data is available,
- *         -1 when there is not enough space for the requested length
+ * room is the number of bytes that must be free afterwards.
+ * @return 0 if successful, -2 when the bootloader does not know about
+ *         banks or a log from before there were banks has grown into the
+ *         other bank, -1 when there would not be enough room
  */
-int config_write(const uint32_t type, const uint32_t length, const void* data) {
-	uint32_t *dst = (uint32_t*) config_find_item(CONFIG_UNSET);
-	if(dst == NULL)
+static int compact(const uint32_t room) {
+	if(!config_index.banks || (config_index.bank == 0 && config_index.end > BANK_ADDRESS(1)))
 		return -2;
-	if(dst + length + 3 >= (uint32_t*)(CONFIG_ADDRESS + CONFIG_SIZE))
+	const unsigned int bank = config_index.bank ^ 1;
+	uint32_t size = item_size(sizeof(uint32_t)) + room;
+	for(void *config = config_index.start; config < config_index.end; ) {
+		struct config_item *item = (struct config_item *)config;
+		if(item_is_latest(item))
+			size += item_size(item->length);
+		config += item_size(item->length);
+	}
+	if(size > CONFIG_BANK_SIZE)
 		return -1;
 
 	flash_unlock();
+	/* the first page goes first, with the CONFIG_BANK item of an old copy */
+	for(void *page = BANK_ADDRESS(bank); page < BANK_ADDRESS(bank + 1); page += FLASH_PAGE_SIZE)
+		flash_erase_page((uint32_t)page);
+	uint32_t dst = (uint32_t)BANK_ADDRESS(bank) + item_size(sizeof(uint32_t));
+	for(void *config = config_index.start; config < config_index.end; ) {
+		struct config_item *item = (struct config_item *)config;
+		const uint32_t length = item_size(item->length);
+		if(item_is_latest(item)) {
+			for(uint32_t p = 0; p < length; p += sizeof(uint32_t))
+				flash_program_word(dst + p, *((uint32_t*)(config + p)));
+			dst += length;
+		}
+		config += length;
+	}
+	uint16_t generation = config_index.generation + 1;
+	if(generation == 0)
+		generation = 1;
+	const uint32_t header = (uint32_t)BANK_ADDRESS(bank);
+	flash_program_word(header, CONFIG_BANK);
+	flash_program_word(header + sizeof(uint32_t), sizeof(uint32_t));
+	flash_program_word(header + 2*sizeof(uint32_t), ((uint32_t)(uint16_t)~generation << 16) | generation);
+	flash_lock();
+
+	index_build();
+	compacted = true;
+	return 0;
+}
+#endif
+
+/* convenience function for accessing configuration consisting of one word of data */
+uint32_t config_get_uint32(const uint32_t type) {
+	void *dst = config_find_item(type);
+	if(dst == NULL) return 0;
+	return *((uint32_t*)(dst + sizeof(struct config_item)));
+}
+
+/* program an item to flash (unlocked) at dst, returns the address after it */
+static uint32_t *item_program(uint32_t *dst, const uint32_t type, const uint32_t length, const void* data) {
 	/* write header information */
 	flash_program_word((uint32_t)(dst++), type);
 	flash_program_word((uint32_t)(dst++), length);
@@ -86,10 +401,126 @@ int config_write(const uint32_t type, const uint32_t length, const void* data) {
 			v = v | (((uint8_t*)data)[p++] << 16);
 		flash_program_word((uint32_t)(dst++), v);
 	}
+	return dst;
+}
+
+/* make room for size bytes at the end of the log, compacting it if needed */
+static int config_room(const uint32_t size) {
+	if(!config_index.valid)
+		index_build();
+	if(config_index.end + size > config_index.limit)
+		return compact(size);
+	return 0;
+}
+
+static int item_write(const uint32_t type, const uint32_t length, const void* data) {
+	if(type >= CONFIG_COMMIT || length > CONFIG_BANK_SIZE)
+		return -1;
+	const int ret = config_room(item_size(length));
+	if(ret < 0)
+		return ret;
+
+	flash_unlock();
+	uint32_t *dst = item_program(config_index.end, type, length, data);
 	flash_lock();
+	index_add((struct config_item *)config_index.end);
+	config_index.end = dst;
 	return 0;
 }
 
+/* write a new configuration item to config space in flash memory.
+ * data will be 4-byte aligned when writing, but original length information
+ * will be retained. When the active bank is full, the config store is
+ * compacted first, which takes a while (erasing a bank).
+ *
+ * @return 0 if successful, -2 when no space for storing data is available,
+ *         -1 when there is not enough space for the requested length,
+ *         -3 when called from an ISR that interrupted a config write
+ */
+int config_write(const uint32_t type, const uint32_t length, const void* data) {
+	if(!busy_enter())
+		return -3;
+	const int ret = item_write(type, length, data);
+	busy_leave();
+	return ret;
+}
+
+#ifndef CONFIG_SMALL
+/* Batched writes
+ *
+ * The items are written when committing, with a single flash unlock, between
+ * a CONFIG_BATCH item and a CONFIG_COMMIT item holding the number of bytes
+ * in between. Without a matching CONFIG_COMMIT item, e.g. after a power loss,
+ * the items of a batch are ignored.
+ */
+static struct {
+	unsigned int count;
+	struct {
+		uint32_t type;
+		uint32_t length;
+		const void *data;
+	} items[CONFIG_BATCH_MAX];
+} config_batch;
+
+/* start a batch of config writes */
+void config_begin(void) {
+	config_batch.count = 0;
+}
+
+/* add an item to the current batch, the data is not copied: it must stay
+ * valid until config_commit()
+ *
+ * @return 0 if successful, -1 when the batch is full or the item is invalid
+ */
+int config_put(const uint32_t type, const uint32_t length, const void* data) {
+	if(type >= CONFIG_COMMIT || length > CONFIG_BANK_SIZE || config_batch.count == CONFIG_BATCH_MAX)
+		return -1;
+	config_batch.items[config_batch.count].type = type;
+	config_batch.items[config_batch.count].length = length;
+	config_batch.items[config_batch.count].data = data;
+	config_batch.count++;
+	return 0;
+}
+
+static int batch_write(void) {
+	uint32_t size = 0;
+	for(unsigned int i=0; i<config_batch.count; i++)
+		size += item_size(config_batch.items[i].length);
+	if(size > CONFIG_BANK_SIZE)
+		return -1;
+	const int ret = config_room(item_size(0) + size + item_size(sizeof(uint32_t)));
+	if(ret < 0)
+		return ret;
+
+	flash_unlock();
+	uint32_t *dst = item_program(config_index.end, CONFIG_BATCH, 0, NULL);
+	struct config_item *first = (struct config_item *)dst;
+	for(unsigned int i=0; i<config_batch.count; i++)
+		dst = item_program(dst, config_batch.items[i].type, config_batch.items[i].length, config_batch.items[i].data);
+	dst = item_program(dst, CONFIG_COMMIT, sizeof(uint32_t), &size);
+	flash_lock();
+	for(unsigned int i=0; i<config_batch.count; i++) {
+		index_add(first);
+		first = (struct config_item *)((void*)first + item_size(first->length));
+	}
+	config_index.end = dst;
+	config_batch.count = 0;
+	return 0;
+}
+
+/* write the items of the current batch, all or none of them count
+ *
+ * @return 0 if successful, see config_write() for errors
+ */
+int config_commit(void) {
+	if(!busy_enter())
+		return -3;
+	const int ret = batch_write();
+	busy_leave();
+	return ret;
+}
+#endif
+
 /* convenience function to store a single word of configuration */
 int config_set_uint32(const uint32_t type, const uint32_t value) {
 	return config_write(type, sizeof(uint32_t), &value);
@@ -102,4 +533,5 @@ void config_erase(void) {
 		flash_erase_page((uint32_t)config);
 	}
 	flash_lock();
+	config_index.valid = false;
 }
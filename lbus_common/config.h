@@ -5,18 +5,36 @@
 
 enum config_type {
 	CONFIG_LBUS_ADDRESS = 1,
+	CONFIG_LBUS_BAUDRATE,
+	CONFIG_LBUS_GROUPS, /* LBUS_MAX_GROUPS bytes packed into one word */
 
 	/* config for PWM LEDs: */
-	CONFIG_LED_GROUP = 0x00010000,
+	CONFIG_LED_GROUP = 0x00010000, /* first value used from LED_FRAME */
 	CONFIG_LED_LUT8TO16 = 0x00011000, /* reserved up to 0x000110FF */
   CONFIG_LED_POLARITY = 0x00011100,
 
+	/* used by the config store itself, see config.c */
+	CONFIG_COMMIT = 0xFFFFFFFC, /* end of a complete batch of items */
+	CONFIG_BATCH = 0xFFFFFFFD, /* start of a batch of items */
+	CONFIG_BANK = 0xFFFFFFFE, /* marks the active bank */
+
 	/* 0xFFFFFFFF will be the value present after the config space has
 	 * been erased, so it is reserved here
 	 */
 	CONFIG_UNSET = 0xFFFFFFFF
 };
 
+/* number of item types kept in the RAM index of the config store,
+ * further types are found by scanning the config space
+ */
+#define CONFIG_INDEX_SIZE 32
+
+/* the config space is used as two banks, see config.c */
+#define CONFIG_BANK_SIZE (CONFIG_SIZE / 2)
+
+/* maximum number of items in a batch, see config_begin() */
+#define CONFIG_BATCH_MAX 16
+
 struct config_item {
 	uint32_t type;
 	uint32_t length;
@@ -26,9 +44,24 @@ struct config_item {
 uint32_t config_get_uint32(const uint32_t type);
 int config_set_uint32(const uint32_t type, const uint32_t value);
 
+/* batched writes: the items put between config_begin() and config_commit()
+ * are written in one go, after a power loss either all or none of them are
+ * there. Their data must stay valid until config_commit().
+ * Not available when built with CONFIG_SMALL.
+ */
+void config_begin(void);
+int config_put(const uint32_t type, const uint32_t length, const void* data);
+int config_commit(void);
+
 /* low-level API: */
 struct config_item* config_find_item(const uint32_t type);
 int config_write(const uint32_t type, const uint32_t length, const void* data);
 void config_erase(void);
 
+/* define this in your application when it keeps pointers to config items:
+ * they have been moved to the other bank, e.g. by a config_write() that
+ * found the active bank full
+ */
+void config_compacted(void);
+
 #endif // _CONFIG_H_
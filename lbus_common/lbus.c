@@ -22,15 +22,20 @@
  */
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/pwr.h>
 #include <libopencm3/stm32/f1/bkp.h>
 #include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/dwt.h>
 
 #include "lbus.h"
 #include "platform.h"
@@ -39,34 +44,1148 @@
 static struct lbus_hdr lbus_header;
 static volatile int pkg_pos;
 static lbus_recv_func recv_func;
+static volatile bool transmitting = false;
 uint8_t lbus_address;
 
+static void recv(const uint8_t rbyte, const struct lbus_hdr* hdr, const unsigned int p);
+
+#if defined(LBUS_DMA_RX) || defined(LBUS_DEFERRED)
+/* received characters are passed through a ring buffer */
+#define LBUS_RX_RING
+#endif
+#ifdef LBUS_ADDRESS_MARKS
+static bool rx_mute(void);
+#endif
+static void timeout_update(void);
+
+#ifdef LBUS_SCAN
+/* waiting for our SCAN reply slot, see scan_wait() */
+static volatile bool scan_pending;
+#else
+#define scan_pending false
+#endif
+
+#ifdef LBUS_COMPACT
+/* Compact container being received: the command for its frames and
+ * the number of container bytes following the current frame
+ */
+static bool compact_active;
+static uint8_t compact_cmd;
+static unsigned int compact_left;
+static void compact_next(void);
+#define compact_abort() (compact_active = false)
+/* a container is complete only at its end, not between its frames */
+#define rx_in_packet() (pkg_pos != 0 || compact_active)
+#else
+#define compact_abort()
+#define rx_in_packet() (pkg_pos != 0)
+#endif
+
+#ifdef LBUS_PROFILE
+static struct lbus_profile profile[LBUS_PROFILE_PROBES];
+
+#define PROFILE_START(var) const uint32_t var = dwt_read_cycle_counter()
+#define PROFILE_END(var, probe) profile_record(probe, dwt_read_cycle_counter() - var)
+
+static void profile_record(const unsigned int probe, const uint32_t cycles) {
+	struct lbus_profile *p = &profile[probe];
+	if(p->count == 0 || cycles < p->min)
+		p->min = cycles;
+	if(cycles > p->max)
+		p->max = cycles;
+	p->count++;
+	p->total += cycles;
+	/* bucket by bit length, 6 bits (<64) being the first one */
+	int bucket = (32 - __builtin_clz(cycles | 1)) - 6;
+	if(bucket < 0)
+		bucket = 0;
+	if(bucket >= LBUS_PROFILE_BUCKETS)
+		bucket = LBUS_PROFILE_BUCKETS - 1;
+	p->histogram[bucket]++;
+}
+
+/* LBUS handler for GET_PROFILE request
+ *
+ * Will transmit back a struct lbus_profile, all zero for unknown probes
+ */
+static void handle_GET_PROFILE(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	(void)header;
+	LBUS_HANDLE_COMPLETE(static struct lbus_GET_PROFILE, d, p, rbyte) {
+		struct lbus_profile r;
+		memset(&r, 0, sizeof(r));
+		if(d.probe < LBUS_PROFILE_PROBES) {
+			const uint32_t mask = cm_mask_interrupts(1);
+			r = profile[d.probe];
+			if(d.flags & LBUS_PROFILE_RESET)
+				memset(&profile[d.probe], 0, sizeof(r));
+			cm_mask_interrupts(mask);
+		}
+		lbus_start_tx();
+		lbus_send_buf(&r, sizeof(r));
+		lbus_end_pkg();
+	}
+}
+#else
+#define PROFILE_START(var)
+#define PROFILE_END(var, probe)
+#endif
+
+#ifdef LBUS_STATS
+static struct lbus_stats stats;
+#define STATS_ADD(counter, n) stats.counter += (n)
+
+/* Count USART errors as flagged in the status register */
+static inline void stats_usart_errors(const uint32_t sr) {
+	if(sr & USART_SR_ORE)
+		stats.overrun_errors++;
+	if(sr & USART_SR_FE)
+		stats.framing_errors++;
+	if(sr & USART_SR_NE)
+		stats.noise_errors++;
+}
+
+/* Take a snapshot of the counters */
+void lbus_read_stats(struct lbus_stats *s, const bool reset) {
+	const uint32_t mask = cm_mask_interrupts(1);
+	*s = stats;
+	if(reset)
+		memset(&stats, 0, sizeof(stats));
+	cm_mask_interrupts(mask);
+}
+
+/* Send a snapshot of the counters */
+void lbus_send_stats(const bool reset) {
+	struct lbus_stats s;
+	lbus_read_stats(&s, reset);
+	lbus_send_buf(&s, sizeof(s));
+}
+#else
+#define STATS_ADD(counter, n) do {} while(0)
+#define stats_usart_errors(sr) (void)(sr)
+#endif
+
+#ifdef LBUS_ADDRESS_MARKS
+static uint8_t lbus_framing = LBUS_FRAMING_PLAIN;
+
+/* Receive callback when waiting for the start of a packet */
+static inline lbus_recv_func idle_recv_func(void) {
+	/* with address marks, nothing is received until the next mark */
+	return (lbus_framing == LBUS_FRAMING_ADDRESS_MARK) ? NULL : recv;
+}
+
+/* Switch USART between 8 bit frames and 9 bit frames with address marks
+ *
+ * Wakeup from mute mode is on address mark. All nodes use the (4 bit)
+ * USART address 0, so every LBUS_ADDRESS_MARK wakes every node.
+ */
+static void set_framing(const uint8_t framing) {
+	if(framing == LBUS_FRAMING_ADDRESS_MARK) {
+		USART_CR1(LBUS_USART) |= USART_CR1_M | USART_CR1_WAKE;
+	} else {
+		USART_CR1(LBUS_USART) &= ~(USART_CR1_M | USART_CR1_WAKE | USART_CR1_RWU);
+	}
+	lbus_framing = framing;
+	recv_func = idle_recv_func();
+	timeout_update();
+}
+
+/* LBUS handler for SET_FRAMING request
+ *
+ * The switch happens after the request has been fully received.
+ */
+static void handle_SET_FRAMING(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	(void)header;
+	LBUS_HANDLE_COMPLETE(static struct lbus_SET_FRAMING, d, p, rbyte) {
+		lbus_end_pkg();
+		set_framing(d.framing);
+	}
+}
+#else
+#define idle_recv_func() recv
+#endif
+
+#ifdef LBUS_BAUDRATE_SWITCH
+static uint32_t lbus_baudrate = LBUS_BAUDRATE;
+/* current baud rate has not yet been confirmed by a valid packet */
+static bool baudrate_pending;
+static bool baudrate_persist;
+/* confirmed baud rate to be stored in config by lbus_poll(), or 0 */
+static volatile uint32_t baudrate_store;
+/* msec since the last valid packet */
+static volatile uint32_t silence;
+
+static inline bool baudrate_valid(const uint32_t baudrate) {
+	return baudrate >= LBUS_BAUDRATE && baudrate <= LBUS_BAUDRATE_MAX;
+}
+
+static void set_baudrate(const uint32_t baudrate) {
+	usart_set_baudrate(LBUS_USART, baudrate);
+	lbus_baudrate = baudrate;
+	silence = 0;
+	timeout_update();
+}
+
+/* A valid packet has been received at the current baud rate
+ *
+ * When requested, a new baud rate is stored in config now that it has
+ * proven to work, by lbus_poll(): the write may compact the config store,
+ * which takes too long for the bus path.
+ */
+static void baudrate_confirm(void) {
+	silence = 0;
+	if(baudrate_pending) {
+		baudrate_pending = false;
+		if(baudrate_persist)
+			baudrate_store = lbus_baudrate;
+	}
+}
+
+/* LBUS handler for SET_BAUDRATE request
+ *
+ * The switch happens after the request has been fully received.
+ */
+static void handle_SET_BAUDRATE(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	(void)header;
+	LBUS_HANDLE_COMPLETE(static struct lbus_SET_BAUDRATE, d, p, rbyte) {
+		lbus_end_pkg();
+		if(!baudrate_valid(d.baudrate))
+			return;
+		baudrate_persist = (d.flags & LBUS_BAUDRATE_PERSIST) != 0;
+		baudrate_pending = true;
+		if(d.baudrate == lbus_baudrate) {
+			/* this very request has been received fine */
+			baudrate_confirm();
+		} else {
+			set_baudrate(d.baudrate);
+		}
+	}
+}
+
+/* Store a confirmed baud rate, see baudrate_confirm() */
+static inline void baudrate_poll(void) {
+	const uint32_t baudrate = baudrate_store;
+	if(baudrate == 0)
+		return;
+	/* a handler was using the config store, try again */
+	if(config_get_uint32(CONFIG_LBUS_BAUDRATE) != baudrate
+		&& config_set_uint32(CONFIG_LBUS_BAUDRATE, baudrate) == -3)
+		return;
+	/* unless a newer one came in meanwhile */
+	const uint32_t mask = cm_mask_interrupts(1);
+	if(baudrate_store == baudrate)
+		baudrate_store = 0;
+	cm_mask_interrupts(mask);
+}
+
+/* Called every msec
+ *
+ * Falls back to the safe baud rate when the bus has been silent for too
+ * long, e.g. because the bus master has been restarted.
+ */
+static inline void baudrate_tick(void) {
+	if(lbus_baudrate == LBUS_BAUDRATE || transmitting || scan_pending)
+		return;
+	if(++silence >= LBUS_BAUDRATE_FALLBACK) {
+		baudrate_pending = false;
+		set_baudrate(LBUS_BAUDRATE);
+		lbus_end_pkg();
+	}
+}
+#endif
+
+/* Packet timeout in character times, see SET_TIMEOUT, 0 for the default */
+static uint16_t timeout_chars;
+/* the same in timeout timer ticks (usec) */
+static uint16_t timeout_ticks;
+
+/* Convert the packet timeout for the current baud rate and framing
+ *
+ * Rounds up to whole usec, the baud rate is taken in kBaud so this
+ * does not overflow. The default is LBUS_TIMEOUT_MIN_US at least.
+ */
+static void timeout_update(void) {
+#ifdef LBUS_BAUDRATE_SWITCH
+	const uint32_t kbaud = lbus_baudrate / 1000;
+#else
+	const uint32_t kbaud = LBUS_BAUDRATE / 1000;
+#endif
+#ifdef LBUS_ADDRESS_MARKS
+	const uint32_t bits = (lbus_framing == LBUS_FRAMING_ADDRESS_MARK) ? 11 : 10;
+#else
+	const uint32_t bits = 10;
+#endif
+	const uint32_t chars = timeout_chars ? timeout_chars : LBUS_TIMEOUT_CHARS;
+	uint32_t us = (chars * bits * 1000 + kbaud - 1) / kbaud;
+	if(timeout_chars == 0 && us < LBUS_TIMEOUT_MIN_US)
+		us = LBUS_TIMEOUT_MIN_US;
+	timeout_ticks = (us > 0xFFFF) ? 0xFFFF : us;
+	/* a SCAN slot wait has TIM1, scan_tick() restores it */
+	if(!scan_pending)
+		TIM_ARR(TIM1) = timeout_ticks;
+}
+
+#ifndef LBUS_SMALL
+/* LBUS handler for SET_TIMEOUT request
+ *
+ * Takes effect with the next packet.
+ */
+static void handle_SET_TIMEOUT(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	(void)header;
+	LBUS_HANDLE_COMPLETE(static struct lbus_SET_TIMEOUT, d, p, rbyte) {
+		lbus_end_pkg();
+		timeout_chars = d.chars;
+		timeout_update();
+	}
+}
+#endif
+
+#ifdef LBUS_TIME_SYNC
+/* bus time in msec, set by TIME_SYNC broadcasts */
+static volatile uint32_t lbus_ticks;
+static lbus_scheduled_func scheduled_func;
+static uint32_t scheduled_at;
+
+/* Check whether bus time <at> has come
+ *
+ * Times too far in the future are considered to be in the past, they
+ * are the result of a bus time jump or of a missed TIME_SYNC.
+ */
+static inline bool time_reached(const uint32_t at) {
+	return (at - lbus_ticks) == 0 || (at - lbus_ticks) > LBUS_SCHEDULE_MAX;
+}
+
+uint32_t lbus_time(void) {
+	return lbus_ticks;
+}
+
+/* Have func called (from the SysTick ISR) at bus time <at>
+ *
+ * There is a single slot, so this replaces a function that has been
+ * scheduled before. If the time has already come, func is called
+ * right away.
+ */
+void lbus_schedule(const uint32_t at, lbus_scheduled_func func) {
+	const uint32_t mask = cm_mask_interrupts(1);
+	if(time_reached(at)) {
+		scheduled_func = NULL;
+		cm_mask_interrupts(mask);
+		func();
+		return;
+	}
+	scheduled_at = at;
+	scheduled_func = func;
+	cm_mask_interrupts(mask);
+}
+
+/* Default for applications that do not need to know about TIME_SYNC */
+__attribute__((weak)) void lbus_time_synced(void) {
+}
+
+/* LBUS handler for TIME_SYNC request
+ *
+ * All nodes see the end of the packet at the same moment, so start
+ * the current msec now.
+ */
+static void handle_TIME_SYNC(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	(void)header;
+	LBUS_HANDLE_COMPLETE(static struct lbus_TIME_SYNC, d, p, rbyte) {
+		STK_CVR = 0;
+		lbus_ticks = d.time;
+		lbus_end_pkg();
+		lbus_time_synced();
+	}
+}
+
+/* Called every msec: advance bus time, run scheduled function */
+static inline void time_tick(void) {
+	lbus_ticks++;
+	if(scheduled_func != NULL && time_reached(scheduled_at)) {
+		const lbus_scheduled_func func = scheduled_func;
+		scheduled_func = NULL;
+		func();
+	}
+}
+#endif
+
+#if defined(LBUS_BAUDRATE_SWITCH) || defined(LBUS_TIME_SYNC)
+/* SysTick ISR, 1 msec */
+void sys_tick_handler(void) {
+#ifdef LBUS_TIME_SYNC
+	time_tick();
+#endif
+#ifdef LBUS_BAUDRATE_SWITCH
+	baudrate_tick();
+#endif
+}
+#endif
+
+#ifdef LBUS_GROUPS
+static uint8_t lbus_groups[LBUS_MAX_GROUPS];
+
+/* Check whether we have joined the given group address */
+static inline bool in_group(const uint8_t addr) {
+	if(addr < LBUS_GROUP_FIRST || addr > LBUS_GROUP_LAST)
+		return false;
+	for(int i=0; i<LBUS_MAX_GROUPS; i++)
+		if(lbus_groups[i] == addr)
+			return true;
+	return false;
+}
+
+/* LBUS handler for SET_GROUPS request
+ *
+ * Will transmit back 1 status byte:
+ *  0: success
+ *  other: error storing groups in config section in flash memory
+ */
+static void handle_SET_GROUPS(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	(void)header;
+	LBUS_HANDLE_COMPLETE(static struct lbus_SET_GROUPS, d, p, rbyte) {
+		uint32_t groups;
+		memcpy(&groups, d.groups, sizeof(groups));
+		/* flash is written before the bus is driven, it might take up
+		 * to LBUS_CONFIG_WRITE_MAX_MS */
+		int8_t result = config_set_uint32(CONFIG_LBUS_GROUPS, groups);
+		if(result == 0)
+			memcpy(lbus_groups, d.groups, sizeof(lbus_groups));
+		lbus_start_tx();
+		lbus_send(result);
+		lbus_end_pkg();
+	}
+}
+#else
+#define in_group(addr) false
+#endif
+
+#ifdef LBUS_SCAN
+/* our SCAN reply and the usec left until its slot */
+static struct {
+	struct lbus_hdr hdr;
+	struct lbus_scan info;
+} __packed scan_reply;
+static uint32_t scan_left;
+
+static void scan_send(void) {
+	lbus_start_tx();
+	lbus_send_buf(&scan_reply, sizeof(scan_reply));
+	lbus_end_pkg();
+}
+
+/* Let the packet timeout timer run for the next part of the wait, it is
+ * 16 bit and slots are up to seconds away
+ */
+static void scan_timer(void) {
+	const uint32_t ticks = (scan_left > 0xFFFF) ? 0xFFFF : scan_left;
+	TIM_ARR(TIM1) = ticks;
+	scan_left -= ticks;
+}
+
+/* Send the SCAN reply after <us> usec
+ *
+ * The wait is timed by the packet timeout timer, its ISR sends the reply
+ * (see scan_tick()). The replies of the nodes in the slots before ours
+ * are not received meanwhile, so they cannot reset the timer.
+ */
+static void scan_wait(const uint32_t us) {
+	if(us == 0) {
+		scan_send();
+		return;
+	}
+#ifndef LBUS_DMA_RX
+	USART_CR1(LBUS_USART) &= ~USART_CR1_RXNEIE;
+#endif
+	gpio_set(LBUS_RE_GPIO, LBUS_RE_PIN);
+	scan_pending = true;
+	scan_left = us;
+	scan_timer();
+	TIM1_CNT = 0;
+	TIM_SR(TIM1) &= ~TIM_SR_UIF;
+	TIM_CR1(TIM1) |= TIM_CR1_CEN;
+}
+
+/* The packet timeout timer has hit while waiting for our slot */
+static void scan_tick(void) {
+	if(scan_left > 0) {
+		scan_timer();
+		return;
+	}
+	TIM_CR1(TIM1) &= ~TIM_CR1_CEN;
+	TIM_ARR(TIM1) = timeout_ticks;
+	scan_pending = false;
+	scan_send();
+}
+
+/* LBUS handler for SCAN request
+ *
+ * Will transmit back a packet to LBUS_MASTER_ADDR with a struct lbus_scan
+ * in our slot, if we are within the scanned range. The other nodes skip
+ * it like any packet that is not for them.
+ */
+static void handle_SCAN(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	(void)header;
+	LBUS_HANDLE_COMPLETE(static struct lbus_SCAN, d, p, rbyte) {
+		lbus_end_pkg();
+		const unsigned int slot = lbus_address - d.first;
+		/* a node without an address would reply to itself */
+		if(lbus_address == LBUS_MASTER_ADDR || lbus_address < d.first || slot >= d.count)
+			return;
+		memset(&scan_reply, 0, sizeof(scan_reply));
+		scan_reply.hdr.length = sizeof(scan_reply);
+		scan_reply.hdr.addr = LBUS_MASTER_ADDR;
+		scan_reply.hdr.cmd = SCAN;
+		scan_reply.info.addr = lbus_address;
+		lbus_scan_info(&scan_reply.info);
+		scan_wait(slot * d.slot * LBUS_SCAN_TICK_US);
+	}
+}
+#endif
+
+#ifndef LBUS_SMALL
+/* Type list of a GET_DATA_MULTI request */
+static uint8_t data_count;
+static uint16_t data_types[LBUS_DATA_MULTI_MAX];
+
+/* Default for applications that do not support GET_DATA_MULTI */
+__attribute__((weak)) unsigned int lbus_get_data(const uint16_t type, void *buf) {
+	(void)type;
+	(void)buf;
+	return 0;
+}
+
+/* Capabilities of the common code, see LBUS_DATA_CAPABILITIES */
+void lbus_capabilities(struct lbus_capabilities *caps) {
+	memset(caps, 0, sizeof(*caps));
+	lbus_cap_set_command(caps->commands, GET_DATA_MULTI);
+	lbus_cap_set_command(caps->commands, SET_TIMEOUT);
+#ifdef LBUS_ADDRESS_MARKS
+	caps->flags |= LBUS_CAP_ADDRESS_MARKS;
+	lbus_cap_set_command(caps->commands, SET_FRAMING);
+#endif
+#ifdef LBUS_BAUDRATE_SWITCH
+	caps->flags |= LBUS_CAP_BAUDRATE_SWITCH;
+	lbus_cap_set_command(caps->commands, SET_BAUDRATE);
+	caps->baudrate_max = LBUS_BAUDRATE_MAX;
+#else
+	caps->baudrate_max = LBUS_BAUDRATE_SAFE;
+#endif
+#ifdef LBUS_GROUPS
+	caps->flags |= LBUS_CAP_GROUPS;
+	lbus_cap_set_command(caps->commands, SET_GROUPS);
+#endif
+#ifdef LBUS_TIME_SYNC
+	caps->flags |= LBUS_CAP_TIME_SYNC;
+	lbus_cap_set_command(caps->commands, TIME_SYNC);
+#endif
+#ifdef LBUS_STATS
+	caps->flags |= LBUS_CAP_STATS;
+#endif
+#ifdef LBUS_COMPACT
+	caps->flags |= LBUS_CAP_COMPACT;
+#endif
+#ifdef LBUS_SCAN
+	caps->flags |= LBUS_CAP_SCAN;
+	lbus_cap_set_command(caps->commands, SCAN);
+#endif
+#ifdef LBUS_SEQ
+	caps->flags |= LBUS_CAP_SEQ;
+#endif
+#ifdef LBUS_PROFILE
+	caps->flags |= LBUS_CAP_PROFILE;
+	lbus_cap_set_command(caps->commands, GET_PROFILE);
+#endif
+	/* packets are streamed, so there is no limit here */
+	caps->max_length = 0xFFFF;
+}
+
+/* Send the items for the received type list */
+static void send_data_multi(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	(void)data;
+	lbus_start_tx();
+	for(unsigned int i=0; i < length / sizeof(uint16_t); i++) {
+		uint8_t buf[sizeof(struct lbus_data_item) + LBUS_DATA_MAX];
+		struct lbus_data_item *item = (struct lbus_data_item *)buf;
+		item->type = data_types[i];
+		item->length = lbus_get_data(item->type, item->data);
+		const unsigned int size = sizeof(*item) + item->length;
+		if(pkg_pos + size > header->length)
+			break;
+		lbus_send_buf(item, size);
+	}
+	while(pkg_pos < header->length)
+		lbus_send(0);
+	lbus_end_pkg();
+}
+
+/* LBUS handler for GET_DATA_MULTI request, after the type count
+ *
+ * Will transmit back a struct lbus_data_item per type (as far as they fit),
+ * padded with zeros to the packet length. Longer type lists than we can
+ * take are not replied to.
+ */
+static void recv_data_count(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	(void)header;
+	(void)data;
+	if(length == 0 || data_count > LBUS_DATA_MULTI_MAX)
+		return;
+	recv_func = lbus_recv_pkg(data_types, data_count * sizeof(uint16_t), send_data_multi);
+}
+#endif
+
+/* Handle bus management requests, pass all others to the application */
+static lbus_recv_func dispatch(const struct lbus_hdr *hdr) {
+	switch(hdr->cmd) {
+#ifndef LBUS_SMALL
+		case GET_DATA_MULTI:
+			return lbus_recv_pkg(&data_count, 1, recv_data_count);
+		case SET_TIMEOUT:
+			return handle_SET_TIMEOUT;
+#endif
+#ifdef LBUS_ADDRESS_MARKS
+		case SET_FRAMING:
+			return handle_SET_FRAMING;
+#endif
+#ifdef LBUS_BAUDRATE_SWITCH
+		case SET_BAUDRATE:
+			return handle_SET_BAUDRATE;
+#endif
+#ifdef LBUS_GROUPS
+		case SET_GROUPS:
+			return handle_SET_GROUPS;
+#endif
+#ifdef LBUS_TIME_SYNC
+		case TIME_SYNC:
+			return handle_TIME_SYNC;
+#endif
+#ifdef LBUS_PROFILE
+		case GET_PROFILE:
+			return handle_GET_PROFILE;
+#endif
+#ifdef LBUS_SCAN
+		case SCAN:
+			return handle_SCAN;
+#endif
+	}
+	PROFILE_START(start);
+	const lbus_recv_func func = lbus_handler(hdr);
+	PROFILE_END(start, LBUS_PROFILE_HANDLER);
+	return func;
+}
+
+#ifdef LBUS_SEQ
+/* The last request with a sequence number and its reply */
+static struct {
+	/* it has been handled completely, so it can be replayed */
+	bool valid;
+	/* it is being handled, its reply is being recorded */
+	bool active;
+	/* the sequence number has been sent in front of the reply */
+	bool echoed;
+	/* the sequence number is to be sent at all (requests to us only) */
+	bool echo;
+	uint8_t seq;
+	uint8_t addr;
+	uint8_t cmd;
+	uint16_t length;
+	/* reply length, not replayable if more than LBUS_SEQ_REPLY_MAX */
+	unsigned int reply_length;
+	uint8_t reply[LBUS_SEQ_REPLY_MAX];
+} seq_last;
+
+/* Record reply data of the current request */
+static inline void seq_record(const void *buf, const unsigned int length) {
+	if(!seq_last.active || !seq_last.echoed)
+		return;
+	if(seq_last.reply_length + length <= LBUS_SEQ_REPLY_MAX)
+		memcpy(seq_last.reply + seq_last.reply_length, buf, length);
+	seq_last.reply_length += length;
+}
+
+/* Send the sequence number in front of the reply, not counted in pkg_pos
+ * as the handlers do not know about it
+ */
+static void seq_echo(void) {
+	lbus_send(seq_last.seq);
+	pkg_pos--;
+	seq_last.echoed = true;
+}
+
+/* Receive callback for a repeated request: skip its data, then send
+ * the recorded reply again
+ */
+static void seq_replay(const uint8_t rbyte, const struct lbus_hdr *hdr, const unsigned int p) {
+	(void)rbyte;
+	if(p + seq_last.reply_length < hdr->length)
+		return;
+	recv_func = NULL;
+	lbus_start_tx();
+	if(seq_last.echo) {
+		lbus_send(seq_last.seq);
+		pkg_pos--;
+	}
+	lbus_send_buf(seq_last.reply, seq_last.reply_length);
+	lbus_end_pkg();
+}
+
+/* Receive callback for the sequence number of a request
+ *
+ * The handlers get the request without it, i.e. without LBUS_CMD_SEQ,
+ * the sequence number and the room for its echo in the reply.
+ */
+static void recv_seq(const uint8_t rbyte, const struct lbus_hdr *hdr, const unsigned int p) {
+	(void)p;
+	const bool echo = (hdr->addr == lbus_address);
+	lbus_header.cmd &= ~LBUS_CMD_SEQ;
+	lbus_header.length -= echo ? 2 : 1;
+	pkg_pos--;
+	if(seq_last.valid && seq_last.seq == rbyte && seq_last.addr == hdr->addr
+		&& seq_last.cmd == hdr->cmd && seq_last.length == hdr->length
+		&& seq_last.reply_length <= LBUS_SEQ_REPLY_MAX)
+	{
+		/* our reply has been lost, do not handle the request again */
+		recv_func = seq_replay;
+		if(pkg_pos + seq_last.reply_length >= hdr->length)
+			seq_replay(rbyte, hdr, pkg_pos);
+		return;
+	}
+	seq_last.valid = false;
+	seq_last.active = true;
+	seq_last.echoed = false;
+	seq_last.echo = echo;
+	seq_last.seq = rbyte;
+	seq_last.addr = hdr->addr;
+	seq_last.cmd = hdr->cmd;
+	seq_last.length = hdr->length;
+	seq_last.reply_length = 0;
+	recv_func = dispatch(hdr);
+	if(recv_func == NULL && pkg_pos < hdr->length)
+		STATS_ADD(packets_unhandled, 1);
+	if(pkg_pos == hdr->length)
+		lbus_end_pkg();
+}
+
+/* The current request ends: keep it for replaying if it is complete, and
+ * acknowledge it by the sequence number if it has no reply
+ */
+static void seq_end(void) {
+	const bool complete = (pkg_pos == lbus_header.length);
+	if(complete && seq_last.echo && !seq_last.echoed)
+		lbus_start_tx();
+	seq_last.active = false;
+	seq_last.valid = complete;
+}
+#else
+#define seq_record(buf, length) do {} while(0)
+#endif
+
+/* Handle a complete packet header
+ *
+ * Calls the lbus_handler() function (via dispatch()) when the packet is
+ * for us - and either has it handled directly or gets a new receive
+ * callback for further packet data.
+ */
+static void recv_header(const struct lbus_hdr *hdr) {
+	STATS_ADD(packets, 1);
+#ifdef LBUS_COMPACT
+	if(hdr->addr == LBUS_COMPACT_ADDR && !compact_active && hdr->length > sizeof(*hdr)) {
+		compact_active = true;
+		compact_cmd = hdr->cmd;
+		compact_left = hdr->length - sizeof(*hdr);
+		compact_next();
+		return;
+	}
+#endif
+	if(hdr->addr == 0xFF || hdr->addr == lbus_address || in_group(hdr->addr)) {
+		STATS_ADD(packets_for_us, 1);
+#ifdef LBUS_SEQ
+		/* sequence number and (for requests to us) its echo */
+		const unsigned int seq_length = (hdr->addr == lbus_address) ? 2 : 1;
+		if((hdr->cmd & LBUS_CMD_SEQ) && hdr->length >= sizeof(*hdr) + seq_length) {
+			recv_func = recv_seq;
+			return;
+		}
+#endif
+		recv_func = dispatch(hdr);
+		if(recv_func == NULL && pkg_pos < hdr->length)
+			STATS_ADD(packets_unhandled, 1);
+	} else {
+		/* not for us, skip remaining packet data */
+		recv_func = NULL;
+	}
+#ifdef LBUS_ADDRESS_MARKS
+	if(recv_func == NULL && !transmitting && pkg_pos < hdr->length
+#ifdef LBUS_COMPACT
+		&& !compact_active
+#endif
+		&& lbus_framing == LBUS_FRAMING_ADDRESS_MARK && rx_mute())
+	{
+		/* the USART drops the rest, wakes up on next address mark */
+		lbus_end_pkg();
+		return;
+	}
+#endif
+	/* pkg_pos might be more actual here than the header length, when the
+	 * lbus_handler has sent some data.
+	 */
+	if(pkg_pos >= 2 && pkg_pos == hdr->length)
+		lbus_end_pkg();
+}
+
 /* Standard receive callback
  *
- * This is used for receiving the packet header. When the packet header
- * is fully received, it will call the lbus_handler() function to handle
- * the packet - either directly or by setting a new receive callback
- * for further packet data
+ * This is used for receiving the packet header, see recv_header().
  */
 static void recv(const uint8_t rbyte, const struct lbus_hdr* hdr, const unsigned int p) {
 	if(p <= sizeof(*hdr)) {
 		((uint8_t*)hdr)[p-1] = rbyte;
 	}
 	if(p == sizeof(*hdr)) {
-		if(hdr->addr == 0xFF || hdr->addr == lbus_address) {
-			recv_func = lbus_handler(hdr);
-		}
-	}
-	/* pkg_pos might be more actual here than the <p> value, when the lbus_handler
-	 * has sent some data.
-	 */
-	if(pkg_pos >= 2 && pkg_pos == hdr->length) {
+		recv_header(hdr);
+	} else if(pkg_pos >= 2 && pkg_pos == hdr->length) {
 		/* in any case reset state when a packet is complete (as indicated by the length) */
 		lbus_end_pkg();
 	}
 }
 
-static bool transmitting = false;
+#ifdef LBUS_COMPACT
+/* Receive callback for the frame headers in a compact container
+ *
+ * Each frame is handled like a packet of its own, with a header made up
+ * from the frame header and the container's command.
+ */
+static void recv_compact(const uint8_t rbyte, const struct lbus_hdr *hdr, const unsigned int p) {
+	static struct lbus_compact_hdr frame;
+	((uint8_t*)&frame)[p-1] = rbyte;
+	if(p < sizeof(frame) && p < hdr->length)
+		return;
+	const unsigned int length = sizeof(frame) + frame.length;
+	if(length > compact_left) {
+		/* broken container, skip the rest */
+		compact_abort();
+		recv_func = NULL;
+		if(pkg_pos == hdr->length)
+			lbus_end_pkg();
+		return;
+	}
+	compact_left -= length;
+	lbus_header.length = sizeof(struct lbus_hdr) + frame.length;
+	lbus_header.addr = frame.addr;
+	lbus_header.cmd = compact_cmd;
+	pkg_pos = sizeof(struct lbus_hdr);
+	recv_header(&lbus_header);
+}
+
+/* Receive the next frame header of the compact container */
+static void compact_next(void) {
+	pkg_pos = 0;
+	/* skipping (e.g. a broken frame header) ends with the container */
+	lbus_header.length = compact_left;
+	recv_func = recv_compact;
+}
+#endif
+
+/* The packet timeout has hit: drop an incomplete packet */
+static void rx_timeout(void) {
+	if(rx_in_packet())
+		STATS_ADD(timeouts, 1);
+	compact_abort();
+	lbus_end_pkg();
+}
+
+/* Packet-level receive state, see lbus_recv_pkg() */
+static uint8_t *pkg_buf;
+static unsigned int pkg_len, pkg_maxlen;
+static lbus_pkg_func pkg_func;
+
+/* Receive callback for packet-level handlers
+ *
+ * Stores the packet data and calls the handler once the buffer is full
+ * or the packet is complete. Remaining data is skipped, unless the
+ * handler has set up something else. rx_byte() calls this directly.
+ */
+static inline void recv_pkg(const uint8_t rbyte, const struct lbus_hdr *hdr, const unsigned int p) {
+	pkg_buf[pkg_len++] = rbyte;
+	if(pkg_len == pkg_maxlen || p == hdr->length) {
+		recv_func = NULL;
+		pkg_func(hdr, pkg_buf, pkg_len);
+		if(pkg_pos >= 2 && pkg_pos == hdr->length)
+			lbus_end_pkg();
+	}
+}
+
+lbus_recv_func lbus_recv_pkg(void *buf, const unsigned int maxlen, lbus_pkg_func func) {
+	if(maxlen == 0 || pkg_pos >= lbus_header.length) {
+		/* nothing (more) to receive */
+		func(&lbus_header, buf, 0);
+		return NULL;
+	}
+	pkg_buf = buf;
+	pkg_len = 0;
+	pkg_maxlen = maxlen;
+	pkg_func = func;
+	return recv_pkg;
+}
+
+#if defined(LBUS_DEFERRED) && !defined(LBUS_DMA_RX)
+/* put into the ring buffer by the timeout ISR, in order with the data */
+#define RX_TIMEOUT_MARK 0x200
+#endif
+
+/* Handle a received byte
+ *
+ * Passes the byte on to the current receive callback. Packets without
+ * a receive callback are skipped until their end as per header length.
+ * With address marks, a mark starts a new packet.
+ */
+static inline void rx_byte(const uint16_t rdata) {
+#if defined(LBUS_DEFERRED) && !defined(LBUS_DMA_RX)
+	if(rdata == RX_TIMEOUT_MARK) {
+		rx_timeout();
+		return;
+	}
+#endif
+#ifdef LBUS_ADDRESS_MARKS
+	if(rdata & LBUS_ADDRESS_MARK) {
+		compact_abort();
+		lbus_end_pkg();
+		recv_func = recv;
+		return;
+	}
+#endif
+	STATS_ADD(bytes, 1);
+	pkg_pos++;
+#ifndef LBUS_SMALL
+	if(recv_func == recv_pkg) {
+		/* packet-level handler: store without a call per byte */
+		PROFILE_START(start);
+		recv_pkg(rdata, &lbus_header, pkg_pos);
+		PROFILE_END(start, LBUS_PROFILE_RECV_FUNC);
+	} else
+#endif
+	if(recv_func) {
+		PROFILE_START(start);
+		recv_func(rdata, &lbus_header, pkg_pos);
+		PROFILE_END(start, LBUS_PROFILE_RECV_FUNC);
+	} else if(pkg_pos == lbus_header.length) {
+		lbus_end_pkg();
+	}
+}
+
+#ifdef LBUS_RX_RING
+static uint16_t rx_buf[LBUS_RX_BUFSIZE];
+static volatile unsigned int rx_tail;
+
+#ifdef LBUS_DMA_RX
+/* Current DMA write position in the receive ring buffer */
+static inline unsigned int rx_head(void) {
+	return LBUS_RX_BUFSIZE - DMA_CNDTR(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL);
+}
+
+#ifdef LBUS_ADDRESS_MARKS
+/* address marks must not be skipped */
+#define rx_can_skip() (recv_func == NULL && lbus_framing != LBUS_FRAMING_ADDRESS_MARK)
+#else
+#define rx_can_skip() (recv_func == NULL)
+#endif
+#else
+/* Write position in the receive ring buffer, advanced by the ISRs */
+static volatile unsigned int rx_head_pos;
+
+static inline unsigned int rx_head(void) {
+	return rx_head_pos;
+}
+
+/* Queue a received character (or a timeout mark) for the PendSV handler */
+static void rx_push(const uint16_t data) {
+	const unsigned int next = (rx_head_pos + 1) % LBUS_RX_BUFSIZE;
+	if(next == rx_tail) {
+		STATS_ADD(overrun_errors, 1);
+	} else {
+		rx_buf[rx_head_pos] = data;
+		rx_head_pos = next;
+	}
+	SCB_ICSR = SCB_ICSR_PENDSVSET;
+}
+
+/* timeout marks must not be skipped */
+#define rx_can_skip() false
+#endif
+
+/* Process bytes that have been put into the receive ring buffer
+ *
+ * Feeds the bytes to the receive callbacks just like the per-byte ISR
+ * would do. Data of packets that have no receive callback (e.g. because
+ * they are addressed to another node) is skipped in one go when possible.
+ * Returns the number of bytes consumed.
+ */
+static int rx_drain(void) {
+	unsigned int head;
+	int consumed = 0;
+	while(!transmitting && !scan_pending && (head = rx_head()) != rx_tail) {
+		int n = (head + LBUS_RX_BUFSIZE - rx_tail) % LBUS_RX_BUFSIZE;
+		if(rx_can_skip()) {
+			const int left = lbus_header.length - pkg_pos;
+			if(left > 0 && n > left)
+				n = left;
+			rx_tail = (rx_tail + n) % LBUS_RX_BUFSIZE;
+			STATS_ADD(bytes, n);
+			pkg_pos += n;
+			if(pkg_pos == lbus_header.length)
+				lbus_end_pkg();
+		} else {
+			const uint16_t rdata = rx_buf[rx_tail];
+			n = 1;
+			rx_tail = (rx_tail + 1) % LBUS_RX_BUFSIZE;
+			rx_byte(rdata);
+		}
+		consumed += n;
+	}
+#ifdef LBUS_DMA_RX
+	if(consumed && rx_in_packet()) {
+		/* packet is not complete yet, (re-)start timeout timer */
+		TIM1_CNT = 0;
+		TIM_CR1(TIM1) |= TIM_CR1_CEN;
+	}
+#endif
+	return consumed;
+}
+#endif
+
+#ifdef LBUS_ADDRESS_MARKS
+/* Put the USART into mute mode until the next address mark
+ *
+ * Not done when received data is still waiting to be processed, since
+ * that might contain the next address mark already. The remaining data
+ * is skipped by its length then.
+ */
+static bool rx_mute(void) {
+#ifdef LBUS_RX_RING
+	const uint32_t mask = cm_mask_interrupts(1);
+	const bool empty = rx_head() == rx_tail
+		&& (USART_SR(LBUS_USART) & USART_SR_RXNE) == 0;
+	if(empty)
+		USART_CR1(LBUS_USART) |= USART_CR1_RWU;
+	cm_mask_interrupts(mask);
+	return empty;
+#else
+	USART_CR1(LBUS_USART) |= USART_CR1_RWU;
+	return true;
+#endif
+}
+#endif
+
+#ifdef LBUS_DEFERRED
+#ifdef LBUS_DMA_RX
+/* the packet timeout has hit, handled by the PendSV handler */
+static volatile bool rx_timeout_pending;
+#endif
+
+/* Have received data processed by the PendSV handler */
+static inline void rx_process(void) {
+	SCB_ICSR = SCB_ICSR_PENDSVSET;
+}
+#elif defined(LBUS_DMA_RX)
+static inline void rx_process(void) {
+	rx_drain();
+}
+#endif
+
+/* Switch MAX485 back to receive mode after transmitting */
+static void rx_resume(void) {
+	/* tie low MAX485 DE/~RE */
+	gpio_clear(LBUS_DE_GPIO, LBUS_DE_PIN);
+	gpio_clear(LBUS_RE_GPIO, LBUS_RE_PIN);
+#ifdef LBUS_DMA_RX
+	/* drop anything that was received while transmitting */
+	rx_tail = rx_head();
+#else
+	/* enable RX interrupt: */
+	USART_CR1(LBUS_USART) |= USART_CR1_RXNEIE;
+#endif
+	transmitting = false;
+}
+
+#ifdef LBUS_DMA_TX
+/* TX queue: chunks of data to be sent by DMA
+ *
+ * Data passed to lbus_send()/lbus_send_buf() is copied to tx_buf,
+ * lbus_send_ref() queues its data without copying. The chunk at
+ * tx_qtail is the one that is currently being transmitted.
+ */
+static struct {
+	const uint8_t *data;
+	uint16_t length;
+} tx_queue[LBUS_TX_QUEUE];
+static volatile unsigned int tx_qhead, tx_qtail;
+static uint8_t tx_buf[LBUS_TX_BUFSIZE];
+static unsigned int tx_buf_pos;
+static volatile bool tx_busy;
+static volatile bool tx_end;
+
+/* Start DMA for the next queued chunk
+ *
+ * When the queue has run empty and the packet has been ended, the USART
+ * transmission complete interrupt is enabled in order to do the bus
+ * turnaround. Must be called with interrupts masked.
+ */
+static void tx_next(void) {
+	if(tx_qtail != tx_qhead) {
+		DMA_CCR(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL) &= ~DMA_CCR_EN;
+		DMA_CMAR(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL) = (uint32_t)tx_queue[tx_qtail].data;
+		DMA_CNDTR(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL) = tx_queue[tx_qtail].length;
+		USART_SR(LBUS_USART) = ~USART_SR_TC; /* rc_w0 */
+		DMA_CCR(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL) |= DMA_CCR_EN;
+		tx_busy = true;
+	} else {
+		tx_busy = false;
+		tx_buf_pos = 0;
+		if(tx_end)
+			USART_CR1(LBUS_USART) |= USART_CR1_TCIE;
+	}
+}
+
+/* DMA is done with the current chunk, start the next one */
+static void tx_complete(void) {
+	dma_clear_interrupt_flags(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL, DMA_TCIF);
+	tx_qtail = (tx_qtail + 1) % LBUS_TX_QUEUE;
+	tx_next();
+}
+
+/* Add a chunk to the TX queue, start DMA if idle
+ *
+ * Returns false if the queue is full. Must be called with interrupts masked.
+ */
+static bool tx_push(const uint8_t *data, const unsigned int length) {
+	const unsigned int next = (tx_qhead + 1) % LBUS_TX_QUEUE;
+	if(next == tx_qtail)
+		return false;
+	tx_queue[tx_qhead].data = data;
+	tx_queue[tx_qhead].length = length;
+	tx_qhead = next;
+	if(!tx_busy)
+		tx_next();
+	return true;
+}
+
+/* Wait for the currently running DMA transfer to complete
+ *
+ * We might be called from an ISR that has the same or a higher priority
+ * than the DMA interrupt, so the completion is polled and handled here.
+ */
+static void tx_wait(void) {
+	const unsigned int qtail = tx_qtail;
+	while(tx_busy && tx_qtail == qtail) {
+		const uint32_t mask = cm_mask_interrupts(1);
+		if(dma_get_interrupt_flag(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL, DMA_TCIF))
+			tx_complete();
+		cm_mask_interrupts(mask);
+	}
+}
+
+/* DMA interrupt service routine for TX */
+void LBUS_TX_DMA_ISR(void) {
+	tx_complete();
+}
+#endif
 
 /* End transmit mode, switch back to receive mode
  *
@@ -75,55 +1194,164 @@ static bool transmitting = false;
  * order.
  */
 void lbus_end_pkg(void) {
+#ifdef LBUS_SEQ
+	if(seq_last.active)
+		seq_end();
+#endif
 	if(transmitting) {
+#ifdef LBUS_DMA_TX
+		/* switch back when everything has been sent, see tx_next() */
+		const uint32_t mask = cm_mask_interrupts(1);
+		tx_end = true;
+		if(!tx_busy)
+			USART_CR1(LBUS_USART) |= USART_CR1_TCIE;
+		cm_mask_interrupts(mask);
+#else
 		/* wait until everything has been sent */
 		while((USART_SR(LBUS_USART) & USART_SR_TC) == 0) __asm("nop");
-		/* tie low MAX485 DE/~RE */
-		gpio_clear(LBUS_DE_GPIO, LBUS_DE_PIN);
-		gpio_clear(LBUS_RE_GPIO, LBUS_RE_PIN);
-		/* enable RX interrupt: */
-		USART_CR1(LBUS_USART) |= USART_CR1_RXNEIE;
-		transmitting = false;
+		rx_resume();
+#endif
 	}
+#ifdef LBUS_BAUDRATE_SWITCH
+	if(pkg_pos >= (int)sizeof(struct lbus_hdr) && pkg_pos == lbus_header.length)
+		baudrate_confirm();
+#endif
+#ifdef LBUS_COMPACT
+	if(compact_active) {
+		if(pkg_pos < lbus_header.length) {
+			/* frame ended early, skip the rest of it */
+			recv_func = NULL;
+			return;
+		}
+		if(compact_left > 0) {
+			/* the packet timeout keeps running for the next frame */
+			compact_next();
+			return;
+		}
+		compact_active = false;
+	}
+#endif
+#if !defined(LBUS_DEFERRED) || defined(LBUS_DMA_RX)
+	/* (with LBUS_DEFERRED and without DMA, the ISRs run the timer) */
 	TIM_CR1(TIM1) &= ~TIM_CR1_CEN;
+#endif
 	pkg_pos = 0;
-	recv_func = recv;
+	recv_func = idle_recv_func();
 }
 
 /* USART interrupt service routine
  *
- * This ISR handles received bytes on the USART
+ * This ISR handles received bytes on the USART. With LBUS_DMA_RX,
+ * only the idle line interrupt is enabled for receiving: the sender
+ * has paused, so handle what has been received so far.
+ * With LBUS_DMA_TX, it also handles the end of a transmission.
  */
 void LBUS_USART_ISR(void) {
+	PROFILE_START(start);
+#ifdef LBUS_DMA_TX
+	if((USART_CR1(LBUS_USART) & USART_CR1_TCIE) != 0
+		&& (USART_SR(LBUS_USART) & USART_SR_TC) != 0)
+	{
+		USART_CR1(LBUS_USART) &= ~USART_CR1_TCIE;
+		tx_end = false;
+		rx_resume();
+	}
+#endif
+#ifdef LBUS_DMA_RX
+	const uint32_t sr = USART_SR(LBUS_USART);
+	if((sr & USART_SR_IDLE) != 0) {
+		/* IDLE (and error) flags are cleared by reading SR, then DR */
+		stats_usart_errors(sr);
+		usart_recv(LBUS_USART);
+		rx_process();
+	}
+#else
 	/* Check if we were called because of RXNE. */
-	if((USART_SR(LBUS_USART) & USART_SR_RXNE) != 0) {
+	const uint32_t sr = USART_SR(LBUS_USART);
+	if((sr & USART_SR_RXNE) != 0) {
+		stats_usart_errors(sr);
 		/* reset timeout timer */
 		TIM1_CNT = 0;
+#ifdef LBUS_DEFERRED
+		/* the timer stops itself when it hits */
+		TIM_CR1(TIM1) |= TIM_CR1_CEN;
+		rx_push(usart_recv(LBUS_USART));
+#else
 		/* start timer when a new packet starts (avoids lots of timer interrupts on an idle lbus)*/
 		if(pkg_pos == 0) {
 			TIM_CR1(TIM1) |= TIM_CR1_CEN;
 		}
-		/* use recv_func to handle incoming bytes */
-		pkg_pos++;
-		/* call receive handler callback function, if set */
-		if(recv_func) {
-			recv_func(usart_recv(LBUS_USART), &lbus_header, pkg_pos);
-		} else {
-			/* otherwise, just consume the data */
-			usart_recv(LBUS_USART);
-		}
+		rx_byte(usart_recv(LBUS_USART));
+#endif
 	}
+#endif
+	PROFILE_END(start, LBUS_PROFILE_USART_ISR);
 }
 
+#ifdef LBUS_DMA_RX
+/* DMA interrupt service routine for RX
+ *
+ * Receive ring buffer is half full or has wrapped around
+ */
+void LBUS_RX_DMA_ISR(void) {
+	PROFILE_START(start);
+	dma_clear_interrupt_flags(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL, DMA_HTIF | DMA_TCIF);
+	rx_process();
+	PROFILE_END(start, LBUS_PROFILE_RX_DMA_ISR);
+}
+#endif
+
 /* Timeout timer ISR
  *
  * will enforce end of packet receive when the timeout has been hit
  */
 void tim1_up_isr(void) {
-	lbus_end_pkg();
+	PROFILE_START(start);
 	TIM_SR(TIM1) &= ~TIM_SR_UIF;
+#ifdef LBUS_SCAN
+	if(scan_pending) {
+		scan_tick();
+		PROFILE_END(start, LBUS_PROFILE_TIM1_ISR);
+		return;
+	}
+#endif
+#if defined(LBUS_DEFERRED) && defined(LBUS_DMA_RX)
+	rx_timeout_pending = true;
+	rx_process();
+#elif defined(LBUS_DEFERRED)
+	TIM_CR1(TIM1) &= ~TIM_CR1_CEN;
+	rx_push(RX_TIMEOUT_MARK);
+#elif defined(LBUS_DMA_RX)
+	/* data might be flowing without having triggered an idle or DMA event */
+	if(rx_drain() == 0)
+		rx_timeout();
+#else
+	rx_timeout();
+#endif
+	PROFILE_END(start, LBUS_PROFILE_TIM1_ISR);
 }
 
+#ifdef LBUS_DEFERRED
+/* PendSV handler: process received data
+ *
+ * Runs at the lowest priority, so the USART, DMA and timer ISRs can
+ * keep receiving while the handlers work.
+ */
+void pend_sv_handler(void) {
+	PROFILE_START(start);
+#ifdef LBUS_DMA_RX
+	const bool timeout = rx_timeout_pending;
+	rx_timeout_pending = false;
+	/* data might be flowing without having triggered an idle or DMA event */
+	if(rx_drain() == 0 && timeout)
+		rx_timeout();
+#else
+	rx_drain();
+#endif
+	PROFILE_END(start, LBUS_PROFILE_PENDSV);
+}
+#endif
+
 /* Switch operation from receive to transmit
  *
  * disable timeout timer (as the new transmitting entity, we're in charge
@@ -132,8 +1360,10 @@ void tim1_up_isr(void) {
  * their mode, too.
  */
 void lbus_start_tx(void) {
+#ifndef LBUS_DMA_RX
 	/* disable RX interrupt: */
 	USART_CR1(LBUS_USART) &= ~USART_CR1_RXNEIE;
+#endif
 	/* stop timeout timer */
 	TIM_CR1(TIM1) &= ~TIM_CR1_CEN;
 	/* toggle MAX485 driver/receiver enable */
@@ -150,6 +1380,21 @@ void lbus_start_tx(void) {
 	for(int i=0; i<100; i++) __asm("nop");
 	//*/
 	transmitting = true;
+#ifdef LBUS_SEQ
+	if(seq_last.active && seq_last.echo && !seq_last.echoed)
+		seq_echo();
+#endif
+}
+
+/* Do the work that must not hold up the bus, call this from the main loop
+ *
+ * It may take a while: storing a baud rate in config might compact the
+ * config store. The handlers keep running in the ISRs meanwhile.
+ */
+void lbus_poll(void) {
+#ifdef LBUS_BAUDRATE_SWITCH
+	baudrate_poll();
+#endif
 }
 
 /* Set up LBUS handling (RX/TX/DE/RE lines, ISRs etc.)
@@ -158,12 +1403,25 @@ void lbus_start_tx(void) {
  */
 void lbus_init(void) {
 	lbus_address = config_get_uint32(CONFIG_LBUS_ADDRESS);
+#ifdef LBUS_PROFILE
+	dwt_enable_cycle_counter();
+#endif
+#ifdef LBUS_GROUPS
+	{
+		const uint32_t groups = config_get_uint32(CONFIG_LBUS_GROUPS);
+		memcpy(lbus_groups, &groups, sizeof(lbus_groups));
+	}
+#endif
 
 	RCC_APB2ENR |= (RCC_APB2ENR_TIM1EN | RCC_APB2ENR_IOPBEN | RCC_APB2ENR_AFIOEN);
 	RCC_APB1ENR |= (RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN | RCC_APB1ENR_USART3EN);
 
 	/* Enable the USART interrupt. */
 	nvic_enable_irq(LBUS_USART_IRQ);
+#ifdef LBUS_DEFERRED
+	/* received data is processed at the lowest priority */
+	nvic_set_priority(NVIC_PENDSV_IRQ, 0xFF);
+#endif
 
 	/* Pin setup */
 	gpio_set_mode(LBUS_USART_GPIO, GPIO_MODE_OUTPUT_50_MHZ,
@@ -176,24 +1434,81 @@ void lbus_init(void) {
 		GPIO_CNF_OUTPUT_PUSHPULL, LBUS_RE_PIN);
 
 	/* Setup UART parameters. */
+#ifdef LBUS_BAUDRATE_SWITCH
+	lbus_baudrate = config_get_uint32(CONFIG_LBUS_BAUDRATE);
+	if(!baudrate_valid(lbus_baudrate))
+		lbus_baudrate = LBUS_BAUDRATE;
+	usart_set_baudrate(LBUS_USART, lbus_baudrate);
+#else
 	usart_set_baudrate(LBUS_USART, LBUS_BAUDRATE);
+#endif
 
 	/* empty USART receive buffer */
 	while((USART_SR(LBUS_USART) & USART_SR_RXNE) != 0)
 		usart_recv(LBUS_USART);
 
+#ifdef LBUS_DMA_RX
+	/* set up DMA into receive ring buffer */
+	RCC_AHBENR |= RCC_AHBENR_DMA1EN;
+	dma_channel_reset(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL);
+	dma_set_peripheral_address(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL, (uint32_t)&USART_DR(LBUS_USART));
+	dma_set_memory_address(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL, (uint32_t)rx_buf);
+	dma_set_number_of_data(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL, LBUS_RX_BUFSIZE);
+	dma_set_read_from_peripheral(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL);
+	dma_enable_memory_increment_mode(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL);
+	/* 16 bit transfers keep bit 8 (address marks) */
+	dma_set_peripheral_size(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL, DMA_CCR_PSIZE_16BIT);
+	dma_set_memory_size(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL, DMA_CCR_MSIZE_16BIT);
+	dma_set_priority(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL, DMA_CCR_PL_VERY_HIGH);
+	dma_enable_circular_mode(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL);
+	dma_enable_half_transfer_interrupt(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL);
+	dma_enable_transfer_complete_interrupt(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL);
+	nvic_enable_irq(LBUS_RX_DMA_IRQ);
+	dma_enable_channel(LBUS_RX_DMA, LBUS_RX_DMA_CHANNEL);
+	rx_tail = 0;
+	usart_enable_rx_dma(LBUS_USART);
+#endif
+#ifdef LBUS_DMA_TX
+	/* set up DMA for transmitting, started per chunk by tx_next() */
+	RCC_AHBENR |= RCC_AHBENR_DMA1EN;
+	dma_channel_reset(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL);
+	dma_set_peripheral_address(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL, (uint32_t)&USART_DR(LBUS_USART));
+	dma_set_read_from_memory(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL);
+	dma_enable_memory_increment_mode(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL);
+	/* bytes are zero-extended, bit 8 is clear for 9 bit frames */
+	dma_set_peripheral_size(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL, DMA_CCR_PSIZE_16BIT);
+	dma_set_memory_size(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL, DMA_CCR_PL_HIGH);
+	dma_enable_transfer_complete_interrupt(LBUS_TX_DMA, LBUS_TX_DMA_CHANNEL);
+	nvic_enable_irq(LBUS_TX_DMA_IRQ);
+	usart_enable_tx_dma(LBUS_USART);
+#endif
+
+#ifdef LBUS_DMA_RX
+	/* configure and enable USART. */
+	USART_CR1(LBUS_USART) |= USART_CR1_IDLEIE | USART_CR1_RE | USART_CR1_TE | USART_CR1_UE;
+#else
 	/* configure and enable USART. */
 	USART_CR1(LBUS_USART) |= USART_CR1_RXNEIE | USART_CR1_RE | USART_CR1_TE | USART_CR1_UE;
+#endif
 
 	/* set up a timer for timing out packet receives: */
 	RCC_APB2RSTR |= RCC_APB2RSTR_TIM1RST;
 	RCC_APB2RSTR &= ~RCC_APB2RSTR_TIM1RST;
 	nvic_enable_irq(NVIC_TIM1_UP_IRQ);
-	TIM_PSC(TIM1) = ((CPU_SPEED/2)/10000); // 1 tick = 100 usec
-	TIM_ARR(TIM1) = LBUS_TIMEOUT;
+	TIM_PSC(TIM1) = (CPU_SPEED/1000000) - 1; // 1 tick = 1 usec
+	timeout_update();
 	TIM_EGR(TIM1) |= TIM_EGR_UG;
 	TIM_DIER(TIM1) |= TIM_DIER_UIE;
 
+#if defined(LBUS_BAUDRATE_SWITCH) || defined(LBUS_TIME_SYNC)
+	/* 1 msec SysTick for the baud rate fallback and bus time */
+	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+	systick_set_reload(CPU_SPEED/1000 - 1);
+	systick_interrupt_enable();
+	systick_counter_enable();
+#endif
+
 	/* mis-use end-of-packet function to enforce state reset */
 	lbus_end_pkg();
 }
@@ -209,15 +1524,84 @@ void lbus_reset_to_bootloader(void) {
 	while (1);
 }
 
+#ifdef LBUS_DMA_TX
 /* Send a single byte over LBUS */
 void lbus_send(const uint8_t txbyte) {
+	lbus_send_buf(&txbyte, 1);
+}
+
+/* Send a series of bytes from a buffer over LBUS
+ *
+ * The data is copied to the TX buffer, so the caller may re-use its
+ * buffer right away. Only waits when the TX buffer is full.
+ */
+void lbus_send_buf(const void *buf, const int length) {
+	const uint8_t *src = buf;
+	int left = length;
+	seq_record(buf, length);
+	while(left > 0) {
+		const uint32_t mask = cm_mask_interrupts(1);
+		const unsigned int last = (tx_qhead + LBUS_TX_QUEUE - 1) % LBUS_TX_QUEUE;
+		int n = LBUS_TX_BUFSIZE - tx_buf_pos;
+		if(n > left)
+			n = left;
+		if(n > 0) {
+			/* extend last queued chunk if it is not in transmission yet */
+			if(tx_qhead != tx_qtail && last != tx_qtail
+				&& tx_queue[last].data + tx_queue[last].length == &tx_buf[tx_buf_pos])
+			{
+				memcpy(&tx_buf[tx_buf_pos], src, n);
+				tx_queue[last].length += n;
+			} else {
+				memcpy(&tx_buf[tx_buf_pos], src, n);
+				if(!tx_push(&tx_buf[tx_buf_pos], n))
+					n = 0;
+			}
+			tx_buf_pos += n;
+			src += n;
+			left -= n;
+		}
+		cm_mask_interrupts(mask);
+		if(n == 0)
+			tx_wait();
+	}
+	pkg_pos += length;
+}
+
+/* Send data that stays valid until it has been sent (e.g. flash contents)
+ *
+ * The data is transmitted by DMA directly from where it is, without
+ * copying it.
+ */
+void lbus_send_ref(const void *buf, const int length) {
+	seq_record(buf, length);
+	uint32_t mask = cm_mask_interrupts(1);
+	while(!tx_push(buf, length)) {
+		cm_mask_interrupts(mask);
+		tx_wait();
+		mask = cm_mask_interrupts(1);
+	}
+	cm_mask_interrupts(mask);
+	pkg_pos += length;
+}
+#else
+/* Send a single byte over LBUS */
+void lbus_send(const uint8_t txbyte) {
+	seq_record(&txbyte, 1);
 	usart_send_blocking(LBUS_USART, txbyte);
 	pkg_pos++;
 }
 
 /* Send a series of bytes from a buffer over LBUS */
 void lbus_send_buf(const void *buf, const int length) {
+	seq_record(buf, length);
 	for(int i=0; i<length; i++)
 		usart_send_blocking(LBUS_USART, ((uint8_t*)buf)[i]);
 	pkg_pos += length;
 }
+
+/* Send data that stays valid until it has been sent */
+void lbus_send_ref(const void *buf, const int length) {
+	lbus_send_buf(buf, length);
+}
+#endif
@@ -2,10 +2,19 @@
 #define _LBUS_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "platform.h"
 
-/* packet receive times out after 1msec (=10 ticks) */
-#define LBUS_TIMEOUT 10
+/* Packet receive times out after this many character times of silence
+ * at the current baud rate and framing (0.5 msec at LBUS_BAUDRATE_SAFE),
+ * the timeout timer counts usec. The bus master can change it by a
+ * SET_TIMEOUT broadcast, it must cover the gaps in its own transmissions.
+ */
+#define LBUS_TIMEOUT_CHARS 25
+/* the default is at least this many usec at higher baud rates, so it
+ * covers the gaps between the USB packets of the USB busmaster
+ */
+#define LBUS_TIMEOUT_MIN_US 500
 
 #define LBUS_USART USART3
 #define LBUS_USART_RCC RCC_USART3
@@ -16,7 +25,90 @@
 #define LBUS_USART_GPIO_RX GPIO_USART3_RX
 #define LBUS_USART_ISR usart3_isr
 
-#define LBUS_BAUDRATE 500000
+/* With LBUS_DMA_RX defined, received bytes are written to a ring buffer
+ * by DMA instead of raising an interrupt per byte. The buffer is
+ * processed when the line goes idle, when it is half/completely filled
+ * and when the packet timeout hits.
+ */
+#define LBUS_RX_DMA DMA1
+#define LBUS_RX_DMA_CHANNEL DMA_CHANNEL3
+#define LBUS_RX_DMA_IRQ NVIC_DMA1_CHANNEL3_IRQ
+#define LBUS_RX_DMA_ISR dma1_channel3_isr
+#define LBUS_RX_BUFSIZE 256
+
+/* With LBUS_DMA_TX defined, data is sent by DMA from a queue and the
+ * switch back to receive mode is done in the transmission complete
+ * interrupt, so sending does not block.
+ */
+#define LBUS_TX_DMA DMA1
+#define LBUS_TX_DMA_CHANNEL DMA_CHANNEL2
+#define LBUS_TX_DMA_IRQ NVIC_DMA1_CHANNEL2_IRQ
+#define LBUS_TX_DMA_ISR dma1_channel2_isr
+#define LBUS_TX_BUFSIZE 256
+#define LBUS_TX_QUEUE 8
+
+/* With LBUS_ADDRESS_MARKS defined, the bus can be switched to 9 bit
+ * frames by a SET_FRAMING request. Each packet then starts with an
+ * address mark and nodes that are not addressed by a packet put the
+ * USART into mute mode after the header, so they do not see its data.
+ */
+
+/* With LBUS_BAUDRATE_SWITCH defined, the baud rate can be changed by a
+ * SET_BAUDRATE broadcast. A node that has not received a valid packet
+ * for LBUS_BAUDRATE_FALLBACK msec falls back to LBUS_BAUDRATE.
+ * This uses the SysTick timer.
+ */
+#define LBUS_BAUDRATE_FALLBACK 2000
+
+/* With LBUS_GROUPS defined, nodes also accept packets sent to group
+ * addresses they have joined by a SET_GROUPS request.
+ */
+
+/* With LBUS_TIME_SYNC defined, nodes keep a bus time in msec that is
+ * set by TIME_SYNC broadcasts, and functions can be scheduled to run
+ * at a given bus time. This uses the SysTick timer.
+ * Scheduled times further than LBUS_SCHEDULE_MAX msec in the future
+ * are considered to be in the past.
+ */
+#define LBUS_SCHEDULE_MAX 10000
+
+/* With LBUS_STATS defined, health and throughput counters are kept,
+ * see struct lbus_stats. With LBUS_DMA_RX, USART errors are sampled
+ * when the line goes idle, so errors within a burst count once.
+ */
+
+/* With LBUS_DEFERRED defined, received data is processed (and the
+ * handlers are run) in the PendSV handler at the lowest priority. The
+ * ISRs only put received data into a ring buffer of LBUS_RX_BUFSIZE
+ * characters (shared with LBUS_DMA_RX), so the next packets keep being
+ * received while a handler is busy, e.g. sending a long reply. Note
+ * that the CPU still stalls while flash is being erased or programmed.
+ */
+
+/* With LBUS_COMPACT defined, packets to LBUS_COMPACT_ADDR are compact
+ * containers: each frame in them has a 2 byte header (length, address)
+ * and is handled like a packet with the container's command. Frames get
+ * no reply, the handlers must not send one.
+ */
+
+/* With LBUS_SCAN defined, nodes reply to SCAN broadcasts in a time slot
+ * given by their address, so the bus master can enumerate all nodes with
+ * a single request. A node waits for its slot with the receiver
+ * disabled, the packet timeout timer ISR sends the reply. The
+ * application has to provide lbus_scan_info().
+ */
+
+/* With LBUS_SEQ defined, requests can carry a sequence number (see
+ * LBUS_CMD_SEQ), so the bus master can repeat a request when the reply
+ * got lost: the node repeats its reply instead of handling it again.
+ */
+
+/* With LBUS_PROFILE defined (e.g. by "make PROFILE=1"), the time spent
+ * in the LBUS ISRs and callbacks is measured using the DWT cycle
+ * counter and can be read by GET_PROFILE requests.
+ */
+
+#define LBUS_BAUDRATE LBUS_BAUDRATE_SAFE
 #define LBUS_DE_GPIO GPIOB
 #define LBUS_DE_PIN GPIO12
 #define LBUS_RE_GPIO GPIOB
@@ -31,13 +123,46 @@
 
 /* LBUS API */
 void lbus_init(void);
+/* call this from the main loop, e.g. before each WFE: it does the work
+ * that must not hold up the bus (storing a confirmed baud rate)
+ */
+void lbus_poll(void);
 void lbus_send(const uint8_t txbyte);
 void lbus_send_buf(const void *buf, const int length);
+void lbus_send_ref(const void *buf, const int length);
 static inline void lbus_send32(const uint32_t *txwordptr) { lbus_send_buf(txwordptr, 4); }
 void lbus_start_tx(void);
 void lbus_end_pkg(void);
 void lbus_reset_to_bootloader(void);
 
+/* send statistics counters (see LBUS_STATS), optionally reset them */
+void lbus_send_stats(const bool reset);
+void lbus_read_stats(struct lbus_stats *stats, const bool reset);
+
+/* define this in your application for GET_DATA_MULTI: put the data for
+ * GET_DATA type <type> (up to LBUS_DATA_MAX bytes) to buf, return its length
+ * (0 for unknown types). GET_DATA handlers can use it, too.
+ */
+unsigned int lbus_get_data(const uint16_t type, void *buf);
+
+/* fill in the capabilities of the common LBUS code for LBUS_DATA_CAPABILITIES,
+ * the application adds its own commands, flags and channels.
+ * Not available with LBUS_SMALL.
+ */
+void lbus_capabilities(struct lbus_capabilities *caps);
+
+/* bus time API, see LBUS_TIME_SYNC */
+typedef void (*lbus_scheduled_func)(void);
+uint32_t lbus_time(void);
+void lbus_schedule(const uint32_t at, lbus_scheduled_func func);
+/* define this in your application to be notified after a TIME_SYNC: */
+void lbus_time_synced(void);
+
+/* define this in your application when using LBUS_SCAN: fill in status,
+ * version and name_hash (the address is already set)
+ */
+void lbus_scan_info(struct lbus_scan *info);
+
 /* For receiving packet data (following the packet header), define a matching lbus_recv_func:
  * it will be called for each received byte (rbyte) and has access to the packet header and
  * a counter for the current position within the packet (starting at 1 for the first byte
@@ -47,6 +172,17 @@ typedef void (*lbus_recv_func)(const uint8_t rbyte, const struct lbus_hdr *heade
 /* define this in your application to handle LBUS communication: */
 extern lbus_recv_func lbus_handler(const struct lbus_hdr *header);
 
+/* Alternatively, the lbus_handler can have the packet data received into a
+ * buffer by returning lbus_recv_pkg(): up to maxlen bytes following the header
+ * are stored to buf, then func is called once with the number of bytes stored.
+ * It is called earlier when the packet ends before the buffer is full. Packet
+ * data beyond maxlen is skipped, so maxlen must not cover the reply part of a
+ * request: func can send the reply just like a receive callback.
+ * Streaming data (e.g. firmware pages) is better handled by an lbus_recv_func.
+ */
+typedef void (*lbus_pkg_func)(const struct lbus_hdr *header, void *data, const unsigned int length);
+lbus_recv_func lbus_recv_pkg(void *buf, const unsigned int maxlen, lbus_pkg_func func);
+
 /* convenience macros for defining lbus_recv_funcs: */
 #define LBUS_READ_PKG(pkgdef,var,pos,data) \
 	pkgdef var; \
@@ -0,0 +1,19 @@
+# LBUS common code
+#
+# Include this from an LBUS project Makefile. The common code is built
+# into the project directory rather than into lbus_common/, since the
+# LBUS feature flags (e.g. -DLBUS_DMA_RX) are set per project in CFLAGS.
+
+LBUS_COMMON	= ../lbus_common
+
+OBJS		+= lbus.o config.o
+CFLAGS		+= -I$(LBUS_COMMON)
+
+# instrumentation build: "make PROFILE=1"
+ifeq ($(PROFILE),1)
+CFLAGS		+= -DLBUS_PROFILE
+endif
+
+%.o: $(LBUS_COMMON)/%.c
+	@#printf "  CC      $<\n"
+	$(Q)$(CC) $(CFLAGS) $(CPPFLAGS) $(ARCH_FLAGS) -o $@ -c $<
@@ -8,27 +8,95 @@
 
 #define PAGE_SIZE 1024
 
+// Commands as X-macro table: C(name, value), see the packet schema below
+#define LBUS_COMMANDS(C) \
+	C(NOP, 0) /* reserved */ \
+	C(PING, 1) \
+	C(GET_DATA, 2) \
+	C(GET_DATA_MULTI, 3) \
+	C(LED_SET_16BIT, 10) \
+	C(LED_COMMIT, 11) \
+	C(LED_SET_8BIT, 12) \
+	C(SET_POLARITY, 13) \
+	C(LED_FRAME, 14) \
+	C(SET_LED_GROUP, 15) \
+	C(LED_COMMIT_AT, 16) \
+	C(LED_SET_DELTA, 17) \
+	C(LED_SET_ALL, 18) /* LED_SET_16BIT starting at LED 0, without offset */ \
+	/* bus management, handled by the common LBUS code: */ \
+	C(SET_FRAMING, 100) \
+	C(SET_BAUDRATE, 101) \
+	C(SET_GROUPS, 102) \
+	C(TIME_SYNC, 103) \
+	C(GET_PROFILE, 104) \
+	C(SCAN, 105) \
+	C(SET_TIMEOUT, 106) \
+	C(CONFIG_READ, 120) \
+	C(CONFIG_WRITE, 121) \
+	C(RESET_TO_BOOTLOADER, 122) \
+	C(ERASE_CONFIG, 123) \
+	C(SET_ADDRESS, 124) \
+	C(READ_MEMORY, 125) \
+	C(FLASH_FIRMWARE, 126) \
+	C(RESET_TO_FIRMWARE, 127)
+
+#define LBUS_CMD_ENUM(name, value) name = value,
 enum lbus_cmd {
-	NOP = 0, // reserved
-	PING,
-	GET_DATA,
-	LED_SET_16BIT = 10,
-	LED_COMMIT,
-	LED_SET_8BIT,
-  SET_POLARITY,
-	RESET_TO_BOOTLOADER = 122,
-	ERASE_CONFIG,
-	SET_ADDRESS,
-	READ_MEMORY,
-	FLASH_FIRMWARE,
-	RESET_TO_FIRMWARE
+	LBUS_COMMANDS(LBUS_CMD_ENUM)
 };
+#undef LBUS_CMD_ENUM
+
+// flag in lbus_hdr.cmd: the request data starts with a uint8_t sequence
+// number. For requests to a single node, the reply starts with it, too
+// (the packet length includes both). A node that gets the same request
+// (sequence number, address, command and length) as the last one it has
+// handled completely does not handle it again, but repeats the reply -
+// if that is up to LBUS_SEQ_REPLY_MAX bytes. Requests without a reply
+// are acknowledged by the sequence number alone.
+// Not for compact containers, see LBUS_CAP_SEQ for the nodes supporting it.
+#define LBUS_CMD_SEQ 0x80
+#define LBUS_SEQ_REPLY_MAX 8
 
 enum lbus_state {
 	LBUS_STATE_IN_BOOTLOADER = 1,
 	LBUS_STATE_IN_FIRMWARE = 2
 };
 
+enum lbus_framing {
+	// 8 bit frames
+	LBUS_FRAMING_PLAIN = 0,
+	// 9 bit frames, each packet is preceded by LBUS_ADDRESS_MARK
+	LBUS_FRAMING_ADDRESS_MARK = 1
+};
+
+// 9 bit frame marking the start of a packet in LBUS_FRAMING_ADDRESS_MARK
+#define LBUS_ADDRESS_MARK 0x100
+
+// group addresses, nodes join up to LBUS_MAX_GROUPS groups
+#define LBUS_GROUP_FIRST 0x80
+#define LBUS_GROUP_LAST 0xFD
+#define LBUS_MAX_GROUPS 4
+
+// packets to this address are compact containers holding frames for
+// several nodes, see lbus_compact_hdr. Nodes without support for them
+// skip them like any packet not addressed to them.
+#define LBUS_COMPACT_ADDR 0xFE
+
+// SCAN replies are packets to this address, no node must use it
+#define LBUS_MASTER_ADDR 0x00
+
+// SCAN slots are counted in ticks of 50 usec
+#define LBUS_SCAN_TICK_US 50
+
+// baud rate after reset and fallback after bus silence
+#define LBUS_BAUDRATE_SAFE 500000
+// USART3 runs on 36MHz APB1 clock, so this is the limit
+#define LBUS_BAUDRATE_MAX 2250000
+
+// SET_BAUDRATE flags
+// store new baud rate in config once it has been confirmed by traffic
+#define LBUS_BAUDRATE_PERSIST 1
+
 enum lbus_data {
 	LBUS_DATA_STATUS = 1,
 	LBUS_DATA_ADDRESS,
@@ -36,60 +104,501 @@ enum lbus_data {
 	LBUS_DATA_BOOTLOADER_VERSION,
 	LBUS_DATA_FIRMWARE_NAME_LENGTH,
 	LBUS_DATA_FIRMWARE_NAME,
-  LBUS_DATA_POLARITY
+  LBUS_DATA_POLARITY,
+	LBUS_DATA_LED_GROUP,
+	LBUS_DATA_GROUPS,
+	LBUS_DATA_STATS,
+	// like LBUS_DATA_STATS, but resets the counters after reading
+	LBUS_DATA_STATS_RESET,
+	// struct lbus_capabilities
+	LBUS_DATA_CAPABILITIES
 };
 
-struct lbus_hdr {
-	// always send a packet length so controllers can skip
-	// unknown commands
-	uint16_t length;
-	uint8_t addr;
-	uint8_t cmd;
-} __packed;
+// GET_DATA_MULTI takes up to this many types, items are up to
+// LBUS_DATA_MAX bytes
+#define LBUS_DATA_MULTI_MAX 16
+#define LBUS_DATA_MAX 64
 
-struct lbus_GET_DATA {
-	uint16_t type;
-} __packed;
+// capability flags, see struct lbus_capabilities
+// features of the common LBUS code
+#define LBUS_CAP_ADDRESS_MARKS 0x0001
+#define LBUS_CAP_BAUDRATE_SWITCH 0x0002
+#define LBUS_CAP_GROUPS 0x0004
+#define LBUS_CAP_TIME_SYNC 0x0008
+#define LBUS_CAP_STATS 0x0010
+#define LBUS_CAP_COMPACT 0x0020
+#define LBUS_CAP_SCAN 0x0040
+#define LBUS_CAP_PROFILE 0x0080
+#define LBUS_CAP_SEQ 0x0100
+// application features from here on
+// LED_SET_8BIT values are mapped by a LUT per channel
+#define LBUS_CAP_LED_LUT 0x10000
 
-struct lbus_LED_SET_16BIT {
-	uint16_t led;
-	uint16_t color[];
-} __packed;
+// the command bitmap covers commands 0..127
+#define LBUS_CAP_COMMAND_BYTES 16
 
-struct lbus_LED_SET_8BIT {
-	uint16_t led;
-	uint8_t color[];
-} __packed;
+// profiling probes, see GET_PROFILE
+enum lbus_profile_probe {
+	// whole ISRs, including the callbacks they run
+	LBUS_PROFILE_USART_ISR = 0,
+	LBUS_PROFILE_TIM1_ISR,
+	LBUS_PROFILE_RX_DMA_ISR,
+	// lbus_handler() calls
+	LBUS_PROFILE_HANDLER,
+	// receive callback calls, one per byte
+	LBUS_PROFILE_RECV_FUNC,
+	// PendSV handler processing received data, see LBUS_DEFERRED
+	LBUS_PROFILE_PENDSV,
+	LBUS_PROFILE_PROBES
+};
 
-struct lbus_SET_POLARITY {
-	uint8_t polarity;
-} __packed;
+// histogram buckets: <64 cycles, then doubling, the last one is >=4096
+#define LBUS_PROFILE_BUCKETS 8
 
-struct lbus_SET_ADDRESS {
-	uint8_t naddr;
-} __packed;
+// GET_PROFILE flags
+// reset the probe after reading
+#define LBUS_PROFILE_RESET 1
 
-struct lbus_READ_MEMORY {
-	uint32_t address;
-} __packed;
+/* Packet schema
+ *
+ * The fixed-size parts of the packets are described once by the X-macro
+ * tables below. The packed structs, checks of their sizes, little endian
+ * encoders/decoders for the host side and the LuaJIT FFI declarations
+ * (see host_tools/lbus_cdef.c) are generated from them.
+ *
+ * LBUS_FIELDS_<name>(F, A, V) lists the fields of struct lbus_<name>:
+ * F(type, field) for a scalar, A(type, field, count) for an array and
+ * V(type, field) for trailing data of variable length.
+ * LBUS_REQUESTS(P) lists P(name, size) for the data following the header
+ * of a <name> request, LBUS_STRUCTS(P) for the header and reply data.
+ */
+#define LBUS_FIELDS_hdr(F, A, V) \
+	/* always send a packet length so controllers can skip */ \
+	/* unknown commands */ \
+	F(uint16_t, length) \
+	F(uint8_t, addr) \
+	F(uint8_t, cmd)
 
-struct lbus_FLASH_FIRMWARE {
-	uint16_t page_id;
-	uint8_t data[PAGE_SIZE];
-	uint32_t crc;
-} __packed;
+// frame in a compact container: instead of a struct lbus_hdr, the packet
+// data for <addr> is preceded by this, the command is the container's.
+// length counts the data bytes only. Frames get no reply.
+#define LBUS_FIELDS_compact_hdr(F, A, V) \
+	F(uint8_t, length) \
+	F(uint8_t, addr)
+
+#define LBUS_FIELDS_GET_DATA(F, A, V) \
+	F(uint16_t, type)
+
+// the reply holds a struct lbus_data_item for each type, in order, up
+// to the first one that does not fit. The rest of the reply is zero.
+#define LBUS_FIELDS_GET_DATA_MULTI(F, A, V) \
+	F(uint8_t, count) \
+	V(uint16_t, types)
+
+// GET_DATA_MULTI reply item, length is 0 for unknown types
+#define LBUS_FIELDS_data_item(F, A, V) \
+	F(uint16_t, type) \
+	F(uint8_t, length) \
+	V(uint8_t, data)
+
+#define LBUS_FIELDS_LED_SET_16BIT(F, A, V) \
+	F(uint16_t, led) \
+	V(uint16_t, color)
+
+#define LBUS_FIELDS_LED_SET_8BIT(F, A, V) \
+	F(uint16_t, led) \
+	V(uint8_t, color)
+
+// LED_FRAME flags
+// commit the new values when the packet is complete
+#define LBUS_LED_FRAME_COMMIT 1
+
+// broadcast LED values for all nodes, each node takes its slice
+// starting at its LED group
+#define LBUS_FIELDS_LED_FRAME(F, A, V) \
+	F(uint8_t, flags) \
+	V(uint16_t, values)
+
+#define LBUS_FIELDS_SET_LED_GROUP(F, A, V) \
+	F(uint16_t, group)
+
+// LED_SET_DELTA encodings
+enum lbus_delta_encoding {
+	// entries of uint16_t position, uint16_t value
+	LBUS_DELTA_SPARSE = 0,
+	// entries of uint8_t control byte, followed by a uint16_t value
+	// that is set for <count> positions - or with LBUS_DELTA_RLE_SKIP,
+	// no value and <count> positions are left unchanged
+	LBUS_DELTA_RLE,
+	// uint16_t values for consecutive positions
+	LBUS_DELTA_RAW
+};
+#define LBUS_DELTA_RLE_SKIP 0x80
+#define LBUS_DELTA_RLE_COUNT 0x7F
+
+// LED_SET_DELTA flags
+// positions are relative to LED_FRAME, i.e. nodes use their LED group
+#define LBUS_DELTA_FRAME 1
+// commit the new values when the packet is complete
+#define LBUS_DELTA_COMMIT 2
+
+// update of some LED values, RLE and raw data start at position 0
+#define LBUS_FIELDS_LED_SET_DELTA(F, A, V) \
+	F(uint8_t, encoding) \
+	F(uint8_t, flags) \
+	V(uint8_t, data)
+
+#define LBUS_FIELDS_LED_COMMIT_AT(F, A, V) \
+	/* bus time in msec */ \
+	F(uint32_t, time)
+
+#define LBUS_FIELDS_SET_POLARITY(F, A, V) \
+	F(uint8_t, polarity)
+
+#define LBUS_FIELDS_SET_FRAMING(F, A, V) \
+	F(uint8_t, framing)
+
+#define LBUS_FIELDS_SET_BAUDRATE(F, A, V) \
+	F(uint32_t, baudrate) \
+	F(uint8_t, flags)
+
+#define LBUS_FIELDS_TIME_SYNC(F, A, V) \
+	/* bus time in msec at the end of this packet */ \
+	F(uint32_t, time)
+
+// packet timeout in character times, 0 for the nodes' default
+#define LBUS_FIELDS_SET_TIMEOUT(F, A, V) \
+	F(uint16_t, chars)
+
+#define LBUS_FIELDS_GET_PROFILE(F, A, V) \
+	F(uint8_t, probe) \
+	F(uint8_t, flags)
+
+// every node with an address in first..first+count-1 replies with a
+// packet of its own: node <first> right at the end of the request, the
+// next ones <slot> ticks (see LBUS_SCAN_TICK_US) later each
+#define LBUS_FIELDS_SCAN(F, A, V) \
+	F(uint8_t, first) \
+	F(uint8_t, count) \
+	F(uint8_t, slot)
+
+// SCAN reply, sent in a packet with a struct lbus_hdr to LBUS_MASTER_ADDR
+#define LBUS_FIELDS_scan(F, A, V) \
+	F(uint8_t, addr) \
+	/* enum lbus_state */ \
+	F(uint8_t, status) \
+	F(uint32_t, version) \
+	/* lbus_name_hash() of the firmware name */ \
+	F(uint32_t, name_hash)
+
+#define LBUS_FIELDS_SET_GROUPS(F, A, V) \
+	/* unused entries are 0 */ \
+	A(uint8_t, groups, LBUS_MAX_GROUPS)
+
+#define LBUS_FIELDS_SET_ADDRESS(F, A, V) \
+	F(uint8_t, naddr)
+
+#define LBUS_FIELDS_READ_MEMORY(F, A, V) \
+	F(uint32_t, address)
+
+#define LBUS_FIELDS_FLASH_FIRMWARE(F, A, V) \
+	F(uint16_t, page_id) \
+	A(uint8_t, data, PAGE_SIZE) \
+	F(uint32_t, crc)
+
+// config items of up to this many bytes can be written by CONFIG_WRITE,
+// they are read in chunks of up to this size by the host library
+#define LBUS_CONFIG_MAX 512
+// item length in a CONFIG_READ reply when the node has no such item
+#define LBUS_CONFIG_NONE 0xFFFF
+// requests that write to config flash (SET_ADDRESS, SET_GROUPS, SET_POLARITY,
+// SET_LED_GROUP, CONFIG_WRITE) reply within this many msec: a node whose
+// config store is full compacts it first, erasing a bank (8 pages of up to
+// 40 msec each) and copying up to a bank of items (70 usec per half word)
+#define LBUS_CONFIG_WRITE_MAX_MS 650
+
+// read config item <type>, see struct lbus_config_data for the reply
+#define LBUS_FIELDS_CONFIG_READ(F, A, V) \
+	F(uint32_t, type) \
+	/* of the first byte to read */ \
+	F(uint16_t, offset)
+
+// CONFIG_READ reply: the length of the whole item, followed by its data
+// from the offset on. The rest of the reply is zero, but for the last 4
+// bytes: the CRC32 of the item data in the reply, padded with zeros to
+// whole words.
+#define LBUS_FIELDS_config_data(F, A, V) \
+	F(uint16_t, length) \
+	V(uint8_t, data)
+
+// store config item <type> of <length> bytes (up to LBUS_CONFIG_MAX), the
+// data is followed by its CRC32 (padded with zeros to whole words). The
+// reply is a status byte.
+#define LBUS_FIELDS_CONFIG_WRITE(F, A, V) \
+	F(uint32_t, type) \
+	F(uint16_t, length) \
+	V(uint8_t, data)
+
+// LBUS health/throughput counters, see LBUS_DATA_STATS
+#define LBUS_FIELDS_stats(F, A, V) \
+	/* bytes received */ \
+	F(uint32_t, bytes) \
+	/* packet headers received */ \
+	F(uint32_t, packets) \
+	/* packets addressed to this node (including broadcast/groups) */ \
+	F(uint32_t, packets_for_us) \
+	/* packets addressed to this node that were not handled */ \
+	F(uint32_t, packets_unhandled) \
+	/* packets that did not complete before the timeout */ \
+	F(uint32_t, timeouts) \
+	/* USART errors */ \
+	F(uint32_t, overrun_errors) \
+	F(uint32_t, framing_errors) \
+	F(uint32_t, noise_errors)
+
+// what a node supports, see LBUS_DATA_CAPABILITIES
+#define LBUS_FIELDS_capabilities(F, A, V) \
+	/* LBUS_CAP_* flags */ \
+	F(uint32_t, flags) \
+	/* bit (n & 7) of byte (n >> 3) is set when command n is handled */ \
+	A(uint8_t, commands, LBUS_CAP_COMMAND_BYTES) \
+	/* longest packet the node handles, header included */ \
+	F(uint16_t, max_length) \
+	/* baud rates from LBUS_BAUDRATE_SAFE up to this one work */ \
+	F(uint32_t, baudrate_max) \
+	/* number of LED channels */ \
+	F(uint16_t, channels)
+
+// CPU cycles spent in a probe, see GET_PROFILE
+#define LBUS_FIELDS_profile(F, A, V) \
+	F(uint64_t, total) \
+	F(uint32_t, count) \
+	F(uint32_t, min) \
+	F(uint32_t, max) \
+	A(uint32_t, histogram, LBUS_PROFILE_BUCKETS)
+
+#define LBUS_REQUESTS(P) \
+	P(GET_DATA, 2) \
+	P(GET_DATA_MULTI, 1) \
+	P(LED_SET_16BIT, 2) \
+	P(LED_SET_8BIT, 2) \
+	P(SET_ADDRESS, 1) \
+	P(READ_MEMORY, 4) \
+	P(FLASH_FIRMWARE, 2+PAGE_SIZE+4) \
+	P(SET_POLARITY, 1) \
+	P(LED_FRAME, 1) \
+	P(SET_LED_GROUP, 2) \
+	P(SET_FRAMING, 1) \
+	P(SET_BAUDRATE, 5) \
+	P(SET_GROUPS, LBUS_MAX_GROUPS) \
+	P(TIME_SYNC, 4) \
+	P(GET_PROFILE, 2) \
+	P(LED_COMMIT_AT, 4) \
+	P(LED_SET_DELTA, 2) \
+	P(SCAN, 3) \
+	P(SET_TIMEOUT, 2) \
+	P(CONFIG_READ, 6) \
+	P(CONFIG_WRITE, 6)
+
+#define LBUS_STRUCTS(P) \
+	P(hdr, 4) \
+	P(compact_hdr, 2) \
+	P(data_item, 3) \
+	P(config_data, 2) \
+	P(stats, 8*4) \
+	P(profile, 8+3*4+LBUS_PROFILE_BUCKETS*4) \
+	P(scan, 10) \
+	P(capabilities, 4+LBUS_CAP_COMMAND_BYTES+2+4+2)
+
+// firmware names are hashed up to their end or this many characters
+#define LBUS_NAME_MAX 64
+
+/* length of a firmware name, see LBUS_DATA_FIRMWARE_NAME_LENGTH */
+static inline unsigned int lbus_name_length(const char *name) {
+	unsigned int l = 0;
+	while(l < LBUS_NAME_MAX && name[l] != '\0')
+		l++;
+	return l;
+}
+
+/* FNV-1a hash of a firmware name, see SCAN */
+static inline uint32_t lbus_name_hash(const char *name) {
+	uint32_t h = 2166136261u;
+	for(unsigned int i = 0; i < LBUS_NAME_MAX && name[i] != '\0'; i++)
+		h = (h ^ (uint8_t)name[i]) * 16777619u;
+	return h;
+}
+
+/* command bitmap of a struct lbus_capabilities */
+static inline void lbus_cap_set_command(uint8_t *commands, const uint8_t cmd) {
+	if(cmd < LBUS_CAP_COMMAND_BYTES*8)
+		commands[cmd >> 3] |= 1 << (cmd & 7);
+}
+static inline int lbus_cap_has_command(const uint8_t *commands, const uint8_t cmd) {
+	return cmd < LBUS_CAP_COMMAND_BYTES*8 && (commands[cmd >> 3] & (1 << (cmd & 7)));
+}
+
+#ifdef __cplusplus
+#define LBUS_STATIC_ASSERT static_assert
+#else
+#define LBUS_STATIC_ASSERT _Static_assert
+#endif
+
+/* the structs */
+#define LBUS_STRUCT_F(type, field) type field;
+#define LBUS_STRUCT_A(type, field, count) type field[count];
+#define LBUS_STRUCT_V(type, field) type field[];
+#define LBUS_STRUCT(name, size) \
+	struct lbus_##name { \
+		LBUS_FIELDS_##name(LBUS_STRUCT_F, LBUS_STRUCT_A, LBUS_STRUCT_V) \
+	} __packed; \
+	LBUS_STATIC_ASSERT(sizeof(struct lbus_##name) == (size), "size of struct lbus_" #name);
+LBUS_STRUCTS(LBUS_STRUCT)
+LBUS_REQUESTS(LBUS_STRUCT)
 
 struct lbus_pkg {
 	struct lbus_hdr hdr;
 	union {
-		struct lbus_GET_DATA GET_DATA;
-		struct lbus_LED_SET_16BIT LED_SET_16BIT;
-		struct lbus_LED_SET_8BIT LED_SET_8BIT;
-		struct lbus_SET_ADDRESS SET_ADDRESS;
-		struct lbus_READ_MEMORY READ_MEMORY;
-		struct lbus_FLASH_FIRMWARE FLASH_FIRMWARE;
-		struct lbus_SET_POLARITY SET_POLARITY;
+#define LBUS_PKG_MEMBER(name, size) struct lbus_##name name;
+		LBUS_REQUESTS(LBUS_PKG_MEMBER)
+#undef LBUS_PKG_MEMBER
 	};
 } __packed;
 
+/* Little endian encoding and decoding
+ *
+ * The controllers just use the structs above. These are for hosts, which
+ * might not be little endian.
+ */
+static inline unsigned int lbus_put_uint8_t(uint8_t *out, const uint8_t v) {
+	out[0] = v;
+	return 1;
+}
+static inline unsigned int lbus_put_uint16_t(uint8_t *out, const uint16_t v) {
+	out[0] = v & 0xFF;
+	out[1] = v >> 8;
+	return 2;
+}
+static inline unsigned int lbus_put_uint32_t(uint8_t *out, const uint32_t v) {
+	lbus_put_uint16_t(out, v & 0xFFFF);
+	lbus_put_uint16_t(out+2, v >> 16);
+	return 4;
+}
+static inline unsigned int lbus_put_uint64_t(uint8_t *out, const uint64_t v) {
+	lbus_put_uint32_t(out, v & 0xFFFFFFFF);
+	lbus_put_uint32_t(out+4, v >> 32);
+	return 8;
+}
+static inline uint8_t lbus_get_uint8_t(const uint8_t *in) {
+	return in[0];
+}
+static inline uint16_t lbus_get_uint16_t(const uint8_t *in) {
+	return in[0] | (in[1] << 8);
+}
+static inline uint32_t lbus_get_uint32_t(const uint8_t *in) {
+	return lbus_get_uint16_t(in) | ((uint32_t)lbus_get_uint16_t(in+2) << 16);
+}
+static inline uint64_t lbus_get_uint64_t(const uint8_t *in) {
+	return lbus_get_uint32_t(in) | ((uint64_t)lbus_get_uint32_t(in+4) << 32);
+}
+
+/* lbus_encode_<name>(out, v) and lbus_decode_<name>(v, in) convert the
+ * fixed-size part of struct lbus_<name>, they return the number of bytes.
+ */
+#define LBUS_PUT_F(type, field) p += lbus_put_##type(p, v->field);
+#define LBUS_PUT_A(type, field, count) \
+	for(unsigned int i = 0; i < (count); i++) p += lbus_put_##type(p, v->field[i]);
+#define LBUS_GET_F(type, field) v->field = lbus_get_##type(p); p += sizeof(type);
+#define LBUS_GET_A(type, field, count) \
+	for(unsigned int i = 0; i < (count); i++, p += sizeof(type)) v->field[i] = lbus_get_##type(p);
+#define LBUS_NOTHING(type, field)
+#define LBUS_CODEC(name, size) \
+	static inline unsigned int lbus_encode_##name(void *out, const struct lbus_##name *v) { \
+		uint8_t *p = (uint8_t*)out; \
+		LBUS_FIELDS_##name(LBUS_PUT_F, LBUS_PUT_A, LBUS_NOTHING) \
+		return p - (uint8_t*)out; \
+	} \
+	static inline unsigned int lbus_decode_##name(struct lbus_##name *v, const void *in) { \
+		const uint8_t *p = (const uint8_t*)in; \
+		LBUS_FIELDS_##name(LBUS_GET_F, LBUS_GET_A, LBUS_NOTHING) \
+		return p - (const uint8_t*)in; \
+	}
+LBUS_STRUCTS(LBUS_CODEC)
+LBUS_REQUESTS(LBUS_CODEC)
+
+/* lbus_request_<name>(out, addr, more, v) encodes the header and the
+ * fixed-size data of a <name> request, with <more> bytes (variable-length
+ * data and reply) following in the packet. Returns the number of bytes.
+ */
+#define LBUS_REQUEST(name, size) \
+	static inline unsigned int lbus_request_##name(void *out, const uint8_t addr, const unsigned int more, const struct lbus_##name *v) { \
+		struct lbus_hdr hdr; \
+		hdr.length = sizeof(struct lbus_hdr) + (size) + more; \
+		hdr.addr = addr; \
+		hdr.cmd = name; \
+		const unsigned int l = lbus_encode_hdr(out, &hdr); \
+		return l + lbus_encode_##name((uint8_t*)out + l, v); \
+	}
+LBUS_REQUESTS(LBUS_REQUEST)
+
+/* encode LED_SET_DELTA data for <vcount> values, changed ones are those
+ * that differ from previous[] (all of them with previous == NULL).
+ * Returns the length of the encoded data, with out == NULL it is just
+ * calculated.
+ */
+static inline unsigned int lbus_delta_encode(const uint8_t encoding, const unsigned int vcount, const uint16_t previous[], const uint16_t values[], uint8_t *out) {
+#define CHANGED(i) (!previous || previous[i] != values[i])
+#define PUT16(v) do { if(out) lbus_put_uint16_t(out+len, (v)); len += 2; } while(0)
+#define PUT8(v) do { if(out) out[len] = (v); len++; } while(0)
+	unsigned int len = 0;
+	if(encoding == LBUS_DELTA_SPARSE) {
+		for(unsigned int i=0; i<vcount; i++) {
+			if(CHANGED(i)) {
+				PUT16(i);
+				PUT16(values[i]);
+			}
+		}
+	} else if(encoding == LBUS_DELTA_RLE) {
+		unsigned int i=0;
+		unsigned int skip_len = 0; /* trailing skips are dropped */
+		while(i<vcount) {
+			unsigned int j=i+1;
+			if(!CHANGED(i)) {
+				while(j<vcount && !CHANGED(j) && j-i < LBUS_DELTA_RLE_COUNT) j++;
+				PUT8(LBUS_DELTA_RLE_SKIP | (j-i));
+				skip_len++;
+			} else {
+				while(j<vcount && values[j] == values[i] && j-i < LBUS_DELTA_RLE_COUNT) j++;
+				PUT8(j-i);
+				PUT16(values[i]);
+				skip_len = 0;
+			}
+			i = j;
+		}
+		len -= skip_len;
+	} else {
+		for(unsigned int i=0; i<vcount; i++)
+			PUT16(values[i]);
+	}
+	return len;
+#undef PUT8
+#undef PUT16
+#undef CHANGED
+}
+
+/* the LED_SET_DELTA encoding with the shortest data, raw when none is shorter */
+static inline uint8_t lbus_delta_encoding(const unsigned int vcount, const uint16_t previous[], const uint16_t values[]) {
+	uint8_t encoding = LBUS_DELTA_RAW;
+	unsigned int len = lbus_delta_encode(LBUS_DELTA_RAW, vcount, previous, values, 0);
+	const uint8_t others[2] = { LBUS_DELTA_SPARSE, LBUS_DELTA_RLE };
+	for(int i=0; i<2; i++) {
+		const unsigned int l = lbus_delta_encode(others[i], vcount, previous, values, 0);
+		if(l < len) {
+			len = l;
+			encoding = others[i];
+		}
+	}
+	return encoding;
+}
+
 #endif
@@ -35,6 +35,11 @@
 #define BOOTFLAG_GOTO_BOOTLOADER 1
 #define BOOTFLAG_ENFORCE_NORMAL_BOOT 2
 
+/* BKP_DR4 is BKP_DR2 (the low half of the bootloader version) xor this
+ * when the bootloader reads the config store by banks, see config.c
+ */
+#define BOOTINFO_CONFIG_BANKS 0xCB4E
+
 /* firmware config information */
 struct config_section_s {
 	uint32_t version;
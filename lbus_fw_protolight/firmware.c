@@ -22,6 +22,7 @@
  */
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/scb.h>
@@ -60,6 +61,9 @@ static void clock_setup(void)
 	rcc_periph_clock_enable(RCC_TIM2);
 	rcc_periph_clock_enable(RCC_TIM3);
 	rcc_periph_clock_enable(RCC_TIM4);
+
+	/* CRC unit for CONFIG_READ/CONFIG_WRITE */
+	rcc_periph_clock_enable(RCC_CRC);
 }
 
 // 16bit @ 100 Hz
@@ -146,6 +150,10 @@ static void pwm_setup(void) {
 static uint16_t values[4*3];
 static const uint16_t* lut[4*3];
 
+/* offset of our values in LED_FRAME packets */
+#define LED_GROUP_NONE 0xFFFF
+static uint16_t led_group = LED_GROUP_NONE;
+
 /* ((n+1)^2 - 1) by default: */
 static const uint16_t default_lut[256] = {
 	0, 3, 8, 15, 24, 35, 48, 63, 80, 99, 120, 143, 168, 195, 224, 255, 288,
@@ -176,14 +184,19 @@ static const uint16_t default_lut[256] = {
 static void read_lut(void) {
 	for(int i=0; i<4*3; i++) {
 		const struct config_item* led_lut = config_find_item(CONFIG_LED_LUT8TO16 + i);
-		if(led_lut != NULL) {
-			lut[i] = (uint16_t*)((void*)&led_lut + sizeof(struct config_item));
+		if(led_lut != NULL && led_lut->length == sizeof(default_lut)) {
+			lut[i] = (uint16_t*)((void*)led_lut + sizeof(struct config_item));
 		} else {
 			lut[i] = default_lut;
 		}
 	}
 }
 
+/* the LUTs have been moved to the other config bank */
+void config_compacted(void) {
+	read_lut();
+}
+
 static void commit(void) {
 	timer_set_oc_value(TIM2, TIM_OC1, values[0]);
 	timer_set_oc_value(TIM3, TIM_OC1, values[1]);
@@ -199,105 +212,407 @@ static void commit(void) {
 	timer_set_oc_value(TIM4, TIM_OC4, values[11]);
 }
 
-static void handle_LED_SET_16BIT(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
-	static struct {
-		uint16_t offset;
-		uint16_t data[4*3];
-	} in;
-	if(sizeof(struct lbus_hdr)+sizeof(in) >= p)
-		((uint8_t*)&in)[p-sizeof(struct lbus_hdr)-1] = rbyte;
-	if(p == header->length) {
-		uint16_t n = (p-sizeof(struct lbus_hdr)-sizeof(uint16_t)) / sizeof(uint16_t);
-		while(n-- > 0) {
-			const int led = in.offset+n;
-			if(led < 12) {
-				values[led] = in.data[n];
-			}
-		}
-		lbus_end_pkg();
+/* Receive buffer for the packet-level handlers below */
+static union {
+	struct lbus_GET_DATA GET_DATA;
+	struct {
+		uint16_t led;
+		uint16_t color[4*3];
+	} __packed LED_SET_16BIT;
+	struct {
+		uint16_t led;
+		uint8_t color[4*3];
+	} __packed LED_SET_8BIT;
+	struct lbus_SET_POLARITY SET_POLARITY;
+	struct lbus_SET_LED_GROUP SET_LED_GROUP;
+	struct lbus_LED_COMMIT_AT LED_COMMIT_AT;
+	struct lbus_CONFIG_READ CONFIG_READ;
+} pkg;
+
+/* LBUS handler for LED_SET_16BIT request */
+static void handle_LED_SET_16BIT(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	(void)header;
+	const struct lbus_LED_SET_16BIT *d = data;
+	if(length < sizeof(uint16_t))
+		return;
+	const unsigned int n = (length-sizeof(uint16_t)) / sizeof(uint16_t);
+	for(unsigned int i = 0; i < n; i++) {
+		const unsigned int led = d->led+i;
+		if(led >= 12)
+			break;
+		values[led] = d->color[i];
+	}
+}
+
+/* LBUS handler for LED_SET_8BIT request
+ *
+ * Values are mapped to 16 bit by the LUT of the respective LED.
+ */
+static void handle_LED_SET_8BIT(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	(void)header;
+	const struct lbus_LED_SET_8BIT *d = data;
+	if(length < sizeof(uint16_t))
+		return;
+	const unsigned int n = length-sizeof(uint16_t);
+	for(unsigned int i = 0; i < n; i++) {
+		const unsigned int led = d->led+i;
+		if(led >= 12)
+			break;
+		values[led] = lut[led][d->color[i]];
 	}
 }
 
-static void handle_LED_SET_8BIT(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
-	static struct {
-		uint16_t offset;
-		uint8_t v[4*3];
-	} data;
-	if(sizeof(struct lbus_hdr)+sizeof(data) >= p)
-		((uint8_t*)&data)[p-sizeof(struct lbus_hdr)-1] = rbyte;
+/* LBUS handler for LED_SET_ALL request, i.e. LED_SET_16BIT from LED 0 on
+ *
+ * The data has been received right after the offset in pkg.
+ */
+static void handle_LED_SET_ALL(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	(void)data;
+	handle_LED_SET_16BIT(header, &pkg, sizeof(uint16_t)+length);
+}
+
+#ifdef LBUS_TIME_SYNC
+/* LBUS handler for LED_COMMIT_AT request
+ *
+ * The values are written to the preload registers at the given bus
+ * time and become active at the end of the current PWM period.
+ */
+static void handle_LED_COMMIT_AT(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	(void)header;
+	const struct lbus_LED_COMMIT_AT *d = data;
+	if(length == sizeof(*d))
+		lbus_schedule(d->time, commit);
+}
+
+/* Bus time has been set, this happens at the same moment on all nodes
+ *
+ * Restart the PWM periods, so all nodes switch to committed values
+ * at the same time. Keeps the offsets between the timers that have
+ * been set up in pwm_setup().
+ */
+void lbus_time_synced(void) {
+	timer_set_counter(TIM2, 0);
+	timer_set_counter(TIM3, 2*65535/3);
+	timer_set_counter(TIM4, 65535/3);
+}
+#endif
+
+/* LBUS handler for LED_FRAME request
+ *
+ * The packet holds 16 bit values for many nodes, only our 4*3 values
+ * starting at led_group are used.
+ */
+static void handle_LED_FRAME(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	static uint8_t flags;
+	const unsigned int pos = p-sizeof(struct lbus_hdr)-1;
+	if(pos == 0) {
+		flags = rbyte;
+	} else {
+		const unsigned int led = (pos-sizeof(struct lbus_LED_FRAME)) / sizeof(uint16_t);
+		if(led >= led_group && led < led_group+4*3)
+			((uint8_t*)values)[(pos-sizeof(struct lbus_LED_FRAME)) - led_group*sizeof(uint16_t)] = rbyte;
+	}
 	if(p == header->length) {
-		uint16_t num_values = p-sizeof(struct lbus_hdr)-sizeof(uint16_t)-1;
-		int n = 0;
-		while(num_values > 0) {
-			if(data.offset < 12) {
-				values[data.offset] = lut[data.offset][data.v[n]];
-				data.offset++;
-				num_values--;
-				n++;
-			}
-		}
+		if(flags & LBUS_LED_FRAME_COMMIT)
+			commit();
 		lbus_end_pkg();
 	}
 }
 
-/* LBUS handler for GET_DATA request */
-static void handle_GET_DATA(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
-	LBUS_HANDLE_COMPLETE(static struct lbus_GET_DATA, d, p, rbyte) {
-		lbus_start_tx();
-		switch(d.type) {
-			case LBUS_DATA_STATUS:
-				lbus_send(LBUS_STATE_IN_FIRMWARE);
-				break;
-			case LBUS_DATA_ADDRESS: {
-					uint32_t lbus_address = config_get_uint32(CONFIG_LBUS_ADDRESS);
-					lbus_send(lbus_address);
-				}
-				break;
-			case LBUS_DATA_FIRMWARE_VERSION:
-				lbus_send32(&firmware_config.version);
-				break;
-			case LBUS_DATA_BOOTLOADER_VERSION:
-				{
-					uint32_t bootloader_version = (BKP_DR3 << 16) | BKP_DR2;
-					lbus_send32(&bootloader_version);
+/* Set a value for LED_SET_DELTA, ignoring positions of other nodes */
+static inline void set_delta_value(const uint8_t flags, const unsigned int pos, const uint16_t value) {
+	unsigned int led = pos;
+	if(flags & LBUS_DELTA_FRAME) {
+		if(led_group == LED_GROUP_NONE)
+			return;
+		led -= led_group;
+	}
+	if(led < 12)
+		values[led] = value;
+}
+
+/* LBUS handler for LED_SET_DELTA request
+ *
+ * Entries are decoded as soon as they are complete.
+ */
+static void handle_LED_SET_DELTA(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	static struct lbus_LED_SET_DELTA d;
+	static unsigned int pos;
+	static uint8_t entry[4];
+	static unsigned int n;
+	const unsigned int i = p-sizeof(struct lbus_hdr)-1;
+	if(i == 0) {
+		/* nothing of the last packet applies to a short one */
+		memset(&d, 0, sizeof(d));
+		pos = 0;
+		n = 0;
+	}
+	if(i < sizeof(d)) {
+		((uint8_t*)&d)[i] = rbyte;
+	} else {
+		entry[n++] = rbyte;
+		switch(d.encoding) {
+			case LBUS_DELTA_SPARSE:
+				if(n == 4) {
+					set_delta_value(d.flags, entry[0] | (entry[1] << 8), entry[2] | (entry[3] << 8));
+					n = 0;
 				}
 				break;
-			case LBUS_DATA_FIRMWARE_NAME_LENGTH:
-				{
-					uint8_t l=0;
-					for(const char* n=firmware_config.name; *n != '\0'; n++) 
-						l++;
-					lbus_send(l);
+			case LBUS_DELTA_RLE:
+				if(entry[0] & LBUS_DELTA_RLE_SKIP) {
+					pos += entry[0] & LBUS_DELTA_RLE_COUNT;
+					n = 0;
+				} else if(n == 3) {
+					for(int c = entry[0] & LBUS_DELTA_RLE_COUNT; c > 0; c--)
+						set_delta_value(d.flags, pos++, entry[1] | (entry[2] << 8));
+					n = 0;
 				}
 				break;
-			case LBUS_DATA_FIRMWARE_NAME:
-				for(unsigned int i=0; i < header->length - p; i++)
-					lbus_send(firmware_config.name[i]);
-				break;
-      case LBUS_DATA_POLARITY: {
-					uint32_t lbus_polarity = config_get_uint32(CONFIG_LED_POLARITY);
-					lbus_send(lbus_polarity);
+			case LBUS_DELTA_RAW:
+				if(n == 2) {
+					set_delta_value(d.flags, pos++, entry[0] | (entry[1] << 8));
+					n = 0;
 				}
 				break;
 			default:
-				for(int i=p; i<header->length; i++) 
-					lbus_send(0);
+				n = 0;
 		}
+	}
+	if(p == header->length) {
+		if(d.flags & LBUS_DELTA_COMMIT)
+			commit();
 		lbus_end_pkg();
 	}
 }
 
+/* Commands handled by lbus_handler() below */
+static const uint8_t commands[] = {
+	PING, GET_DATA, LED_COMMIT, LED_SET_16BIT, LED_SET_ALL, LED_SET_8BIT,
+	SET_POLARITY, LED_FRAME, LED_SET_DELTA,
+#ifdef LBUS_TIME_SYNC
+	LED_COMMIT_AT,
+#endif
+	SET_LED_GROUP, CONFIG_READ, CONFIG_WRITE, RESET_TO_BOOTLOADER
+};
+
+/* Data for GET_DATA and GET_DATA_MULTI requests */
+unsigned int lbus_get_data(const uint16_t type, void *buf) {
+	uint8_t *b = buf;
+	uint32_t v;
+	switch(type) {
+		case LBUS_DATA_STATUS:
+			b[0] = LBUS_STATE_IN_FIRMWARE;
+			return 1;
+		case LBUS_DATA_ADDRESS:
+			b[0] = config_get_uint32(CONFIG_LBUS_ADDRESS);
+			return 1;
+		case LBUS_DATA_FIRMWARE_VERSION:
+			v = firmware_config.version;
+			break;
+		case LBUS_DATA_BOOTLOADER_VERSION:
+			v = (BKP_DR3 << 16) | BKP_DR2;
+			break;
+		case LBUS_DATA_FIRMWARE_NAME_LENGTH:
+			b[0] = lbus_name_length(firmware_config.name);
+			return 1;
+		case LBUS_DATA_FIRMWARE_NAME: {
+				const unsigned int l = lbus_name_length(firmware_config.name);
+				memcpy(buf, firmware_config.name, l);
+				return l;
+			}
+		case LBUS_DATA_POLARITY:
+			b[0] = config_get_uint32(CONFIG_LED_POLARITY);
+			return 1;
+		case LBUS_DATA_GROUPS:
+			v = config_get_uint32(CONFIG_LBUS_GROUPS);
+			break;
+#ifdef LBUS_STATS
+		case LBUS_DATA_STATS:
+		case LBUS_DATA_STATS_RESET: {
+				struct lbus_stats stats;
+				lbus_read_stats(&stats, type == LBUS_DATA_STATS_RESET);
+				memcpy(buf, &stats, sizeof(stats));
+				return sizeof(stats);
+			}
+#endif
+		case LBUS_DATA_LED_GROUP:
+			memcpy(buf, &led_group, sizeof(led_group));
+			return sizeof(led_group);
+		case LBUS_DATA_CAPABILITIES: {
+				struct lbus_capabilities caps;
+				lbus_capabilities(&caps);
+				for(unsigned int i=0; i<sizeof(commands); i++)
+					lbus_cap_set_command(caps.commands, commands[i]);
+				caps.flags |= LBUS_CAP_LED_LUT;
+				caps.channels = sizeof(values) / sizeof(values[0]);
+				memcpy(buf, &caps, sizeof(caps));
+				return sizeof(caps);
+			}
+		default:
+			return 0;
+	}
+	memcpy(buf, &v, sizeof(v));
+	return sizeof(v);
+}
+
+/* LBUS handler for GET_DATA request
+ *
+ * Sends as much of the data as fits into the packet, padded with zeros
+ */
+static void handle_GET_DATA(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	const struct lbus_GET_DATA *d = data;
+	if(length == sizeof(*d)) {
+		uint8_t buf[LBUS_DATA_MAX];
+		const unsigned int space = header->length - sizeof(struct lbus_hdr) - length;
+		unsigned int l = lbus_get_data(d->type, buf);
+		if(l > space)
+			l = space;
+		lbus_start_tx();
+		lbus_send_buf(buf, l);
+		for(; l < space; l++)
+			lbus_send(0);
+	}
+}
+
+/* SCAN reply data, see LBUS_SCAN */
+void lbus_scan_info(struct lbus_scan *info) {
+	info->status = LBUS_STATE_IN_FIRMWARE;
+	info->version = firmware_config.version;
+	info->name_hash = lbus_name_hash(firmware_config.name);
+}
+
 /* LBUS handler for SET_POLARITY request
  *
  * Will transmit back 1 status byte:
  *  0: success
  *  other: error storing address in config section in flash memory
  */
-static void handle_SET_POLARITY(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+static void handle_SET_POLARITY(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	(void)header;
+	const struct lbus_SET_POLARITY *d = data;
+	if(length == sizeof(*d)) {
+		/* flash is written before the bus is driven, see handle_CONFIG_WRITE() */
+		int8_t result = config_set_uint32(CONFIG_LED_POLARITY, d->polarity);
+		lbus_start_tx();
+		lbus_send(result);
+	}
+}
+
+/* LBUS handler for SET_LED_GROUP request
+ *
+ * Will transmit back 1 status byte:
+ *  0: success
+ *  other: error storing LED group in config section in flash memory
+ */
+static void handle_SET_LED_GROUP(const struct lbus_hdr *header, void *data, const unsigned int length) {
 	(void)header;
-	LBUS_HANDLE_COMPLETE(static struct lbus_SET_POLARITY, d, p, rbyte) {
+	const struct lbus_SET_LED_GROUP *d = data;
+	if(length == sizeof(*d)) {
+		int8_t result = config_set_uint32(CONFIG_LED_GROUP, d->group);
+		if(result == 0)
+			led_group = d->group;
+		lbus_start_tx();
+		lbus_send(result);
+	}
+}
+
+static void read_led_group(void) {
+	if(config_find_item(CONFIG_LED_GROUP) != NULL)
+		led_group = config_get_uint32(CONFIG_LED_GROUP);
+}
+
+/* CRC32 of length bytes at data, padded with zeros to whole words */
+static uint32_t config_crc(const void *data, const unsigned int length) {
+	CRC_CR = 1; /* reset */
+	for(unsigned int i = 0; i < length; i += sizeof(uint32_t)) {
+		uint32_t w = 0;
+		memcpy(&w, data+i, length-i < sizeof(w) ? length-i : sizeof(w));
+		CRC_DR = w;
+	}
+	return CRC_DR;
+}
+
+/* LBUS handler for CONFIG_READ request
+ *
+ * Sends as much of the item as fits into the packet, see
+ * struct lbus_config_data.
+ */
+static void handle_CONFIG_READ(const struct lbus_hdr *header, void *data, const unsigned int length) {
+	const struct lbus_CONFIG_READ *d = data;
+	const unsigned int extra = sizeof(struct lbus_config_data) + sizeof(uint32_t);
+	if(length == sizeof(*d) && header->length >= sizeof(struct lbus_hdr) + length + extra) {
+		const unsigned int space = header->length - sizeof(struct lbus_hdr) - length - extra;
+		const struct config_item *item = config_find_item(d->type);
+		uint16_t item_length = LBUS_CONFIG_NONE;
+		const void *src = NULL;
+		unsigned int l = 0;
+		if(item != NULL && item->length < LBUS_CONFIG_NONE) {
+			item_length = item->length;
+			src = (void*)item + sizeof(struct config_item) + d->offset;
+			if(d->offset < item->length)
+				l = item->length - d->offset;
+			if(l > space)
+				l = space;
+		}
+		const uint32_t crc = config_crc(src, l);
+		lbus_start_tx();
+		lbus_send_buf(&item_length, sizeof(item_length));
+		if(l > 0)
+			lbus_send_ref(src, l);
+		for(; l < space; l++)
+			lbus_send(0);
+		lbus_send32(&crc);
+	}
+}
+
+/* LBUS handler for CONFIG_WRITE request
+ *
+ * The item is received into a buffer of LBUS_CONFIG_MAX bytes and gets
+ * written when its CRC matches.
+ * Will transmit back 1 status byte:
+ *  0: success
+ *  1: bad length
+ *  2: bad CRC
+ *  other: error storing the item in config section in flash memory
+ */
+static void handle_CONFIG_WRITE(const uint8_t rbyte, const struct lbus_hdr *header, const unsigned int p) {
+	static struct lbus_CONFIG_WRITE d;
+	static uint32_t buf[LBUS_CONFIG_MAX / sizeof(uint32_t)];
+	static uint32_t crc;
+	const unsigned int i = p-sizeof(struct lbus_hdr)-1;
+	if(p == header->length) {
+		/* not even room for the reply */
+		lbus_end_pkg();
+		return;
+	}
+	if(i < sizeof(d)) {
+		((uint8_t*)&d)[i] = rbyte;
+	} else if(i - sizeof(d) < d.length) {
+		if(i - sizeof(d) < sizeof(buf))
+			((uint8_t*)buf)[i - sizeof(d)] = rbyte;
+	} else if(i - sizeof(d) - d.length < sizeof(crc)) {
+		((uint8_t*)&crc)[i - sizeof(d) - d.length] = rbyte;
+	}
+	/* the last byte of the packet is the reply */
+	if(p == header->length - 1) {
+		int8_t result;
+		/* shorter than the item header, d is left from an earlier packet */
+		if(i + 1 < sizeof(d) || d.length > sizeof(buf) || i + 1 != sizeof(d) + d.length + sizeof(crc)) {
+			result = 1;
+		} else if(config_crc(buf, d.length) != crc) {
+			result = 2;
+		} else {
+			/* flash is written before the bus is driven: when the config
+			 * store gets compacted, that takes up to LBUS_CONFIG_WRITE_MAX_MS
+			 * and the host waits that long */
+			result = config_write(d.type, d.length, buf);
+			if(result == 0) {
+				/* items might have been replaced */
+				read_lut();
+				read_led_group();
+			}
+		}
 		lbus_start_tx();
-		int8_t result = config_set_uint32(CONFIG_LED_POLARITY, d.polarity);
 		lbus_send(result);
 		lbus_end_pkg();
 	}
@@ -306,7 +621,8 @@ static void handle_SET_POLARITY(const uint8_t rbyte, const struct lbus_hdr *head
 /* LBUS request handling
  *
  * For some operations, further data is pending. In these cases,
- * a handler function for this data is returned. If no further data
+ * a handler function for this data is returned, or the data is
+ * received into pkg for a packet-level handler. If no further data
  * is to be handled, NULL is returned.
  */
 lbus_recv_func lbus_handler(const struct lbus_hdr *header) {
@@ -316,16 +632,33 @@ lbus_recv_func lbus_handler(const struct lbus_hdr *header) {
 			lbus_send(1);
 			break;
 		case GET_DATA:
-			return handle_GET_DATA;
+			return lbus_recv_pkg(&pkg, sizeof(pkg.GET_DATA), handle_GET_DATA);
 		case LED_COMMIT:
 			commit();
 			break;
 		case LED_SET_16BIT:
-			return handle_LED_SET_16BIT;
+			return lbus_recv_pkg(&pkg, sizeof(pkg.LED_SET_16BIT), handle_LED_SET_16BIT);
+		case LED_SET_ALL:
+			pkg.LED_SET_16BIT.led = 0;
+			return lbus_recv_pkg(pkg.LED_SET_16BIT.color, sizeof(pkg.LED_SET_16BIT.color), handle_LED_SET_ALL);
 		case LED_SET_8BIT:
-			return handle_LED_SET_8BIT;
+			return lbus_recv_pkg(&pkg, sizeof(pkg.LED_SET_8BIT), handle_LED_SET_8BIT);
 		case SET_POLARITY:
-			return handle_SET_POLARITY;
+			return lbus_recv_pkg(&pkg, sizeof(pkg.SET_POLARITY), handle_SET_POLARITY);
+		case LED_FRAME:
+			return handle_LED_FRAME;
+		case LED_SET_DELTA:
+			return handle_LED_SET_DELTA;
+#ifdef LBUS_TIME_SYNC
+		case LED_COMMIT_AT:
+			return lbus_recv_pkg(&pkg, sizeof(pkg.LED_COMMIT_AT), handle_LED_COMMIT_AT);
+#endif
+		case SET_LED_GROUP:
+			return lbus_recv_pkg(&pkg, sizeof(pkg.SET_LED_GROUP), handle_SET_LED_GROUP);
+		case CONFIG_READ:
+			return lbus_recv_pkg(&pkg, sizeof(pkg.CONFIG_READ), handle_CONFIG_READ);
+		case CONFIG_WRITE:
+			return handle_CONFIG_WRITE;
 		case RESET_TO_BOOTLOADER:
 			lbus_reset_to_bootloader();
 			break;
@@ -342,10 +675,12 @@ int main(void)
 	pwm_setup();
 
 	read_lut();
+	read_led_group();
 
 	lbus_init();
 
 	while (1) {
+		lbus_poll();
 		__asm__("wfe");
 	}
 }
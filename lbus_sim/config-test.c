@@ -0,0 +1,657 @@
+/* Config store test and benchmark
+ *
+ * Runs lbus_common/config.c on a Linux host against a flash model that
+ * behaves like the STM32F1's: randomized writes checked against a model
+ * of the expected contents, power cuts at every flash operation, and
+ * numbers for lookup cost and write amplification.
+ *
+ * Copyright (c) 2016 Hans-Werner Hilse <hwhilse@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+
+#include "sim.h"
+
+/* included, so a reset can be simulated by dropping the RAM index */
+#include "config.c"
+
+/* the registers config.c uses: RCC, and the backup registers in which
+ * the bootloader tells whether it knows about banks
+ */
+static uint32_t periph[(RCC_BASE + 0x400 - PERIPH_BASE) / sizeof(uint32_t)];
+uintptr_t sim_mmio_offset;
+
+/* types used by the tests: a few big ones (like the LED LUTs), and more
+ * small ones than fit into the index, so some are found by scanning
+ */
+#define TYPES 48
+#define BIG_TYPES 4
+#define BIG_MAX 512
+#define SMALL_MAX 40
+#define BATCH_ITEMS 4
+
+static int failures;
+
+static void __attribute__((format(printf, 1, 2))) fail(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "FAIL: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	failures++;
+}
+
+/* the config store must never misuse the flash, so this ends the test */
+static void __attribute__((format(printf, 1, 2), noreturn)) fatal(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "FAIL: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static void die(const char *msg) {
+	perror(msg);
+	exit(2);
+}
+
+static uint32_t rand_state = 1;
+
+static uint32_t test_random(void) {
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 8;
+}
+
+/* Flash model
+ *
+ * The config space is plain memory at its real address, config.c reads
+ * it through pointers. Like on the STM32F1, a half word can only be
+ * programmed when it is erased or to zero (so bits only go from 1 to 0),
+ * and only a whole page can be erased. Power is cut by a longjmp before
+ * the flash operation with number flash.cut, an ISR runs before the one
+ * with number flash.isr_at.
+ */
+static struct {
+	bool locked;
+	/* flash operations: programmed half words and erased pages */
+	unsigned long ops;
+	long cut;
+	jmp_buf power;
+	long isr_at;
+	void (*isr)(void);
+	unsigned long programmed;
+	unsigned long erased;
+	unsigned long wear[CONFIG_SIZE / FLASH_PAGE_SIZE];
+} flash = { .locked = true, .cut = -1, .isr_at = -1 };
+
+static void flash_op(void) {
+	if(flash.cut >= 0 && flash.ops == (unsigned long)flash.cut)
+		longjmp(flash.power, 1);
+	if(flash.isr_at >= 0 && flash.ops == (unsigned long)flash.isr_at) {
+		flash.isr_at = -1;
+		flash.isr();
+	}
+	flash.ops++;
+}
+
+static void flash_check(const uint32_t address, const uint32_t align) {
+	if(flash.locked)
+		fatal("flash write to 0x%08x while locked", address);
+	if(address < CONFIG_ADDRESS || address >= CONFIG_ADDRESS + CONFIG_SIZE || (address & (align - 1)))
+		fatal("flash write to 0x%08x outside the config space", address);
+}
+
+void flash_unlock(void) {
+	flash.locked = false;
+}
+
+void flash_lock(void) {
+	flash.locked = true;
+}
+
+void flash_wait_for_last_operation(void) {
+}
+
+uint32_t flash_get_status_flags(void) {
+	return 0;
+}
+
+void flash_program_half_word(uint32_t address, uint16_t data) {
+	flash_check(address, 2);
+	uint16_t *p = (uint16_t*)(uintptr_t)address;
+	if(*p != 0xFFFF && data != 0)
+		fatal("programming 0x%04x over 0x%04x at 0x%08x", data, *p, address);
+	flash_op();
+	*p = data;
+	flash.programmed++;
+}
+
+void flash_program_word(uint32_t address, uint32_t data) {
+	flash_program_half_word(address, (uint16_t)data);
+	flash_program_half_word(address + 2, (uint16_t)(data >> 16));
+}
+
+void flash_erase_page(uint32_t page_address) {
+	flash_check(page_address, FLASH_PAGE_SIZE);
+	flash_op();
+	memset((void*)(uintptr_t)page_address, 0xFF, FLASH_PAGE_SIZE);
+	flash.erased++;
+	flash.wear[(page_address - CONFIG_ADDRESS) / FLASH_PAGE_SIZE]++;
+}
+
+/* the RAM index, a batch being put together and a write in progress are
+ * lost by a reset
+ */
+static void store_reboot(void) {
+	config_index.valid = false;
+	config_batch.count = 0;
+	busy = false;
+	compacted = false;
+}
+
+/* the bootloader as it leaves the backup registers */
+static void bootloader_banks(const bool banks) {
+	BKP_DR2 = 0x1234;
+	BKP_DR4 = banks ? (0x1234 ^ BOOTINFO_CONFIG_BANKS) : 0;
+	store_reboot();
+}
+
+static void store_erase(void) {
+	memset((void*)CONFIG_ADDRESS, 0xFF, CONFIG_SIZE);
+	memset(&flash, 0, sizeof(flash));
+	flash.locked = true;
+	flash.cut = -1;
+	flash.isr_at = -1;
+	store_reboot();
+}
+
+/* expected contents of the config store */
+struct value {
+	bool set;
+	uint32_t length;
+	uint8_t data[BIG_MAX];
+};
+static struct value expected[TYPES];
+
+static uint32_t test_type(const int i) {
+	return i < BIG_TYPES ? CONFIG_LED_LUT8TO16 + i : (uint32_t)i;
+}
+
+/* the next config operation of a test */
+static struct {
+	enum { OP_WRITE, OP_BATCH, OP_RESET } kind;
+	int count;
+	struct {
+		int t;
+		uint32_t length;
+		uint8_t data[BIG_MAX];
+	} items[BATCH_ITEMS];
+} op;
+
+static void op_random(void) {
+	const uint32_t r = test_random() % 100;
+	op.kind = r < 65 ? OP_WRITE : r < 95 ? OP_BATCH : OP_RESET;
+	op.count = op.kind == OP_BATCH ? 1 + test_random() % BATCH_ITEMS : op.kind == OP_WRITE;
+	for(int i=0; i<op.count; i++) {
+		/* big items are rare, like LUT uploads */
+		const int t = (test_random() % 8) ? BIG_TYPES + test_random() % (TYPES - BIG_TYPES)
+			: test_random() % BIG_TYPES;
+		op.items[i].t = t;
+		op.items[i].length = test_random() % ((t < BIG_TYPES ? BIG_MAX : SMALL_MAX) + 1);
+		for(uint32_t b=0; b<op.items[i].length; b++)
+			op.items[i].data[b] = test_random();
+	}
+}
+
+static int op_run(void) {
+	if(op.kind == OP_RESET) {
+		store_reboot();
+		return 0;
+	}
+	if(op.kind == OP_WRITE)
+		return config_write(test_type(op.items[0].t), op.items[0].length, op.items[0].data);
+	config_begin();
+	for(int i=0; i<op.count; i++)
+		if(config_put(test_type(op.items[i].t), op.items[i].length, op.items[i].data) < 0)
+			return -1;
+	return config_commit();
+}
+
+static void op_apply(struct value *values) {
+	for(int i=0; i<op.count; i++) {
+		struct value *v = &values[op.items[i].t];
+		v->set = true;
+		v->length = op.items[i].length;
+		memcpy(v->data, op.items[i].data, v->length);
+	}
+}
+
+/* whether the item of type t in the config store has the given value */
+static bool item_matches(const int t, const struct value *v) {
+	const struct config_item *item = config_find_item(test_type(t));
+	if(item == NULL || !v->set)
+		return item == NULL && !v->set;
+	return item->length == v->length && !memcmp((const void*)item + sizeof(*item), v->data, v->length);
+}
+
+static bool store_matches(const struct value *values) {
+	for(int t=0; t<TYPES; t++)
+		if(!item_matches(t, &values[t]))
+			return false;
+	return true;
+}
+
+/* randomized writes, batches and resets, all items are checked after each */
+static void test_fuzz(const int ops) {
+	store_erase();
+	memset(expected, 0, sizeof(expected));
+	for(int n=0; n<ops; n++) {
+		op_random();
+		const int ret = op_run();
+		if(ret != 0) {
+			fail("fuzz: operation %d failed with %d", n, ret);
+			return;
+		}
+		op_apply(expected);
+		if(!store_matches(expected)) {
+			fail("fuzz: wrong contents after operation %d", n);
+			return;
+		}
+	}
+	unsigned long wear = 0;
+	for(unsigned int p=0; p<CONFIG_SIZE / FLASH_PAGE_SIZE; p++)
+		if(flash.wear[p] > wear)
+			wear = flash.wear[p];
+	printf("fuzz: %d operations, %u banks, %lu erases on the most worn page\n",
+		ops, config_index.generation, wear);
+}
+
+/* after a power cut during a single write, its item may be there with
+ * the data only partially programmed: a prefix of it, the rest erased
+ */
+static bool item_torn(const int t) {
+	const struct config_item *item = config_find_item(test_type(t));
+	if(item == NULL || item->length != op.items[0].length)
+		return false;
+	const uint8_t *data = (const void*)item + sizeof(*item);
+	uint32_t b = 0;
+	while(b < item->length && data[b] == op.items[0].data[b])
+		b++;
+	while(b < item->length && data[b] == 0xFF)
+		b++;
+	return b == item->length;
+}
+
+/* Power cuts at every flash operation of a sequence of config operations,
+ * each followed by a reset. The interrupted operation must have taken
+ * effect completely or not at all, the others must be intact. Only the
+ * item of an interrupted single write may be torn (see item_torn()),
+ * batches must not. The store must take further writes afterwards.
+ */
+static void test_crash(const int ops) {
+	static uint8_t saved_flash[CONFIG_SIZE];
+	static struct value saved[TYPES], after[TYPES];
+	store_erase();
+	memset(expected, 0, sizeof(expected));
+	/* start with a bank that is mostly full, so the sequence compacts */
+	while(config_find_item(CONFIG_UNSET) != NULL
+		&& config_index.end - config_index.start < CONFIG_BANK_SIZE * 3 / 4)
+	{
+		op_random();
+		if(op_run() != 0) {
+			fail("crash: setup failed");
+			return;
+		}
+		op_apply(expected);
+	}
+	memcpy(saved_flash, (void*)CONFIG_ADDRESS, CONFIG_SIZE);
+	memcpy(saved, expected, sizeof(saved));
+	const uint32_t seed = rand_state;
+	const uint16_t generation = config_index.generation;
+
+	/* the sequence without power cuts, for the number of flash operations */
+	flash.ops = 0;
+	for(int n=0; n<ops; n++) {
+		op_random();
+		if(op_run() != 0) {
+			fail("crash: sequence failed");
+			return;
+		}
+	}
+	const unsigned long total = flash.ops;
+	const unsigned int banks = (uint16_t)(config_index.generation - generation);
+
+	unsigned long torn = 0;
+	for(unsigned long cut=0; cut<total; cut++) {
+		memcpy((void*)CONFIG_ADDRESS, saved_flash, CONFIG_SIZE);
+		memcpy(expected, saved, sizeof(expected));
+		rand_state = seed;
+		store_reboot();
+		flash.ops = 0;
+		flash.cut = cut;
+		if(!setjmp(flash.power)) {
+			for(int n=0; n<ops; n++) {
+				op_random();
+				op_run();
+				op_apply(expected);
+			}
+			fail("crash: no power cut at operation %lu", cut);
+			break;
+		}
+		flash.cut = -1;
+		flash.locked = true;
+		store_reboot();
+
+		memcpy(after, expected, sizeof(after));
+		op_apply(after);
+		if(store_matches(after)) {
+			memcpy(expected, after, sizeof(expected));
+		} else if(!store_matches(expected)) {
+			const int t = op.items[0].t;
+			bool others = op.kind == OP_WRITE && item_torn(t);
+			for(int i=0; others && i<TYPES; i++)
+				others = i == t || item_matches(i, &expected[i]);
+			if(!others) {
+				fail("crash: wrong contents after a power cut at operation %lu", cut);
+				continue;
+			}
+			const struct config_item *item = config_find_item(test_type(t));
+			expected[t].set = true;
+			expected[t].length = item->length;
+			memcpy(expected[t].data, (const void*)item + sizeof(*item), item->length);
+			torn++;
+		}
+
+		/* the store must still work, and keep it after another reset */
+		op_random();
+		if(op_run() != 0) {
+			fail("crash: write after a power cut at operation %lu failed", cut);
+			continue;
+		}
+		op_apply(expected);
+		store_reboot();
+		if(!store_matches(expected))
+			fail("crash: wrong contents after a write following a power cut at operation %lu", cut);
+	}
+	printf("crash: %lu power cuts in %d operations (%u bank switches), %lu torn single writes\n",
+		total, ops, banks, torn);
+}
+
+/* what an LBUS handler interrupting a write got from the store */
+static struct {
+	int runs;
+	int write;
+	const struct config_item *item;
+} isr;
+
+static void isr_run(void) {
+	const uint32_t v = 0x12345678;
+	isr.runs++;
+	isr.item = config_find_item(test_type(0));
+	isr.write = config_write(test_type(0), sizeof(v), &v);
+}
+
+/* Writes and batches interrupted by an ISR before a random flash
+ * operation: its lookups and writes must fail without touching the store,
+ * compaction must have been notified after the write.
+ */
+static void test_isr(const int ops) {
+	store_erase();
+	memset(expected, 0, sizeof(expected));
+	memset(&isr, 0, sizeof(isr));
+	flash.isr = isr_run;
+	for(int n=0; n<ops; n++) {
+		op_random();
+		if(op.kind == OP_RESET)
+			continue;
+		const int runs = isr.runs;
+		flash.isr_at = flash.ops + test_random() % 64;
+		struct value next[TYPES];
+		memcpy(next, expected, sizeof(next));
+		op_apply(next);
+		const int ret = op_run();
+		flash.isr_at = -1;
+		if(ret != 0) {
+			fail("isr: operation %d failed with %d", n, ret);
+			break;
+		}
+		memcpy(expected, next, sizeof(expected));
+		if(isr.runs != runs && (isr.write != -3 || isr.item != NULL)) {
+			fail("isr: got %d and %p while interrupting operation %d", isr.write, (void*)isr.item, n);
+			break;
+		}
+		if(!store_matches(expected)) {
+			fail("isr: wrong contents after operation %d", n);
+			break;
+		}
+		if(compacted) {
+			fail("isr: compaction not notified after operation %d", n);
+			break;
+		}
+	}
+	printf("isr: %d of %d operations interrupted, %u banks\n", isr.runs, ops, config_index.generation);
+}
+
+/* config_find_item() of the bootloaders from before there were banks */
+static const struct config_item *legacy_find(const uint32_t type) {
+	const struct config_item *found = NULL;
+	for(const void *config = (void*)CONFIG_ADDRESS; config < (void*)(CONFIG_ADDRESS + CONFIG_SIZE); ) {
+		const struct config_item *item = config;
+		if(item->type == type)
+			found = item;
+		if(item->type == CONFIG_UNSET)
+			break;
+		config += item_size(item->length);
+	}
+	return found;
+}
+
+/* With a bootloader that does not know about banks, the store must stay
+ * a single log over the whole config space, the bootloader must find the
+ * same items. Writes fail when it is full.
+ */
+static void test_legacy(void) {
+	store_erase();
+	bootloader_banks(false);
+	memset(expected, 0, sizeof(expected));
+	int n = 0;
+	for(;; n++) {
+		op_random();
+		const int ret = op_run();
+		if(ret == -2)
+			break;
+		if(ret != 0) {
+			fail("legacy: operation %d failed with %d", n, ret);
+			break;
+		}
+		op_apply(expected);
+		bool same = store_matches(expected);
+		for(int t=0; same && t<TYPES; t++)
+			same = legacy_find(test_type(t)) == config_find_item(test_type(t));
+		if(!same) {
+			fail("legacy: wrong contents after operation %d", n);
+			break;
+		}
+	}
+	if(config_index.generation != 0 || config_index.end <= BANK_ADDRESS(1))
+		fail("legacy: the log did not grow into the second bank");
+	printf("legacy: %d operations until the single log was full at %d bytes\n",
+		n, (int)(config_index.end - config_index.start));
+	bootloader_banks(true);
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Lookup cost by fill level of the active bank: rebuilding the index
+ * after a reset scans the whole log, and so does every lookup of a type
+ * that did not fit into the index. Host times, only good for comparisons.
+ */
+static volatile const void *sink;
+
+static void bench_lookup(void) {
+	store_erase();
+	printf("lookup: %4s  %5s  %11s  %14s  %14s\n", "fill", "items", "index build", "indexed lookup", "scanned lookup");
+	int fill = 10;
+	for(uint32_t i=0; fill<100; i++) {
+		if(config_find_item(CONFIG_UNSET) == NULL
+			|| config_index.end + item_size(sizeof(uint32_t)) > config_index.limit)
+		{
+			break;
+		}
+		config_set_uint32(1 + i % TYPES, i);
+		if((config_index.end - config_index.start) * 100 < fill * CONFIG_BANK_SIZE)
+			continue;
+		const int rounds = 200, lookups = 100000, scans = 2000;
+		double t = now_ns();
+		for(int r=0; r<rounds; r++) {
+			store_reboot();
+			sink = config_find_item(1);
+		}
+		const double build = (now_ns() - t) / rounds;
+		t = now_ns();
+		for(int r=0; r<lookups; r++)
+			sink = config_find_item(1 + r % CONFIG_INDEX_SIZE);
+		const double indexed = (now_ns() - t) / lookups;
+		t = now_ns();
+		for(int r=0; r<scans; r++)
+			sink = config_find_item(CONFIG_INDEX_SIZE + 1 + r % (TYPES - CONFIG_INDEX_SIZE));
+		const double scanned = (now_ns() - t) / scans;
+		printf("        %3d%%  %5u  %8.0f ns  %11.0f ns  %11.0f ns\n",
+			fill, i + 1, build, indexed, scanned);
+		fill += 10;
+	}
+}
+
+/* Write amplification: bytes programmed and pages erased for the data
+ * written by a workload, and the flash busy time per config operation
+ * (with the typical program/erase times of the STM32F1)
+ */
+static void bench_workload(const char *name, const int writes, const int types,
+	const uint32_t length, const int batch)
+{
+	static uint8_t data[BATCH_ITEMS][BIG_MAX];
+	unsigned long payload = 0;
+	store_erase();
+	for(int w=0; w<writes; w++) {
+		int ret;
+		for(int i=0; i<batch; i++)
+			for(uint32_t b=0; b<length; b++)
+				data[i][b] = test_random();
+		if(batch == 1) {
+			ret = config_write(1 + test_random() % types, length, data[0]);
+		} else {
+			config_begin();
+			for(int i=0; i<batch; i++)
+				config_put(1 + test_random() % types, length, data[i]);
+			ret = config_commit();
+		}
+		if(ret != 0) {
+			fail("%s: write %d failed with %d", name, w, ret);
+			return;
+		}
+		payload += batch * length;
+	}
+	const double busy = (double)(flash.programmed * SIM_FLASH_PROGRAM_CYCLES
+		+ flash.erased * SIM_FLASH_ERASE_CYCLES) / SIM_CPU_SPEED * 1e6;
+	printf("      %-20s  %8lu  %10lu  %5.2f  %6lu  %8.0f us\n", name, payload,
+		flash.programmed * 2, (double)flash.programmed * 2 / payload, flash.erased, busy / writes);
+}
+
+static void bench_wear(const int writes) {
+	printf("wear: %-20s  %8s  %10s  %5s  %6s  %11s\n", "workload", "data", "programmed", "ampl.", "erases", "flash/write");
+	bench_workload("4 bytes, 8 types", writes, 8, 4, 1);
+	bench_workload("4 bytes, 48 types", writes, 48, 4, 1);
+	bench_workload("32 bytes, 16 types", writes, 16, 32, 1);
+	bench_workload("512 bytes, 4 types", writes / 16, 4, 512, 1);
+	bench_workload("batch 4x4 bytes", writes / 4, 8, 4, BATCH_ITEMS);
+}
+
+static const char *tests[] = { "fuzz", "crash", "legacy", "isr", "lookup", "wear" };
+#define TESTS (sizeof(tests) / sizeof(tests[0]))
+
+static void usage(void) {
+	fprintf(stderr, "Usage: config-test [-n operations] [-c operations] [-s seed] [test...]\n"
+		"tests: fuzz crash legacy isr lookup wear (default: all)\n");
+	exit(2);
+}
+
+int main(int argc, char* argv[]) {
+	int ops = 20000, cut_ops = 150;
+	int opt;
+	while((opt = getopt(argc, argv, "n:c:s:")) != -1) {
+		switch(opt) {
+			case 'n': ops = atoi(optarg); break;
+			case 'c': cut_ops = atoi(optarg); break;
+			case 's': rand_state = strtoul(optarg, NULL, 0); break;
+			default: usage();
+		}
+	}
+	if(ops < 1 || cut_ops < 1)
+		usage();
+	for(int i=optind; i<argc; i++) {
+		unsigned int t = 0;
+		while(t < TESTS && strcmp(argv[i], tests[t]))
+			t++;
+		if(t == TESTS)
+			usage();
+	}
+
+	if(mmap((void*)CONFIG_ADDRESS, CONFIG_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void*)CONFIG_ADDRESS)
+	{
+		die("mmap");
+	}
+	sim_mmio_offset = (uintptr_t)periph - PERIPH_BASE;
+	bootloader_banks(true);
+
+	for(unsigned int t=0; t<TESTS; t++) {
+		bool run = optind == argc;
+		for(int i=optind; i<argc; i++)
+			run = run || !strcmp(argv[i], tests[t]);
+		if(!run)
+			continue;
+		switch(t) {
+			case 0: test_fuzz(ops); break;
+			case 1: test_crash(cut_ops); break;
+			case 2: test_legacy(); break;
+			case 3: test_isr(cut_ops * 20); break;
+			case 4: bench_lookup(); break;
+			case 5: bench_wear(ops); break;
+		}
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,583 @@
+/* LBUS simulator: libopencm3 stand-in for node images
+ *
+ * Copyright (c) 2016 Hans-Werner Hilse <hwhilse@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/dma.h>
+
+#include "sim.h"
+
+/* set by the simulator after loading the image */
+struct sim_env *sim_env;
+uintptr_t sim_mmio_offset;
+
+#define NODE (sim_env->node)
+
+/* cycles spent for polling a register through a library call */
+#define POLL_CYCLES 4
+
+/* Inline assembly of the node code
+ *
+ * WFE/WFI sleep until the next interrupt, NOP busy waits for a cycle.
+ * Anything else has no meaning in the simulator.
+ */
+void sim_asm(const char *insn) {
+	if(!strcmp(insn, "wfe") || !strcmp(insn, "wfi"))
+		sim_env->wait(NODE);
+	else if(!strcmp(insn, "nop"))
+		sim_env->delay(NODE, 1);
+}
+
+volatile uint32_t *sim_scb_aircr(void) {
+	sim_env->reset(NODE, SIM_RESET);
+}
+
+/* jump from the bootloader to the firmware, see bootloader.c */
+void sim_run_firmware(void) {
+	sim_env->reset(NODE, SIM_RUN_FIRMWARE);
+}
+
+/* Cortex-M3 core
+ *
+ * Interrupt handlers run to completion in the simulator, so masking
+ * interrupts only needs to be recorded.
+ */
+static uint32_t primask;
+
+void cm_enable_interrupts(void) {
+	primask = 0;
+}
+
+void cm_disable_interrupts(void) {
+	primask = 1;
+}
+
+bool cm_is_masked_interrupts(void) {
+	return primask != 0;
+}
+
+uint32_t cm_mask_interrupts(uint32_t mask) {
+	const uint32_t old = primask;
+	primask = mask;
+	return old;
+}
+
+void nvic_enable_irq(uint8_t irqn) {
+	NVIC_ISER(irqn / 32) |= 1 << (irqn % 32);
+}
+
+void nvic_disable_irq(uint8_t irqn) {
+	NVIC_ISER(irqn / 32) &= ~(1 << (irqn % 32));
+}
+
+void nvic_set_priority(uint8_t irqn, uint8_t priority) {
+	/* system handlers have negative numbers */
+	if((int8_t)irqn < 0)
+		SCB_SHPR((irqn & 0xF) - 4) = priority;
+	else
+		NVIC_IPR(irqn) = priority;
+}
+
+void systick_set_reload(uint32_t value) {
+	STK_RVR = value & 0x00FFFFFF;
+}
+
+uint32_t systick_get_reload(void) {
+	return STK_RVR;
+}
+
+uint32_t systick_get_value(void) {
+	return STK_CVR;
+}
+
+void systick_set_clocksource(uint8_t clocksource) {
+	STK_CSR = (STK_CSR & ~STK_CSR_CLKSOURCE_AHB) | clocksource;
+}
+
+void systick_interrupt_enable(void) {
+	STK_CSR |= STK_CSR_TICKINT;
+}
+
+void systick_interrupt_disable(void) {
+	STK_CSR &= ~STK_CSR_TICKINT;
+}
+
+void systick_counter_enable(void) {
+	STK_CSR |= STK_CSR_ENABLE;
+}
+
+void systick_counter_disable(void) {
+	STK_CSR &= ~STK_CSR_ENABLE;
+}
+
+void systick_clear(void) {
+	STK_CVR = 0;
+}
+
+bool dwt_enable_cycle_counter(void) {
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+	return true;
+}
+
+void dwt_disable_cycle_counter(void) {
+	DWT_CTRL &= ~DWT_CTRL_CYCCNTENA;
+}
+
+uint32_t dwt_read_cycle_counter(void) {
+	return sim_env->now(NODE);
+}
+
+/* RCC: the simulated clock tree is fixed at 72 MHz */
+void rcc_periph_clock_enable(enum rcc_periph_clken clken) {
+	MMIO32(RCC_BASE + (clken >> 5)) |= 1 << (clken & 0x1F);
+}
+
+void rcc_periph_clock_disable(enum rcc_periph_clken clken) {
+	MMIO32(RCC_BASE + (clken >> 5)) &= ~(1 << (clken & 0x1F));
+}
+
+void rcc_clock_setup_in_hse_8mhz_out_72mhz(void) {
+}
+
+/* GPIO */
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios) {
+	for(int i=0; i<16; i++) {
+		if(!(gpios & (1 << i)))
+			continue;
+		volatile uint32_t *cr = (i < 8) ? &GPIO_CRL(gpioport) : &GPIO_CRH(gpioport);
+		const int shift = (i % 8) * 4;
+		*cr = (*cr & ~(0xF << shift)) | (((cnf << 2) | mode) << shift);
+	}
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios) {
+	GPIO_ODR(gpioport) |= gpios;
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios) {
+	GPIO_ODR(gpioport) &= ~gpios;
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios) {
+	return GPIO_IDR(gpioport) & gpios;
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios) {
+	GPIO_ODR(gpioport) ^= gpios;
+}
+
+/* USART
+ *
+ * Transmitting is done by the simulator, received characters are put
+ * into the data register by the simulator, too.
+ */
+void usart_set_baudrate(uint32_t usart, uint32_t baud) {
+	const uint32_t clock = (usart == USART1) ? SIM_CPU_SPEED : SIM_APB1_SPEED;
+	USART_BRR(usart) = (clock + baud / 2) / baud;
+}
+
+void usart_set_databits(uint32_t usart, uint32_t bits) {
+	if(bits == 9)
+		USART_CR1(usart) |= USART_CR1_M;
+	else
+		USART_CR1(usart) &= ~USART_CR1_M;
+}
+
+void usart_enable(uint32_t usart) {
+	USART_CR1(usart) |= USART_CR1_UE;
+}
+
+void usart_disable(uint32_t usart) {
+	USART_CR1(usart) &= ~USART_CR1_UE;
+}
+
+void usart_send(uint32_t usart, uint16_t data) {
+	(void)usart;
+	sim_env->usart_send(NODE, data);
+}
+
+uint16_t usart_recv(uint32_t usart) {
+	const uint16_t data = USART_DR(usart) & 0x1FF;
+	/* reading SR, then DR clears the error flags, too */
+	USART_SR(usart) &= ~(USART_SR_RXNE | USART_SR_IDLE | USART_SR_ORE
+		| USART_SR_NE | USART_SR_FE | USART_SR_PE);
+	return data;
+}
+
+void usart_wait_send_ready(uint32_t usart) {
+	while((USART_SR(usart) & USART_SR_TXE) == 0)
+		sim_env->delay(NODE, POLL_CYCLES);
+}
+
+void usart_wait_recv_ready(uint32_t usart) {
+	while((USART_SR(usart) & USART_SR_RXNE) == 0)
+		sim_env->delay(NODE, POLL_CYCLES);
+}
+
+void usart_send_blocking(uint32_t usart, uint16_t data) {
+	usart_send(usart, data);
+}
+
+uint16_t usart_recv_blocking(uint32_t usart) {
+	usart_wait_recv_ready(usart);
+	return usart_recv(usart);
+}
+
+void usart_enable_rx_dma(uint32_t usart) {
+	USART_CR3(usart) |= USART_CR3_DMAR;
+}
+
+void usart_disable_rx_dma(uint32_t usart) {
+	USART_CR3(usart) &= ~USART_CR3_DMAR;
+}
+
+void usart_enable_tx_dma(uint32_t usart) {
+	USART_CR3(usart) |= USART_CR3_DMAT;
+}
+
+void usart_disable_tx_dma(uint32_t usart) {
+	USART_CR3(usart) &= ~USART_CR3_DMAT;
+}
+
+bool usart_get_flag(uint32_t usart, uint32_t flag) {
+	return (USART_SR(usart) & flag) != 0;
+}
+
+/* DMA: the transfers are done by the simulator, see dma_sync() there */
+void dma_channel_reset(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) = 0;
+	DMA_CNDTR(dma, channel) = 0;
+	DMA_CPAR(dma, channel) = 0;
+	DMA_CMAR(dma, channel) = 0;
+	DMA_ISR(dma) &= ~(0xF << DMA_FLAG_OFFSET(channel));
+}
+
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts) {
+	DMA_ISR(dma) &= ~(interrupts << DMA_FLAG_OFFSET(channel));
+}
+
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts) {
+	sim_env->delay(NODE, POLL_CYCLES);
+	return (DMA_ISR(dma) & (interrupts << DMA_FLAG_OFFSET(channel))) != 0;
+}
+
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio) {
+	DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_PL_VERY_HIGH) | prio;
+}
+
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size) {
+	DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_MSIZE_MASK) | mem_size;
+}
+
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size) {
+	DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_PSIZE_MASK) | peripheral_size;
+}
+
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) |= DMA_CCR_MINC;
+}
+
+void dma_disable_peripheral_increment_mode(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) &= ~DMA_CCR_PINC;
+}
+
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) |= DMA_CCR_CIRC;
+}
+
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) &= ~DMA_CCR_DIR;
+}
+
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) |= DMA_CCR_DIR;
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) |= DMA_CCR_TCIE;
+}
+
+void dma_disable_transfer_complete_interrupt(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) &= ~DMA_CCR_TCIE;
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) |= DMA_CCR_HTIE;
+}
+
+void dma_disable_half_transfer_interrupt(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) &= ~DMA_CCR_HTIE;
+}
+
+void dma_enable_channel(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) |= DMA_CCR_EN;
+}
+
+void dma_disable_channel(uint32_t dma, uint8_t channel) {
+	DMA_CCR(dma, channel) &= ~DMA_CCR_EN;
+}
+
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address) {
+	DMA_CPAR(dma, channel) = address;
+}
+
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address) {
+	DMA_CMAR(dma, channel) = address;
+}
+
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number) {
+	DMA_CNDTR(dma, channel) = number;
+}
+
+/* Timers: counting is done by the simulator */
+void timer_reset(uint32_t timer_peripheral) {
+	for(int reg=0; reg<=0x4C; reg+=4)
+		MMIO32(timer_peripheral + reg) = 0;
+}
+
+void timer_set_mode(uint32_t timer_peripheral, uint32_t clock_div, uint32_t alignment, uint32_t direction) {
+	TIM_CR1(timer_peripheral) = (TIM_CR1(timer_peripheral) & ~(0x3FF0)) | clock_div | alignment | direction;
+}
+
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value) {
+	TIM_PSC(timer_peripheral) = value;
+}
+
+void timer_set_period(uint32_t timer_peripheral, uint32_t period) {
+	TIM_ARR(timer_peripheral) = period;
+}
+
+void timer_continuous_mode(uint32_t timer_peripheral) {
+	TIM_CR1(timer_peripheral) &= ~TIM_CR1_OPM;
+}
+
+void timer_one_shot_mode(uint32_t timer_peripheral) {
+	TIM_CR1(timer_peripheral) |= TIM_CR1_OPM;
+}
+
+void timer_enable_counter(uint32_t timer_peripheral) {
+	TIM_CR1(timer_peripheral) |= TIM_CR1_CEN;
+}
+
+void timer_disable_counter(uint32_t timer_peripheral) {
+	TIM_CR1(timer_peripheral) &= ~TIM_CR1_CEN;
+}
+
+uint32_t timer_get_counter(uint32_t timer_peripheral) {
+	sim_env->delay(NODE, POLL_CYCLES);
+	return TIM_CNT(timer_peripheral);
+}
+
+void timer_set_counter(uint32_t timer_peripheral, uint32_t count) {
+	TIM_CNT(timer_peripheral) = count;
+}
+
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event) {
+	TIM_EGR(timer_peripheral) |= event;
+}
+
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq) {
+	TIM_DIER(timer_peripheral) |= irq;
+}
+
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq) {
+	TIM_DIER(timer_peripheral) &= ~irq;
+}
+
+/* output compare channels, the complementary outputs are ignored */
+static inline int oc_channel(enum tim_oc_id oc_id) {
+	switch(oc_id) {
+		case TIM_OC1: return 0;
+		case TIM_OC2: return 1;
+		case TIM_OC3: return 2;
+		case TIM_OC4: return 3;
+		default: return -1;
+	}
+}
+
+static inline volatile uint32_t *oc_ccmr(uint32_t timer_peripheral, const int ch) {
+	return (ch < 2) ? &TIM_CCMR1(timer_peripheral) : &TIM_CCMR2(timer_peripheral);
+}
+
+void timer_disable_oc_output(uint32_t timer_peripheral, enum tim_oc_id oc_id) {
+	const int ch = oc_channel(oc_id);
+	if(ch >= 0)
+		TIM_CCER(timer_peripheral) &= ~(1 << (ch * 4));
+}
+
+void timer_enable_oc_output(uint32_t timer_peripheral, enum tim_oc_id oc_id) {
+	const int ch = oc_channel(oc_id);
+	if(ch >= 0)
+		TIM_CCER(timer_peripheral) |= 1 << (ch * 4);
+}
+
+void timer_set_oc_mode(uint32_t timer_peripheral, enum tim_oc_id oc_id, enum tim_oc_mode oc_mode) {
+	const int ch = oc_channel(oc_id);
+	if(ch < 0)
+		return;
+	const int shift = (ch % 2) * 8 + 4;
+	volatile uint32_t *ccmr = oc_ccmr(timer_peripheral, ch);
+	*ccmr = (*ccmr & ~(0x7 << shift)) | (oc_mode << shift);
+}
+
+void timer_disable_oc_clear(uint32_t timer_peripheral, enum tim_oc_id oc_id) {
+	const int ch = oc_channel(oc_id);
+	if(ch >= 0)
+		*oc_ccmr(timer_peripheral, ch) &= ~(1 << ((ch % 2) * 8 + 7));
+}
+
+void timer_enable_oc_preload(uint32_t timer_peripheral, enum tim_oc_id oc_id) {
+	const int ch = oc_channel(oc_id);
+	if(ch >= 0)
+		*oc_ccmr(timer_peripheral, ch) |= 1 << ((ch % 2) * 8 + 3);
+}
+
+void timer_set_oc_polarity_high(uint32_t timer_peripheral, enum tim_oc_id oc_id) {
+	const int ch = oc_channel(oc_id);
+	if(ch >= 0)
+		TIM_CCER(timer_peripheral) &= ~(1 << (ch * 4 + 1));
+}
+
+void timer_set_oc_polarity_low(uint32_t timer_peripheral, enum tim_oc_id oc_id) {
+	const int ch = oc_channel(oc_id);
+	if(ch >= 0)
+		TIM_CCER(timer_peripheral) |= 1 << (ch * 4 + 1);
+}
+
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value) {
+	const int ch = oc_channel(oc_id);
+	if(ch >= 0)
+		MMIO32(timer_peripheral + 0x34 + ch * 4) = value;
+}
+
+/* Flash controller
+ *
+ * Like the real thing, a half word can only be programmed when it is
+ * erased (or to zero). Programming and erasing take their typical time.
+ */
+#define FLASH_CR_LOCK (1 << 7)
+
+void flash_unlock(void) {
+	FLASH_CR &= ~FLASH_CR_LOCK;
+}
+
+void flash_lock(void) {
+	FLASH_CR |= FLASH_CR_LOCK;
+}
+
+void flash_wait_for_last_operation(void) {
+}
+
+static bool flash_writable(uint32_t address) {
+	if(FLASH_CR & FLASH_CR_LOCK) {
+		FLASH_SR |= FLASH_SR_WRPRTERR;
+		return false;
+	}
+	return address >= SIM_FLASH_BASE && address < SIM_FLASH_BASE + SIM_FLASH_SIZE;
+}
+
+void flash_program_half_word(uint32_t address, uint16_t data) {
+	if(!flash_writable(address))
+		return;
+	volatile uint16_t *dst = &MMIO16(address);
+	if(*dst != 0xFFFF && data != 0) {
+		FLASH_SR |= FLASH_SR_PGERR;
+	} else {
+		*dst = data;
+		FLASH_SR |= FLASH_SR_EOP;
+	}
+	sim_env->delay(NODE, SIM_FLASH_PROGRAM_CYCLES);
+}
+
+void flash_program_word(uint32_t address, uint32_t data) {
+	flash_program_half_word(address, (uint16_t)data);
+	flash_program_half_word(address + 2, (uint16_t)(data >> 16));
+}
+
+void flash_erase_page(uint32_t page_address) {
+	if(!flash_writable(page_address))
+		return;
+	memset((void*)&MMIO8(page_address & ~(1024 - 1)), 0xFF, 1024);
+	FLASH_SR |= FLASH_SR_EOP;
+	sim_env->delay(NODE, SIM_FLASH_ERASE_CYCLES);
+}
+
+uint32_t flash_get_status_flags(void) {
+	return FLASH_SR & (FLASH_SR_PGERR | FLASH_SR_EOP | FLASH_SR_WRPRTERR | FLASH_SR_BSY);
+}
+
+/* CRC unit
+ *
+ * Calculation happens on writing the data register. A write is noticed
+ * on the next register access by the data register differing from the
+ * last result - so writing a word equal to the current CRC value goes
+ * unnoticed, which does not matter for the LBUS code.
+ */
+static uint32_t crc_last = 0xFFFFFFFF;
+
+static uint32_t crc_step(uint32_t crc, const uint32_t data) {
+	crc ^= data;
+	for(int i=0; i<32; i++)
+		crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+	return crc;
+}
+
+volatile uint32_t *sim_crc_reg(unsigned int offset) {
+	volatile uint32_t *dr = &MMIO32(CRC_BASE + 0x00);
+	volatile uint32_t *cr = &MMIO32(CRC_BASE + 0x08);
+	if(*dr != crc_last)
+		*dr = crc_step(crc_last, *dr);
+	if(*cr & CRC_CR_RESET) {
+		*cr &= ~CRC_CR_RESET;
+		*dr = 0xFFFFFFFF;
+	}
+	crc_last = *dr;
+	return &MMIO32(CRC_BASE + offset);
+}
+
+void crc_reset(void) {
+	CRC_CR |= CRC_CR_RESET;
+}
+
+uint32_t crc_calculate(uint32_t data) {
+	CRC_DR = data;
+	return CRC_DR;
+}
+
+uint32_t crc_calculate_block(uint32_t *datap, int size) {
+	for(int i=0; i<size; i++)
+		CRC_DR = datap[i];
+	return CRC_DR;
+}
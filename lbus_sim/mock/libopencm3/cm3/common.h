@@ -0,0 +1,28 @@
+/* LBUS simulator: libopencm3 stand-in, common definitions
+ *
+ * Each node has its own copy of the STM32F103 address space, so register
+ * accesses are offset by the location of that copy. The flash is also
+ * mapped at its real address for the node about to run, since it is read
+ * through plain pointers.
+ */
+#ifndef LIBOPENCM3_CM3_COMMON_H
+#define LIBOPENCM3_CM3_COMMON_H
+#include <stdint.h>
+#include <stdbool.h>
+/* the C library uses __asm itself, so get it in before the mapping below */
+#include <string.h>
+
+extern uintptr_t sim_mmio_offset;
+
+#define MMIO8(addr)	(*(volatile uint8_t *)((uintptr_t)(addr) + sim_mmio_offset))
+#define MMIO16(addr)	(*(volatile uint16_t *)((uintptr_t)(addr) + sim_mmio_offset))
+#define MMIO32(addr)	(*(volatile uint32_t *)((uintptr_t)(addr) + sim_mmio_offset))
+
+/* inline assembly of the node code is handed to the simulator, see mock.c */
+void sim_asm(const char *insn);
+#ifndef SIM_MOCK
+#define __asm(insn) sim_asm(insn)
+#define __asm__(insn) sim_asm(insn)
+#endif
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef LIBOPENCM3_CM3_CORTEX_H
+#define LIBOPENCM3_CM3_CORTEX_H
+#include <libopencm3/cm3/common.h>
+
+void cm_enable_interrupts(void);
+void cm_disable_interrupts(void);
+bool cm_is_masked_interrupts(void);
+uint32_t cm_mask_interrupts(uint32_t mask);
+
+#endif
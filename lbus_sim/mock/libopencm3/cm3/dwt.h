@@ -0,0 +1,14 @@
+#ifndef LIBOPENCM3_CM3_DWT_H
+#define LIBOPENCM3_CM3_DWT_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/memorymap.h>
+
+#define DWT_CTRL		MMIO32(DWT_BASE + 0x00)
+#define DWT_CYCCNT		MMIO32(DWT_BASE + 0x04)
+#define DWT_CTRL_CYCCNTENA	(1 << 0)
+
+bool dwt_enable_cycle_counter(void);
+void dwt_disable_cycle_counter(void);
+uint32_t dwt_read_cycle_counter(void);
+
+#endif
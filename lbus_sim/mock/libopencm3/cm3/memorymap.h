@@ -0,0 +1,11 @@
+#ifndef LIBOPENCM3_CM3_MEMORYMAP_H
+#define LIBOPENCM3_CM3_MEMORYMAP_H
+
+#define PPBI_BASE	(0xE0000000U)
+#define DWT_BASE	(PPBI_BASE + 0x1000)
+#define SCS_BASE	(PPBI_BASE + 0xE000)
+#define SYS_TICK_BASE	(SCS_BASE + 0x0010)
+#define NVIC_BASE	(SCS_BASE + 0x0100)
+#define SCB_BASE	(SCS_BASE + 0x0D00)
+
+#endif
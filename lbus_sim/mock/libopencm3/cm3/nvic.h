@@ -0,0 +1,47 @@
+#ifndef LIBOPENCM3_NVIC_H
+#define LIBOPENCM3_NVIC_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/memorymap.h>
+
+#define NVIC_ISER(iser_id)	MMIO32(NVIC_BASE + 0x00 + ((iser_id) * 4))
+#define NVIC_ICER(icer_id)	MMIO32(NVIC_BASE + 0x80 + ((icer_id) * 4))
+#define NVIC_ISPR(ispr_id)	MMIO32(NVIC_BASE + 0x100 + ((ispr_id) * 4))
+#define NVIC_ICPR(icpr_id)	MMIO32(NVIC_BASE + 0x180 + ((icpr_id) * 4))
+#define NVIC_IPR(ipr_id)	MMIO8(NVIC_BASE + 0x300 + (ipr_id))
+
+#define NVIC_NMI_IRQ		-14
+#define NVIC_HARD_FAULT_IRQ	-13
+#define NVIC_SV_CALL_IRQ	-5
+#define NVIC_PENDSV_IRQ		-2
+#define NVIC_SYSTICK_IRQ	-1
+
+#define NVIC_DMA1_CHANNEL1_IRQ	11
+#define NVIC_DMA1_CHANNEL2_IRQ	12
+#define NVIC_DMA1_CHANNEL3_IRQ	13
+#define NVIC_USB_LP_CAN_RX0_IRQ	20
+#define NVIC_TIM1_UP_IRQ	25
+#define NVIC_TIM2_IRQ		28
+#define NVIC_TIM3_IRQ		29
+#define NVIC_TIM4_IRQ		30
+#define NVIC_USART1_IRQ		37
+#define NVIC_USART2_IRQ		38
+#define NVIC_USART3_IRQ		39
+#define NVIC_IRQ_COUNT		68
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+void nvic_set_priority(uint8_t irqn, uint8_t priority);
+
+/* interrupt handlers as named by libopencm3 */
+void sys_tick_handler(void);
+void pend_sv_handler(void);
+void dma1_channel2_isr(void);
+void dma1_channel3_isr(void);
+void usb_lp_can_rx0_isr(void);
+void tim1_up_isr(void);
+void tim2_isr(void);
+void tim3_isr(void);
+void tim4_isr(void);
+void usart3_isr(void);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef LIBOPENCM3_SCB_H
+#define LIBOPENCM3_SCB_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/memorymap.h>
+
+#define SCB_CPUID	MMIO32(SCB_BASE + 0x00)
+#define SCB_ICSR	MMIO32(SCB_BASE + 0x04)
+#define SCB_VTOR	MMIO32(SCB_BASE + 0x08)
+/* LBUS code only ever writes SYSRESETREQ here: the simulator resets
+ * the node as soon as the register is accessed.
+ */
+volatile uint32_t *sim_scb_aircr(void);
+#define SCB_AIRCR	(*sim_scb_aircr())
+#define SCB_SCR		MMIO32(SCB_BASE + 0x10)
+#define SCB_CCR		MMIO32(SCB_BASE + 0x14)
+#define SCB_SHPR(shpr_id) MMIO8(SCB_BASE + 0x18 + (shpr_id))
+
+#define SCB_ICSR_PENDSVSET	(1 << 28)
+#define SCB_ICSR_PENDSVCLR	(1 << 27)
+#define SCB_ICSR_PENDSTSET	(1 << 26)
+
+#define SCB_AIRCR_VECTKEY	(0x05FA << 16)
+#define SCB_AIRCR_SYSRESETREQ	(1 << 2)
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef LIBOPENCM3_CM3_SCS_H
+#define LIBOPENCM3_CM3_SCS_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/memorymap.h>
+
+#define SCS_DEMCR		MMIO32(SCS_BASE + 0xDFC)
+#define SCS_DEMCR_TRCENA	(1 << 24)
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef LIBOPENCM3_SYSTICK_H
+#define LIBOPENCM3_SYSTICK_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/memorymap.h>
+
+#define STK_CSR		MMIO32(SYS_TICK_BASE + 0x00)
+#define STK_RVR		MMIO32(SYS_TICK_BASE + 0x04)
+#define STK_CVR		MMIO32(SYS_TICK_BASE + 0x08)
+#define STK_CALIB	MMIO32(SYS_TICK_BASE + 0x0C)
+
+#define STK_CSR_COUNTFLAG		(1 << 16)
+#define STK_CSR_CLKSOURCE_AHB_DIV8	(0 << 2)
+#define STK_CSR_CLKSOURCE_AHB		(1 << 2)
+#define STK_CSR_TICKINT			(1 << 1)
+#define STK_CSR_ENABLE			(1 << 0)
+
+void systick_set_reload(uint32_t value);
+uint32_t systick_get_reload(void);
+uint32_t systick_get_value(void);
+void systick_set_clocksource(uint8_t clocksource);
+void systick_interrupt_enable(void);
+void systick_interrupt_disable(void);
+void systick_counter_enable(void);
+void systick_counter_disable(void);
+void systick_clear(void);
+
+#endif
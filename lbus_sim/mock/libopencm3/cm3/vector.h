@@ -0,0 +1,10 @@
+#ifndef LIBOPENCM3_CM3_VECTOR_H
+#define LIBOPENCM3_CM3_VECTOR_H
+#include <libopencm3/cm3/common.h>
+
+/* same size as the STM32F1 vector table: 16 system + 68 device vectors */
+typedef struct {
+	uint32_t words[16 + 68];
+} vector_table_t;
+
+#endif
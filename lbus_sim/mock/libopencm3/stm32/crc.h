@@ -0,0 +1,19 @@
+#ifndef LIBOPENCM3_CRC_H
+#define LIBOPENCM3_CRC_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/memorymap.h>
+
+/* The CRC unit computes on register writes, which plain memory cannot
+ * do: the simulator observes the registers through these accessors.
+ */
+volatile uint32_t *sim_crc_reg(unsigned int offset);
+#define CRC_DR			(*sim_crc_reg(0x00))
+#define CRC_IDR			(*sim_crc_reg(0x04))
+#define CRC_CR			(*sim_crc_reg(0x08))
+#define CRC_CR_RESET		(1 << 0)
+
+void crc_reset(void);
+uint32_t crc_calculate(uint32_t data);
+uint32_t crc_calculate_block(uint32_t *datap, int size);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef LIBOPENCM3_BKP_H
+#define LIBOPENCM3_BKP_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#define BKP_DR1			MMIO32(BACKUP_REGS_BASE + 0x04)
+#define BKP_DR2			MMIO32(BACKUP_REGS_BASE + 0x08)
+#define BKP_DR3			MMIO32(BACKUP_REGS_BASE + 0x0C)
+#define BKP_DR4			MMIO32(BACKUP_REGS_BASE + 0x10)
+
+#endif
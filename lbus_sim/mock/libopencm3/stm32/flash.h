@@ -0,0 +1,25 @@
+#ifndef LIBOPENCM3_FLASH_H
+#define LIBOPENCM3_FLASH_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#define FLASH_ACR		MMIO32(FLASH_MEM_INTERFACE_BASE + 0x00)
+#define FLASH_KEYR		MMIO32(FLASH_MEM_INTERFACE_BASE + 0x04)
+#define FLASH_SR		MMIO32(FLASH_MEM_INTERFACE_BASE + 0x0C)
+#define FLASH_CR		MMIO32(FLASH_MEM_INTERFACE_BASE + 0x10)
+#define FLASH_AR		MMIO32(FLASH_MEM_INTERFACE_BASE + 0x14)
+
+#define FLASH_SR_EOP		(1 << 5)
+#define FLASH_SR_WRPRTERR	(1 << 4)
+#define FLASH_SR_PGERR		(1 << 2)
+#define FLASH_SR_BSY		(1 << 0)
+
+void flash_unlock(void);
+void flash_lock(void);
+void flash_wait_for_last_operation(void);
+void flash_program_word(uint32_t address, uint32_t data);
+void flash_program_half_word(uint32_t address, uint16_t data);
+void flash_erase_page(uint32_t page_address);
+uint32_t flash_get_status_flags(void);
+
+#endif
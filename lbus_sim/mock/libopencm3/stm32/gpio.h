@@ -0,0 +1,68 @@
+#ifndef LIBOPENCM3_GPIO_H
+#define LIBOPENCM3_GPIO_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#define GPIOA			GPIO_PORT_A_BASE
+#define GPIOB			GPIO_PORT_B_BASE
+#define GPIOC			GPIO_PORT_C_BASE
+
+#define GPIO0			(1 << 0)
+#define GPIO1			(1 << 1)
+#define GPIO2			(1 << 2)
+#define GPIO3			(1 << 3)
+#define GPIO4			(1 << 4)
+#define GPIO5			(1 << 5)
+#define GPIO6			(1 << 6)
+#define GPIO7			(1 << 7)
+#define GPIO8			(1 << 8)
+#define GPIO9			(1 << 9)
+#define GPIO10			(1 << 10)
+#define GPIO11			(1 << 11)
+#define GPIO12			(1 << 12)
+#define GPIO13			(1 << 13)
+#define GPIO14			(1 << 14)
+#define GPIO15			(1 << 15)
+
+#define GPIO_CRL(port)		MMIO32((port) + 0x00)
+#define GPIO_CRH(port)		MMIO32((port) + 0x04)
+#define GPIO_IDR(port)		MMIO32((port) + 0x08)
+#define GPIO_ODR(port)		MMIO32((port) + 0x0c)
+#define GPIO_BSRR(port)		MMIO32((port) + 0x10)
+#define GPIO_BRR(port)		MMIO32((port) + 0x14)
+
+#define GPIO_MODE_INPUT		0x00
+#define GPIO_MODE_OUTPUT_10_MHZ	0x01
+#define GPIO_MODE_OUTPUT_2_MHZ	0x02
+#define GPIO_MODE_OUTPUT_50_MHZ	0x03
+
+#define GPIO_CNF_INPUT_ANALOG		0x00
+#define GPIO_CNF_INPUT_FLOAT		0x01
+#define GPIO_CNF_INPUT_PULL_UPDOWN	0x02
+#define GPIO_CNF_OUTPUT_PUSHPULL	0x00
+#define GPIO_CNF_OUTPUT_OPENDRAIN	0x01
+#define GPIO_CNF_OUTPUT_ALTFN_PUSHPULL	0x02
+#define GPIO_CNF_OUTPUT_ALTFN_OPENDRAIN	0x03
+
+#define GPIO_USART3_TX		GPIO10
+#define GPIO_USART3_RX		GPIO11
+#define GPIO_TIM2_CH1_ETR	GPIO0
+#define GPIO_TIM2_CH2		GPIO1
+#define GPIO_TIM2_CH3		GPIO2
+#define GPIO_TIM2_CH4		GPIO3
+#define GPIO_TIM3_CH1		GPIO6
+#define GPIO_TIM3_CH2		GPIO7
+#define GPIO_TIM3_CH3		GPIO0
+#define GPIO_TIM3_CH4		GPIO1
+#define GPIO_TIM4_CH1		GPIO6
+#define GPIO_TIM4_CH2		GPIO7
+#define GPIO_TIM4_CH3		GPIO8
+#define GPIO_TIM4_CH4		GPIO9
+
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios);
+void gpio_set(uint32_t gpioport, uint16_t gpios);
+void gpio_clear(uint32_t gpioport, uint16_t gpios);
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios);
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+
+#endif
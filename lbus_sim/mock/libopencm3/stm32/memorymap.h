@@ -0,0 +1,28 @@
+#ifndef LIBOPENCM3_MEMORYMAP_H
+#define LIBOPENCM3_MEMORYMAP_H
+#include <libopencm3/cm3/memorymap.h>
+
+#define PERIPH_BASE		(0x40000000U)
+#define PERIPH_BASE_APB1	(PERIPH_BASE + 0x00000)
+#define PERIPH_BASE_APB2	(PERIPH_BASE + 0x10000)
+#define PERIPH_BASE_AHB		(PERIPH_BASE + 0x18000)
+
+#define TIM2_BASE		(PERIPH_BASE_APB1 + 0x0000)
+#define TIM3_BASE		(PERIPH_BASE_APB1 + 0x0400)
+#define TIM4_BASE		(PERIPH_BASE_APB1 + 0x0800)
+#define USART2_BASE		(PERIPH_BASE_APB1 + 0x4400)
+#define USART3_BASE		(PERIPH_BASE_APB1 + 0x4800)
+#define BACKUP_REGS_BASE	(PERIPH_BASE_APB1 + 0x6c00)
+#define POWER_CONTROL_BASE	(PERIPH_BASE_APB1 + 0x7000)
+#define AFIO_BASE		(PERIPH_BASE_APB2 + 0x0000)
+#define GPIO_PORT_A_BASE	(PERIPH_BASE_APB2 + 0x0800)
+#define GPIO_PORT_B_BASE	(PERIPH_BASE_APB2 + 0x0c00)
+#define GPIO_PORT_C_BASE	(PERIPH_BASE_APB2 + 0x1000)
+#define TIM1_BASE		(PERIPH_BASE_APB2 + 0x2c00)
+#define USART1_BASE		(PERIPH_BASE_APB2 + 0x3800)
+#define DMA1_BASE		(PERIPH_BASE_AHB + 0x08000)
+#define RCC_BASE		(PERIPH_BASE_AHB + 0x09000)
+#define FLASH_MEM_INTERFACE_BASE (PERIPH_BASE_AHB + 0x0a000)
+#define CRC_BASE		(PERIPH_BASE_AHB + 0x0b000)
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef LIBOPENCM3_PWR_H
+#define LIBOPENCM3_PWR_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#define PWR_CR			MMIO32(POWER_CONTROL_BASE + 0x00)
+#define PWR_CSR			MMIO32(POWER_CONTROL_BASE + 0x04)
+#define PWR_CR_DBP		(1 << 8)
+
+#endif
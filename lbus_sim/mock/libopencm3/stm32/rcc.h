@@ -0,0 +1,83 @@
+#ifndef LIBOPENCM3_RCC_H
+#define LIBOPENCM3_RCC_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#define RCC_CR			MMIO32(RCC_BASE + 0x00)
+#define RCC_CFGR		MMIO32(RCC_BASE + 0x04)
+#define RCC_CIR			MMIO32(RCC_BASE + 0x08)
+#define RCC_APB2RSTR		MMIO32(RCC_BASE + 0x0c)
+#define RCC_APB1RSTR		MMIO32(RCC_BASE + 0x10)
+#define RCC_AHBENR		MMIO32(RCC_BASE + 0x14)
+#define RCC_APB2ENR		MMIO32(RCC_BASE + 0x18)
+#define RCC_APB1ENR		MMIO32(RCC_BASE + 0x1c)
+#define RCC_BDCR		MMIO32(RCC_BASE + 0x20)
+#define RCC_CSR			MMIO32(RCC_BASE + 0x24)
+
+#define RCC_APB2RSTR_USART1RST	(1 << 14)
+#define RCC_APB2RSTR_SPI1RST	(1 << 12)
+#define RCC_APB2RSTR_TIM1RST	(1 << 11)
+#define RCC_APB2RSTR_ADC2RST	(1 << 10)
+#define RCC_APB2RSTR_ADC1RST	(1 << 9)
+#define RCC_APB2RSTR_IOPCRST	(1 << 4)
+#define RCC_APB2RSTR_IOPBRST	(1 << 3)
+#define RCC_APB2RSTR_IOPARST	(1 << 2)
+#define RCC_APB2RSTR_AFIORST	(1 << 0)
+
+#define RCC_APB1RSTR_PWRRST	(1 << 28)
+#define RCC_APB1RSTR_BKPRST	(1 << 27)
+#define RCC_APB1RSTR_USART3RST	(1 << 18)
+#define RCC_APB1RSTR_USART2RST	(1 << 17)
+#define RCC_APB1RSTR_SPI3RST	(1 << 15)
+#define RCC_APB1RSTR_SPI2RST	(1 << 14)
+#define RCC_APB1RSTR_WWDGRST	(1 << 11)
+#define RCC_APB1RSTR_TIM4RST	(1 << 2)
+#define RCC_APB1RSTR_TIM3RST	(1 << 1)
+#define RCC_APB1RSTR_TIM2RST	(1 << 0)
+
+#define RCC_AHBENR_CRCEN	(1 << 6)
+#define RCC_AHBENR_DMA1EN	(1 << 0)
+
+#define RCC_APB2ENR_USART1EN	(1 << 14)
+#define RCC_APB2ENR_SPI1EN	(1 << 12)
+#define RCC_APB2ENR_TIM1EN	(1 << 11)
+#define RCC_APB2ENR_ADC2EN	(1 << 10)
+#define RCC_APB2ENR_ADC1EN	(1 << 9)
+#define RCC_APB2ENR_IOPCEN	(1 << 4)
+#define RCC_APB2ENR_IOPBEN	(1 << 3)
+#define RCC_APB2ENR_IOPAEN	(1 << 2)
+#define RCC_APB2ENR_AFIOEN	(1 << 0)
+
+#define RCC_APB1ENR_PWREN	(1 << 28)
+#define RCC_APB1ENR_BKPEN	(1 << 27)
+#define RCC_APB1ENR_USART3EN	(1 << 18)
+#define RCC_APB1ENR_USART2EN	(1 << 17)
+#define RCC_APB1ENR_SPI3EN	(1 << 15)
+#define RCC_APB1ENR_SPI2EN	(1 << 14)
+#define RCC_APB1ENR_WWDGEN	(1 << 11)
+#define RCC_APB1ENR_TIM4EN	(1 << 2)
+#define RCC_APB1ENR_TIM3EN	(1 << 1)
+#define RCC_APB1ENR_TIM2EN	(1 << 0)
+
+#define _REG_BIT(base, bit)	(((base) << 5) + (bit))
+enum rcc_periph_clken {
+	RCC_DMA1	= _REG_BIT(0x14, 0),
+	RCC_CRC		= _REG_BIT(0x14, 6),
+	RCC_AFIO	= _REG_BIT(0x18, 0),
+	RCC_GPIOA	= _REG_BIT(0x18, 2),
+	RCC_GPIOB	= _REG_BIT(0x18, 3),
+	RCC_GPIOC	= _REG_BIT(0x18, 4),
+	RCC_TIM1	= _REG_BIT(0x18, 11),
+	RCC_USART1	= _REG_BIT(0x18, 14),
+	RCC_TIM2	= _REG_BIT(0x1c, 0),
+	RCC_TIM3	= _REG_BIT(0x1c, 1),
+	RCC_TIM4	= _REG_BIT(0x1c, 2),
+	RCC_USART2	= _REG_BIT(0x1c, 17),
+	RCC_USART3	= _REG_BIT(0x1c, 18),
+};
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+void rcc_periph_clock_disable(enum rcc_periph_clken clken);
+void rcc_clock_setup_in_hse_8mhz_out_72mhz(void);
+
+#endif
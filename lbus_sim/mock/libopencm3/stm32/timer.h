@@ -0,0 +1,72 @@
+#ifndef LIBOPENCM3_TIMER_H
+#define LIBOPENCM3_TIMER_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#define TIM1			TIM1_BASE
+#define TIM2			TIM2_BASE
+#define TIM3			TIM3_BASE
+#define TIM4			TIM4_BASE
+
+#define TIM_CR1(tim_base)	MMIO32((tim_base) + 0x00)
+#define TIM_CR2(tim_base)	MMIO32((tim_base) + 0x04)
+#define TIM_SMCR(tim_base)	MMIO32((tim_base) + 0x08)
+#define TIM_DIER(tim_base)	MMIO32((tim_base) + 0x0C)
+#define TIM_SR(tim_base)	MMIO32((tim_base) + 0x10)
+#define TIM_EGR(tim_base)	MMIO32((tim_base) + 0x14)
+#define TIM_CCMR1(tim_base)	MMIO32((tim_base) + 0x18)
+#define TIM_CCMR2(tim_base)	MMIO32((tim_base) + 0x1C)
+#define TIM_CCER(tim_base)	MMIO32((tim_base) + 0x20)
+#define TIM_CNT(tim_base)	MMIO32((tim_base) + 0x24)
+#define TIM_PSC(tim_base)	MMIO32((tim_base) + 0x28)
+#define TIM_ARR(tim_base)	MMIO32((tim_base) + 0x2C)
+#define TIM_CCR1(tim_base)	MMIO32((tim_base) + 0x34)
+#define TIM_CCR2(tim_base)	MMIO32((tim_base) + 0x38)
+#define TIM_CCR3(tim_base)	MMIO32((tim_base) + 0x3C)
+#define TIM_CCR4(tim_base)	MMIO32((tim_base) + 0x40)
+
+#define TIM1_CNT		TIM_CNT(TIM1)
+#define TIM2_CNT		TIM_CNT(TIM2)
+#define TIM3_CNT		TIM_CNT(TIM3)
+#define TIM4_CNT		TIM_CNT(TIM4)
+
+#define TIM_CR1_CKD_CK_INT	(0x0 << 8)
+#define TIM_CR1_ARPE		(1 << 7)
+#define TIM_CR1_CMS_EDGE	(0x0 << 5)
+#define TIM_CR1_DIR_UP		(0 << 4)
+#define TIM_CR1_OPM		(1 << 3)
+#define TIM_CR1_URS		(1 << 2)
+#define TIM_CR1_UDIS		(1 << 1)
+#define TIM_CR1_CEN		(1 << 0)
+
+#define TIM_DIER_UIE		(1 << 0)
+#define TIM_SR_UIF		(1 << 0)
+#define TIM_EGR_UG		(1 << 0)
+
+enum tim_oc_id { TIM_OC1 = 0, TIM_OC1N, TIM_OC2, TIM_OC2N, TIM_OC3, TIM_OC3N, TIM_OC4 };
+enum tim_oc_mode { TIM_OCM_FROZEN, TIM_OCM_ACTIVE, TIM_OCM_INACTIVE, TIM_OCM_TOGGLE,
+	TIM_OCM_FORCE_LOW, TIM_OCM_FORCE_HIGH, TIM_OCM_PWM1, TIM_OCM_PWM2 };
+
+void timer_reset(uint32_t timer_peripheral);
+void timer_set_mode(uint32_t timer_peripheral, uint32_t clock_div, uint32_t alignment, uint32_t direction);
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value);
+void timer_set_period(uint32_t timer_peripheral, uint32_t period);
+void timer_continuous_mode(uint32_t timer_peripheral);
+void timer_one_shot_mode(uint32_t timer_peripheral);
+void timer_enable_counter(uint32_t timer_peripheral);
+void timer_disable_counter(uint32_t timer_peripheral);
+uint32_t timer_get_counter(uint32_t timer_peripheral);
+void timer_set_counter(uint32_t timer_peripheral, uint32_t count);
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event);
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq);
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq);
+void timer_disable_oc_output(uint32_t timer_peripheral, enum tim_oc_id oc_id);
+void timer_enable_oc_output(uint32_t timer_peripheral, enum tim_oc_id oc_id);
+void timer_set_oc_mode(uint32_t timer_peripheral, enum tim_oc_id oc_id, enum tim_oc_mode oc_mode);
+void timer_disable_oc_clear(uint32_t timer_peripheral, enum tim_oc_id oc_id);
+void timer_enable_oc_preload(uint32_t timer_peripheral, enum tim_oc_id oc_id);
+void timer_set_oc_polarity_high(uint32_t timer_peripheral, enum tim_oc_id oc_id);
+void timer_set_oc_polarity_low(uint32_t timer_peripheral, enum tim_oc_id oc_id);
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value);
+
+#endif
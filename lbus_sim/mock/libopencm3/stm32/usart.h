@@ -0,0 +1,67 @@
+#ifndef LIBOPENCM3_USART_H
+#define LIBOPENCM3_USART_H
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#define USART1			USART1_BASE
+#define USART2			USART2_BASE
+#define USART3			USART3_BASE
+
+#define USART_SR(usart_base)	MMIO32((usart_base) + 0x00)
+#define USART_DR(usart_base)	MMIO32((usart_base) + 0x04)
+#define USART_BRR(usart_base)	MMIO32((usart_base) + 0x08)
+#define USART_CR1(usart_base)	MMIO32((usart_base) + 0x0c)
+#define USART_CR2(usart_base)	MMIO32((usart_base) + 0x10)
+#define USART_CR3(usart_base)	MMIO32((usart_base) + 0x14)
+#define USART_GTPR(usart_base)	MMIO32((usart_base) + 0x18)
+
+#define USART3_SR		USART_SR(USART3)
+#define USART3_DR		USART_DR(USART3)
+
+#define USART_SR_CTS		(1 << 9)
+#define USART_SR_LBD		(1 << 8)
+#define USART_SR_TXE		(1 << 7)
+#define USART_SR_TC		(1 << 6)
+#define USART_SR_RXNE		(1 << 5)
+#define USART_SR_IDLE		(1 << 4)
+#define USART_SR_ORE		(1 << 3)
+#define USART_SR_NE		(1 << 2)
+#define USART_SR_FE		(1 << 1)
+#define USART_SR_PE		(1 << 0)
+
+#define USART_CR1_UE		(1 << 13)
+#define USART_CR1_M		(1 << 12)
+#define USART_CR1_WAKE		(1 << 11)
+#define USART_CR1_PCE		(1 << 10)
+#define USART_CR1_PS		(1 << 9)
+#define USART_CR1_PEIE		(1 << 8)
+#define USART_CR1_TXEIE		(1 << 7)
+#define USART_CR1_TCIE		(1 << 6)
+#define USART_CR1_RXNEIE	(1 << 5)
+#define USART_CR1_IDLEIE	(1 << 4)
+#define USART_CR1_TE		(1 << 3)
+#define USART_CR1_RE		(1 << 2)
+#define USART_CR1_RWU		(1 << 1)
+#define USART_CR1_SBK		(1 << 0)
+
+#define USART_CR3_DMAT		(1 << 7)
+#define USART_CR3_DMAR		(1 << 6)
+#define USART_CR3_EIE		(1 << 0)
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud);
+void usart_set_databits(uint32_t usart, uint32_t bits);
+void usart_enable(uint32_t usart);
+void usart_disable(uint32_t usart);
+void usart_send(uint32_t usart, uint16_t data);
+uint16_t usart_recv(uint32_t usart);
+void usart_wait_send_ready(uint32_t usart);
+void usart_wait_recv_ready(uint32_t usart);
+void usart_send_blocking(uint32_t usart, uint16_t data);
+uint16_t usart_recv_blocking(uint32_t usart);
+void usart_enable_rx_dma(uint32_t usart);
+void usart_disable_rx_dma(uint32_t usart);
+void usart_enable_tx_dma(uint32_t usart);
+void usart_disable_tx_dma(uint32_t usart);
+bool usart_get_flag(uint32_t usart, uint32_t flag);
+
+#endif
@@ -0,0 +1,2362 @@
+/* LBUS simulator
+ *
+ * Runs a number of LBUS nodes built from the real firmware sources on a
+ * simulated RS485 bus, driven by a simulated bus master.
+ *
+ * Copyright (c) 2016 Hans-Werner Hilse <hwhilse@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/stm32/memorymap.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/dma.h>
+
+#include "sim.h"
+#include "platform.h"
+#include "config.h"
+#include "lbus_data.h"
+
+/* MAX485 control lines, see lbus.h */
+#define DE_PIN GPIO12
+#define RE_PIN GPIO13
+/* DMA channels for USART3, see lbus.h */
+#define RX_DMA_CHANNEL DMA_CHANNEL3
+#define TX_DMA_CHANNEL DMA_CHANNEL2
+#define RX_RING_SIZE 256
+/* LBUS_SCHEDULE_MAX, bus times further ahead are taken as past, see lbus.h */
+#define SCHEDULE_MAX 10000
+/* DMA channel registers: CCR 0x00, CNDTR 0x04, CMAR 0x0C */
+#define DMA_CH(channel, reg) (DMA1_BASE + 0x08 + 0x14 * ((channel) - 1) + (reg))
+
+/* receivers tolerate this much baud rate deviation (percent) */
+#define BAUD_TOLERANCE 3
+/* interrupt entry/exit */
+#define IRQ_CYCLES 24
+/* a node not giving back control for this long is considered stuck */
+#define STUCK_CYCLES (10 * SIM_CPU_SPEED)
+/* master waits this long for the next byte of a reply */
+#define REPLY_TIMEOUT (2 * SIM_CPU_SPEED / 1000)
+/* well beyond the LBUS packet timeout (about 0.5 ms) */
+#define TIMEOUT_WAIT (SIM_CPU_SPEED / 1000)
+
+#define STACK_SIZE (256 * 1024)
+#define MAX_NODES 64
+/* must hold the largest packet, the master puts it on the bus in one go */
+#define TX_RING 4096
+#define MASTER_ID -1
+
+#define US(cycles) ((double)(cycles) * 1e6 / SIM_CPU_SPEED)
+
+/* memory regions of a node, all in one shared memory file
+ *
+ * Every node has its own address space window in which they appear at
+ * their STM32 addresses, register accesses of the node code are offset
+ * accordingly. The flash is also mapped at its real address for the node
+ * currently running.
+ */
+static const struct region {
+	uintptr_t base;
+	size_t size;
+} regions[] = {
+	{ SIM_FLASH_BASE, SIM_FLASH_SIZE },
+	{ SIM_RAM_BASE, SIM_RAM_SIZE },
+	{ SIM_PERIPH_BASE, SIM_PERIPH_SIZE },
+	{ SIM_PPB_BASE, SIM_PPB_SIZE },
+};
+#define REGIONS (sizeof(regions) / sizeof(regions[0]))
+/* address space window of a node */
+#define NODE_SPACE 0x100000000ULL
+
+struct timer {
+	uint32_t base;
+	uint8_t irq;
+	void (*isr)(void);
+	/* counter had value cnt0 at time t0 */
+	uint64_t t0;
+	uint32_t cnt0;
+	/* register values as last seen, for noticing writes */
+	uint32_t cr1, dier, cnt, psc, arr;
+	unsigned int gen;
+};
+
+struct node {
+	int id;
+	bool bootloader;
+	int memfd;
+	size_t offset[REGIONS];
+	uint8_t *mmio;
+
+	/* currently loaded image */
+	void *dl;
+	int (*main)(void);
+	void (*usart_isr)(void);
+	void (*systick_isr)(void);
+	void (*pendsv_isr)(void);
+	void (*dma_rx_isr)(void);
+	void (*dma_tx_isr)(void);
+	void *image_base;
+	struct sim_env env;
+
+	uint64_t now;
+	uint64_t run_start;
+	ucontext_t ctx;
+	void *stack;
+	bool main_alive, in_main, in_isr;
+	jmp_buf isr_jmp;
+	enum sim_reset reset;
+
+	struct timer tim[4];
+	struct {
+		uint64_t t0, first;
+		uint32_t csr, rvr, cvr;
+		unsigned int gen;
+	} stk;
+
+	/* USART status register as left by the last sync, see usart_flags() */
+	uint32_t usart_sr;
+	/* USART transmitter: data register and shift register free again */
+	uint64_t tx_dr_free, tx_free;
+	bool txe_pending, tc_pending;
+	/* woken up for the TC interrupt at this time */
+	uint64_t tc_wake;
+	/* USART receiver: line becomes idle unless another character comes */
+	uint64_t rx_idle;
+	bool idle_pending;
+
+	/* DMA: RX channel has been enabled for this many transfers,
+	 * TX channel is busy with a transfer until dma_tx_done
+	 */
+	bool dma_rx_on, dma_tx_busy;
+	uint16_t dma_rx_count;
+	uint64_t dma_tx_done;
+
+	unsigned long resets, overruns, rx_errors, undriven;
+};
+
+/* a character on the bus */
+struct tx {
+	int sender;
+	uint16_t data;
+	bool nine;
+	double bit;
+	uint64_t start, end;
+};
+
+enum event_type {
+	EV_CHAR,
+	EV_TIMER,
+	EV_SYSTICK,
+	EV_WAKE,	/* something is due at a node, see periph_sync() */
+	EV_MASTER
+};
+
+struct event {
+	uint64_t time;
+	uint64_t seq;
+	enum event_type type;
+	int node;
+	int arg;
+	unsigned int gen;
+};
+
+static struct {
+	uint64_t now;
+	uint64_t seq;
+	struct event *heap;
+	int events, heap_size;
+	struct tx tx[TX_RING];
+	unsigned int tx_count;
+	ucontext_t ctx;
+	struct node *mapped;
+	char tmpdir[PATH_MAX];
+	char imagedir[PATH_MAX];
+	const char *firmware;
+	int loads;
+	uint32_t rand;
+	bool verbose;
+	unsigned long chars, collisions;
+} sim;
+
+static struct node nodes[MAX_NODES];
+static int node_count;
+
+static struct {
+	ucontext_t ctx;
+	void *stack;
+	void (*scenario)(void);
+	bool done;
+	uint32_t baudrate;
+	bool marks;
+	uint64_t tx_free;
+	uint8_t rx[4096];
+	int rx_len;
+	uint64_t rx_first;
+	int rx_want;
+	unsigned int gen;
+	unsigned long rx_errors, rx_stale;
+} master;
+
+static int failures;
+
+static void __attribute__((format(printf, 1, 2))) fail(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "FAIL: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	failures++;
+}
+
+static void die(const char *msg) {
+	perror(msg);
+	exit(2);
+}
+
+static uint32_t sim_random(void) {
+	sim.rand = sim.rand * 1103515245 + 12345;
+	return sim.rand >> 8;
+}
+
+/* event queue: binary heap ordered by time, then insertion */
+static bool event_before(const struct event *a, const struct event *b) {
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void event_push(uint64_t time, enum event_type type, int node, int arg, unsigned int gen) {
+	if(sim.events == sim.heap_size) {
+		sim.heap_size = sim.heap_size ? sim.heap_size * 2 : 1024;
+		sim.heap = realloc(sim.heap, sim.heap_size * sizeof(struct event));
+		if(sim.heap == NULL)
+			die("realloc");
+	}
+	int i = sim.events++;
+	const struct event ev = { .time = time, .seq = sim.seq++, .type = type, .node = node, .arg = arg, .gen = gen };
+	while(i > 0 && event_before(&ev, &sim.heap[(i - 1) / 2])) {
+		sim.heap[i] = sim.heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	sim.heap[i] = ev;
+}
+
+static struct event event_pop(void) {
+	const struct event top = sim.heap[0];
+	const struct event last = sim.heap[--sim.events];
+	int i = 0;
+	for(;;) {
+		int c = 2 * i + 1;
+		if(c >= sim.events)
+			break;
+		if(c + 1 < sim.events && event_before(&sim.heap[c + 1], &sim.heap[c]))
+			c++;
+		if(!event_before(&sim.heap[c], &last))
+			break;
+		sim.heap[i] = sim.heap[c];
+		i = c;
+	}
+	sim.heap[i] = last;
+	return top;
+}
+
+/* access to a node's memory, no matter which node is mapped */
+static void *node_mem(struct node *n, const uintptr_t addr) {
+	for(unsigned int r=0; r<REGIONS; r++)
+		if(addr >= regions[r].base && addr < regions[r].base + regions[r].size)
+			return n->mmio + addr;
+	fprintf(stderr, "bad address 0x%08lx\n", (unsigned long)addr);
+	abort();
+}
+#define REG(n, addr) (*(volatile uint32_t *)node_mem((n), (addr)))
+
+/* map a node's flash at its real address before running its code */
+static void node_map(struct node *n) {
+	if(sim.mapped == n)
+		return;
+	if(mmap((void*)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED, n->memfd, n->offset[0]) == MAP_FAILED)
+		die("mmap");
+	sim.mapped = n;
+}
+
+/* make sure nothing else lives at the flash address */
+static void reserve_flash(void) {
+	if(mmap((void*)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void*)SIM_FLASH_BASE)
+		die("cannot reserve STM32 flash address space");
+}
+
+static inline bool irq_enabled(struct node *n, const int irq) {
+	return (REG(n, NVIC_BASE + (irq / 32) * 4) & (1 << (irq % 32))) != 0;
+}
+
+/* Timer counting
+ *
+ * The node code reads and writes plain memory: each sync notices writes
+ * by comparing with the values as left by the last sync, then updates
+ * the counter register to the node's current time.
+ */
+static void timer_schedule(struct node *n, struct timer *t) {
+	t->gen++;
+	if((t->cr1 & TIM_CR1_CEN) && (t->dier & TIM_DIER_UIE) && t->isr != NULL) {
+		const uint64_t left = (uint64_t)(t->arr + 1 - (t->cnt0 % (t->arr + 1))) * (t->psc + 1);
+		event_push(t->t0 + left, EV_TIMER, n->id, t - n->tim, t->gen);
+	}
+}
+
+static void timer_sync(struct node *n, struct timer *t) {
+	volatile uint32_t *cr1 = &REG(n, t->base + 0x00);
+	volatile uint32_t *dier = &REG(n, t->base + 0x0C);
+	volatile uint32_t *sr = &REG(n, t->base + 0x10);
+	volatile uint32_t *egr = &REG(n, t->base + 0x14);
+	volatile uint32_t *cnt = &REG(n, t->base + 0x24);
+	volatile uint32_t *psc = &REG(n, t->base + 0x28);
+	volatile uint32_t *arr = &REG(n, t->base + 0x2C);
+
+	if(*egr & TIM_EGR_UG) {
+		*egr &= ~TIM_EGR_UG;
+		*cnt = 0;
+		if(!(*cr1 & TIM_CR1_URS))
+			*sr |= TIM_SR_UIF;
+	}
+	if(*cr1 != t->cr1 || *dier != t->dier || *cnt != t->cnt || *psc != t->psc || *arr != t->arr) {
+		t->t0 = n->now;
+		t->cnt0 = *cnt;
+		t->cr1 = *cr1;
+		t->dier = *dier;
+		t->psc = *psc;
+		t->arr = *arr;
+		t->cnt = *cnt;
+		timer_schedule(n, t);
+	}
+	if(t->cr1 & TIM_CR1_CEN) {
+		const uint64_t ticks = (n->now - t->t0) / (t->psc + 1);
+		t->cnt = (t->cnt0 + ticks) % ((uint64_t)t->arr + 1);
+		*cnt = t->cnt;
+	}
+}
+
+static void timer_overflow(struct node *n, struct timer *t, const uint64_t time) {
+	t->t0 = time;
+	t->cnt0 = 0;
+	t->cnt = 0;
+	REG(n, t->base + 0x24) = 0;
+	REG(n, t->base + 0x10) |= TIM_SR_UIF;
+	if(t->cr1 & TIM_CR1_OPM) {
+		t->cr1 &= ~TIM_CR1_CEN;
+		REG(n, t->base + 0x00) = t->cr1;
+	}
+	timer_schedule(n, t);
+}
+
+/* SysTick counting, same principle as for the timers */
+static inline uint64_t systick_period(struct node *n) {
+	return ((uint64_t)n->stk.rvr + 1) * ((n->stk.csr & STK_CSR_CLKSOURCE_AHB) ? 1 : 8);
+}
+
+static void systick_schedule(struct node *n) {
+	n->stk.gen++;
+	if((n->stk.csr & STK_CSR_ENABLE) && (n->stk.csr & STK_CSR_TICKINT) && n->systick_isr != NULL)
+		event_push(n->stk.t0 + n->stk.first, EV_SYSTICK, n->id, 0, n->stk.gen);
+}
+
+static void systick_sync(struct node *n) {
+	volatile uint32_t *csr = &REG(n, SYS_TICK_BASE + 0x00);
+	volatile uint32_t *rvr = &REG(n, SYS_TICK_BASE + 0x04);
+	volatile uint32_t *cvr = &REG(n, SYS_TICK_BASE + 0x08);
+	if(*csr != n->stk.csr || *rvr != n->stk.rvr || *cvr != n->stk.cvr) {
+		/* a write to CVR clears it, reload happens on the next clock */
+		n->stk.csr = *csr;
+		n->stk.rvr = *rvr;
+		n->stk.t0 = n->now;
+		n->stk.first = (*cvr != 0 && *cvr == n->stk.cvr) ? *cvr : systick_period(n);
+		systick_schedule(n);
+	}
+	if(n->stk.csr & STK_CSR_ENABLE) {
+		const uint64_t period = systick_period(n);
+		const uint64_t elapsed = n->now - n->stk.t0;
+		if(elapsed < n->stk.first)
+			*cvr = (n->stk.first - elapsed) % period;
+		else
+			*cvr = n->stk.rvr - ((elapsed - n->stk.first) % period);
+	}
+	n->stk.cvr = *cvr;
+}
+
+/* USART status flags
+ *
+ * The flags are cleared by writing zero, writing one has no effect: the
+ * node code may write e.g. ~USART_SR_TC to clear TC alone. So only the
+ * flags cleared since the last sync are taken from the register.
+ */
+static void usart_flags(struct node *n, const uint32_t set, const uint32_t clear) {
+	volatile uint32_t *sr = &REG(n, USART3_BASE + 0x00);
+	n->usart_sr = ((*sr & n->usart_sr) | set) & ~clear;
+	*sr = n->usart_sr;
+}
+
+static void usart_sync(struct node *n) {
+	usart_flags(n, 0, 0);
+	if(n->txe_pending && n->now >= n->tx_dr_free) {
+		usart_flags(n, USART_SR_TXE, 0);
+		n->txe_pending = false;
+	}
+	if(n->tc_pending && n->now >= n->tx_free) {
+		usart_flags(n, USART_SR_TC, 0);
+		n->tc_pending = false;
+	} else if(n->tc_pending && (REG(n, USART3_BASE + 0x0C) & USART_CR1_TCIE) && n->tc_wake != n->tx_free) {
+		n->tc_wake = n->tx_free;
+		event_push(n->tc_wake, EV_WAKE, n->id, 0, 0);
+	}
+	if(n->idle_pending && n->now >= n->rx_idle) {
+		usart_flags(n, USART_SR_IDLE, 0);
+		n->idle_pending = false;
+	}
+}
+
+static void dma_tx_start(struct node *n);
+
+/* DMA for USART3
+ *
+ * RX is done by node_receive() per character. A TX transfer puts all of
+ * its data into the USART transmitter at once, the channel is busy until
+ * the last character has been taken.
+ */
+static void dma_sync(struct node *n) {
+	const uint32_t rx_ccr = REG(n, DMA_CH(RX_DMA_CHANNEL, 0x00));
+	if((rx_ccr & DMA_CCR_EN) && !n->dma_rx_on)
+		n->dma_rx_count = REG(n, DMA_CH(RX_DMA_CHANNEL, 0x04));
+	n->dma_rx_on = (rx_ccr & DMA_CCR_EN) != 0;
+
+	if(n->dma_tx_busy && n->now >= n->dma_tx_done) {
+		REG(n, DMA_CH(TX_DMA_CHANNEL, 0x04)) = 0;
+		REG(n, DMA1_BASE + 0x00) |= (DMA_GIF | DMA_TCIF) << DMA_FLAG_OFFSET(TX_DMA_CHANNEL);
+		n->dma_tx_busy = false;
+	}
+	const uint32_t tx_ccr = REG(n, DMA_CH(TX_DMA_CHANNEL, 0x00));
+	if(!n->dma_tx_busy && (tx_ccr & DMA_CCR_EN) && (tx_ccr & DMA_CCR_DIR)
+		&& REG(n, DMA_CH(TX_DMA_CHANNEL, 0x04)) != 0
+		&& (REG(n, USART3_BASE + 0x14) & USART_CR3_DMAT))
+		dma_tx_start(n);
+}
+
+static void periph_sync(struct node *n) {
+	for(int i=0; i<4; i++)
+		timer_sync(n, &n->tim[i]);
+	systick_sync(n);
+	usart_sync(n);
+	dma_sync(n);
+}
+
+/* Put a character on the bus */
+static void bus_transmit(const int sender, const uint16_t data, const bool nine, const double bit, const uint64_t start) {
+	struct tx *tx = &sim.tx[sim.tx_count % TX_RING];
+	tx->sender = sender;
+	tx->data = data;
+	tx->nine = nine;
+	tx->bit = bit;
+	tx->start = start;
+	tx->end = start + (uint64_t)(bit * (nine ? 11 : 10));
+	event_push(tx->end, EV_CHAR, sender, sim.tx_count % TX_RING, 0);
+	sim.tx_count++;
+	sim.chars++;
+}
+
+/* services for the node images */
+static uint64_t env_now(void *p) {
+	return ((struct node *)p)->now;
+}
+
+static void env_delay(void *p, const uint64_t cycles) {
+	struct node *n = p;
+	n->now += cycles;
+	if(n->now - n->run_start > STUCK_CYCLES) {
+		fprintf(stderr, "node %d is stuck\n", n->id);
+		exit(2);
+	}
+	periph_sync(n);
+}
+
+static void env_wait(void *p) {
+	struct node *n = p;
+	if(n->in_main)
+		swapcontext(&n->ctx, &sim.ctx);
+}
+
+/* Put a character into the USART transmitter
+ *
+ * It goes on the bus as soon as the shift register is free, the data
+ * register is free again from then on.
+ */
+static void usart_transmit(struct node *n, const uint16_t data) {
+	const uint32_t cr1 = REG(n, USART3_BASE + 0x0C);
+	const bool nine = (cr1 & USART_CR1_M) != 0;
+	const double bit = 2.0 * REG(n, USART3_BASE + 0x08);
+	const uint64_t start = (n->now > n->tx_free) ? n->now : n->tx_free;
+	n->tx_dr_free = start;
+	n->tx_free = start + (uint64_t)(bit * (nine ? 11 : 10));
+	if(start > n->now) {
+		usart_flags(n, 0, USART_SR_TXE);
+		n->txe_pending = true;
+	}
+	usart_flags(n, 0, USART_SR_TC);
+	n->tc_pending = true;
+	if(!(cr1 & USART_CR1_UE) || !(cr1 & USART_CR1_TE) || bit == 0)
+		return;
+	if(!(REG(n, GPIO_PORT_B_BASE + 0x0C) & DE_PIN)) {
+		/* MAX485 driver not enabled */
+		n->undriven++;
+		return;
+	}
+	bus_transmit(n->id, data & (nine ? 0x1FF : 0xFF), nine, bit, start);
+}
+
+static void env_usart_send(void *p, const uint16_t data) {
+	struct node *n = p;
+	/* wait for TXE */
+	if(n->now < n->tx_dr_free)
+		env_delay(n, n->tx_dr_free - n->now);
+	usart_transmit(n, data);
+}
+
+/* Memory address of a DMA transfer
+ *
+ * The address registers have 32 bits, the node image lives somewhere in
+ * the simulator's address space: the upper bits are taken from where the
+ * image has been loaded to. Addresses in flash are taken as they are.
+ */
+static void *dma_mem(struct node *n, const uint32_t addr, const size_t len) {
+	if(addr >= SIM_FLASH_BASE && addr + len <= SIM_FLASH_BASE + SIM_FLASH_SIZE)
+		return node_mem(n, addr);
+	const uintptr_t base = (uintptr_t)n->image_base;
+	uintptr_t p = (base & ~(uintptr_t)0xFFFFFFFF) | addr;
+	if(p < base && base - p > NODE_SPACE / 2)
+		p += NODE_SPACE;
+	else if(p > base && p - base > NODE_SPACE / 2)
+		p -= NODE_SPACE;
+	Dl_info first, last;
+	if(len == 0 || !dladdr((void *)p, &first) || !dladdr((void *)(p + len - 1), &last)
+		|| first.dli_fbase != n->image_base || last.dli_fbase != n->image_base)
+	{
+		fprintf(stderr, "node %d: DMA from/to 0x%08x is outside of the node image\n", n->id, addr);
+		abort();
+	}
+	return (void *)p;
+}
+
+static void dma_tx_start(struct node *n) {
+	const uint32_t ccr = REG(n, DMA_CH(TX_DMA_CHANNEL, 0x00));
+	const unsigned int count = REG(n, DMA_CH(TX_DMA_CHANNEL, 0x04)) & 0xFFFF;
+	const bool wide = (ccr & DMA_CCR_MSIZE_MASK) != DMA_CCR_MSIZE_8BIT;
+	const unsigned int step = (ccr & DMA_CCR_MINC) ? 1 : 0;
+	const uint8_t *mem = dma_mem(n, REG(n, DMA_CH(TX_DMA_CHANNEL, 0x0C)),
+		(count - 1) * step * (wide ? 2 : 1) + (wide ? 2 : 1));
+	for(unsigned int i=0; i<count; i++)
+		usart_transmit(n, wide ? ((const uint16_t *)mem)[i * step] : mem[i * step]);
+	/* the last character has been taken when it starts */
+	n->dma_tx_done = n->tx_dr_free;
+	n->dma_tx_busy = true;
+	event_push(n->dma_tx_done, EV_WAKE, n->id, 0, 0);
+}
+
+/* A character for the RX DMA channel, returns false if it is not active */
+static bool dma_receive(struct node *n, const uint16_t data) {
+	const uint32_t ccr = REG(n, DMA_CH(RX_DMA_CHANNEL, 0x00));
+	volatile uint32_t *cndtr = &REG(n, DMA_CH(RX_DMA_CHANNEL, 0x04));
+	if(!(REG(n, USART3_BASE + 0x14) & USART_CR3_DMAR) || !(ccr & DMA_CCR_EN)
+		|| (ccr & DMA_CCR_DIR) || *cndtr == 0)
+		return false;
+	const bool wide = (ccr & DMA_CCR_MSIZE_MASK) != DMA_CCR_MSIZE_8BIT;
+	const unsigned int index = (ccr & DMA_CCR_MINC) ? n->dma_rx_count - *cndtr : 0;
+	const uint32_t addr = REG(n, DMA_CH(RX_DMA_CHANNEL, 0x0C)) + index * (wide ? 2 : 1);
+	if(wide)
+		*(uint16_t *)dma_mem(n, addr, 2) = data;
+	else
+		*(uint8_t *)dma_mem(n, addr, 1) = data;
+	uint32_t flags = 0;
+	if(--*cndtr == n->dma_rx_count / 2)
+		flags |= DMA_GIF | DMA_HTIF;
+	if(*cndtr == 0) {
+		flags |= DMA_GIF | DMA_TCIF;
+		if(ccr & DMA_CCR_CIRC)
+			*cndtr = n->dma_rx_count;
+	}
+	REG(n, DMA1_BASE + 0x00) |= flags << DMA_FLAG_OFFSET(RX_DMA_CHANNEL);
+	return true;
+}
+
+static void __attribute__((noreturn)) env_reset(void *p, const enum sim_reset how) {
+	struct node *n = p;
+	n->reset = how;
+	if(n->in_isr)
+		longjmp(n->isr_jmp, 1);
+	if(n->in_main)
+		swapcontext(&n->ctx, &sim.ctx);
+	fprintf(stderr, "node %d: reset from outside of node code\n", n->id);
+	abort();
+}
+
+/* Load a fresh copy of a node image
+ *
+ * Each node needs its own instance of all the global variables, so the
+ * image is copied under a new name for every (re)start.
+ */
+static void node_load(struct node *n, const char *image) {
+	char src[2 * PATH_MAX], dst[2 * PATH_MAX];
+	snprintf(src, sizeof(src), "%s/node-%s.so", sim.imagedir, image);
+	snprintf(dst, sizeof(dst), "%s/%d-%d.so", sim.tmpdir, n->id, sim.loads++);
+	int in = open(src, O_RDONLY);
+	if(in == -1)
+		die(src);
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0700);
+	if(out == -1)
+		die(dst);
+	struct stat st;
+	if(fstat(in, &st) == -1 || sendfile(out, in, NULL, st.st_size) != st.st_size)
+		die("copying node image");
+	close(in);
+	close(out);
+
+	if(n->dl != NULL)
+		dlclose(n->dl);
+	n->dl = dlopen(dst, RTLD_NOW | RTLD_LOCAL);
+	unlink(dst);
+	if(n->dl == NULL) {
+		fprintf(stderr, "%s\n", dlerror());
+		exit(2);
+	}
+	struct sim_env **env = dlsym(n->dl, "sim_env");
+	uintptr_t *mmio_offset = dlsym(n->dl, "sim_mmio_offset");
+	n->main = (int (*)(void))dlsym(n->dl, "main");
+	if(env == NULL || mmio_offset == NULL || n->main == NULL) {
+		fprintf(stderr, "%s: not a node image\n", src);
+		exit(2);
+	}
+	*env = &n->env;
+	*mmio_offset = (uintptr_t)n->mmio;
+	Dl_info info;
+	n->image_base = dladdr(env, &info) ? info.dli_fbase : NULL;
+	n->usart_isr = (void (*)(void))dlsym(n->dl, "usart3_isr");
+	n->dma_rx_isr = (void (*)(void))dlsym(n->dl, "dma1_channel3_isr");
+	n->dma_tx_isr = (void (*)(void))dlsym(n->dl, "dma1_channel2_isr");
+	n->systick_isr = (void (*)(void))dlsym(n->dl, "sys_tick_handler");
+	n->pendsv_isr = (void (*)(void))dlsym(n->dl, "pend_sv_handler");
+	static const char *timer_isrs[4] = { "tim1_up_isr", "tim2_isr", "tim3_isr", "tim4_isr" };
+	for(int i=0; i<4; i++)
+		n->tim[i].isr = (void (*)(void))dlsym(n->dl, timer_isrs[i]);
+}
+
+static struct node *booting;
+
+static void node_main_entry(void) {
+	struct node *n = booting;
+	n->main();
+	n->main_alive = false;
+	swapcontext(&n->ctx, &sim.ctx);
+}
+
+/* (Re)start a node: reset the peripherals, keep flash and backup domain */
+static void node_boot(struct node *n) {
+	const bool firmware = !n->bootloader || n->reset == SIM_RUN_FIRMWARE;
+	if(n->dl != NULL)
+		n->resets++;
+	n->reset = SIM_RUNNING;
+	node_load(n, firmware ? sim.firmware : "bootloader");
+
+	uint8_t bkp[0x400];
+	memcpy(bkp, node_mem(n, BACKUP_REGS_BASE), sizeof(bkp));
+	memset(node_mem(n, SIM_RAM_BASE), 0, SIM_RAM_SIZE);
+	memset(node_mem(n, SIM_PERIPH_BASE), 0, SIM_PERIPH_SIZE);
+	memset(node_mem(n, SIM_PPB_BASE), 0, SIM_PPB_SIZE);
+	memcpy(node_mem(n, BACKUP_REGS_BASE), bkp, sizeof(bkp));
+	REG(n, USART3_BASE + 0x00) = n->usart_sr = USART_SR_TXE | USART_SR_TC;
+	REG(n, FLASH_MEM_INTERFACE_BASE + 0x10) = 1 << 7; /* LOCK */
+	REG(n, CRC_BASE + 0x00) = 0xFFFFFFFF;
+	if(!n->bootloader) {
+		/* as left by the bootloader, which knows about config banks */
+		REG(n, BACKUP_REGS_BASE + 0x10) = BOOTINFO_CONFIG_BANKS;
+	}
+
+	static const uint32_t timer_bases[4] = { TIM1_BASE, TIM2_BASE, TIM3_BASE, TIM4_BASE };
+	static const uint8_t timer_irqs[4] = { NVIC_TIM1_UP_IRQ, NVIC_TIM2_IRQ, NVIC_TIM3_IRQ, NVIC_TIM4_IRQ };
+	for(int i=0; i<4; i++) {
+		struct timer *t = &n->tim[i];
+		t->base = timer_bases[i];
+		t->irq = timer_irqs[i];
+		t->cr1 = t->dier = t->cnt = t->psc = t->arr = 0;
+		t->gen++;
+	}
+	memset(&n->stk, 0, sizeof(n->stk));
+	n->stk.gen = n->tim[0].gen;
+	n->tx_dr_free = n->tx_free = n->now;
+	n->txe_pending = n->tc_pending = n->idle_pending = false;
+	n->dma_rx_on = n->dma_tx_busy = false;
+
+	getcontext(&n->ctx);
+	n->ctx.uc_stack.ss_sp = n->stack;
+	n->ctx.uc_stack.ss_size = STACK_SIZE;
+	n->ctx.uc_link = NULL;
+	booting = n;
+	makecontext(&n->ctx, node_main_entry, 0);
+	n->main_alive = true;
+}
+
+static void node_isr(struct node *n, void (*isr)(void)) {
+	n->now += IRQ_CYCLES;
+	n->in_isr = true;
+	if(setjmp(n->isr_jmp) == 0)
+		isr();
+	n->in_isr = false;
+	if(n->reset == SIM_RUNNING)
+		periph_sync(n);
+}
+
+/* Find an interrupt to be handled, PendSV having the lowest priority
+ *
+ * With <take>, a pending PendSV is cleared when it is returned.
+ */
+static void (*node_pending_isr(struct node *n, const bool take))(void) {
+	if(n->usart_isr != NULL && irq_enabled(n, NVIC_USART3_IRQ)) {
+		const uint32_t sr = REG(n, USART3_BASE + 0x00);
+		const uint32_t cr1 = REG(n, USART3_BASE + 0x0C);
+		if(((sr & USART_SR_RXNE) && (cr1 & USART_CR1_RXNEIE))
+			|| ((sr & USART_SR_TC) && (cr1 & USART_CR1_TCIE))
+			|| ((sr & USART_SR_TXE) && (cr1 & USART_CR1_TXEIE))
+			|| ((sr & USART_SR_IDLE) && (cr1 & USART_CR1_IDLEIE)))
+			return n->usart_isr;
+	}
+	const uint32_t dma_isr = REG(n, DMA1_BASE + 0x00);
+	const uint32_t dma_ie = DMA_CCR_TCIE | DMA_CCR_HTIE | DMA_CCR_TEIE;
+	if(n->dma_rx_isr != NULL && irq_enabled(n, NVIC_DMA1_CHANNEL3_IRQ)
+		&& ((dma_isr >> DMA_FLAG_OFFSET(RX_DMA_CHANNEL)) & REG(n, DMA_CH(RX_DMA_CHANNEL, 0x00)) & dma_ie))
+		return n->dma_rx_isr;
+	if(n->dma_tx_isr != NULL && irq_enabled(n, NVIC_DMA1_CHANNEL2_IRQ)
+		&& ((dma_isr >> DMA_FLAG_OFFSET(TX_DMA_CHANNEL)) & REG(n, DMA_CH(TX_DMA_CHANNEL, 0x00)) & dma_ie))
+		return n->dma_tx_isr;
+	for(int i=0; i<4; i++) {
+		struct timer *t = &n->tim[i];
+		if(t->isr != NULL && irq_enabled(n, t->irq)
+			&& (REG(n, t->base + 0x10) & TIM_SR_UIF)
+			&& (REG(n, t->base + 0x0C) & TIM_DIER_UIE))
+			return t->isr;
+	}
+	volatile uint32_t *icsr = &REG(n, SCB_BASE + 0x04);
+	if(n->pendsv_isr != NULL && (*icsr & SCB_ICSR_PENDSVSET)) {
+		if(take)
+			*icsr &= ~SCB_ICSR_PENDSVSET;
+		return n->pendsv_isr;
+	}
+	return NULL;
+}
+
+/* Let a node react to whatever happened at <time>
+ *
+ * Pending interrupts are handled, then the main loop gets woken up.
+ * This repeats until the node is quiet.
+ */
+static void node_service(struct node *n, const uint64_t time) {
+	if(n->now < time)
+		n->now = time;
+	n->run_start = n->now;
+	node_map(n);
+	for(int round=0; round<100; round++) {
+		if(n->reset != SIM_RUNNING)
+			node_boot(n);
+		periph_sync(n);
+		void (*isr)(void);
+		for(int i=0; i<32 && n->reset == SIM_RUNNING && (isr = node_pending_isr(n, true)) != NULL; i++)
+			node_isr(n, isr);
+		if(n->reset != SIM_RUNNING)
+			continue;
+		if(n->main_alive) {
+			n->in_main = true;
+			swapcontext(&sim.ctx, &n->ctx);
+			n->in_main = false;
+			if(n->reset != SIM_RUNNING)
+				continue;
+			periph_sync(n);
+		}
+		if(node_pending_isr(n, false) == NULL)
+			return;
+	}
+	fprintf(stderr, "node %d does not settle\n", n->id);
+	exit(2);
+}
+
+/* A character arrives at a node's receiver */
+static void node_receive(struct node *n, const struct tx *tx, const bool corrupt) {
+	if(REG(n, GPIO_PORT_B_BASE + 0x0C) & RE_PIN)
+		return;
+	volatile uint32_t *cr1 = &REG(n, USART3_BASE + 0x0C);
+	if(!(*cr1 & USART_CR1_UE) || !(*cr1 & USART_CR1_RE))
+		return;
+	const bool nine = (*cr1 & USART_CR1_M) != 0;
+	const double bit = 2.0 * REG(n, USART3_BASE + 0x08);
+	const bool error = corrupt || nine != tx->nine
+		|| bit * 100 < tx->bit * (100 - BAUD_TOLERANCE)
+		|| bit * 100 > tx->bit * (100 + BAUD_TOLERANCE);
+	const uint16_t data = error ? (sim_random() & (nine ? 0x1FF : 0xFF)) : tx->data;
+
+	if((*cr1 & USART_CR1_RWU) && (*cr1 & USART_CR1_WAKE)) {
+		/* mute, wait for an address mark matching the node's USART address */
+		if(error || !(data & 0x100) || (data & 0xF) != (REG(n, USART3_BASE + 0x10) & 0xF))
+			return;
+		*cr1 &= ~USART_CR1_RWU;
+	}
+	usart_flags(n, 0, 0);
+	if(dma_receive(n, data)) {
+		/* RXNE is cleared right away by the DMA reading DR */
+		REG(n, USART3_BASE + 0x04) = data;
+		usart_flags(n, error ? USART_SR_FE : 0, 0);
+		if(error)
+			n->rx_errors++;
+	} else if(n->usart_sr & USART_SR_RXNE) {
+		usart_flags(n, USART_SR_ORE, 0);
+		n->overruns++;
+	} else {
+		REG(n, USART3_BASE + 0x04) = data;
+		usart_flags(n, USART_SR_RXNE | (error ? USART_SR_FE : 0), 0);
+		if(error)
+			n->rx_errors++;
+	}
+	if(*cr1 & USART_CR1_IDLEIE) {
+		/* IDLE after one character time without reception */
+		n->rx_idle = tx->end + (uint64_t)(bit * (nine ? 11 : 10));
+		n->idle_pending = true;
+		event_push(n->rx_idle, EV_WAKE, n->id, 0, 0);
+	}
+	node_service(n, tx->end);
+}
+
+static void master_receive(const struct tx *tx, const bool corrupt);
+
+static void bus_char(const struct tx *tx) {
+	/* another driver active at the same time garbles the character */
+	bool corrupt = false;
+	for(unsigned int i=1; i<=8 && i<=sim.tx_count; i++) {
+		const struct tx *o = &sim.tx[(sim.tx_count - i) % TX_RING];
+		if(o != tx && o->sender != tx->sender && o->start < tx->end && tx->start < o->end)
+			corrupt = true;
+	}
+	if(corrupt)
+		sim.collisions++;
+	if(sim.verbose)
+		fprintf(stderr, "%10.1f us: %3d -> 0x%03x%s\n", US(tx->end), tx->sender, tx->data, corrupt ? " (collision)" : "");
+	for(int i=0; i<node_count; i++)
+		if(nodes[i].id != tx->sender)
+			node_receive(&nodes[i], tx, corrupt);
+	if(tx->sender != MASTER_ID)
+		master_receive(tx, corrupt);
+}
+
+/* Bus master
+ *
+ * The scenarios run as a coroutine of the simulator, so they can be
+ * written as plain sequences of requests and replies.
+ */
+static double master_bit(void) {
+	return (double)SIM_CPU_SPEED / master.baudrate;
+}
+
+static void master_yield(void) {
+	swapcontext(&master.ctx, &sim.ctx);
+}
+
+static void master_sleep_until(const uint64_t time) {
+	event_push(time, EV_MASTER, MASTER_ID, 0, ++master.gen);
+	master_yield();
+}
+
+static void master_sleep(const uint64_t cycles) {
+	master_sleep_until(sim.now + cycles);
+}
+
+/* send bytes, <mark> starts a packet with an address mark
+ * (with address mark framing), returns when they are on the bus
+ */
+static void master_put(const void *buf, const int len, const bool mark) {
+	master.rx_stale += master.rx_len;
+	master.rx_len = 0;
+	uint64_t t = (sim.now > master.tx_free) ? sim.now : master.tx_free;
+	const double bit = master_bit();
+	const uint64_t chartime = (uint64_t)(bit * (master.marks ? 11 : 10));
+	if(master.marks && mark) {
+		bus_transmit(MASTER_ID, LBUS_ADDRESS_MARK, true, bit, t);
+		t += chartime;
+	}
+	for(int i=0; i<len; i++) {
+		bus_transmit(MASTER_ID, ((const uint8_t*)buf)[i], master.marks, bit, t);
+		t += chartime;
+	}
+	master.tx_free = t;
+	master_sleep_until(t);
+}
+
+/* send a packet, returns when it is on the bus */
+static void master_send(const void *buf, const int len) {
+	master_put(buf, len, true);
+}
+
+/* receive up to <len> bytes, waiting REPLY_TIMEOUT for each one */
+static int master_recv(void *buf, const int len) {
+	master.rx_want = len;
+	while(master.rx_len < len) {
+		const int before = master.rx_len;
+		master_sleep(REPLY_TIMEOUT);
+		if(master.rx_len == before)
+			break;
+	}
+	master.rx_want = 0;
+	const int got = (master.rx_len < len) ? master.rx_len : len;
+	memcpy(buf, master.rx, got);
+	memmove(master.rx, master.rx + got, master.rx_len - got);
+	master.rx_len -= got;
+	return got;
+}
+
+static void master_receive(const struct tx *tx, const bool corrupt) {
+	if(corrupt || tx->nine != master.marks
+		|| tx->bit * 100 < master_bit() * (100 - BAUD_TOLERANCE)
+		|| tx->bit * 100 > master_bit() * (100 + BAUD_TOLERANCE))
+	{
+		master.rx_errors++;
+		return;
+	}
+	if(master.rx_len == 0)
+		master.rx_first = tx->end;
+	if(master.rx_len < (int)sizeof(master.rx))
+		master.rx[master.rx_len++] = tx->data;
+	if(master.rx_want > 0) {
+		/* wake up for the complete reply or for the next timeout */
+		if(master.rx_len >= master.rx_want)
+			event_push(sim.now, EV_MASTER, MASTER_ID, 0, ++master.gen);
+		else
+			event_push(sim.now + REPLY_TIMEOUT, EV_MASTER, MASTER_ID, 0, ++master.gen);
+	}
+}
+
+/* send an LBUS request, receive <reply_len> bytes of reply */
+static int lbus_request(const uint8_t addr, const uint8_t cmd, const void *data, const int len, void *reply, const int reply_len) {
+	uint8_t pkg[sizeof(struct lbus_hdr) + 2048];
+	if(len > (int)sizeof(pkg) - (int)sizeof(struct lbus_hdr))
+		abort();
+	struct lbus_hdr *hdr = (struct lbus_hdr *)pkg;
+	hdr->length = sizeof(struct lbus_hdr) + len + reply_len;
+	hdr->addr = addr;
+	hdr->cmd = cmd;
+	memcpy(pkg + sizeof(struct lbus_hdr), data, len);
+	master_send(pkg, sizeof(struct lbus_hdr) + len);
+	if(reply_len == 0)
+		return 0;
+	return master_recv(reply, reply_len);
+}
+
+static bool lbus_ping(const uint8_t addr) {
+	uint8_t reply;
+	return lbus_request(addr, PING, NULL, 0, &reply, 1) == 1 && reply == 1;
+}
+
+static bool lbus_get_stats(const uint8_t addr, struct lbus_stats *stats) {
+	const struct lbus_GET_DATA req = { .type = LBUS_DATA_STATS };
+	return lbus_request(addr, GET_DATA, &req, sizeof(req), stats, sizeof(*stats)) == sizeof(*stats);
+}
+
+static inline uint8_t node_address(const struct node *n) {
+	return n->id + 1;
+}
+
+/* scenarios */
+static int rounds = 1000;
+
+static void scenario_setup(void) {
+	/* nodes start with plain framing at the safe baud rate */
+	const uint32_t baudrate = master.baudrate;
+	const bool marks = master.marks;
+	master.baudrate = LBUS_BAUDRATE_SAFE;
+	master.marks = false;
+	if(marks) {
+		const struct lbus_SET_FRAMING req = { .framing = LBUS_FRAMING_ADDRESS_MARK };
+		lbus_request(0xFF, SET_FRAMING, &req, sizeof(req), NULL, 0);
+		master.marks = true;
+	}
+	if(baudrate != LBUS_BAUDRATE_SAFE) {
+		const struct lbus_SET_BAUDRATE req = { .baudrate = baudrate, .flags = 0 };
+		lbus_request(0xFF, SET_BAUDRATE, &req, sizeof(req), NULL, 0);
+		master.baudrate = baudrate;
+	}
+	master_sleep(SIM_CPU_SPEED / 1000);
+	for(int i=0; i<node_count; i++)
+		if(!lbus_ping(node_address(&nodes[i])))
+			fail("node %d does not answer after setup", nodes[i].id);
+}
+
+/* restart all nodes like after a power cut, flash and backup registers
+ * stay; the bus is set up again when they have booted
+ */
+static void nodes_restart(void) {
+	for(int i=0; i<node_count; i++) {
+		nodes[i].reset = SIM_RESET;
+		event_push(sim.now, EV_WAKE, i, 0, 0);
+	}
+	master_sleep(TIMEOUT_WAIT);
+	for(int i=0; i<node_count; i++)
+		if(nodes[i].now > sim.now)
+			master_sleep_until(nodes[i].now);
+	scenario_setup();
+}
+
+struct latency {
+	unsigned long count;
+	uint64_t min, max, total;
+};
+
+static void latency_add(struct latency *l, const uint64_t cycles) {
+	if(l->count == 0 || cycles < l->min)
+		l->min = cycles;
+	if(cycles > l->max)
+		l->max = cycles;
+	l->total += cycles;
+	l->count++;
+}
+
+static void latency_print(const char *what, const struct latency *l) {
+	if(l->count == 0)
+		return;
+	printf("  %s: min %.1f us, avg %.1f us, max %.1f us\n", what,
+		US(l->min), US(l->total / l->count), US(l->max));
+}
+
+/* round robin PING to all nodes */
+static void scenario_ping(void) {
+	struct latency turnaround = {0};
+	unsigned long sent = 0, missing = 0;
+	const uint64_t start = sim.now;
+	for(int r=0; r<rounds; r++) {
+		for(int i=0; i<node_count; i++) {
+			sent++;
+			if(!lbus_ping(node_address(&nodes[i]))) {
+				missing++;
+				continue;
+			}
+			latency_add(&turnaround, master.rx_first - master.tx_free);
+		}
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	printf("ping: %lu requests, %lu missing, %.0f packets/s\n", sent, missing, sent / secs);
+	latency_print("turnaround (end of request to end of reply)", &turnaround);
+	if(missing)
+		fail("%lu PINGs got no answer", missing);
+}
+
+/* check the PWM outputs of the protolight nodes against <values>, 12 per node
+ *
+ * values[i] is output on timer i%3, channel i/3, see firmware.c. Nodes
+ * with DMA handle the last packet only when the bus has gone idle.
+ */
+static uint32_t led_output(struct node *n, const int v) {
+	static const uint32_t timer_bases[3] = { TIM2_BASE, TIM3_BASE, TIM4_BASE };
+	return REG(n, timer_bases[v % 3] + 0x34 + (v / 3) * 4);
+}
+
+static void check_leds(const uint16_t *values) {
+	master_sleep(TIMEOUT_WAIT);
+	for(int i=0; i<node_count; i++) {
+		if(nodes[i].bootloader)
+			continue;
+		for(int v=0; v<12; v++) {
+			const uint16_t want = values[i * 12 + v];
+			const uint32_t ccr = led_output(&nodes[i], v);
+			if(ccr != want) {
+				fail("node %d: LED %d is %u, should be %u", nodes[i].id, v, ccr, want);
+				break;
+			}
+		}
+	}
+}
+
+/* LED_FRAME broadcasts, checks the PWM outputs of all nodes afterwards */
+static void scenario_frame(void) {
+	const int leds = node_count * 12;
+	uint8_t pkg[sizeof(struct lbus_LED_FRAME) + MAX_NODES * 12 * sizeof(uint16_t)];
+	struct lbus_LED_FRAME *frame = (struct lbus_LED_FRAME *)pkg;
+	uint16_t values[MAX_NODES * 12];
+	const int len = sizeof(struct lbus_LED_FRAME) + leds * sizeof(uint16_t);
+	const uint64_t start = sim.now;
+	frame->flags = LBUS_LED_FRAME_COMMIT;
+	for(int r=0; r<rounds; r++) {
+		for(int l=0; l<leds; l++)
+			values[l] = r * 251 + l;
+		memcpy(frame->values, values, leds * sizeof(uint16_t));
+		lbus_request(0xFF, LED_FRAME, pkg, len, NULL, 0);
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	printf("frame: %d frames of %d LEDs, %.0f frames/s, %.0f bytes/s\n",
+		rounds, leds, rounds / secs, (double)rounds * (len + sizeof(struct lbus_hdr)) / secs);
+
+	check_leds(values);
+}
+
+/* LED_SET_ALL frames for all nodes in compact containers, then LED_COMMIT
+ *
+ * Containers also hold an empty frame and one for a missing node.
+ * Bootloader nodes do not know compact containers and must skip them.
+ * Finally, a truncated container must be dropped after the packet timeout.
+ */
+static void scenario_compact(void) {
+	uint16_t values[MAX_NODES * 12];
+	uint8_t pkg[sizeof(struct lbus_hdr) + (MAX_NODES + 2) * (sizeof(struct lbus_compact_hdr) + sizeof(uint16_t) * 12)];
+	unsigned long bytes = 0;
+	const uint64_t start = sim.now;
+	for(int r=0; r<rounds; r++) {
+		unsigned int len = sizeof(struct lbus_hdr);
+		const struct lbus_compact_hdr empty = { .length = 0, .addr = node_address(&nodes[0]) };
+		len += lbus_encode_compact_hdr(pkg + len, &empty);
+		for(int i=0; i<=node_count; i++) {
+			/* i == node_count is a node that is not on the bus */
+			const struct lbus_compact_hdr frame = { .length = sizeof(uint16_t) * 12, .addr = i + 1 };
+			len += lbus_encode_compact_hdr(pkg + len, &frame);
+			for(int v=0; v<12; v++) {
+				const uint16_t value = r * 241 + i * 12 + v;
+				if(i < node_count)
+					values[i * 12 + v] = value;
+				len += lbus_put_uint16_t(pkg + len, value);
+			}
+		}
+		const struct lbus_hdr hdr = { .length = len, .addr = LBUS_COMPACT_ADDR, .cmd = LED_SET_ALL };
+		lbus_encode_hdr(pkg, &hdr);
+		master_send(pkg, len);
+		lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+		bytes += len + sizeof(struct lbus_hdr);
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	printf("compact: %d containers for %d nodes, %.0f updates/s, %.0f bytes/s\n",
+		rounds, node_count, rounds / secs, bytes / secs);
+	check_leds(values);
+
+	/* a frame header, but no data */
+	const struct lbus_hdr hdr = { .length = 100, .addr = LBUS_COMPACT_ADDR, .cmd = LED_SET_ALL };
+	const struct lbus_compact_hdr frame = { .length = 24, .addr = node_address(&nodes[0]) };
+	unsigned int len = lbus_encode_hdr(pkg, &hdr);
+	len += lbus_encode_compact_hdr(pkg + len, &frame);
+	master_send(pkg, len);
+	master_sleep(TIMEOUT_WAIT);
+	for(int i=0; i<node_count; i++)
+		if(!lbus_ping(node_address(&nodes[i])))
+			fail("node %d did not recover from a truncated compact container", nodes[i].id);
+}
+
+/* CRC32 like the STM32 CRC unit, of data padded with zeros to whole words */
+static uint32_t crc32_words(const void *data, const int length) {
+	uint32_t crc = 0xFFFFFFFF;
+	for(int i=0; i<length; i+=4) {
+		uint32_t w = 0;
+		memcpy(&w, (const uint8_t*)data + i, (length - i < 4) ? length - i : 4);
+		crc ^= w;
+		for(int b=0; b<32; b++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+	}
+	return crc;
+}
+
+/* add a GET_DATA_MULTI item to the expected reply, if it fits */
+static int data_item_put(uint8_t *out, const int p, const int len, const uint16_t type, const void *data, const int length) {
+	if(p + (int)sizeof(struct lbus_data_item) + length > len)
+		return len;
+	const struct lbus_data_item item = { .type = type, .length = length };
+	const int l = lbus_encode_data_item(out + p, &item);
+	memcpy(out + p + l, data, length);
+	return p + l + length;
+}
+
+/* GET_DATA_MULTI to all protolight nodes, including an unknown type, with
+ * one byte too little room for the last item. Then a GET_DATA with more
+ * reply space than data.
+ */
+static void scenario_data(void) {
+	static const uint16_t types[] = {
+		LBUS_DATA_STATUS, LBUS_DATA_ADDRESS, 0x7FFF, LBUS_DATA_FIRMWARE_NAME, LBUS_DATA_FIRMWARE_VERSION
+	};
+	static const char fw_name[] = "protolight-controller";
+	const int count = sizeof(types) / sizeof(types[0]);
+	const int reply_len = 5 * sizeof(struct lbus_data_item) + 1 + 1 + strlen(fw_name) + 4 - 1;
+	uint8_t req[sizeof(struct lbus_GET_DATA_MULTI) + sizeof(types)];
+	const struct lbus_GET_DATA_MULTI d = { .count = count };
+	int len = lbus_encode_GET_DATA_MULTI(req, &d);
+	for(int i=0; i<count; i++)
+		len += lbus_put_uint16_t(req + len, types[i]);
+	unsigned long bad = 0;
+	const uint64_t start = sim.now;
+	for(int r=0; r<rounds; r++) {
+		for(int i=0; i<node_count; i++) {
+			const struct node *n = &nodes[i];
+			const uint8_t status = LBUS_STATE_IN_FIRMWARE;
+			const uint8_t address = node_address(n);
+			const uint32_t version = 0;
+			uint8_t want[reply_len], reply[reply_len];
+			/* the bootloader is built with LBUS_SMALL */
+			if(n->bootloader)
+				continue;
+			memset(want, 0, reply_len);
+			int p = data_item_put(want, 0, reply_len, LBUS_DATA_STATUS, &status, 1);
+			p = data_item_put(want, p, reply_len, LBUS_DATA_ADDRESS, &address, 1);
+			p = data_item_put(want, p, reply_len, 0x7FFF, NULL, 0);
+			p = data_item_put(want, p, reply_len, LBUS_DATA_FIRMWARE_NAME, fw_name, strlen(fw_name));
+			p = data_item_put(want, p, reply_len, LBUS_DATA_FIRMWARE_VERSION, &version, 4);
+			if(lbus_request(address, GET_DATA_MULTI, req, len, reply, reply_len) != reply_len
+				|| memcmp(reply, want, reply_len))
+			{
+				bad++;
+				fail("round %d: node %d: bad GET_DATA_MULTI reply", r, n->id);
+			}
+		}
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	int firmware_nodes = 0;
+	for(int i=0; i<node_count; i++)
+		firmware_nodes += !nodes[i].bootloader;
+	printf("data: %d GET_DATA_MULTI rounds, %.0f requests/s, %lu bad replies\n",
+		rounds, rounds * firmware_nodes / secs, bad);
+
+	for(int i=0; i<node_count; i++) {
+		const struct lbus_GET_DATA get = { .type = LBUS_DATA_STATUS };
+		uint8_t status[4];
+		if(lbus_request(node_address(&nodes[i]), GET_DATA, &get, sizeof(get), status, sizeof(status)) != sizeof(status)
+			|| status[0] != (nodes[i].bootloader ? LBUS_STATE_IN_BOOTLOADER : LBUS_STATE_IN_FIRMWARE)
+			|| status[1] != 0 || status[2] != 0 || status[3] != 0)
+		{
+			fail("node %d: bad GET_DATA reply", nodes[i].id);
+		}
+	}
+
+	/* capabilities must match the node images' build flags, the bootloader
+	 * has none (LBUS_SMALL): zeros like nodes from before capabilities.
+	 * protolight-nodma is built with LBUS_PROFILE.
+	 */
+	const bool profile = !strcmp(sim.firmware, "protolight-nodma");
+	for(int i=0; i<node_count; i++) {
+		const struct node *n = &nodes[i];
+		const struct lbus_GET_DATA get = { .type = LBUS_DATA_CAPABILITIES };
+		uint8_t buf[sizeof(struct lbus_capabilities)];
+		static const uint8_t none[sizeof(struct lbus_capabilities)];
+		struct lbus_capabilities caps;
+		if(lbus_request(node_address(n), GET_DATA, &get, sizeof(get), buf, sizeof(buf)) != sizeof(buf)) {
+			fail("node %d: no capabilities", n->id);
+			continue;
+		}
+		if(n->bootloader) {
+			if(memcmp(buf, none, sizeof(buf)))
+				fail("node %d: capabilities from the bootloader", n->id);
+			continue;
+		}
+		lbus_decode_capabilities(&caps, buf);
+		const uint32_t flags = LBUS_CAP_ADDRESS_MARKS | LBUS_CAP_BAUDRATE_SWITCH | LBUS_CAP_GROUPS | LBUS_CAP_TIME_SYNC
+			| LBUS_CAP_STATS | LBUS_CAP_COMPACT | LBUS_CAP_SCAN | LBUS_CAP_SEQ | LBUS_CAP_LED_LUT
+			| (profile ? LBUS_CAP_PROFILE : 0);
+		if(caps.flags != flags
+			|| lbus_cap_has_command(caps.commands, GET_PROFILE) != profile
+			|| !lbus_cap_has_command(caps.commands, GET_DATA_MULTI)
+			|| lbus_cap_has_command(caps.commands, FLASH_FIRMWARE)
+			|| !lbus_cap_has_command(caps.commands, LED_SET_DELTA)
+			|| caps.baudrate_max != LBUS_BAUDRATE_MAX
+			|| caps.channels != 12)
+		{
+			fail("node %d: bad capabilities", n->id);
+		}
+	}
+
+	/* GET_PROFILE: after a reset of the probes, lbus_handler() must
+	 * have been called once per PING, the receive ISR at least for each
+	 * character of them, and the histograms must add up
+	 */
+	for(int i=0; profile && i<node_count; i++) {
+		const struct node *n = &nodes[i];
+		const int pings = 10;
+		uint8_t buf[sizeof(struct lbus_profile)];
+		struct lbus_profile probes[LBUS_PROFILE_PROBES];
+		if(n->bootloader)
+			continue;
+		for(int p=0; p<LBUS_PROFILE_PROBES; p++) {
+			const struct lbus_GET_PROFILE req = { .probe = p, .flags = LBUS_PROFILE_RESET };
+			lbus_request(node_address(n), GET_PROFILE, &req, sizeof(req), buf, sizeof(buf));
+		}
+		for(int r=0; r<pings; r++)
+			lbus_ping(node_address(n));
+		for(int p=0; p<LBUS_PROFILE_PROBES; p++) {
+			const struct lbus_GET_PROFILE req = { .probe = p, .flags = 0 };
+			if(lbus_request(node_address(n), GET_PROFILE, &req, sizeof(req), buf, sizeof(buf)) != sizeof(buf))
+				fail("node %d: no GET_PROFILE reply for probe %d", n->id, p);
+			lbus_decode_profile(&probes[p], buf);
+			uint32_t count = 0;
+			for(int b=0; b<LBUS_PROFILE_BUCKETS; b++)
+				count += probes[p].histogram[b];
+			if(count != probes[p].count
+				|| (count > 0 && (probes[p].min > probes[p].max || probes[p].total < (uint64_t)count * probes[p].min)))
+				fail("node %d: inconsistent profile for probe %d", n->id, p);
+		}
+		if(probes[LBUS_PROFILE_HANDLER].count != (uint32_t)pings
+			|| probes[LBUS_PROFILE_USART_ISR].count < (uint32_t)pings * sizeof(struct lbus_hdr))
+			fail("node %d: profile counts %u lbus_handler() calls and %u receive ISRs for %d PINGs", n->id,
+				probes[LBUS_PROFILE_HANDLER].count, probes[LBUS_PROFILE_USART_ISR].count, pings);
+	}
+
+	/* READ_MEMORY on bootloader nodes: the CRC covers exactly the bytes sent */
+	for(int i=0; i<node_count; i++) {
+		struct node *n = &nodes[i];
+		if(!n->bootloader)
+			continue;
+		for(int length=1; length<=8; length++) {
+			const struct lbus_READ_MEMORY req = { .address = CONFIG_ADDRESS + 2 };
+			uint8_t reply[8 + sizeof(uint32_t)];
+			const uint8_t *want = (const uint8_t *)node_mem(n, CONFIG_ADDRESS + 2);
+			if(lbus_request(node_address(n), READ_MEMORY, &req, sizeof(req), reply, length + 4) != length + 4
+				|| memcmp(reply, want, length)
+				|| lbus_get_uint32_t(reply + length) != crc32_words(want, length))
+				fail("node %d: bad READ_MEMORY reply for %d bytes", n->id, length);
+		}
+	}
+}
+
+/* SCAN broadcasts for all nodes and two missing ones
+ *
+ * Every node must reply in its slot, without collisions, and all nodes
+ * must be back in line afterwards.
+ */
+static void scenario_scan(void) {
+	const int reply_size = sizeof(struct lbus_hdr) + sizeof(struct lbus_scan);
+	const int us = reply_size * (master.marks ? 11 : 10) * 1000000 / master.baudrate + 100;
+	const struct lbus_SCAN req = {
+		.first = 1,
+		.count = node_count + 2,
+		.slot = (us + LBUS_SCAN_TICK_US - 1) / LBUS_SCAN_TICK_US
+	};
+	const uint32_t name_hash = lbus_name_hash("protolight-controller");
+	uint8_t buf[(MAX_NODES + 2) * (sizeof(struct lbus_hdr) + sizeof(struct lbus_scan))];
+	unsigned long missing = 0;
+	/* bootloader nodes come last, they do not answer SCAN */
+	int scanned = 0;
+	while(scanned < node_count && !nodes[scanned].bootloader)
+		scanned++;
+	const uint64_t start = sim.now;
+	for(int r=0; r<rounds; r++) {
+		lbus_request(0xFF, SCAN, &req, sizeof(req), NULL, 0);
+		const int got = master_recv(buf, req.count * reply_size);
+		int i = 0;
+		for(int p=0; p + reply_size <= got; p += reply_size, i++) {
+			struct lbus_hdr hdr;
+			struct lbus_scan info;
+			lbus_decode_hdr(&hdr, buf + p);
+			lbus_decode_scan(&info, buf + p + sizeof(hdr));
+			if(i >= scanned || hdr.length != reply_size || hdr.addr != LBUS_MASTER_ADDR || hdr.cmd != SCAN) {
+				fail("round %d: broken SCAN reply at offset %d", r, p);
+				break;
+			}
+			const struct node *n = &nodes[i];
+			if(info.addr != node_address(n) || info.status != LBUS_STATE_IN_FIRMWARE
+				|| info.version != 0 || info.name_hash != name_hash)
+			{
+				fail("round %d: node %d: bad SCAN reply (addr %d, status %d, version %08x, name hash %08x)",
+					r, n->id, info.addr, info.status, info.version, info.name_hash);
+			}
+		}
+		missing += scanned - i;
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	printf("scan: %d scans of %d slots at %u us, %.1f ms per scan, %lu replies missing\n",
+		rounds, req.count, req.slot * LBUS_SCAN_TICK_US, secs * 1000 / rounds, missing);
+	if(missing)
+		fail("%lu SCAN replies missing", missing);
+	for(int i=0; i<node_count; i++)
+		if(!lbus_ping(node_address(&nodes[i])))
+			fail("node %d does not answer after SCAN", nodes[i].id);
+}
+
+/* truncated packets must be dropped after the packet timeout */
+static void scenario_timeout(void) {
+	unsigned long missing = 0;
+	for(int r=0; r<rounds; r++) {
+		for(int i=0; i<node_count; i++) {
+			/* announce more data than is sent */
+			struct lbus_hdr hdr = { .length = 10, .addr = node_address(&nodes[i]), .cmd = GET_DATA };
+			master_send(&hdr, sizeof(hdr));
+			master_sleep(TIMEOUT_WAIT);
+			if(!lbus_ping(node_address(&nodes[i])))
+				missing++;
+		}
+	}
+	printf("timeout: %d truncated packets per node, %lu times no answer %.1f us later\n",
+		rounds, missing, US(TIMEOUT_WAIT));
+	if(missing)
+		fail("%lu times, a node did not recover from a truncated packet", missing);
+	for(int i=0; i<node_count; i++) {
+		struct lbus_stats stats;
+		if(!nodes[i].bootloader && lbus_get_stats(node_address(&nodes[i]), &stats) && stats.timeouts == 0)
+			fail("node %d did not count its timeouts", nodes[i].id);
+	}
+
+	/* with a short timeout, nodes must be back a few characters later,
+	 * the bootloader (LBUS_SMALL) keeps its default
+	 */
+	const struct lbus_SET_TIMEOUT set = { .chars = 4 };
+	lbus_request(0xFF, SET_TIMEOUT, &set, sizeof(set), NULL, 0);
+	const uint64_t wait = 2 * set.chars * (master.marks ? 11 : 10) * master_bit();
+	missing = 0;
+	for(int r=0; r<rounds; r++) {
+		for(int i=0; i<node_count; i++) {
+			if(nodes[i].bootloader)
+				continue;
+			struct lbus_hdr hdr = { .length = 10, .addr = node_address(&nodes[i]), .cmd = GET_DATA };
+			master_send(&hdr, sizeof(hdr));
+			master_sleep(wait);
+			if(!lbus_ping(node_address(&nodes[i])))
+				missing++;
+		}
+	}
+	printf("timeout: %d truncated packets per node at a timeout of %d characters, %lu times no answer %.1f us later\n",
+		rounds, set.chars, missing, US(wait));
+	if(missing)
+		fail("%lu times, a node did not recover from a truncated packet with a short timeout", missing);
+	const struct lbus_SET_TIMEOUT reset = { .chars = 0 };
+	lbus_request(0xFF, SET_TIMEOUT, &reset, sizeof(reset), NULL, 0);
+}
+
+/* a request that writes to config flash, gets a status byte: that takes
+ * a while when the node has to compact its config store. The other nodes
+ * time out waiting for the end of the packet then, so they must see the
+ * late status byte followed by a pause before the next request.
+ */
+static int config_request(const uint8_t addr, const uint8_t cmd, const void *data, const int len) {
+	uint8_t status;
+	int got = lbus_request(addr, cmd, data, len, &status, 1);
+	if(got == 0) {
+		for(int i=0; got == 0 && i<200; i++)
+			got = master_recv(&status, 1);
+		master_sleep(TIMEOUT_WAIT);
+	}
+	return (got == 1) ? status : -1;
+}
+
+static int get_data_byte(const uint8_t addr, const uint16_t type) {
+	const struct lbus_GET_DATA req = { .type = type };
+	uint8_t reply;
+	if(lbus_request(addr, GET_DATA, &req, sizeof(req), &reply, 1) != 1)
+		return -1;
+	return reply;
+}
+
+/* config writes until the config stores have been compacted a few times:
+ * the latest value must be read back, the other items must survive. The
+ * bootloader does not compact, its writes fail once the active bank is full.
+ */
+static void scenario_config(void) {
+	/* 12 bytes per item, so the active bank changes twice */
+	const int writes = 5 * CONFIG_BANK_SIZE / 2 / 12;
+	/* bootloader nodes start with 3 items in bank 1, see node_create() */
+	const int bootloader_writes = (CONFIG_BANK_SIZE - 3 * 12) / 12;
+	bool failed[MAX_NODES] = { false };
+	const uint64_t start = sim.now;
+	/* all nodes in turn, with a changed baud rate they must not fall back */
+	for(int w=0; w<writes; w++) {
+		for(int i=0; i<node_count; i++) {
+			const struct node *n = &nodes[i];
+			const uint8_t addr = node_address(n);
+			/* polarity ends up 0 again */
+			const uint8_t value = (w == writes - 1) ? 0 : (w % 255) + 1;
+			bool ok;
+			if(failed[i] || (n->bootloader && w > bootloader_writes))
+				continue;
+			if(n->bootloader) {
+				const struct lbus_SET_ADDRESS d = { .naddr = addr };
+				const int status = config_request(addr, SET_ADDRESS, &d, sizeof(d));
+				ok = (w < bootloader_writes) ? status == 0 : status > 0;
+			} else {
+				const struct lbus_SET_POLARITY d = { .polarity = value };
+				ok = config_request(addr, SET_POLARITY, &d, sizeof(d)) == 0
+					&& get_data_byte(addr, LBUS_DATA_POLARITY) == value;
+			}
+			if(!ok) {
+				fail("node %d: config write %d failed", n->id, w);
+				failed[i] = true;
+			}
+		}
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	for(int i=0; i<node_count; i++) {
+		struct node *n = &nodes[i];
+		const uint8_t addr = node_address(n);
+		const struct lbus_GET_DATA req = { .type = LBUS_DATA_LED_GROUP };
+		uint8_t group[2];
+		const uint32_t *bank0 = node_mem(n, CONFIG_ADDRESS);
+		const uint32_t *bank1 = node_mem(n, CONFIG_ADDRESS + CONFIG_BANK_SIZE);
+		if(n->bootloader && (bank0[2] != 0xFFFE0001 || bank1[2] != 0xFFFD0002))
+			fail("node %d: config store compacted by the bootloader", n->id);
+		else if(!n->bootloader && (bank0[0] != CONFIG_BANK || (bank0[2] & 0xFFFF) != 2))
+			fail("node %d: config store not compacted twice", n->id);
+		if(get_data_byte(addr, LBUS_DATA_ADDRESS) != addr)
+			fail("node %d: address lost", n->id);
+		else if(!n->bootloader && (lbus_request(addr, GET_DATA, &req, sizeof(req), group, 2) != 2
+			|| (group[0] | (group[1] << 8)) != n->id * 12))
+			fail("node %d: LED group lost", n->id);
+	}
+	printf("config: %d config writes per node, %.0f writes/s\n", writes, node_count * writes / secs);
+}
+
+/* CONFIG_WRITE of an item with the given CRC and length field, returns
+ * the status byte or -1
+ */
+static int config_write_item(const uint8_t addr, const uint32_t type, const void *data, const int length, const uint16_t length_field, const uint32_t crc) {
+	uint8_t pkg[sizeof(struct lbus_CONFIG_WRITE) + LBUS_CONFIG_MAX + sizeof(uint32_t)];
+	const struct lbus_CONFIG_WRITE d = { .type = type, .length = length_field };
+	int len = lbus_encode_CONFIG_WRITE(pkg, &d);
+	memcpy(pkg + len, data, length);
+	len += length;
+	len += lbus_put_uint32_t(pkg + len, crc);
+	return config_request(addr, CONFIG_WRITE, pkg, len);
+}
+
+/* CONFIG_READ of <room> bytes from <offset> on, returns the item length
+ * (LBUS_CONFIG_NONE when there is none) or -1 for a missing or broken reply
+ */
+static int config_read_item(const uint8_t addr, const uint32_t type, const uint16_t offset, void *data, const int room) {
+	const struct lbus_CONFIG_READ d = { .type = type, .offset = offset };
+	uint8_t reply[sizeof(struct lbus_config_data) + LBUS_CONFIG_MAX + sizeof(uint32_t)];
+	const int reply_len = sizeof(struct lbus_config_data) + room + sizeof(uint32_t);
+	if(lbus_request(addr, CONFIG_READ, &d, sizeof(d), reply, reply_len) != reply_len)
+		return -1;
+	const int length = lbus_get_uint16_t(reply);
+	int l = (length == LBUS_CONFIG_NONE) ? 0 : length - offset;
+	if(l > room)
+		l = room;
+	if(l < 0)
+		l = 0;
+	for(int i=l; i<room; i++)
+		if(reply[sizeof(struct lbus_config_data) + i] != 0)
+			return -1;
+	if(lbus_get_uint32_t(reply + sizeof(struct lbus_config_data) + room) != crc32_words(reply + sizeof(struct lbus_config_data), l))
+		return -1;
+	memcpy(data, reply + sizeof(struct lbus_config_data), room);
+	return length;
+}
+
+/* the LUT of a channel in scenario_lut */
+static void lut_fill(uint16_t *lut, const int id, const int channel) {
+	for(int v=0; v<256; v++)
+		lut[v] = v * 251 + (id * 12 + channel) * 97;
+}
+
+/* LUTs for all channels of the protolight nodes by CONFIG_WRITE, read back
+ * by CONFIG_READ, then LED_SET_8BIT must map values by them. Writes with
+ * a bad CRC or length must be refused.
+ */
+static void scenario_lut(void) {
+	uint16_t lut[256], back[256];
+	uint16_t values[MAX_NODES * 12];
+	const uint64_t start = sim.now;
+	int writes = 0;
+	for(int i=0; i<node_count; i++) {
+		const struct node *n = &nodes[i];
+		if(n->bootloader)
+			continue;
+		if(config_read_item(node_address(n), CONFIG_LED_LUT8TO16 + 12, 0, back, 4) != LBUS_CONFIG_NONE)
+			fail("node %d: CONFIG_READ of a missing item failed", n->id);
+	}
+	/* all nodes in turn, so they do not fall back to the safe baud rate */
+	for(int c=0; c<12; c++) {
+		for(int i=0; i<node_count; i++) {
+			const struct node *n = &nodes[i];
+			if(n->bootloader)
+				continue;
+			lut_fill(lut, n->id, c);
+			if(config_write_item(node_address(n), CONFIG_LED_LUT8TO16 + c, lut, sizeof(lut), sizeof(lut), crc32_words(lut, sizeof(lut))) != 0)
+				fail("node %d: CONFIG_WRITE of LUT %d failed", n->id, c);
+			writes++;
+		}
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	for(int i=0; i<node_count; i++) {
+		const struct node *n = &nodes[i];
+		const uint8_t addr = node_address(n);
+		if(n->bootloader)
+			continue;
+		memset(lut, 0, sizeof(lut));
+		if(config_write_item(addr, CONFIG_LED_LUT8TO16, lut, sizeof(lut), sizeof(lut), crc32_words(lut, sizeof(lut)) ^ 1) != 2)
+			fail("node %d: CONFIG_WRITE with a bad CRC not refused", n->id);
+		if(config_write_item(addr, CONFIG_LED_LUT8TO16, lut, sizeof(lut), sizeof(lut) - 2, crc32_words(lut, sizeof(lut) - 2)) != 1)
+			fail("node %d: CONFIG_WRITE with a bad length not refused", n->id);
+		if(config_write_item(addr, CONFIG_LED_LUT8TO16, lut, 4, LBUS_CONFIG_MAX + 4, 0) != 1)
+			fail("node %d: CONFIG_WRITE of a too long item not refused", n->id);
+		if(config_request(addr, CONFIG_WRITE, lut, 3) != 1)
+			fail("node %d: CONFIG_WRITE shorter than its header not refused", n->id);
+		/* without room for the reply, the packet must just end */
+		lbus_request(addr, CONFIG_WRITE, lut, 1, NULL, 0);
+		if(!lbus_ping(addr))
+			fail("node %d: no reply after a CONFIG_WRITE without room for one", n->id);
+		for(int c=0; c<12; c++) {
+			lut_fill(lut, n->id, c);
+			if(config_read_item(addr, CONFIG_LED_LUT8TO16 + c, 0, back, sizeof(back)) != sizeof(lut)
+				|| memcmp(lut, back, sizeof(lut)))
+			{
+				fail("node %d: LUT %d does not read back", n->id, c);
+				break;
+			}
+		}
+		/* the end of an item, with room to spare */
+		if(config_read_item(addr, CONFIG_LED_LUT8TO16 + 11, sizeof(lut) - 6, back, 16) != sizeof(lut)
+			|| memcmp(back, (uint8_t*)lut + sizeof(lut) - 6, 6))
+			fail("node %d: partial CONFIG_READ failed", n->id);
+	}
+	for(int r=0; r<rounds; r++) {
+		for(int i=0; i<node_count; i++) {
+			const struct node *n = &nodes[i];
+			uint8_t pkg[sizeof(struct lbus_LED_SET_8BIT) + 12];
+			const struct lbus_LED_SET_8BIT d = { .led = 0 };
+			if(n->bootloader)
+				continue;
+			int len = lbus_encode_LED_SET_8BIT(pkg, &d);
+			for(int c=0; c<12; c++) {
+				const uint8_t v = r * 7 + i * 12 + c;
+				lut_fill(lut, n->id, c);
+				values[i * 12 + c] = lut[v];
+				pkg[len++] = v;
+			}
+			lbus_request(node_address(n), LED_SET_8BIT, pkg, len, NULL, 0);
+		}
+		lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+		check_leds(values);
+	}
+	printf("lut: %d LUT writes, %.0f bytes/s\n", writes, writes * (sizeof(struct lbus_hdr) + sizeof(struct lbus_CONFIG_WRITE) + sizeof(lut) + 5) / secs);
+}
+
+/* the 16 bit value LED_SET_8BIT maps <v> to on channel <c> of a node,
+ * by its LUT in config or the default one of the firmware
+ */
+static uint16_t lut_entry(const uint8_t addr, const int c, const uint8_t v) {
+	uint8_t entry[2];
+	const int length = config_read_item(addr, CONFIG_LED_LUT8TO16 + c, v * 2, entry, 2);
+	if(length == LBUS_CONFIG_NONE)
+		return (v + 1) * (v + 1) - 1;
+	if(length != 512)
+		fail("node address %d: LUT %d does not read", addr, c);
+	return lbus_get_uint16_t(entry);
+}
+
+/* LED_SET_16BIT, LED_SET_8BIT and LED_COMMIT to groups set by SET_GROUPS:
+ * all protolight nodes are in one group, even and odd ones in another.
+ * Nodes must ignore the groups they are not in, also a group nobody is
+ * in, and must still be in their groups after a restart. Bootloader
+ * nodes are in no group.
+ */
+static void scenario_groups(void) {
+	const uint8_t all = LBUS_GROUP_FIRST, even = LBUS_GROUP_FIRST + 1, odd = LBUS_GROUP_FIRST + 2, none = LBUS_GROUP_LAST;
+	uint16_t values[MAX_NODES * 12], next[MAX_NODES * 12];
+	uint8_t pkg[sizeof(struct lbus_LED_SET_16BIT) + 12 * sizeof(uint16_t)];
+	for(int i=0; i<node_count; i++) {
+		const struct lbus_SET_GROUPS req = { .groups = { (i & 1) ? odd : even, all } };
+		if(!nodes[i].bootloader && config_request(node_address(&nodes[i]), SET_GROUPS, &req, sizeof(req)) != 0)
+			fail("node %d: SET_GROUPS failed", nodes[i].id);
+	}
+	const uint64_t start = sim.now;
+	for(int r=0; r<rounds; r++) {
+		/* all LEDs by the common group, the upper half by one of the
+		 * others, nothing by the empty group
+		 */
+		const uint8_t half = (r & 1) ? odd : even;
+		const struct lbus_LED_SET_16BIT lower = { .led = 0 }, upper = { .led = 6 };
+		int len = lbus_encode_LED_SET_16BIT(pkg, &lower);
+		for(int c=0; c<12; c++)
+			len += lbus_put_uint16_t(pkg + len, r * 31 + c);
+		lbus_request(all, LED_SET_16BIT, pkg, len, NULL, 0);
+		len = lbus_encode_LED_SET_16BIT(pkg, &upper);
+		for(int c=0; c<6; c++)
+			len += lbus_put_uint16_t(pkg + len, r * 37 + c + 1000);
+		lbus_request(half, LED_SET_16BIT, pkg, len, NULL, 0);
+		len = lbus_encode_LED_SET_16BIT(pkg, &lower);
+		for(int c=0; c<12; c++)
+			len += lbus_put_uint16_t(pkg + len, 0xFFFF);
+		lbus_request(none, LED_SET_16BIT, pkg, len, NULL, 0);
+		lbus_request(even, LED_COMMIT, NULL, 0, NULL, 0);
+		lbus_request(odd, LED_COMMIT, NULL, 0, NULL, 0);
+		for(int i=0; i<node_count; i++)
+			for(int c=0; c<12; c++)
+				values[i * 12 + c] = (c >= 6 && (i & 1) == (r & 1)) ? r * 37 + c - 6 + 1000 : r * 31 + c;
+		check_leds(values);
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	printf("groups: %d rounds of 5 group requests, %.0f requests/s\n", rounds, rounds * 5 / secs);
+
+	/* 8 bit values for the even nodes, committed to the odd ones first */
+	const struct lbus_LED_SET_8BIT d8 = { .led = 0 };
+	int len = lbus_encode_LED_SET_8BIT(pkg, &d8);
+	for(int c=0; c<12; c++)
+		pkg[len++] = c * 20 + 7;
+	lbus_request(even, LED_SET_8BIT, pkg, len, NULL, 0);
+	memcpy(next, values, sizeof(next));
+	for(int i=0; i<node_count; i++)
+		if(!nodes[i].bootloader && !(i & 1))
+			for(int c=0; c<12; c++)
+				next[i * 12 + c] = lut_entry(node_address(&nodes[i]), c, c * 20 + 7);
+	lbus_request(odd, LED_COMMIT, NULL, 0, NULL, 0);
+	lbus_request(none, LED_COMMIT, NULL, 0, NULL, 0);
+	check_leds(values);
+	lbus_request(all, LED_COMMIT, NULL, 0, NULL, 0);
+	check_leds(next);
+
+	/* the groups come from config after a restart */
+	nodes_restart();
+	const struct lbus_LED_SET_16BIT lower = { .led = 0 };
+	len = lbus_encode_LED_SET_16BIT(pkg, &lower);
+	for(int c=0; c<12; c++)
+		len += lbus_put_uint16_t(pkg + len, 100 + c);
+	lbus_request(0xFF, LED_SET_16BIT, pkg, len, NULL, 0);
+	lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+	len = lbus_encode_LED_SET_16BIT(pkg, &lower);
+	for(int c=0; c<12; c++)
+		len += lbus_put_uint16_t(pkg + len, 200 + c);
+	lbus_request(odd, LED_SET_16BIT, pkg, len, NULL, 0);
+	lbus_request(all, LED_COMMIT, NULL, 0, NULL, 0);
+	for(int i=0; i<node_count; i++)
+		for(int c=0; c<12; c++)
+			values[i * 12 + c] = ((i & 1) ? 200 : 100) + c;
+	check_leds(values);
+
+	for(int i=0; i<node_count; i++) {
+		const struct lbus_SET_GROUPS req = { .groups = { 0 } };
+		if(!nodes[i].bootloader && config_request(node_address(&nodes[i]), SET_GROUPS, &req, sizeof(req)) != 0)
+			fail("node %d: SET_GROUPS failed", nodes[i].id);
+	}
+}
+
+/* the same 12 values for all nodes by a LED_SET_16BIT broadcast, not committed */
+static void leds_set_all(uint16_t *values, const uint16_t first) {
+	uint8_t pkg[sizeof(struct lbus_LED_SET_16BIT) + 12 * sizeof(uint16_t)];
+	const struct lbus_LED_SET_16BIT d = { .led = 0 };
+	int len = lbus_encode_LED_SET_16BIT(pkg, &d);
+	for(int c=0; c<12; c++)
+		len += lbus_put_uint16_t(pkg + len, first + c);
+	lbus_request(0xFF, LED_SET_16BIT, pkg, len, NULL, 0);
+	for(int l=0; l<node_count * 12; l++)
+		values[l] = first + l % 12;
+}
+
+/* TIME_SYNC, then LED_COMMIT_AT broadcasts a few msec ahead: the protolight
+ * nodes must commit in the msec the bus time comes, counted from the end
+ * of the TIME_SYNC packet (the bus time wraps meanwhile). Commits for a
+ * time in the past, or further ahead than LBUS_SCHEDULE_MAX, must happen
+ * right away.
+ */
+static void scenario_time(void) {
+	const uint32_t t0 = 0xFFFFFFF0;
+	const uint64_t msec = SIM_CPU_SPEED / 1000;
+	/* DMA nodes see the end of a packet when the bus has gone idle */
+	const uint64_t late = (uint64_t)(3 * 11 * master_bit()) + msec / 10;
+	uint16_t values[MAX_NODES * 12], before[MAX_NODES * 12];
+	uint64_t committed[MAX_NODES];
+	struct latency lateness = {0};
+	const struct lbus_TIME_SYNC sync = { .time = t0 };
+	lbus_request(0xFF, TIME_SYNC, &sync, sizeof(sync), NULL, 0);
+	const uint64_t synced = sim.now;
+	leds_set_all(values, 0);
+	lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+	check_leds(values);
+	const int count = (rounds + 9) / 10;
+	for(int r=0; r<count; r++) {
+		memcpy(before, values, sizeof(before));
+		leds_set_all(values, r * 12 + 1);
+		const uint32_t at = t0 + (sim.now - synced) / msec + 2 + r % 8;
+		const uint64_t due = synced + (uint64_t)(uint32_t)(at - t0) * msec;
+		const struct lbus_LED_COMMIT_AT req = { .time = at };
+		lbus_request(0xFF, LED_COMMIT_AT, &req, sizeof(req), NULL, 0);
+		for(int i=0; i<node_count; i++)
+			committed[i] = 0;
+		/* every 10 usec until a msec after it is due */
+		while(sim.now < due + msec) {
+			master_sleep(SIM_CPU_SPEED / 100000);
+			for(int i=0; i<node_count; i++) {
+				if(nodes[i].bootloader || committed[i])
+					continue;
+				if(led_output(&nodes[i], 0) == values[i * 12])
+					committed[i] = sim.now;
+				else if(led_output(&nodes[i], 0) != before[i * 12])
+					fail("node %d: LED 0 is %u, neither before nor after the commit", nodes[i].id, led_output(&nodes[i], 0));
+			}
+		}
+		for(int i=0; i<node_count; i++) {
+			if(nodes[i].bootloader)
+				continue;
+			if(committed[i] == 0)
+				fail("node %d: no commit within a msec after bus time %u", nodes[i].id, at);
+			else if(committed[i] < due || committed[i] > due + late)
+				fail("node %d: commit %+.1f us from bus time %u, should be within %.1f us after it",
+					nodes[i].id, US(committed[i]) - US(due), at, US(late));
+			else
+				latency_add(&lateness, committed[i] - due);
+		}
+		check_leds(values);
+	}
+	printf("time: %d scheduled commits\n", count);
+	latency_print("commit after the scheduled bus time", &lateness);
+
+	/* in the past, and too far ahead */
+	const uint32_t now = t0 + (sim.now - synced) / msec;
+	const uint32_t past[2] = { now - 3, now + SCHEDULE_MAX + 100 };
+	for(int p=0; p<2; p++) {
+		leds_set_all(values, 1000 + p * 12);
+		const struct lbus_LED_COMMIT_AT req = { .time = past[p] };
+		lbus_request(0xFF, LED_COMMIT_AT, &req, sizeof(req), NULL, 0);
+		master_sleep(late);
+		for(int i=0; i<node_count; i++)
+			if(!nodes[i].bootloader && led_output(&nodes[i], 0) != values[i * 12])
+				fail("node %d: commit for bus time %u has not happened right away", nodes[i].id, past[p]);
+		check_leds(values);
+	}
+}
+
+/* LED_SET_DELTA request with data from lbus_delta_encode() */
+static void delta_send(const uint8_t addr, const uint8_t flags, const uint8_t encoding, const unsigned int vcount, const uint16_t *previous, const uint16_t *values) {
+	uint8_t pkg[sizeof(struct lbus_LED_SET_DELTA) + 2048];
+	const struct lbus_LED_SET_DELTA d = { .encoding = encoding, .flags = flags };
+	const unsigned int len = lbus_encode_LED_SET_DELTA(pkg, &d);
+	if(lbus_delta_encode(encoding, vcount, previous, values, NULL) > sizeof(pkg) - len)
+		abort();
+	lbus_request(addr, LED_SET_DELTA, pkg, len + lbus_delta_encode(encoding, vcount, previous, values, pkg + len), NULL, 0);
+}
+
+/* LED_SET_DELTA to single nodes with all encodings (and the shortest one,
+ * as lbus_led_set_delta() picks it), the last LEDs never change, so RLE
+ * data ends with a dropped skip. Then LBUS_DELTA_FRAME broadcasts with the
+ * LED groups moved behind runs and skips of more than 127 positions, and
+ * a packet shorter than the delta header that must not commit.
+ */
+static void scenario_delta(void) {
+	/* positions in front of the LED groups of the frame updates */
+	const unsigned int front = 200;
+	uint16_t values[MAX_NODES * 12], next[MAX_NODES * 12];
+	uint16_t frame[200 + MAX_NODES * 12 + 20], previous[200 + MAX_NODES * 12 + 20];
+	const unsigned int vcount = front + node_count * 12 + 20;
+	unsigned long bytes = 0;
+	const uint64_t start = sim.now;
+	/* known values to start with */
+	for(int i=0; i<node_count; i++) {
+		for(int c=0; c<12; c++)
+			values[i * 12 + c] = i * 12 + c;
+		if(!nodes[i].bootloader)
+			delta_send(node_address(&nodes[i]), LBUS_DELTA_COMMIT, LBUS_DELTA_RAW, 12, NULL, values + i * 12);
+	}
+	check_leds(values);
+	memcpy(next, values, sizeof(next));
+	for(int r=0; r<rounds; r++) {
+		for(int i=0; i<node_count; i++) {
+			const struct node *n = &nodes[i];
+			uint16_t *v = next + i * 12;
+			if(n->bootloader)
+				continue;
+			for(int c=0; c<12; c++) {
+				v[c] = values[i * 12 + c];
+				/* every other round, the changed LEDs get the same value */
+				if(c < 9 && (c + r) % 3 != 0)
+					v[c] = (r & 1) ? r * 13 : r * 13 + c;
+			}
+			const uint8_t encoding = (r % 4 < 3) ? r % 4 : lbus_delta_encoding(12, values + i * 12, v);
+			delta_send(node_address(n), 0, encoding, 12, values + i * 12, v);
+			bytes += sizeof(struct lbus_hdr) + sizeof(struct lbus_LED_SET_DELTA) + lbus_delta_encode(encoding, 12, values + i * 12, v, NULL);
+		}
+		lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+		memcpy(values, next, sizeof(values));
+		check_leds(values);
+	}
+	const double secs = (double)(sim.now - start) / SIM_CPU_SPEED;
+	printf("delta: %d rounds for %d nodes, %.0f bytes/s\n", rounds, node_count, bytes / secs);
+
+	for(int i=0; i<node_count; i++)
+		if(!nodes[i].bootloader) {
+			const struct lbus_SET_LED_GROUP req = { .group = front + i * 12 };
+			if(config_request(node_address(&nodes[i]), SET_LED_GROUP, &req, sizeof(req)) != 0)
+				fail("node %d: SET_LED_GROUP failed", nodes[i].id);
+		}
+	/* one run over all positions, split into runs of at most 127 */
+	for(unsigned int p=0; p<vcount; p++)
+		frame[p] = 0x1234;
+	delta_send(0xFF, LBUS_DELTA_FRAME | LBUS_DELTA_COMMIT, LBUS_DELTA_RLE, vcount, NULL, frame);
+	for(int l=0; l<node_count * 12; l++)
+		values[l] = 0x1234;
+	check_leds(values);
+	/* skips in front of the LED groups, changes within, none behind */
+	for(int e=0; e<3; e++) {
+		memcpy(previous, frame, sizeof(frame));
+		for(int l=0; l<node_count * 12; l++)
+			if(l % 12 != 11)
+				frame[front + l] = values[l] = e * 4099 + (l / 5) * 7;
+		delta_send(0xFF, LBUS_DELTA_FRAME | LBUS_DELTA_COMMIT, e, vcount, previous, frame);
+		check_leds(values);
+	}
+	/* only the encoding: no flags, so nothing must be committed */
+	for(int i=0; i<node_count; i++) {
+		uint8_t pkg[sizeof(struct lbus_LED_SET_16BIT) + 12 * sizeof(uint16_t)];
+		const struct lbus_LED_SET_16BIT d = { .led = 0 };
+		int len = lbus_encode_LED_SET_16BIT(pkg, &d);
+		if(nodes[i].bootloader)
+			continue;
+		for(int c=0; c<12; c++)
+			len += lbus_put_uint16_t(pkg + len, values[i * 12 + c] ^ 0x5555);
+		lbus_request(node_address(&nodes[i]), LED_SET_16BIT, pkg, len, NULL, 0);
+		const uint8_t encoding = LBUS_DELTA_RAW;
+		lbus_request(node_address(&nodes[i]), LED_SET_DELTA, &encoding, 1, NULL, 0);
+	}
+	check_leds(values);
+	lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+	for(int l=0; l<node_count * 12; l++)
+		values[l] ^= 0x5555;
+	check_leds(values);
+
+	for(int i=0; i<node_count; i++)
+		if(!nodes[i].bootloader) {
+			const struct lbus_SET_LED_GROUP req = { .group = i * 12 };
+			if(config_request(node_address(&nodes[i]), SET_LED_GROUP, &req, sizeof(req)) != 0)
+				fail("node %d: SET_LED_GROUP failed", nodes[i].id);
+		}
+}
+
+/* request with a sequence number, the reply includes its echo */
+static int lbus_seq_request(const uint8_t addr, const uint8_t cmd, const uint8_t seq, const void *data, const int len, void *reply, const int reply_len) {
+	uint8_t buf[1 + 2048];
+	if(len > (int)sizeof(buf) - 1)
+		abort();
+	buf[0] = seq;
+	memcpy(buf + 1, data, len);
+	return lbus_request(addr, cmd | LBUS_CMD_SEQ, buf, 1 + len, reply, reply_len);
+}
+
+/* requests with sequence numbers, each one sent twice as if the reply
+ * got lost: the second one must get the same reply, but must not be
+ * handled again. A truncated request must not count as handled.
+ */
+static void scenario_seq(void) {
+	uint16_t values[MAX_NODES * 12];
+	uint8_t pkg[sizeof(uint16_t) * 12];
+	uint8_t reply[2];
+	unsigned long bad = 0;
+	for(int r=0; r<rounds; r++) {
+		for(int i=0; i<node_count; i++) {
+			const uint8_t addr = node_address(&nodes[i]);
+			const uint8_t seq = r * 2;
+			/* the bootloader does not know sequence numbers */
+			if(nodes[i].bootloader)
+				continue;
+			/* PING: echo and reply, twice */
+			for(int t=0; t<2; t++)
+				if(lbus_seq_request(addr, PING, seq, NULL, 0, reply, 2) != 2
+					|| reply[0] != seq || reply[1] != 1)
+					bad++;
+			/* LED_SET_ALL: acknowledged by the echo; the repeated
+			 * request has other values that must not be set
+			 */
+			for(int t=0; t<2; t++) {
+				for(int v=0; v<12; v++) {
+					const uint16_t value = r * 251 + i * 12 + v + t;
+					if(t == 0)
+						values[i * 12 + v] = value;
+					lbus_put_uint16_t(pkg + v * sizeof(uint16_t), value);
+				}
+				if(lbus_seq_request(addr, LED_SET_ALL, seq + 1, pkg, sizeof(pkg), reply, 1) != 1
+					|| reply[0] != seq + 1)
+					bad++;
+			}
+		}
+		lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+		check_leds(values);
+	}
+	printf("seq: %d rounds of repeated requests, %lu bad replies\n", rounds, bad);
+	if(bad)
+		fail("%lu bad replies to requests with a sequence number", bad);
+
+	/* truncated, then complete with the same sequence number */
+	for(int i=0; i<node_count; i++) {
+		const uint8_t addr = node_address(&nodes[i]);
+		const uint8_t seq = 0xAA;
+		const struct lbus_hdr hdr = { .length = sizeof(hdr) + 2 + sizeof(pkg), .addr = addr, .cmd = LED_SET_ALL | LBUS_CMD_SEQ };
+		uint8_t buf[sizeof(hdr) + 1];
+		lbus_encode_hdr(buf, &hdr);
+		buf[sizeof(hdr)] = seq;
+		master_send(buf, sizeof(buf));
+		master_sleep(TIMEOUT_WAIT);
+		for(int v=0; v<12; v++) {
+			values[i * 12 + v] = 0x1000 + i * 12 + v;
+			lbus_put_uint16_t(pkg + v * sizeof(uint16_t), values[i * 12 + v]);
+		}
+		if(!nodes[i].bootloader
+			&& (lbus_seq_request(addr, LED_SET_ALL, seq, pkg, sizeof(pkg), reply, 1) != 1 || reply[0] != seq))
+			fail("node %d: no acknowledge after a truncated request", nodes[i].id);
+	}
+	lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+	check_leds(values);
+}
+
+/* write position of a node's DMA receive ring buffer, 0 without DMA */
+static unsigned int ring_pos(struct node *n) {
+	if(!n->dma_rx_on)
+		return 0;
+	return RX_RING_SIZE - REG(n, DMA_CH(RX_DMA_CHANNEL, 0x04));
+}
+
+/* a packet for an address no node has, so that the next byte received
+ * by node <n> goes to ring buffer position <pos>, plus <extra> bytes
+ */
+static int replay_filler(uint8_t *out, struct node *n, const unsigned int pos, const int extra) {
+	int len = (pos + RX_RING_SIZE - ring_pos(n)) % RX_RING_SIZE;
+	if(len < (int)sizeof(struct lbus_hdr))
+		len += RX_RING_SIZE;
+	len += extra;
+	const struct lbus_hdr hdr = { .length = len, .addr = 0x7E, .cmd = LED_SET_ALL };
+	lbus_encode_hdr(out, &hdr);
+	for(int i=sizeof(hdr); i<len; i++)
+		out[i] = sim_random();
+	return len;
+}
+
+/* send a filler of <filler> bytes, then a packet with a pause of a few
+ * characters after its first <split> bytes
+ */
+static void replay_send(const uint8_t *buf, const int filler, const int len, const int split) {
+	master_send(buf, filler);
+	master_put(buf + filler, split, true);
+	master_sleep(3 * (master.marks ? 11 : 10) * master_bit());
+	master_put(buf + filler + split, len - filler - split, false);
+}
+
+/* Received data in pieces, as rx_drain() gets it with DMA
+ *
+ * With LBUS_DMA_RX, the receive ring buffer is processed on a pause of
+ * the sender, when it is half full or wraps around, and on the packet
+ * timeout. Packets for another node put requests to a node at the end
+ * of its ring buffer: a PING with its header across the end and paused
+ * within, a LED_SET_ALL with its data across the end, and a packet cut
+ * off in the middle of its data by the packet timeout. Every other
+ * round, the skipped packet is longer than the ring buffer.
+ */
+static void scenario_replay(void) {
+	uint16_t values[MAX_NODES * 12];
+	uint8_t buf[3 * RX_RING_SIZE];
+	unsigned long bad = 0;
+	unsigned long timeouts[MAX_NODES];
+	for(int i=0; i<node_count; i++) {
+		struct lbus_stats stats;
+		timeouts[i] = (!nodes[i].bootloader && lbus_get_stats(node_address(&nodes[i]), &stats)) ? stats.timeouts : 0;
+	}
+	for(int r=0; r<rounds; r++) {
+		const int extra = (r % 2) ? RX_RING_SIZE : 0;
+		for(int i=0; i<node_count; i++) {
+			struct node *n = &nodes[i];
+			const uint8_t addr = node_address(n);
+			uint8_t reply;
+
+			/* PING, its header starting 0 to 3 bytes before the end */
+			const int split = r % sizeof(struct lbus_hdr);
+			int filler = replay_filler(buf, n, RX_RING_SIZE - split, extra);
+			const struct lbus_hdr ping = { .length = sizeof(struct lbus_hdr) + 1, .addr = addr, .cmd = PING };
+			int len = filler + lbus_encode_hdr(buf + filler, &ping);
+			replay_send(buf, filler, len, split);
+			if(master_recv(&reply, 1) != 1 || reply != 1)
+				bad++;
+			if(n->bootloader)
+				continue;
+
+			/* LED_SET_ALL, its data across the end */
+			filler = replay_filler(buf, n, RX_RING_SIZE - sizeof(struct lbus_hdr) - 11, extra);
+			const struct lbus_hdr set = { .length = sizeof(struct lbus_hdr) + 24, .addr = addr, .cmd = LED_SET_ALL };
+			len = filler + lbus_encode_hdr(buf + filler, &set);
+			for(int v=0; v<12; v++) {
+				values[i * 12 + v] = r * 241 + i * 12 + v;
+				len += lbus_put_uint16_t(buf + len, values[i * 12 + v]);
+			}
+			replay_send(buf, filler, len, len - filler - 7);
+
+			/* GET_DATA, cut off after the header and one byte */
+			filler = replay_filler(buf, n, RX_RING_SIZE - 2, extra);
+			master_send(buf, filler);
+			const struct lbus_hdr get = { .length = sizeof(struct lbus_hdr) + 1 + 16, .addr = addr, .cmd = GET_DATA };
+			len = lbus_encode_hdr(buf, &get);
+			buf[len++] = LBUS_DATA_STATUS;
+			master_send(buf, len);
+			master_sleep(TIMEOUT_WAIT);
+			if(!lbus_ping(addr))
+				bad++;
+		}
+		lbus_request(0xFF, LED_COMMIT, NULL, 0, NULL, 0);
+		check_leds(values);
+
+		/* a packet for another node, cut off in the middle */
+		const struct lbus_hdr other = { .length = 2 * RX_RING_SIZE, .addr = 0x7E, .cmd = LED_SET_ALL };
+		int len = lbus_encode_hdr(buf, &other);
+		for(; len<RX_RING_SIZE; len++)
+			buf[len] = sim_random();
+		master_send(buf, len);
+		master_sleep(TIMEOUT_WAIT);
+		for(int i=0; i<node_count; i++)
+			if(!lbus_ping(node_address(&nodes[i])))
+				bad++;
+	}
+	printf("replay: %d rounds of split packets, %lu bad replies\n", rounds, bad);
+	if(bad)
+		fail("%lu bad replies to packets received in pieces", bad);
+	for(int i=0; i<node_count; i++) {
+		struct lbus_stats stats;
+		if(!nodes[i].bootloader && lbus_get_stats(node_address(&nodes[i]), &stats)
+			&& stats.timeouts < timeouts[i] + rounds)
+			fail("node %d: %lu timeouts counted, should be at least %d", nodes[i].id,
+				(unsigned long)(stats.timeouts - timeouts[i]), rounds);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} scenarios[] = {
+	{ "ping", scenario_ping },
+	{ "frame", scenario_frame },
+	{ "timeout", scenario_timeout },
+	{ "compact", scenario_compact },
+	{ "data", scenario_data },
+	{ "scan", scenario_scan },
+	{ "seq", scenario_seq },
+	{ "config", scenario_config },
+	{ "lut", scenario_lut },
+	{ "delta", scenario_delta },
+	{ "groups", scenario_groups },
+	{ "time", scenario_time },
+	{ "replay", scenario_replay },
+};
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static const char *selected[SCENARIOS];
+static int selected_count;
+
+static void master_main(void) {
+	scenario_setup();
+	for(int s=0; s<selected_count; s++)
+		for(unsigned int i=0; i<SCENARIOS; i++)
+			if(!strcmp(selected[s], scenarios[i].name))
+				scenarios[i].run();
+	master.done = true;
+	master_yield();
+}
+
+/* put config items into a node's (erased) config flash */
+static uint32_t *config_preset(uint32_t *p, const uint32_t type, const uint32_t value) {
+	*p++ = type;
+	*p++ = sizeof(uint32_t);
+	*p++ = value;
+	return p;
+}
+
+static void node_create(struct node *n, const int id, const bool bootloader) {
+	n->id = id;
+	n->bootloader = bootloader;
+	size_t size = 0;
+	for(unsigned int r=0; r<REGIONS; r++) {
+		n->offset[r] = size;
+		size += regions[r].size;
+	}
+	n->memfd = memfd_create("lbus-sim-node", 0);
+	if(n->memfd == -1 || ftruncate(n->memfd, size) == -1)
+		die("memfd");
+	n->mmio = mmap(NULL, NODE_SPACE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(n->mmio == MAP_FAILED)
+		die("mmap");
+	for(unsigned int r=0; r<REGIONS; r++)
+		if(mmap(n->mmio + regions[r].base, regions[r].size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, n->memfd, n->offset[r]) == MAP_FAILED)
+			die("mmap");
+	n->stack = malloc(STACK_SIZE);
+	if(n->stack == NULL)
+		die("malloc");
+	n->env = (struct sim_env) {
+		.node = n,
+		.now = env_now,
+		.delay = env_delay,
+		.wait = env_wait,
+		.usart_send = env_usart_send,
+		.reset = env_reset,
+	};
+
+	memset(node_mem(n, SIM_FLASH_BASE), 0xFF, SIM_FLASH_SIZE);
+	uint32_t *config = node_mem(n, CONFIG_ADDRESS);
+	if(bootloader) {
+		/* as left by the firmware: bank 1 is the active one, bank 0
+		 * has an outdated address the bootloader must not use
+		 */
+		config = config_preset(config, CONFIG_BANK, 0xFFFE0001);
+		config_preset(config, CONFIG_LBUS_ADDRESS, 0x7D);
+		config = node_mem(n, CONFIG_ADDRESS + CONFIG_BANK_SIZE);
+		config = config_preset(config, CONFIG_BANK, 0xFFFD0002);
+	}
+	config = config_preset(config, CONFIG_LBUS_ADDRESS, node_address(n));
+	config = config_preset(config, CONFIG_LED_GROUP, id * 12);
+
+	n->reset = SIM_RESET;
+	node_service(n, 0);
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: lbus-sim [-n nodes] [-l bootloader nodes] [-b baudrate] [-m] [-i]\n"
+		"                [-r rounds] [-s seed] [-d image dir] [-v] [scenario...]\n"
+		"scenarios: ping frame timeout compact data scan seq config lut delta groups time replay (default: all)\n");
+	exit(2);
+}
+
+int main(int argc, char* argv[]) {
+	int protolight = 4, bootloader = 0;
+	master.baudrate = LBUS_BAUDRATE_SAFE;
+	sim.firmware = "protolight";
+	sim.rand = 1;
+
+	if(readlink("/proc/self/exe", sim.imagedir, sizeof(sim.imagedir) - 1) > 0) {
+		char *slash = strrchr(sim.imagedir, '/');
+		if(slash)
+			*slash = '\0';
+	}
+
+	int opt;
+	while((opt = getopt(argc, argv, "n:l:b:mir:s:d:v")) != -1) {
+		switch(opt) {
+			case 'n': protolight = atoi(optarg); break;
+			case 'l': bootloader = atoi(optarg); break;
+			case 'b': master.baudrate = strtoul(optarg, NULL, 0); break;
+			case 'm': master.marks = true; break;
+			case 'i': sim.firmware = "protolight-nodma"; break;
+			case 'r': rounds = atoi(optarg); break;
+			case 's': sim.rand = strtoul(optarg, NULL, 0); break;
+			case 'd': snprintf(sim.imagedir, sizeof(sim.imagedir), "%s", optarg); break;
+			case 'v': sim.verbose = true; break;
+			default: usage();
+		}
+	}
+	if(protolight < 0 || bootloader < 0 || protolight + bootloader < 1 || protolight + bootloader > MAX_NODES)
+		usage();
+	if(bootloader > 0 && (master.marks || master.baudrate != LBUS_BAUDRATE_SAFE)) {
+		fprintf(stderr, "bootloader nodes support neither -m nor -b\n");
+		exit(2);
+	}
+	for(; optind < argc && selected_count < (int)SCENARIOS; optind++)
+		selected[selected_count++] = argv[optind];
+	if(selected_count == 0)
+		for(unsigned int i=0; i<SCENARIOS; i++)
+			selected[selected_count++] = scenarios[i].name;
+
+	snprintf(sim.tmpdir, sizeof(sim.tmpdir), "/tmp/lbus-sim-XXXXXX");
+	if(mkdtemp(sim.tmpdir) == NULL)
+		die("mkdtemp");
+	reserve_flash();
+
+	node_count = protolight + bootloader;
+	for(int i=0; i<node_count; i++)
+		node_create(&nodes[i], i, i >= protolight);
+
+	master.stack = malloc(STACK_SIZE);
+	if(master.stack == NULL)
+		die("malloc");
+	getcontext(&master.ctx);
+	master.ctx.uc_stack.ss_sp = master.stack;
+	master.ctx.uc_stack.ss_size = STACK_SIZE;
+	makecontext(&master.ctx, master_main, 0);
+	/* start when all nodes have booted */
+	uint64_t booted = 0;
+	for(int i=0; i<node_count; i++)
+		if(nodes[i].now > booted)
+			booted = nodes[i].now;
+	event_push(booted, EV_MASTER, MASTER_ID, 0, master.gen);
+
+	printf("%d nodes (%d %s, %d bootloader), %u baud, %s framing\n",
+		node_count, protolight, sim.firmware, bootloader, master.baudrate, master.marks ? "address mark" : "plain");
+
+	while(!master.done && sim.events > 0) {
+		const struct event ev = event_pop();
+		sim.now = ev.time;
+		struct node *n = (ev.node >= 0) ? &nodes[ev.node] : NULL;
+		switch(ev.type) {
+			case EV_CHAR:
+				bus_char(&sim.tx[ev.arg]);
+				break;
+			case EV_TIMER:
+				if(ev.gen == n->tim[ev.arg].gen) {
+					timer_overflow(n, &n->tim[ev.arg], ev.time);
+					node_service(n, ev.time);
+				}
+				break;
+			case EV_SYSTICK:
+				if(ev.gen == n->stk.gen) {
+					if(n->now < ev.time)
+						n->now = ev.time;
+					node_map(n);
+					periph_sync(n);
+					n->stk.t0 = ev.time;
+					n->stk.first = systick_period(n);
+					systick_schedule(n);
+					node_isr(n, n->systick_isr);
+					node_service(n, ev.time);
+				}
+				break;
+			case EV_WAKE:
+				node_service(n, ev.time);
+				break;
+			case EV_MASTER:
+				if(ev.gen == master.gen)
+					swapcontext(&sim.ctx, &master.ctx);
+				break;
+		}
+	}
+	if(!master.done)
+		fail("simulation ran out of events");
+
+	unsigned long overruns = 0, rx_errors = 0, resets = 0, undriven = 0;
+	for(int i=0; i<node_count; i++) {
+		overruns += nodes[i].overruns;
+		rx_errors += nodes[i].rx_errors;
+		resets += nodes[i].resets;
+		undriven += nodes[i].undriven;
+	}
+	printf("bus: %lu chars in %.3f s, %lu collisions; master: %lu receive errors, %lu stray bytes\n",
+		sim.chars, (double)sim.now / SIM_CPU_SPEED, sim.collisions, master.rx_errors, master.rx_stale);
+	printf("nodes: %lu overruns, %lu receive errors, %lu resets, %lu chars sent with driver off\n",
+		overruns, rx_errors, resets, undriven);
+	if(sim.collisions)
+		fail("%lu bus collisions", sim.collisions);
+
+	rmdir(sim.tmpdir);
+	return failures ? 1 : 0;
+}
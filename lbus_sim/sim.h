@@ -0,0 +1,73 @@
+/* LBUS simulator: interface between simulator and node images
+ *
+ * Copyright (c) 2016 Hans-Werner Hilse <hwhilse@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _SIM_H_
+#define _SIM_H_
+#include <stdint.h>
+
+/* simulated time is counted in CPU cycles */
+#define SIM_CPU_SPEED 72000000ULL
+/* USART3 is clocked by APB1 */
+#define SIM_APB1_SPEED 36000000ULL
+
+/* memory regions mapped at their STM32F103 addresses for each node */
+#define SIM_FLASH_BASE	0x08000000UL
+#define SIM_FLASH_SIZE	0x00010000UL
+#define SIM_RAM_BASE	0x20000000UL
+#define SIM_RAM_SIZE	0x00005000UL
+#define SIM_PERIPH_BASE	0x40000000UL
+#define SIM_PERIPH_SIZE	0x00030000UL
+#define SIM_PPB_BASE	0xE0000000UL
+#define SIM_PPB_SIZE	0x0000F000UL
+
+/* flash timing (typical values from the datasheet) */
+#define SIM_FLASH_PROGRAM_CYCLES (52 * (SIM_CPU_SPEED / 1000000))
+#define SIM_FLASH_ERASE_CYCLES (20 * (SIM_CPU_SPEED / 1000))
+
+/* why a node's code gives control back to the simulator for good */
+enum sim_reset {
+	SIM_RUNNING = 0,
+	SIM_RESET,		/* system reset requested */
+	SIM_RUN_FIRMWARE	/* bootloader jumps to the firmware */
+};
+
+/* services of the simulator for the node images
+ *
+ * Each node image has its own copy of the sim_env pointer, set by the
+ * simulator after loading the image. The functions never return to the
+ * node code when they end its current run (reset, jump to firmware).
+ */
+struct sim_env {
+	void *node;
+	/* current time as seen by the node */
+	uint64_t (*now)(void *node);
+	/* busy wait for the given number of cycles */
+	void (*delay)(void *node, const uint64_t cycles);
+	/* sleep until the next interrupt (WFE/WFI) */
+	void (*wait)(void *node);
+	/* put a character into the USART's data register, waits for TXE */
+	void (*usart_send)(void *node, const uint16_t data);
+	/* end the node's current run */
+	void (*reset)(void *node, const enum sim_reset how) __attribute__((noreturn));
+};
+
+#endif // _SIM_H_
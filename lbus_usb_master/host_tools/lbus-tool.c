@@ -22,10 +22,12 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "lbuscomm.h"
 
@@ -45,6 +47,45 @@ static void usage(void) {
 	fprintf(stderr, "Usage: comm <dest_addr> <command> [parameters...]\n");
 }
 
+/* named data types for get_data, size is the maximum length of the data */
+static const struct {
+	const char *name;
+	uint16_t type;
+	int size;
+} data_items[] = {
+	{ "status", LBUS_DATA_STATUS, 1 },
+	{ "address", LBUS_DATA_ADDRESS, 1 },
+	{ "polarity", LBUS_DATA_POLARITY, 1 },
+	{ "groups", LBUS_DATA_GROUPS, 4 },
+	{ "led_group", LBUS_DATA_LED_GROUP, 2 },
+	{ "firmware_version", LBUS_DATA_FIRMWARE_VERSION, 4 },
+	{ "bootloader_version", LBUS_DATA_BOOTLOADER_VERSION, 4 },
+	{ "firmware_name", LBUS_DATA_FIRMWARE_NAME, LBUS_NAME_MAX },
+};
+#define DATA_ITEMS (sizeof(data_items) / sizeof(data_items[0]))
+
+static void print_data_item(const uint16_t type, const uint8_t *v, const int l) {
+	if(l < 0) {
+		printf("<no answer>\n");
+	} else if(type == LBUS_DATA_FIRMWARE_NAME) {
+		if(l == 0)
+			printf("<not assigned>\n");
+		else
+			printf("%.*s\n", l, v);
+	} else if(l == 0) {
+		printf("<unknown>\n");
+	} else if(type == LBUS_DATA_GROUPS && l == 4) {
+		for(int i=0; i<LBUS_MAX_GROUPS; i++)
+			printf("%d%c", v[i], i<LBUS_MAX_GROUPS-1 ? ' ' : '\n');
+	} else if(l == 4) {
+		printf("%x\n", lbus_get_uint32_t(v));
+	} else if(l == 2) {
+		printf("%d\n", lbus_get_uint16_t(v));
+	} else {
+		printf("%d\n", v[0]);
+	}
+}
+
 int main(int argc, char* argv[]) {
 	int ret = 0;
 	uint8_t buf[4096];
@@ -55,6 +96,14 @@ int main(int argc, char* argv[]) {
 	if(argc == 2) {
 		if(!strcasecmp("echo", argv[1])) {
 			test_error(lbus_busmaster_echo(C));
+		} else if(!strcasecmp("scan", argv[1])) {
+			struct lbus_scan nodes[127];
+			int found = test_error(lbus_scan(C, 1, 127, 0, nodes));
+			for(int i=0; i<found; i++)
+				printf("%d: %s, version %08x, name hash %08x\n", nodes[i].addr,
+					nodes[i].status == LBUS_STATE_IN_BOOTLOADER ? "bootloader" : "firmware",
+					nodes[i].version, nodes[i].name_hash);
+			fprintf(stderr, "%d nodes found\n", found);
 		} else {
 			fprintf(stderr, "bad short command.\n");
 			goto error;
@@ -76,39 +125,11 @@ int main(int argc, char* argv[]) {
 		} else if(!strcasecmp("erase_config", cmd)) {
 			test_error(lbus_erase_config(C, dst));
 		} else if(!strcasecmp("get_data", cmd)) {
-			if(optind == argc-1) {
-				if(!strcasecmp("status", argv[optind])) {
-					int reply = test_error(lbus_get_config(C, dst, LBUS_DATA_STATUS, true, 1, NULL));
-					printf("%d\n", reply);
-				} else if(!strcasecmp("address", argv[optind])) {
-					int reply = test_error(lbus_get_config(C, dst, LBUS_DATA_ADDRESS, true, 1, NULL));
-					printf("%d\n", reply);
-				} else if(!strcasecmp("polarity", argv[optind])) {
-					int reply = test_error(lbus_get_config(C, dst, LBUS_DATA_POLARITY, true, 1, NULL));
-					printf("%d\n", reply);
-				} else if(!strcasecmp("firmware_version", argv[optind])) {
-					uint32_t version = 0;
-					test_error(lbus_get_config(C, dst, LBUS_DATA_FIRMWARE_VERSION, true, 4, &version));
-					printf("%x\n", version);
-				} else if(!strcasecmp("bootloader_version", argv[optind])) {
-					uint32_t version = 0;
-					test_error(lbus_get_config(C, dst, LBUS_DATA_BOOTLOADER_VERSION, true, 4, &version));
-					printf("%x\n", version);
-				} else if(!strcasecmp("firmware_name", argv[optind])) {
-					int reply = test_error(lbus_get_config(C, dst, LBUS_DATA_FIRMWARE_NAME_LENGTH, true, 1, NULL));
-					if(reply <= 0) {
-						printf("<not assigned>\n");
-					} else {
-						uint8_t nbuf[256];
-						int l = test_error(lbus_get_config(C, dst, LBUS_DATA_FIRMWARE_NAME, false, reply, nbuf));
-						nbuf[l] = '\0';
-						printf("%s\n", nbuf);
-					}
-				} else {
-					fprintf(stderr, "unknown data type name.\n");
+			if(optind < argc && isdigit((unsigned char)argv[optind][0])) {
+				if(optind != argc-2) {
+					fprintf(stderr, "usage: ... %s <type_id> <reply_size>\n", cmd);
 					goto error;
 				}
-			} else if(optind == argc) {
 				int item = strtol(argv[optind++], NULL, 0);
 				if(item < 1 || item > 0xFFFF) {
 					fprintf(stderr, "bad type_id.\n");
@@ -119,11 +140,41 @@ int main(int argc, char* argv[]) {
 					fprintf(stderr, "bad reply_size.\n");
 					goto error;
 				}
-				int l = test_error(lbus_get_config(C, dst, LBUS_DATA_FIRMWARE_NAME, false, reply_size, buf));
+				int l = test_error(lbus_get_config(C, dst, item, false, reply_size, buf));
 				fprintf(stderr, "got answer:\n");
 				write(1, buf, l);
+			} else if(optind < argc) {
+				/* all named items in a single GET_DATA_MULTI request */
+				uint16_t types[LBUS_DATA_MULTI_MAX];
+				int which[LBUS_DATA_MULTI_MAX];
+				int count = 0;
+				int reply_size = 0;
+				for(; optind < argc; optind++) {
+					int i = 0;
+					while(i < DATA_ITEMS && strcasecmp(data_items[i].name, argv[optind]))
+						i++;
+					if(i == DATA_ITEMS) {
+						fprintf(stderr, "unknown data type name.\n");
+						goto error;
+					}
+					if(count == LBUS_DATA_MULTI_MAX) {
+						fprintf(stderr, "too many data types.\n");
+						goto error;
+					}
+					which[count] = i;
+					types[count++] = data_items[i].type;
+					reply_size += sizeof(struct lbus_data_item) + data_items[i].size;
+				}
+				int size = test_error(lbus_get_config_multi(C, dst, count, types, reply_size, buf));
+				for(int n=0; n<count; n++) {
+					const uint8_t *v = NULL;
+					int l = lbus_data_item_find(buf, size, types[n], &v);
+					if(count > 1)
+						printf("%s: ", data_items[which[n]].name);
+					print_data_item(types[n], v, l);
+				}
 			} else {
-				fprintf(stderr, "usage: ... %s <type_id> <reply_size>\nor     ... %s <type_name>\n", cmd, cmd);
+				fprintf(stderr, "usage: ... %s <type_id> <reply_size>\nor     ... %s <type_name>...\n", cmd, cmd);
 				goto error;
 			}
 		} else if(!strcasecmp("set_address", cmd)) {
@@ -142,6 +193,111 @@ int main(int argc, char* argv[]) {
 			int polarity = strtol(argv[optind++], NULL, 0);
 			test_error(lbus_set_polarity(C, dst, polarity));
 			fprintf(stderr, "success\n");
+		} else if(!strcasecmp("stats", cmd)) {
+			struct lbus_stats stats;
+			bool reset = (optind < argc && !strcasecmp("reset", argv[optind++]));
+			test_error(lbus_get_stats(C, dst, reset, &stats));
+			printf("bytes: %u\n", stats.bytes);
+			printf("packets: %u\n", stats.packets);
+			printf("packets_for_us: %u\n", stats.packets_for_us);
+			printf("packets_unhandled: %u\n", stats.packets_unhandled);
+			printf("timeouts: %u\n", stats.timeouts);
+			printf("overrun_errors: %u\n", stats.overrun_errors);
+			printf("framing_errors: %u\n", stats.framing_errors);
+			printf("noise_errors: %u\n", stats.noise_errors);
+		} else if(!strcasecmp("capabilities", cmd)) {
+			static const char *flags[] = {
+				"address_marks", "baudrate_switch", "groups", "time_sync",
+				"stats", "compact", "scan", "profile"
+			};
+			struct lbus_capabilities caps;
+			if(!test_error(lbus_get_capabilities(C, dst, &caps))) {
+				printf("<unknown>\n");
+			} else {
+				printf("flags:");
+				for(int i=0; i<sizeof(flags)/sizeof(flags[0]); i++)
+					if(caps.flags & (1 << i))
+						printf(" %s", flags[i]);
+				if(caps.flags & LBUS_CAP_LED_LUT)
+					printf(" led_lut");
+				printf("\ncommands:");
+				for(int i=0; i<LBUS_CAP_COMMAND_BYTES*8; i++)
+					if(lbus_cap_has_command(caps.commands, i))
+						printf(" %d", i);
+				printf("\nmax_length: %d\n", caps.max_length);
+				printf("baudrate_max: %u\n", caps.baudrate_max);
+				printf("channels: %d\n", caps.channels);
+			}
+		} else if(!strcasecmp("profile", cmd)) {
+			static const char *probes[LBUS_PROFILE_PROBES] = {
+				"usart_isr", "tim1_isr", "rx_dma_isr", "handler", "recv_func", "pendsv"
+			};
+			bool reset = (optind < argc && !strcasecmp("reset", argv[optind++]));
+			for(int i=0; i<LBUS_PROFILE_PROBES; i++) {
+				struct lbus_profile prof;
+				test_error(lbus_get_profile(C, dst, i, reset, &prof));
+				printf("%s: count %u, min %u, avg %llu, max %u cycles\n  histogram:",
+					probes[i], prof.count, prof.count ? prof.min : 0,
+					prof.count ? (unsigned long long)(prof.total / prof.count) : 0ULL,
+					prof.max);
+				for(int b=0; b<LBUS_PROFILE_BUCKETS; b++)
+					printf(" %u", prof.histogram[b]);
+				printf("\n");
+			}
+		} else if(!strcasecmp("set_groups", cmd)) {
+			uint8_t groups[LBUS_MAX_GROUPS];
+			int count = 0;
+			while(optind < argc && count < LBUS_MAX_GROUPS)
+				groups[count++] = strtol(argv[optind++], NULL, 0);
+			test_error(lbus_set_groups(C, dst, count, groups));
+			fprintf(stderr, "success\n");
+		} else if(!strcasecmp("set_led_group", cmd)) {
+			if(optind >= argc) {
+				fprintf(stderr, "usage: ... %s <group>\n", cmd);
+				goto error;
+			}
+			int group = strtol(argv[optind++], NULL, 0);
+			test_error(lbus_set_led_group(C, dst, group));
+			fprintf(stderr, "success\n");
+		} else if(!strcasecmp("set_framing", cmd)) {
+			/* this is always broadcast, dst is ignored */
+			if(optind >= argc) {
+				fprintf(stderr, "usage: ... %s <plain|mark>\n", cmd);
+				goto error;
+			}
+			const char *framing = argv[optind++];
+			if(!strcasecmp("plain", framing)) {
+				test_error(lbus_set_framing(C, LBUS_FRAMING_PLAIN));
+			} else if(!strcasecmp("mark", framing)) {
+				test_error(lbus_set_framing(C, LBUS_FRAMING_ADDRESS_MARK));
+			} else {
+				fprintf(stderr, "unknown framing: %s\n", framing);
+				goto error;
+			}
+			fprintf(stderr, "success\n");
+		} else if(!strcasecmp("set_baudrate", cmd)) {
+			/* this is always broadcast, dst is ignored */
+			if(optind >= argc) {
+				fprintf(stderr, "usage: ... %s <baudrate> [persist]\n", cmd);
+				goto error;
+			}
+			uint32_t baudrate = strtoul(argv[optind++], NULL, 0);
+			bool persist = (optind < argc && !strcasecmp("persist", argv[optind++]));
+			test_error(lbus_set_baudrate(C, baudrate, persist));
+			fprintf(stderr, "success\n");
+		} else if(!strcasecmp("set_timeout", cmd)) {
+			/* this is always broadcast, dst is ignored */
+			if(optind >= argc) {
+				fprintf(stderr, "usage: ... %s <character times>\n", cmd);
+				goto error;
+			}
+			int chars = strtol(argv[optind++], NULL, 0);
+			if(chars < 0 || chars > 0xFFFF) {
+				fprintf(stderr, "bad timeout.\n");
+				goto error;
+			}
+			test_error(lbus_set_timeout(C, chars));
+			fprintf(stderr, "success\n");
 		} else if(!strcasecmp("read_memory", cmd)) {
 			if(optind + 1 >= argc) {
 				fprintf(stderr, "usage: ... %s <address> <length>\n", cmd);
@@ -151,6 +307,41 @@ int main(int argc, char* argv[]) {
 			int length = (strtol(argv[optind++], NULL, 0)+3)&(~(3));
 			test_error(lbus_read_memory(C, dst, address, length, buf));
 			write(1, buf, length);
+		} else if(!strcasecmp("config_read", cmd)) {
+			if(optind >= argc) {
+				fprintf(stderr, "usage: ... %s <type>\n", cmd);
+				goto error;
+			}
+			uint32_t type = strtoul(argv[optind++], NULL, 0);
+			int l = test_error(lbus_config_read(C, dst, type, sizeof(buf), buf));
+			write(1, buf, l > sizeof(buf) ? sizeof(buf) : l);
+		} else if(!strcasecmp("config_write", cmd)) {
+			/* e.g. a LUT for LED_SET_8BIT: type 0x11000 + channel,
+			 * 256 uint16_t values (little endian) */
+			if(optind + 1 >= argc) {
+				fprintf(stderr, "usage: ... %s <type> <file|->\n", cmd);
+				goto error;
+			}
+			uint32_t type = strtoul(argv[optind++], NULL, 0);
+			const char *path = argv[optind++];
+			FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+			if(f == NULL) {
+				fprintf(stderr, "cannot open %s.\n", path);
+				goto error;
+			}
+			int l = fread(buf, 1, LBUS_CONFIG_MAX + 1, f);
+			if(f != stdin)
+				fclose(f);
+			if(l > LBUS_CONFIG_MAX) {
+				fprintf(stderr, "item is too large, up to %d bytes.\n", LBUS_CONFIG_MAX);
+				goto error;
+			}
+			int result = test_error(lbus_config_write(C, dst, type, l, buf));
+			if(result != 0) {
+				fprintf(stderr, "failure %d\n", result);
+				goto error;
+			}
+			fprintf(stderr, "success\n");
 		} else if(!strcasecmp("led_set_16bit", cmd)) {
 			if(optind + 1 >= argc) {
 				fprintf(stderr, "usage: ... %s <led> <value> [<value> ...]\n", cmd);
@@ -163,8 +354,35 @@ int main(int argc, char* argv[]) {
 			for(int i=0; i<c; i++)
 				values[i] = strtoul(argv[optind++], NULL, 0);
 			test_error(lbus_led_set_16bit(C, dst, led, c, values));
+		} else if(!strcasecmp("led_set_8bit", cmd)) {
+			if(optind + 1 >= argc) {
+				fprintf(stderr, "usage: ... %s <led> <value> [<value> ...]\n", cmd);
+				goto error;
+			}
+			int c = argc - (optind + 1);
+			int led = strtoul(argv[optind++], NULL, 0);
+			uint8_t values[1024];
+			if(c>1024) c=1024;
+			for(int i=0; i<c; i++)
+				values[i] = strtoul(argv[optind++], NULL, 0);
+			test_error(lbus_led_set_8bit(C, dst, led, c, values));
 		} else if(!strcasecmp("led_commit", cmd)) {
 			test_error(lbus_led_commit(C, dst));
+		} else if(!strcasecmp("led_commit_at", cmd)) {
+			if(optind >= argc) {
+				fprintf(stderr, "usage: ... %s <bus time>\n", cmd);
+				goto error;
+			}
+			uint32_t time = strtoul(argv[optind++], NULL, 0);
+			test_error(lbus_led_commit_at(C, dst, time));
+		} else if(!strcasecmp("time_sync", cmd)) {
+			/* this is always broadcast, dst is ignored */
+			if(optind >= argc) {
+				fprintf(stderr, "usage: ... %s <bus time>\n", cmd);
+				goto error;
+			}
+			uint32_t time = strtoul(argv[optind++], NULL, 0);
+			test_error(lbus_time_sync(C, time));
 		} else if(!strcasecmp("flash_firmware", cmd)) {
 			if(optind >= argc) {
 				fprintf(stderr, "usage: ... %s <firmware.bin>\n", cmd);
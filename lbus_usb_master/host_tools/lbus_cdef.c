@@ -0,0 +1,56 @@
+/* LBUS packet schema for the LuaJIT FFI
+ *
+ * Prints a Lua module with ffi.cdef declarations of the commands and
+ * packet structs in lbus_data.h, so Lua code does not have to keep its
+ * own copies of them. Run by the Makefile to create luajit/lbus_data.lua.
+ *
+ * Copyright (c) 2016 Hans-Werner Hilse <hwhilse@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#include "lbus_data.h"
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+#define CDEF_CMD(name, value) "\t" #name " = " #value ",\n"
+#define CDEF_F(type, field) "\t" #type " " #field ";\n"
+#define CDEF_A(type, field, count) "\t" #type " " #field "[" XSTR(count) "];\n"
+#define CDEF_V(type, field) "\t" #type " " #field "[];\n"
+#define CDEF_STRUCT(name, size) \
+	"struct lbus_" #name " {\n" \
+	LBUS_FIELDS_##name(CDEF_F, CDEF_A, CDEF_V) \
+	"} __attribute__((packed));\n"
+
+static const char cdef[] =
+	"enum lbus_cmd {\n"
+	LBUS_COMMANDS(CDEF_CMD)
+	"};\n"
+	LBUS_STRUCTS(CDEF_STRUCT)
+	LBUS_REQUESTS(CDEF_STRUCT);
+
+int main(void) {
+	printf("-- generated from lbus_data.h by lbus_cdef.c, do not edit\n"
+		"local ffi = require\"ffi\"\n"
+		"ffi.cdef[[\n%s]]\n", cdef);
+	return 0;
+}
@@ -42,10 +42,40 @@
 
 #define LIBUSB_TIMEOUT 1000
 #define LIBUSB_TXTIMEOUT 20
+/* the busmaster waits up to 100 msec for data per receive command */
+#define RECV_POLL_MS 100
+/* receive attempts for the status of a request that writes config */
+#define CONFIG_POLLS (LBUS_CONFIG_WRITE_MAX_MS / RECV_POLL_MS + 1)
+
+/* USB busmaster commands, see usbmaster.c */
+#define MASTER_CMD_XMIT 1
+#define MASTER_CMD_RECV 2
+#define MASTER_CMD_ECHO 3
+#define MASTER_CMD_XMIT_MARK 4
+#define MASTER_CMD_FRAMING 5
+#define MASTER_CMD_BAUDRATE 6
+
+/* states of the capabilities cache entries */
+#define CAPS_UNKNOWN 0
+#define CAPS_NONE 1
+#define CAPS_KNOWN 2
 
 struct lbus_ctx_s {
 	libusb_context *ctx;
 	libusb_device_handle *dev;
+	uint8_t framing;
+	uint32_t baudrate;
+	/* a node did not answer, it might be back at the safe baud rate */
+	bool baudrate_lost;
+	/* per node address, see lbus_get_capabilities() */
+	struct {
+		uint8_t state;
+		struct lbus_capabilities caps;
+	} caps[128];
+	/* last sequence number used, see lbus_acked() */
+	uint8_t seq;
+	/* retransmissions of requests with a sequence number */
+	int retries;
 };
 
 static void DumpHex(const char* info, const void* data, size_t size) {
@@ -144,20 +174,21 @@ static int readall(int fd, void *buf, size_t count) {
 	return c;
 }
 
-LBUS_API
-int lbus_tx(lbus_ctx* C, const void* buf, const int size) {
+/* send data via USB busmaster, first USB packet with command <cmd> */
+static int lbus_xmit(lbus_ctx* C, uint8_t cmd, const void* buf, const int size) {
 	int done = 0;
 	int transferred = 0;
 	uint8_t tbuf[64];
 	while(done < size) {
 		const int chunk_size = (size-done) > 63 ? 63 : (size-done);
-		tbuf[0] = 1; // XMIT
+		tbuf[0] = cmd;
 		memcpy(tbuf+1, buf+done, chunk_size);
 		int res = libusb_bulk_transfer(C->dev, 0x01, tbuf, chunk_size+1, &transferred, LIBUSB_TXTIMEOUT);
 		if(res == 0 || res == LIBUSB_ERROR_TIMEOUT) {
 			if(transferred > 0) {
 				DumpHex("USB TX:\n", tbuf, transferred);
 				done += transferred-1;
+				cmd = MASTER_CMD_XMIT;
 			}
 		} else {
 			return LBUS_BUS_ERROR;
@@ -166,13 +197,37 @@ int lbus_tx(lbus_ctx* C, const void* buf, const int size) {
 	return done;
 }
 
+LBUS_API
+int lbus_tx(lbus_ctx* C, const void* buf, const int size) {
+	if(C->framing != LBUS_FRAMING_ADDRESS_MARK)
+		return lbus_xmit(C, MASTER_CMD_XMIT, buf, size);
+
+	/* have an address mark sent at the start of each packet in buf */
+	int done = 0;
+	while(done < size) {
+		const uint8_t *p = buf+done;
+		int len = size-done;
+		if(len >= 2) {
+			const int pkg_len = p[0] | (p[1] << 8);
+			if(pkg_len >= (int)sizeof(struct lbus_hdr) && pkg_len < len)
+				len = pkg_len;
+		}
+		int res = lbus_xmit(C, MASTER_CMD_XMIT_MARK, p, len);
+		if(res < 0) return res;
+		done += res;
+	}
+	return done;
+}
+
 LBUS_API
 int lbus_rx(lbus_ctx* C, void* buf, const int size) {
 	int done = 0;
 	int transferred = 0;
-	uint8_t tbuf[2] = { 2 /* RECV */, 0 };
+	uint8_t tbuf[2] = { MASTER_CMD_RECV, 0 };
 	while(done < size) {
-		tbuf[1] = size > 64 ? 64 : size;
+		/* never more than is left, the busmaster would wait for it */
+		const int left = size - done;
+		tbuf[1] = left > 64 ? 64 : left;
 		int res = libusb_bulk_transfer(C->dev, 0x01, tbuf, 2, &transferred, LIBUSB_TXTIMEOUT);
 		if(res != 0) {
 			return LBUS_BUS_ERROR;
@@ -194,7 +249,7 @@ int lbus_rx(lbus_ctx* C, void* buf, const int size) {
 
 LBUS_API
 int lbus_busmaster_echo(lbus_ctx* C) {
-	uint8_t tbuf[64] = { 3 /* ECHO */, 1,2,3,4,5,6,7,8,9,10 };
+	uint8_t tbuf[64] = { MASTER_CMD_ECHO, 1,2,3,4,5,6,7,8,9,10 };
 	uint8_t rbuf[63];
 	int transferred = 0;
 	for(int i=0; i<16384; i++) {
@@ -238,14 +293,64 @@ static int lbus_simple_recv(lbus_ctx* C, const int answer_bytes, uint32_t* d32)
 	return 0;
 }
 
+/* send a request that gets a status byte (answer_bytes 1) or no reply (0)
+ *
+ * For nodes that support it, a sequence number is added (see LBUS_CMD_SEQ)
+ * and the request is sent again when there is no reply after <polls>
+ * receive attempts: the node repeats its reply in case it has handled the
+ * request already, so e.g. a firmware page is not flashed twice.
+ * Returns the status byte or 0.
+ */
+static int lbus_acked(lbus_ctx* C, const int dst, const void* pkg, const int len, const int answer_bytes, const int polls) {
+	struct lbus_capabilities caps;
+	int ret;
+	if(dst < 1 || dst > 127 || lbus_get_capabilities(C, dst, &caps) != 1 || !(caps.flags & LBUS_CAP_SEQ)) {
+		ret = lbus_tx(C, pkg, len);
+		if(ret < 0 || answer_bytes == 0) return ret < 0 ? ret : 0;
+		for(int i=0; i<polls; i++) {
+			uint8_t reply;
+			ret = lbus_rx(C, &reply, 1);
+			if(ret < 0) return ret;
+			if(ret == 1) return reply;
+		}
+		return LBUS_NO_ANSWER;
+	}
+
+	struct lbus_hdr hdr;
+	uint8_t buf[sizeof(struct lbus_pkg) + 1];
+	const int hlen = lbus_decode_hdr(&hdr, pkg);
+	const uint8_t seq = ++C->seq;
+	hdr.length += 2;
+	hdr.cmd |= LBUS_CMD_SEQ;
+	lbus_encode_hdr(buf, &hdr);
+	buf[hlen] = seq;
+	memcpy(buf + hlen + 1, (const uint8_t*)pkg + hlen, len - hlen);
+	for(int t=0; t<=C->retries; t++) {
+		ret = lbus_tx(C, buf, len + 1);
+		if(ret < 0) return ret;
+		for(int i=0; i<polls; i++) {
+			uint8_t reply[2];
+			ret = lbus_rx(C, reply, 1 + answer_bytes);
+			if(ret < 0) return ret;
+			if(ret == 0) continue;
+			if(ret == 1 + answer_bytes && reply[0] == seq)
+				return answer_bytes ? reply[1] : 0;
+			/* broken or stale reply */
+			break;
+		}
+	}
+	return LBUS_NO_ANSWER;
+}
+
 /* convenience wrapper for no-payload commands and single-value receives */
 static int lbus_simple_cmd(lbus_ctx* C, const int dst, const uint8_t command, const int answer_bytes, uint32_t* d32) {
-	struct lbus_hdr pkg = {
-		.length = tole16(sizeof(struct lbus_hdr)+answer_bytes),
+	const struct lbus_hdr hdr = {
+		.length = sizeof(struct lbus_hdr)+answer_bytes,
 		.addr = dst,
 		.cmd = command,
 	};
-	int ret = lbus_tx(C, &pkg, sizeof(pkg));
+	uint8_t pkg[sizeof(hdr)];
+	int ret = lbus_tx(C, pkg, lbus_encode_hdr(pkg, &hdr));
 	if(ret < 0) return ret;
 
 	return lbus_simple_recv(C, answer_bytes, d32);
@@ -253,37 +358,36 @@ static int lbus_simple_cmd(lbus_ctx* C, const int dst, const uint8_t command, co
 
 LBUS_API
 int lbus_ping(lbus_ctx* C, const int dst) {
-	return lbus_simple_cmd(C, dst, PING, 1, NULL);
+	const int ret = lbus_simple_cmd(C, dst, PING, 1, NULL);
+	if(ret == LBUS_NO_ANSWER && dst >= 1 && dst <= 127 && C->baudrate != LBUS_BAUDRATE_SAFE)
+		C->baudrate_lost = true;
+	return ret;
 }
 
 LBUS_API
 int lbus_reset_to_bootloader(lbus_ctx* C, const int dst) {
+	lbus_forget_capabilities(C, dst);
 	return lbus_simple_cmd(C, dst, RESET_TO_BOOTLOADER, 0, NULL);
 }
 
 LBUS_API
 int lbus_reset_to_firmware(lbus_ctx* C, const int dst) {
+	lbus_forget_capabilities(C, dst);
 	return lbus_simple_cmd(C, dst, RESET_TO_FIRMWARE, 0, NULL);
 }
 
 LBUS_API
 int lbus_erase_config(lbus_ctx* C, const int dst) {
+	/* the node falls back to its default address */
+	lbus_forget_capabilities(C, -1);
 	return lbus_simple_cmd(C, dst, ERASE_CONFIG, 0, NULL);
 }
 
 LBUS_API
 int lbus_get_config(lbus_ctx* C, const int dst, const uint16_t type, const bool numeric, const int answer_bytes, void* data) {
-	struct lbus_pkg pkg = {
-		.hdr = {
-			.length = tole16(sizeof(struct lbus_hdr)+sizeof(struct lbus_GET_DATA)+answer_bytes),
-			.addr = dst,
-			.cmd = GET_DATA,
-		},
-		.GET_DATA = {
-			.type = tole16(type)
-		}
-	};
-	int ret = lbus_tx(C, &pkg, sizeof(struct lbus_hdr)+sizeof(struct lbus_GET_DATA));
+	const struct lbus_GET_DATA d = { .type = type };
+	struct lbus_pkg pkg;
+	int ret = lbus_tx(C, &pkg, lbus_request_GET_DATA(&pkg, dst, answer_bytes, &d));
 	if(ret < 0) return ret;
 
 	if(numeric) {
@@ -294,42 +398,296 @@ int lbus_get_config(lbus_ctx* C, const int dst, const uint16_t type, const bool
 }
 
 LBUS_API
-int lbus_set_address(lbus_ctx* C, const int dst, const uint8_t address) {
-	if(address < 1 || address > 127) {
+int lbus_get_config_multi(lbus_ctx* C, const int dst, const unsigned int count, const uint16_t types[], const int answer_bytes, void* data) {
+	if(count > LBUS_DATA_MULTI_MAX || answer_bytes < 0) {
 		return LBUS_MISUSE_ERROR;
 	}
-	struct lbus_pkg pkg = {
-		.hdr = {
-			.length = tole16(sizeof(struct lbus_hdr)+sizeof(struct lbus_SET_ADDRESS)+1),
-			.addr = dst,
-			.cmd = SET_ADDRESS,
-		},
-		.SET_ADDRESS = {
-			.naddr = address
+	uint8_t pkg[sizeof(struct lbus_hdr) + sizeof(struct lbus_GET_DATA_MULTI) + LBUS_DATA_MULTI_MAX * sizeof(uint16_t)];
+	const struct lbus_GET_DATA_MULTI d = { .count = count };
+	int len = lbus_request_GET_DATA_MULTI(pkg, dst, count * sizeof(uint16_t) + answer_bytes, &d);
+	for(int i=0; i<count; i++)
+		len += lbus_put_uint16_t(pkg+len, types[i]);
+	int ret = lbus_tx(C, pkg, len);
+	if(ret < 0) return ret;
+
+	ret = lbus_rx(C, data, answer_bytes);
+	if(ret < 0) return ret;
+	if(ret == 0 && answer_bytes > 0) return LBUS_NO_ANSWER;
+	return ret;
+}
+
+LBUS_API
+int lbus_data_item_find(const void* data, const int size, const uint16_t type, const uint8_t** item_data) {
+	const uint8_t *p = data;
+	const uint8_t *end = p + size;
+	while(p + sizeof(struct lbus_data_item) <= end) {
+		struct lbus_data_item item;
+		p += lbus_decode_data_item(&item, p);
+		/* the rest is padding */
+		if(item.type == 0 || p + item.length > end)
+			break;
+		if(item.type == type) {
+			*item_data = p;
+			return item.length;
 		}
+		p += item.length;
+	}
+	return LBUS_BROKEN_ANSWER;
+}
+
+LBUS_API
+int lbus_get_capabilities(lbus_ctx* C, const int dst, struct lbus_capabilities *caps) {
+	if(dst < 1 || dst > 127) {
+		return LBUS_MISUSE_ERROR;
+	}
+	if(C->caps[dst].state == CAPS_UNKNOWN) {
+		uint8_t buf[sizeof(*caps)];
+		int ret = lbus_get_config(C, dst, LBUS_DATA_CAPABILITIES, false, sizeof(buf), buf);
+		if(ret < 0) return ret;
+		if(ret == 0) return LBUS_NO_ANSWER;
+		if(ret != sizeof(buf)) return LBUS_BROKEN_ANSWER;
+		lbus_decode_capabilities(&C->caps[dst].caps, buf);
+		/* older nodes send zeros for unknown types, all nodes support
+		 * at least LBUS_BAUDRATE_SAFE */
+		C->caps[dst].state = C->caps[dst].caps.baudrate_max ? CAPS_KNOWN : CAPS_NONE;
+	}
+	*caps = C->caps[dst].caps;
+	return C->caps[dst].state == CAPS_KNOWN;
+}
+
+LBUS_API
+void lbus_forget_capabilities(lbus_ctx* C, const int dst) {
+	if(dst >= 1 && dst <= 127) {
+		C->caps[dst].state = CAPS_UNKNOWN;
+	} else {
+		/* broadcast, group or -1 */
+		for(int i=0; i<128; i++)
+			C->caps[i].state = CAPS_UNKNOWN;
+	}
+}
+
+LBUS_API
+int lbus_supports(lbus_ctx* C, const int dst, const uint8_t cmd) {
+	struct lbus_capabilities caps;
+	int ret = lbus_get_capabilities(C, dst, &caps);
+	if(ret < 0) return ret;
+	return lbus_cap_has_command(caps.commands, cmd) ? 1 : 0;
+}
+
+LBUS_API
+int lbus_get_stats(lbus_ctx* C, const int dst, const bool reset, struct lbus_stats *stats) {
+	uint8_t buf[sizeof(*stats)];
+	int ret = lbus_get_config(C, dst, reset ? LBUS_DATA_STATS_RESET : LBUS_DATA_STATS, false, sizeof(buf), buf);
+	if(ret < 0) return ret;
+	if(ret == 0) return LBUS_NO_ANSWER;
+	if(ret != sizeof(buf)) return LBUS_BROKEN_ANSWER;
+	lbus_decode_stats(stats, buf);
+	return ret;
+}
+
+LBUS_API
+int lbus_get_profile(lbus_ctx* C, const int dst, const uint8_t probe, const bool reset, struct lbus_profile *profile) {
+	const struct lbus_GET_PROFILE d = {
+		.probe = probe,
+		.flags = reset ? LBUS_PROFILE_RESET : 0
 	};
-	int ret = lbus_tx(C, &pkg, sizeof(pkg));
+	struct lbus_pkg pkg;
+	int ret = lbus_tx(C, &pkg, lbus_request_GET_PROFILE(&pkg, dst, sizeof(*profile), &d));
+	if(ret < 0) return ret;
+
+	uint8_t buf[sizeof(*profile)];
+	ret = lbus_rx(C, buf, sizeof(buf));
 	if(ret < 0) return ret;
+	if(ret == 0) return LBUS_NO_ANSWER;
+	if(ret != sizeof(buf)) return LBUS_BROKEN_ANSWER;
+	lbus_decode_profile(profile, buf);
+	return ret;
+}
 
-	return lbus_simple_recv(C, 1, NULL);
+LBUS_API
+int lbus_set_address(lbus_ctx* C, const int dst, const uint8_t address) {
+	if(address < 1 || address > 127) {
+		return LBUS_MISUSE_ERROR;
+	}
+	const struct lbus_SET_ADDRESS d = { .naddr = address };
+	struct lbus_pkg pkg;
+	lbus_forget_capabilities(C, address);
+	const int ret = lbus_acked(C, dst, &pkg, lbus_request_SET_ADDRESS(&pkg, dst, 1, &d), 1, CONFIG_POLLS);
+	lbus_forget_capabilities(C, dst);
+	return ret;
 }
 
 LBUS_API
 int lbus_set_polarity(lbus_ctx* C, const int dst, const uint8_t polarity) {
-	struct lbus_pkg pkg = {
-		.hdr = {
-			.length = tole16(sizeof(struct lbus_hdr)+sizeof(struct lbus_SET_POLARITY)+1),
-			.addr = dst,
-			.cmd = SET_POLARITY,
-		},
-		.SET_POLARITY = {
-			.polarity = polarity
-		}
+	const struct lbus_SET_POLARITY d = { .polarity = polarity };
+	struct lbus_pkg pkg;
+	return lbus_acked(C, dst, &pkg, lbus_request_SET_POLARITY(&pkg, dst, 1, &d), 1, CONFIG_POLLS);
+}
+
+LBUS_API
+int lbus_set_groups(lbus_ctx* C, const int dst, const unsigned int count, const uint8_t groups[]) {
+	if(count > LBUS_MAX_GROUPS) {
+		return LBUS_MISUSE_ERROR;
+	}
+	struct lbus_SET_GROUPS d = { .groups = { 0 } };
+	for(int i=0; i<count; i++) {
+		if(groups[i] < LBUS_GROUP_FIRST || groups[i] > LBUS_GROUP_LAST)
+			return LBUS_MISUSE_ERROR;
+		d.groups[i] = groups[i];
+	}
+	struct lbus_pkg pkg;
+	return lbus_acked(C, dst, &pkg, lbus_request_SET_GROUPS(&pkg, dst, 1, &d), 1, CONFIG_POLLS);
+}
+
+LBUS_API
+int lbus_set_led_group(lbus_ctx* C, const int dst, const uint16_t group) {
+	const struct lbus_SET_LED_GROUP d = { .group = group };
+	struct lbus_pkg pkg;
+	return lbus_acked(C, dst, &pkg, lbus_request_SET_LED_GROUP(&pkg, dst, 1, &d), 1, CONFIG_POLLS);
+}
+
+LBUS_API
+int lbus_time_sync(lbus_ctx* C, const uint32_t time) {
+	const struct lbus_TIME_SYNC d = { .time = time };
+	struct lbus_pkg pkg;
+	return lbus_tx(C, &pkg, lbus_request_TIME_SYNC(&pkg, 0xFF, 0, &d));
+}
+
+LBUS_API
+int lbus_set_timeout(lbus_ctx* C, const uint16_t chars) {
+	const struct lbus_SET_TIMEOUT d = { .chars = chars };
+	struct lbus_pkg pkg;
+	return lbus_tx(C, &pkg, lbus_request_SET_TIMEOUT(&pkg, 0xFF, 0, &d));
+}
+
+LBUS_API
+int lbus_scan(lbus_ctx* C, const uint8_t first, const uint8_t count, uint8_t slot, struct lbus_scan nodes[]) {
+	if(count == 0) {
+		return LBUS_MISUSE_ERROR;
+	}
+	const int reply_size = sizeof(struct lbus_hdr) + sizeof(struct lbus_scan);
+	if(slot == 0) {
+		/* a reply plus 100 usec for bus turnaround and jitter */
+		const int bits = (C->framing == LBUS_FRAMING_ADDRESS_MARK) ? 11 : 10;
+		const int us = reply_size * bits * 1000000 / C->baudrate + 100;
+		slot = (us + LBUS_SCAN_TICK_US - 1) / LBUS_SCAN_TICK_US;
+	}
+	const struct lbus_SCAN d = { .first = first, .count = count, .slot = slot };
+	struct lbus_pkg pkg;
+	int ret = lbus_tx(C, &pkg, lbus_request_SCAN(&pkg, 0xFF, 0, &d));
+	if(ret < 0) return ret;
+	usleep(count * slot * LBUS_SCAN_TICK_US);
+
+	uint8_t *buf = malloc(count * reply_size);
+	if(buf == NULL) return LBUS_MEMORY_ERROR;
+	const int size = lbus_rx(C, buf, count * reply_size);
+	if(size < 0) {
+		free(buf);
+		return size;
+	}
+	/* pick the replies, skipping garbage from collisions */
+	int found = 0;
+	for(int p = 0; p + reply_size <= size && found < count; p++) {
+		struct lbus_hdr hdr;
+		lbus_decode_hdr(&hdr, buf + p);
+		if(hdr.length != reply_size || hdr.addr != LBUS_MASTER_ADDR || hdr.cmd != SCAN)
+			continue;
+		lbus_decode_scan(&nodes[found++], buf + p + sizeof(hdr));
+		p += reply_size - 1;
+	}
+	free(buf);
+	return found;
+}
+
+/* switch USB busmaster framing */
+static int lbus_master_framing(lbus_ctx* C, const uint8_t framing) {
+	uint8_t tbuf[2] = { MASTER_CMD_FRAMING, framing };
+	int transferred = 0;
+	if(libusb_bulk_transfer(C->dev, 0x01, tbuf, 2, &transferred, LIBUSB_TXTIMEOUT) != 0)
+		return LBUS_BUS_ERROR;
+	C->framing = framing;
+	return 0;
+}
+
+LBUS_API
+int lbus_set_framing(lbus_ctx* C, const uint8_t framing) {
+	if(framing != LBUS_FRAMING_PLAIN && framing != LBUS_FRAMING_ADDRESS_MARK) {
+		return LBUS_MISUSE_ERROR;
+	}
+	const struct lbus_SET_FRAMING d = { .framing = framing };
+	struct lbus_pkg pkg;
+	const int len = lbus_request_SET_FRAMING(&pkg, 0xFF, 0, &d);
+	/* nodes might use either framing (e.g. after having been reset), so
+	 * send the request in both. Nodes using the other one see garbage
+	 * and drop it after their packet timeout.
+	 */
+	const uint8_t try[2] = { LBUS_FRAMING_ADDRESS_MARK, LBUS_FRAMING_PLAIN };
+	for(int i=0; i<2; i++) {
+		int ret = lbus_master_framing(C, try[i]);
+		if(ret < 0) return ret;
+		ret = lbus_tx(C, &pkg, len);
+		if(ret < 0) return ret;
+		usleep(2000);
+	}
+	return lbus_master_framing(C, framing);
+}
+
+/* switch USB busmaster baud rate */
+static int lbus_master_baudrate(lbus_ctx* C, const uint32_t baudrate) {
+	uint8_t tbuf[5] = { MASTER_CMD_BAUDRATE,
+		baudrate & 0xFF, (baudrate >> 8) & 0xFF, (baudrate >> 16) & 0xFF, baudrate >> 24 };
+	int transferred = 0;
+	if(libusb_bulk_transfer(C->dev, 0x01, tbuf, 5, &transferred, LIBUSB_TXTIMEOUT) != 0)
+		return LBUS_BUS_ERROR;
+	C->baudrate = baudrate;
+	return 0;
+}
+
+LBUS_API
+int lbus_set_baudrate(lbus_ctx* C, const uint32_t baudrate, const bool persist) {
+	if(baudrate < LBUS_BAUDRATE_SAFE || baudrate > LBUS_BAUDRATE_MAX) {
+		return LBUS_MISUSE_ERROR;
+	}
+	const struct lbus_SET_BAUDRATE d = {
+		.baudrate = baudrate,
+		.flags = persist ? LBUS_BAUDRATE_PERSIST : 0
 	};
-	int ret = lbus_tx(C, &pkg, sizeof(pkg));
+	struct lbus_pkg pkg;
+	const int len = lbus_request_SET_BAUDRATE(&pkg, 0xFF, 0, &d);
+	/* nodes are either at the current rate or have fallen back to the
+	 * safe rate (or were reset and run the bootloader). Nodes at the
+	 * current rate see the request at the safe rate as garbage, so it
+	 * is sent there only when switching to another rate, or when a node
+	 * has not answered a PING since (see lbus_ping()).
+	 */
+	const uint32_t try[2] = { C->baudrate, LBUS_BAUDRATE_SAFE };
+	const int tries = (C->baudrate != LBUS_BAUDRATE_SAFE
+		&& (C->baudrate != baudrate || C->baudrate_lost)) ? 2 : 1;
+	C->baudrate_lost = false;
+	for(int i=0; i<tries; i++) {
+		int ret = lbus_master_baudrate(C, try[i]);
+		if(ret < 0) return ret;
+		ret = lbus_tx(C, &pkg, len);
+		if(ret < 0) return ret;
+		usleep(2000);
+	}
+	int ret = lbus_master_baudrate(C, baudrate);
 	if(ret < 0) return ret;
+	/* nodes confirm the new rate with the first valid packet */
+	return lbus_simple_cmd(C, 0xFF, NOP, 0, NULL);
+}
 
-	return lbus_simple_recv(C, 1, NULL);
+/* CRC32 of READ_MEMORY, CONFIG_READ and CONFIG_WRITE data, padded with
+ * zeros to whole words
+ */
+static uint32_t crc32_padded(const void *data, const int length) {
+	uint32_t crc = crc32(0xFFFFFFFF, length & ~3, (void*)data);
+	if(length & 3) {
+		uint8_t tail[4] = { 0 };
+		memcpy(tail, (const uint8_t*)data + (length & ~3), length & 3);
+		crc = crc32(crc, 4, tail);
+	}
+	return crc;
 }
 
 LBUS_API
@@ -337,17 +695,9 @@ int lbus_read_memory(lbus_ctx* C, const int dst, const uint32_t address, const i
 	if(length < 0 || length > 1024) {
 		return LBUS_MISUSE_ERROR;
 	}
-	struct lbus_pkg pkg = {
-		.hdr = {
-			.length = tole16(sizeof(struct lbus_hdr)+sizeof(struct lbus_READ_MEMORY)+length+4),
-			.addr = dst,
-			.cmd = READ_MEMORY,
-		},
-		.READ_MEMORY = {
-			.address = address,
-		}
-	};
-	int ret = lbus_tx(C, &pkg, sizeof(struct lbus_hdr)+sizeof(struct lbus_READ_MEMORY));
+	const struct lbus_READ_MEMORY d = { .address = address };
+	struct lbus_pkg pkg;
+	int ret = lbus_tx(C, &pkg, lbus_request_READ_MEMORY(&pkg, dst, length+4, &d));
 	if(ret < 0) return ret;
 
 	ret = lbus_rx(C, buf, length);
@@ -358,34 +708,161 @@ int lbus_read_memory(lbus_ctx* C, const int dst, const uint32_t address, const i
 	ret = lbus_rx(C, &crc_test, 4);
 	if(ret < 0) return ret;
 	if(ret < 4) return LBUS_BROKEN_ANSWER;
-	if(le32(crc_test) != crc32(0xFFFFFFFF, length, buf)) {
+	if(le32(crc_test) != crc32_padded(buf, length)) {
 		return LBUS_CRC_ERROR;
 	}
 	return length;
 }
 
+LBUS_API
+int lbus_config_read(lbus_ctx* C, const int dst, const uint32_t type, const int size, void *buf) {
+	if(size < 0) {
+		return LBUS_MISUSE_ERROR;
+	}
+	int offset = 0;
+	struct lbus_config_data reply;
+	do {
+		const int chunk = (size - offset) > LBUS_CONFIG_MAX ? LBUS_CONFIG_MAX : (size - offset);
+		const struct lbus_CONFIG_READ d = { .type = type, .offset = offset };
+		struct lbus_pkg pkg;
+		const int reply_size = sizeof(reply) + chunk + sizeof(uint32_t);
+		int ret = lbus_tx(C, &pkg, lbus_request_CONFIG_READ(&pkg, dst, reply_size, &d));
+		if(ret < 0) return ret;
+
+		uint8_t rbuf[sizeof(reply) + LBUS_CONFIG_MAX + sizeof(uint32_t)];
+		ret = lbus_rx(C, rbuf, reply_size);
+		if(ret < 0) return ret;
+		if(ret == 0) return LBUS_NO_ANSWER;
+		if(ret != reply_size) return LBUS_BROKEN_ANSWER;
+		lbus_decode_config_data(&reply, rbuf);
+		if(reply.length == LBUS_CONFIG_NONE) return LBUS_NOT_FOUND;
+		int l = reply.length - offset;
+		if(l > chunk) l = chunk;
+		if(l < 0) l = 0;
+		if(lbus_get_uint32_t(rbuf + sizeof(reply) + chunk) != crc32_padded(rbuf + sizeof(reply), l))
+			return LBUS_CRC_ERROR;
+		memcpy(buf + offset, rbuf + sizeof(reply), l);
+		offset += l;
+		/* the item might have been shorter than before */
+		if(l < chunk) break;
+	} while(offset < size);
+	return reply.length;
+}
+
+LBUS_API
+int lbus_config_write(lbus_ctx* C, const int dst, const uint32_t type, const int length, const void *data) {
+	if(length < 0 || length > LBUS_CONFIG_MAX) {
+		return LBUS_MISUSE_ERROR;
+	}
+	uint8_t pkg[sizeof(struct lbus_hdr) + sizeof(struct lbus_CONFIG_WRITE) + LBUS_CONFIG_MAX + sizeof(uint32_t)];
+	const struct lbus_CONFIG_WRITE d = { .type = type, .length = length };
+	int len = lbus_request_CONFIG_WRITE(pkg, dst, length + sizeof(uint32_t) + 1, &d);
+	memcpy(pkg + len, data, length);
+	len += length;
+	len += lbus_put_uint32_t(pkg + len, crc32_padded(data, length));
+	/* storing the item might take a while when the slave has to compact
+	 * its config store, see LBUS_CONFIG_WRITE_MAX_MS */
+	return lbus_acked(C, dst, pkg, len, 1, CONFIG_POLLS);
+}
+
 #define LBUS_LED_MAX_VCOUNT 1024
 LBUS_API
 int lbus_led_set_16bit(lbus_ctx* C, const int dst, const uint16_t led, const unsigned int vcount, const uint16_t values[]) {
 	if(vcount > LBUS_LED_MAX_VCOUNT) {
 		return LBUS_MISUSE_ERROR;
 	}
-	struct {
-		struct lbus_hdr hdr;
-		uint16_t led;
-		uint16_t values[LBUS_LED_MAX_VCOUNT];
-	} __attribute__((packed)) pkg = {
-		.hdr = {
-			.length = tole16(sizeof(struct lbus_hdr)+sizeof(uint16_t)*(vcount+1)),
-			.addr = dst,
-			.cmd = LED_SET_16BIT,
-		},
-		.led = tole16(led)
-	};
+	uint8_t pkg[sizeof(struct lbus_hdr)+sizeof(struct lbus_LED_SET_16BIT)+sizeof(uint16_t)*LBUS_LED_MAX_VCOUNT];
+	const struct lbus_LED_SET_16BIT d = { .led = led };
+	int len = lbus_request_LED_SET_16BIT(pkg, dst, sizeof(uint16_t)*vcount, &d);
 	for(int i=0; i<vcount; i++)
-		pkg.values[i] = tole16(values[i]);
+		len += lbus_put_uint16_t(pkg+len, values[i]);
+
+	return lbus_tx(C, pkg, len);
+}
+
+LBUS_API
+int lbus_led_set_8bit(lbus_ctx* C, const int dst, const uint16_t led, const unsigned int vcount, const uint8_t values[]) {
+	if(vcount > LBUS_LED_MAX_VCOUNT) {
+		return LBUS_MISUSE_ERROR;
+	}
+	/* all protolight firmware handles LED_SET_8BIT, so broadcasts, groups
+	 * and nodes that do not tell get it, they apply their own LUTs */
+	if(dst >= 1 && dst <= 127) {
+		struct lbus_capabilities caps;
+		int ret = lbus_get_capabilities(C, dst, &caps);
+		if(ret < 0 && ret != LBUS_NO_ANSWER && ret != LBUS_BROKEN_ANSWER) return ret;
+		if(ret == 1 && !lbus_cap_has_command(caps.commands, LED_SET_8BIT)) {
+			/* map like the default LUT */
+			uint16_t v16[LBUS_LED_MAX_VCOUNT];
+			for(int i=0; i<vcount; i++)
+				v16[i] = (values[i]+1)*(values[i]+1) - 1;
+			return lbus_led_set_16bit(C, dst, led, vcount, v16);
+		}
+	}
+	uint8_t pkg[sizeof(struct lbus_hdr)+sizeof(struct lbus_LED_SET_8BIT)+LBUS_LED_MAX_VCOUNT];
+	const struct lbus_LED_SET_8BIT d = { .led = led };
+	int len = lbus_request_LED_SET_8BIT(pkg, dst, vcount, &d);
+	memcpy(pkg+len, values, vcount);
+
+	return lbus_tx(C, pkg, len+vcount);
+}
+
+#define LBUS_LED_FRAME_MAX_VCOUNT 4096
+LBUS_API
+int lbus_led_frame(lbus_ctx* C, const uint8_t flags, const unsigned int vcount, const uint16_t values[]) {
+	if(vcount > LBUS_LED_FRAME_MAX_VCOUNT) {
+		return LBUS_MISUSE_ERROR;
+	}
+	uint8_t pkg[sizeof(struct lbus_hdr)+sizeof(struct lbus_LED_FRAME)+sizeof(uint16_t)*LBUS_LED_FRAME_MAX_VCOUNT];
+	const struct lbus_LED_FRAME d = { .flags = flags };
+	int len = lbus_request_LED_FRAME(pkg, 0xFF, sizeof(uint16_t)*vcount, &d);
+	for(int i=0; i<vcount; i++)
+		len += lbus_put_uint16_t(pkg+len, values[i]);
+
+	return lbus_tx(C, pkg, len);
+}
+
+LBUS_API
+int lbus_led_set_delta(lbus_ctx* C, const int dst, const uint8_t flags, const unsigned int vcount, const uint16_t previous[], const uint16_t values[]) {
+	if(vcount > LBUS_LED_FRAME_MAX_VCOUNT) {
+		return LBUS_MISUSE_ERROR;
+	}
+	/* raw data is at most the size of a full update, others might be smaller */
+	const uint8_t encoding = lbus_delta_encoding(vcount, previous, values);
+	const int len = lbus_delta_encode(encoding, vcount, previous, values, NULL);
+	uint8_t pkg[sizeof(struct lbus_hdr)+sizeof(struct lbus_LED_SET_DELTA)+LBUS_LED_FRAME_MAX_VCOUNT*sizeof(uint16_t)];
+	const struct lbus_LED_SET_DELTA d = {
+		.encoding = encoding,
+		.flags = flags
+	};
+	const int hlen = lbus_request_LED_SET_DELTA(pkg, dst, len, &d);
+	lbus_delta_encode(encoding, vcount, previous, values, pkg+hlen);
+
+	return lbus_tx(C, pkg, hlen+len);
+}
 
-	return lbus_tx(C, &pkg, sizeof(struct lbus_hdr)+sizeof(uint16_t)*(vcount+1));
+LBUS_API
+int lbus_led_set(lbus_ctx* C, const int dst, const uint16_t led, const unsigned int vcount, const uint16_t previous[], const uint16_t values[]) {
+	if(led + vcount > LBUS_LED_FRAME_MAX_VCOUNT) {
+		return LBUS_MISUSE_ERROR;
+	}
+	/* broadcasts and groups cannot be asked for their capabilities */
+	int ret = 0;
+	if(dst >= 1 && dst <= 127) {
+		ret = lbus_supports(C, dst, LED_SET_DELTA);
+		if(ret < 0) return ret;
+	}
+	if(ret == 0 || (previous == NULL && led != 0))
+		return lbus_led_set_16bit(C, dst, led, vcount, values);
+	if(led == 0)
+		return lbus_led_set_delta(C, dst, 0, vcount, previous, values);
+	/* delta positions start at 0, leave the ones before led unchanged */
+	uint16_t p[LBUS_LED_FRAME_MAX_VCOUNT], v[LBUS_LED_FRAME_MAX_VCOUNT];
+	memset(p, 0, led*sizeof(uint16_t));
+	memset(v, 0, led*sizeof(uint16_t));
+	memcpy(p+led, previous, vcount*sizeof(uint16_t));
+	memcpy(v+led, values, vcount*sizeof(uint16_t));
+	return lbus_led_set_delta(C, dst, 0, led+vcount, p, v);
 }
 
 LBUS_API
@@ -393,8 +870,26 @@ int lbus_led_commit(lbus_ctx* C, const int dst) {
 	return lbus_simple_cmd(C, dst, LED_COMMIT, 0, NULL);
 }
 
+LBUS_API
+int lbus_led_commit_at(lbus_ctx* C, const int dst, const uint32_t time) {
+	const struct lbus_LED_COMMIT_AT d = { .time = time };
+	struct lbus_pkg pkg;
+	return lbus_tx(C, &pkg, lbus_request_LED_COMMIT_AT(&pkg, dst, 0, &d));
+}
+
 LBUS_API
 int lbus_flash_firmware(lbus_ctx* C, const int dst, const char *path) {
+	/* nodes that report their capabilities tell whether they are in the
+	 * bootloader, others would just not reply to the first page */
+	struct lbus_capabilities caps;
+	const int known = lbus_get_capabilities(C, dst, &caps);
+	if(known == 1 && !lbus_cap_has_command(caps.commands, FLASH_FIRMWARE))
+		return LBUS_MISUSE_ERROR;
+	/* flashing a page takes up to ~50 msec, while the busmaster waits
+	 * 100 msec for a reply: lost pages (or replies) are sent again when
+	 * the node supports sequence numbers, so do not wait that long then */
+	const int polls = (known == 1 && (caps.flags & LBUS_CAP_SEQ)) ? 2 : 10;
+
 	struct stat st;
 	int ffd = open(path, O_RDONLY);
 	if(ffd == -1)
@@ -424,47 +919,32 @@ int lbus_flash_firmware(lbus_ctx* C, const int dst, const char *path) {
 	void *p = fwbuf;
 	uint16_t pg = FW_START_PAGE;
 	for(void *p = fwbuf; p < (fwbuf+fw_pg_size); p+=PAGE_SIZE) {
-		struct {
-			struct lbus_hdr hdr;
-			uint16_t page;
-			uint8_t data[PAGE_SIZE];
-			uint32_t crc;
-		} __attribute__((packed)) pkg = {
-			.hdr = {
-				.length = tole16(sizeof(struct lbus_hdr) + sizeof(uint16_t) + PAGE_SIZE + sizeof(uint32_t) + 1),
-				.addr = dst,
-				.cmd = FLASH_FIRMWARE
-			},
-			.page = tole16(pg),
+		struct lbus_FLASH_FIRMWARE d = {
+			.page_id = pg,
+			.crc = crc32(0xFFFFFFFF, PAGE_SIZE, p)
 		};
-		memcpy(pkg.data, p, PAGE_SIZE);
-		pkg.crc = tole32(crc32(0xFFFFFFFF, PAGE_SIZE, p));
-		int ret = lbus_tx(C, &pkg, sizeof(pkg));
-		if(ret < 0) {
+		memcpy(d.data, p, PAGE_SIZE);
+		struct lbus_pkg pkg;
+		const int reply = lbus_acked(C, dst, &pkg, lbus_request_FLASH_FIRMWARE(&pkg, dst, 1, &d), 1, polls);
+		if(reply == LBUS_BUS_ERROR) {
 			close(ffd);
-			return ret;
-		}
-
-		uint8_t reply=0x7F;
-		for(int i=0; i<10; i++) {
-			if(lbus_rx(C, &reply, 1) == 1) {
-				break;
-			} else {
-				fprintf(stderr, ".");
-				usleep(100000);
-			}
+			lbus_forget_capabilities(C, dst);
+			return reply;
 		}
 		if(reply == 0) {
 			fprintf(stderr, "<%02X>", pg);
 		} else {
 			fprintf(stderr, " failure %d!\n", reply);
 			close(ffd);
+			lbus_forget_capabilities(C, dst);
 			return LBUS_GENERIC_ERROR;
 		}
 		pg++;
 	}
 	fprintf(stderr, " done!\n");
 	close(ffd);
+	/* the firmware has changed */
+	lbus_forget_capabilities(C, dst);
 	return 0;
 }
 
@@ -483,6 +963,8 @@ const char* lbus_strerror(int ret) {
 			return "CRC error";
 		case LBUS_FIRMWARE_FILE_ERROR:
 			return "bad firmware file";
+		case LBUS_NOT_FOUND:
+			return "no such item";
 		case LBUS_GENERIC_ERROR:
 			return "unspecified error";
 		case LBUS_LIBUSB_INIT_ERROR:
@@ -518,9 +1000,24 @@ int lbus_open(lbus_ctx **C) {
 		*C = NULL;
 		return LBUS_INTERFACE_NOT_AVAILABLE;
 	}
+	/* busmaster might have been left in another framing/baud rate */
+	int ret = lbus_master_framing(*C, LBUS_FRAMING_PLAIN);
+	if(ret >= 0)
+		ret = lbus_master_baudrate(*C, LBUS_BAUDRATE_SAFE);
+	if(ret < 0) {
+		lbus_free(*C);
+		*C = NULL;
+		return ret;
+	}
+	(*C)->retries = 3;
 	return 0;
 }
 
+LBUS_API
+void lbus_set_retries(lbus_ctx* C, const int retries) {
+	C->retries = retries < 0 ? 0 : retries;
+}
+
 LBUS_API
 void lbus_free(lbus_ctx* C) {
 	if(C != NULL) {
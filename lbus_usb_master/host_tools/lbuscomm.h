@@ -26,6 +26,7 @@ extern "C" {
 #define LBUS_MISUSE_ERROR -9
 #define LBUS_CRC_ERROR -10
 #define LBUS_FIRMWARE_FILE_ERROR -11
+#define LBUS_NOT_FOUND -12
 
 struct lbus_ctx_s;
 typedef struct lbus_ctx_s lbus_ctx;
@@ -58,6 +59,17 @@ int lbus_busmaster_echo(lbus_ctx* C);
  */
 const char* lbus_strerror(int ret);
 
+/* set how often requests are sent again when there is no reply
+ *
+ * This is done for nodes that support sequence numbers (LBUS_CAP_SEQ),
+ * by the functions for requests that are answered by a status byte.
+ * A repeated request is not handled again by the node. Default is 3.
+ *
+ * \param C lbus_ctx pointer
+ * \param retries number of retransmissions
+ */
+void lbus_set_retries(lbus_ctx* C, const int retries);
+
 
 /* ========== high level API: ========== */
 
@@ -72,6 +84,65 @@ const char* lbus_strerror(int ret);
  * \return >=0 if successful, error code otherwise
  */
 int lbus_led_set_16bit(lbus_ctx* C, const int dst, const uint16_t led, const unsigned int vcount, const uint16_t values[]);
+/* set PWM configuration from 8 bit values
+ *
+ * Sends a LED_SET_8BIT request, the slaves map the values by their LUTs.
+ * Only for a slave known not to support it (see lbus_get_capabilities()),
+ * the values are mapped like by the default LUT ((n+1)^2-1) and sent as
+ * 16 bit values. Broadcasts, groups and slaves not reporting capabilities
+ * always get LED_SET_8BIT.
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param led offset of first PWM channel to write data to
+ * \param vcount number of values in values array
+ * \param values actual values to configure
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_led_set_8bit(lbus_ctx* C, const int dst, const uint16_t led, const unsigned int vcount, const uint8_t values[]);
+/* set PWM configuration in the smallest way the slave supports
+ *
+ * Uses LED_SET_DELTA (see lbus_led_set_delta()) when the slave supports
+ * it, LED_SET_16BIT otherwise and for broadcasts and groups.
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param led offset of first PWM channel to write data to
+ * \param vcount number of values in values/previous array
+ * \param previous values that the slave has now, NULL if not known
+ * \param values actual values to configure
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_led_set(lbus_ctx* C, const int dst, const uint16_t led, const unsigned int vcount, const uint16_t previous[], const uint16_t values[]);
+/* broadcast PWM configuration for all slaves
+ *
+ * Each slave takes the values starting at its LED group, see
+ * lbus_set_led_group().
+ *
+ * \param C lbus_ctx pointer
+ * \param flags LBUS_LED_FRAME_COMMIT to have slaves commit the values
+ *        when the packet is complete, 0 otherwise
+ * \param vcount number of values in values array
+ * \param values actual values to configure
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_led_frame(lbus_ctx* C, const uint8_t flags, const unsigned int vcount, const uint16_t values[]);
+/* send changed PWM configuration
+ *
+ * Only the values that differ from the previous ones are sent, in
+ * whatever encoding is the smallest for the given data.
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param flags LBUS_DELTA_FRAME for positions relative to the slaves'
+ *        LED groups (see lbus_led_frame()), LBUS_DELTA_COMMIT to have
+ *        slaves commit the values when the packet is complete
+ * \param vcount number of values in values/previous array
+ * \param previous values that slaves have now, NULL to send all values
+ * \param values actual values to configure
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_led_set_delta(lbus_ctx* C, const int dst, const uint8_t flags, const unsigned int vcount, const uint16_t previous[], const uint16_t values[]);
 /* issue command to have slave commit the configured PWM values to its output
  *
  * \param C lbus_ctx pointer
@@ -79,6 +150,14 @@ int lbus_led_set_16bit(lbus_ctx* C, const int dst, const uint16_t led, const uns
  * \return >=0 if successful, error code otherwise
  */
 int lbus_led_commit(lbus_ctx* C, const int dst);
+/* issue command to have slave commit the configured PWM values at a bus time
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param time bus time in msec, see lbus_time_sync()
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_led_commit_at(lbus_ctx* C, const int dst, const uint32_t time);
 /* send a ping message
  *
  * \param C lbus_ctx pointer
@@ -121,6 +200,77 @@ int lbus_erase_config(lbus_ctx* C, const int dst);
  *         the number returned), error code otherwise
  */
 int lbus_get_config(lbus_ctx* C, const int dst, const uint16_t type, const bool numeric, const int answer_bytes, void* data);
+/* query several system configuration data items from a slave at once
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param count number of type IDs, up to LBUS_DATA_MULTI_MAX
+ * \param types config type IDs
+ * \param answer_bytes size of the answer: per type, the size of a
+ *        struct lbus_data_item plus the number of bytes of the data.
+ *        Items that do not fit are left out.
+ * \param data pointer to a buffer for the answer, see lbus_data_item_find()
+ * \return number of bytes received if successful, error code otherwise
+ */
+int lbus_get_config_multi(lbus_ctx* C, const int dst, const unsigned int count, const uint16_t types[], const int answer_bytes, void* data);
+/* look up an item in the answer to lbus_get_config_multi()
+ *
+ * \param data the answer
+ * \param size number of bytes in the answer
+ * \param type config type ID
+ * \param item_data will point to the item's data within the answer
+ * \return length of the item's data (0 if the slave does not know the
+ *         type), error code if the item is missing
+ */
+int lbus_data_item_find(const void* data, const int size, const uint16_t type, const uint8_t** item_data);
+/* query what a slave supports
+ *
+ * The answer is cached per address until the slave is reset, gets a new
+ * address or is flashed through this context, see lbus_forget_capabilities().
+ * Slaves that do not report their capabilities get a zeroed struct.
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to (1..127)
+ * \param caps will be filled with the capabilities
+ * \return 1 if the slave reported its capabilities, 0 if it did not,
+ *         error code otherwise
+ */
+int lbus_get_capabilities(lbus_ctx* C, const int dst, struct lbus_capabilities *caps);
+/* drop cached capabilities, e.g. after a slave has been replaced
+ *
+ * \param C lbus_ctx pointer
+ * \param dst slave address, or -1 for all slaves
+ */
+void lbus_forget_capabilities(lbus_ctx* C, const int dst);
+/* check whether a slave handles a command, see lbus_get_capabilities()
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to (1..127)
+ * \param cmd command
+ * \return 1 if it does, 0 if it does not or does not tell, error code otherwise
+ */
+int lbus_supports(lbus_ctx* C, const int dst, const uint8_t cmd);
+/* read slave's LBUS health/throughput counters
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param reset reset the counters after reading them
+ * \param stats will be filled with the counters
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_get_stats(lbus_ctx* C, const int dst, const bool reset, struct lbus_stats *stats);
+/* read slave's cycle counter profile for one probe
+ *
+ * only available on slaves built with LBUS_PROFILE
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param probe probe number, see enum lbus_profile_probe
+ * \param reset reset the probe after reading it
+ * \param profile will be filled with the measurements
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_get_profile(lbus_ctx* C, const int dst, const uint8_t probe, const bool reset, struct lbus_profile *profile);
 /* configure slave's address
  *
  * \param C lbus_ctx pointer
@@ -137,6 +287,88 @@ int lbus_set_address(lbus_ctx* C, const int dst, const uint8_t address);
  * \return >=0 if successful, error code otherwise
  */
 int lbus_set_polarity(lbus_ctx* C, const int dst, const uint8_t polarity);
+/* configure the group addresses a slave listens to
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param count number of groups, up to LBUS_MAX_GROUPS (0 to leave all)
+ * \param groups group addresses, LBUS_GROUP_FIRST..LBUS_GROUP_LAST
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_set_groups(lbus_ctx* C, const int dst, const unsigned int count, const uint8_t groups[]);
+/* configure slave's LED group, i.e. the offset of its values in LED frames
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param group offset of the slave's first value in LED frames
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_set_led_group(lbus_ctx* C, const int dst, const uint16_t group);
+/* set bus time on all slaves
+ *
+ * \param C lbus_ctx pointer
+ * \param time bus time in msec, e.g. from a monotonic clock
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_time_sync(lbus_ctx* C, const uint32_t time);
+/* set the packet receive timeout on all slaves
+ *
+ * Slaves end a packet that is not complete after this many character
+ * times of silence, at the current baud rate and framing. It must
+ * cover the gaps between the USB packets the busmaster gets the data in.
+ * The slaves' default is 25 characters, but at least 0.5 msec.
+ *
+ * \param C lbus_ctx pointer
+ * \param chars timeout in character times, 0 for the slaves' default
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_set_timeout(lbus_ctx* C, const uint16_t chars);
+/* enumerate the slaves on the bus
+ *
+ * Broadcasts a SCAN request, the slaves reply one after another in time
+ * slots given by their addresses. Slaves built without LBUS_SCAN do not
+ * reply. Two slaves with the same address garble their replies.
+ *
+ * \param C lbus_ctx pointer
+ * \param first first address to scan
+ * \param count number of addresses to scan
+ * \param slot slot length in LBUS_SCAN_TICK_US units, 0 for the
+ *        shortest one at the current baud rate and framing
+ * \param nodes will be filled with the replies, must have room for
+ *        count entries
+ * \return number of replies if successful, error code otherwise
+ */
+int lbus_scan(lbus_ctx* C, const uint8_t first, const uint8_t count, uint8_t slot, struct lbus_scan nodes[]);
+/* switch framing on the bus
+ *
+ * Broadcasts a SET_FRAMING request and switches the USB busmaster to
+ * the new framing. The request is sent in both framings, so this can
+ * also be used to get nodes back in line that have been reset (nodes
+ * always start with LBUS_FRAMING_PLAIN).
+ *
+ * \param C lbus_ctx pointer
+ * \param framing LBUS_FRAMING_PLAIN or LBUS_FRAMING_ADDRESS_MARK
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_set_framing(lbus_ctx* C, const uint8_t framing);
+/* switch baud rate on the bus
+ *
+ * Broadcasts a SET_BAUDRATE request at the current baud rate, then
+ * switches the USB busmaster to the new rate. Nodes fall back to the
+ * safe rate when they do not receive valid packets for a while, so the
+ * bus must be kept busy after switching to a higher rate.
+ * The request is also sent at the safe rate when switching to another
+ * rate, or when a node has not answered lbus_ping() since the last call:
+ * nodes already at the current rate see it as garbage. So calling this
+ * again with the same rate after pinging the nodes picks up nodes that
+ * have been reset, without disturbing the others.
+ *
+ * \param C lbus_ctx pointer
+ * \param baudrate new baud rate, LBUS_BAUDRATE_SAFE..LBUS_BAUDRATE_MAX
+ * \param persist nodes store the new rate in their config once confirmed
+ * \return >=0 if successful, error code otherwise
+ */
+int lbus_set_baudrate(lbus_ctx* C, const uint32_t baudrate, const bool persist);
 /* read from slave's memory
  *
  * \param C lbus_ctx pointer
@@ -147,7 +379,39 @@ int lbus_set_polarity(lbus_ctx* C, const int dst, const uint8_t polarity);
  * \return >=0 if successful, error code otherwise
  */
 int lbus_read_memory(lbus_ctx* C, const int dst, const uint32_t address, const int length, void *buf);
+/* read an item from slave's config store
+ *
+ * The item is read in chunks of up to LBUS_CONFIG_MAX bytes, each one
+ * checked by its CRC32.
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param type config type ID, see config.h
+ * \param size size of buf, only this much of the item is read (can be 0)
+ * \param buf destination buffer to write the item data to
+ * \return length of the whole item if successful, LBUS_NOT_FOUND if the
+ *         slave has no such item, error code otherwise
+ */
+int lbus_config_read(lbus_ctx* C, const int dst, const uint32_t type, const int size, void *buf);
+/* write an item to slave's config store
+ *
+ * The slave stores the item only when its CRC32 matches. Slaves apply
+ * some items right away (e.g. LED LUTs on the protolight firmware),
+ * others when they are reset.
+ *
+ * \param C lbus_ctx pointer
+ * \param dst destination to send message to
+ * \param type config type ID, see config.h
+ * \param length length of the item data, up to LBUS_CONFIG_MAX
+ * \param data item data
+ * \return >=0 if successful (status returned by the slave, 0 when the
+ *         item has been stored), error code otherwise
+ */
+int lbus_config_write(lbus_ctx* C, const int dst, const uint32_t type, const int length, const void *data);
 /* write firmware to slave (in bootloader mode)
+ *
+ * Fails right away for slaves that report their capabilities and do
+ * not support FLASH_FIRMWARE, i.e. are not in bootloader mode.
  *
  * \param C lbus_ctx pointer
  * \param dst destination to send message to
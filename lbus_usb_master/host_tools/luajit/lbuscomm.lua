@@ -1,4 +1,6 @@
 local ffi=require"ffi"
+-- commands and packet structs, generated by the Makefile
+require"lbus_data"
 
 ffi.cdef[[
 const static int LBUS_GENERIC_ERROR = -1;
@@ -12,6 +14,7 @@ const static int LBUS_BROKEN_ANSWER = -8;
 const static int LBUS_MISUSE_ERROR = -9;
 const static int LBUS_CRC_ERROR = -10;
 const static int LBUS_FIRMWARE_FILE_ERROR = -11;
+const static int LBUS_NOT_FOUND = -12;
 
 struct lbus_ctx_s;
 typedef struct lbus_ctx_s lbus_ctx;
@@ -20,14 +23,27 @@ void lbus_free(lbus_ctx* C);
 int lbus_busmaster_echo(lbus_ctx* C);
 const char* lbus_strerror(int ret);
 int lbus_led_set_16bit(lbus_ctx* C, const int dst, const uint16_t led, const unsigned int vcount, const uint16_t values[]);
+int lbus_led_frame(lbus_ctx* C, const uint8_t flags, const unsigned int vcount, const uint16_t values[]);
+int lbus_led_set_delta(lbus_ctx* C, const int dst, const uint8_t flags, const unsigned int vcount, const uint16_t previous[], const uint16_t values[]);
 int lbus_led_commit(lbus_ctx* C, const int dst);
+int lbus_led_commit_at(lbus_ctx* C, const int dst, const uint32_t time);
+int lbus_time_sync(lbus_ctx* C, const uint32_t time);
 int lbus_ping(lbus_ctx* C, const int dst);
 int lbus_reset_to_bootloader(lbus_ctx* C, const int dst);
 int lbus_reset_to_firmware(lbus_ctx* C, const int dst);
 int lbus_erase_config(lbus_ctx* C, const int dst);
 int lbus_get_config(lbus_ctx* C, const int dst, const uint16_t type, const bool numeric, const int answer_bytes, void* data);
+int lbus_get_stats(lbus_ctx* C, const int dst, const bool reset, struct lbus_stats *stats);
+int lbus_get_profile(lbus_ctx* C, const int dst, const uint8_t probe, const bool reset, struct lbus_profile *profile);
+int lbus_get_capabilities(lbus_ctx* C, const int dst, struct lbus_capabilities *caps);
 int lbus_set_address(lbus_ctx* C, const int dst, const uint8_t address);
+int lbus_set_groups(lbus_ctx* C, const int dst, const unsigned int count, const uint8_t groups[]);
+int lbus_set_led_group(lbus_ctx* C, const int dst, const uint16_t group);
+int lbus_set_framing(lbus_ctx* C, const uint8_t framing);
+int lbus_set_baudrate(lbus_ctx* C, const uint32_t baudrate, const bool persist);
 int lbus_read_memory(lbus_ctx* C, const int dst, const uint32_t address, const int length, void *buf);
+int lbus_config_read(lbus_ctx* C, const int dst, const uint32_t type, const int size, void *buf);
+int lbus_config_write(lbus_ctx* C, const int dst, const uint32_t type, const int length, const void *data);
 int lbus_flash_firmware(lbus_ctx* C, const int dst, const char *path);
 int lbus_tx(lbus_ctx* C, const void* buf, const int size);
 int lbus_rx(lbus_ctx* C, void* buf, const int size);
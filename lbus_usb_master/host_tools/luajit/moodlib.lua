@@ -4,14 +4,9 @@ Convenience library for controlling a LED matrix via LBUS
 local lbus = require"lbuscomm"
 local lbus_ctx = lbus.open()
 local ffi = require"ffi"
+-- (commands and struct lbus_hdr come from lbus_data.lua)
+require"lbus_data"
 ffi.cdef[[
-const static int LED_SET_16BIT = 10;
-const static int LED_COMMIT = 11;
-struct lbus_hdr {
-	uint16_t length;
-	uint8_t addr;
-	uint8_t cmd;
-} __attribute__((packed));
 struct led_cols {
 	uint16_t r;
 	uint16_t g;
@@ -8,12 +8,25 @@ local t, c = S.t, S.c
 local lbus
 local watchdog = function() end
 local initdir
+local marks = false
+local baudrate
+local frame = false
+local sync = false
+local delta = false
+-- nil: compact containers for the controllers that support them
+local compact
 while #arg > 0 do
 	if arg[1] == "emu" then
 		-- for now, this flag just disables USB interface
 		lbus = {
 			open = function() return {
-				lbus_tx = function() end
+				lbus_tx = function() end,
+				lbus_set_framing = function() end,
+				lbus_set_baudrate = function() end,
+				lbus_ping = function() end,
+				lbus_time_sync = function() end,
+				lbus_led_set_delta = function() end,
+				lbus_get_capabilities = function() return 0 end
 			} end,
 			check = function() end
 		}
@@ -23,6 +36,36 @@ while #arg > 0 do
 		watchdog = function()
 			sd.notify(0, "WATCHDOG=1")
 		end
+	elseif arg[1] == "marks" then
+		-- use address mark framing, so controllers can ignore
+		-- packets not addressed to them in hardware
+		marks = true
+	elseif arg[1] == "baudrate" then
+		-- run the bus at a higher baud rate
+		if arg[2] then
+			baudrate = tonumber(arg[2])
+			table.remove(arg, 2)
+		end
+	elseif arg[1] == "frame" then
+		-- send all LED data in a single LED_FRAME broadcast, needs the
+		-- controllers' LED groups set up (0, 12, 24, ... for 2, 3, 4, ...)
+		frame = true
+	elseif arg[1] == "delta" then
+		-- like "frame", but only send values that have changed
+		frame = true
+		delta = true
+	elseif arg[1] == "compact" then
+		-- always send compact containers, without asking the
+		-- controllers whether they support them
+		compact = true
+	elseif arg[1] == "nocompact" then
+		-- send LED_SET_16BIT packets instead of compact containers,
+		-- for controllers with older firmware
+		compact = false
+	elseif arg[1] == "sync" then
+		-- synchronize bus time and have all controllers commit
+		-- at the same bus time
+		sync = true
 	elseif arg[1] == "initdir" then
 		-- read a bunch of initial effects from a directory
 		if arg[2] then
@@ -37,15 +80,25 @@ if not lbus then
 end
 
 local lbus_ctx = lbus.open()
+-- framing/baud rate (re-)negotiation: controllers that were reset in
+-- between will start up using plain framing and maybe the safe rate
+local FRAMING_ADDRESS_MARK = 1
+-- address of compact containers
+local COMPACT_ADDR = 0xFE
+-- LBUS_CAP_COMPACT from lbus_data.h
+local CAP_COMPACT = 0x0020
+-- commit this many msec after the data has been sent, should cover USB
+-- latency and the time it takes to stream out the data
+local COMMIT_DELAY = 5
+local function bus_time()
+	return math.floor(S.clock_gettime("MONOTONIC").time * 1000) % 0x100000000
+end
+local negotiate_interval = 500
+local negotiate_countdown = 0
 -- some datastructures for busmaster communication and LED data
+-- (commands and struct lbus_hdr come from lbus_data.lua)
+require"lbus_data"
 ffi.cdef[[
-const static int LED_SET_16BIT = 10;
-const static int LED_COMMIT = 11;
-struct lbus_hdr {
-	uint16_t length;
-	uint8_t addr;
-	uint8_t cmd;
-} __attribute__((packed));
 struct led_cols {
 	uint16_t r;
 	uint16_t g;
@@ -65,6 +118,24 @@ struct led_all {
 	struct led_set F;
 	struct lbus_hdr commit;
 } __attribute__((packed));
+struct led_compact_frame {
+	struct lbus_compact_hdr hdr;
+	struct led_cols v[4];
+} __attribute__((packed));
+struct led_compact {
+	struct lbus_hdr hdr;
+	struct led_compact_frame X;
+	struct led_compact_frame Y;
+} __attribute__((packed));
+struct led_commit_at {
+	struct lbus_hdr hdr;
+	uint32_t time;
+} __attribute__((packed));
+struct led_frame {
+	struct lbus_hdr hdr;
+	uint8_t flags;
+	struct led_cols v[6*4];
+} __attribute__((packed));
 ]]
 -- endianess conversion:
 local function le32(x) return x end 
@@ -99,6 +170,60 @@ cmd.F.hdr.length = cmd.A.hdr.length
 cmd.commit.length = le16(ffi.sizeof("struct lbus_hdr"))
 cmd.commit.addr = 0xFF
 cmd.commit.cmd = ffi.C.LED_COMMIT
+-- compact containers with LED_SET_ALL frames for two controllers each,
+-- 2 bytes of overhead per controller instead of 6
+local set_cmd = {[0] = cmd.A, cmd.B, cmd.C, cmd.D, cmd.E, cmd.F}
+local compact_cmd = ffi.new("struct led_compact[3]")
+for i = 0, 2 do
+	local c = compact_cmd[i]
+	c.hdr.length = le16(ffi.sizeof(c))
+	c.hdr.addr = COMPACT_ADDR
+	c.hdr.cmd = ffi.C.LED_SET_ALL
+	c.X.hdr.length = ffi.sizeof(c.X.v)
+	c.X.hdr.addr = 0x02 + 2*i
+	c.Y.hdr.length = ffi.sizeof(c.Y.v)
+	c.Y.hdr.addr = 0x03 + 2*i
+end
+-- per container: true when both controllers report LBUS_CAP_COMPACT,
+-- nil until both have answered, asked again every negotiate_interval
+local compact_pair = {}
+local compact_countdown = 0
+local caps = ffi.new("struct lbus_capabilities")
+local function compact_check()
+	for i = 0, 2 do
+		if compact_pair[i] == nil then
+			local ok = true
+			for addr = 0x02 + 2*i, 0x03 + 2*i do
+				local ret = lbus_ctx:lbus_get_capabilities(addr, caps)
+				if ret < 0 then
+					ok = nil
+					break
+				elseif ret == 0 or bit.band(caps.flags, CAP_COMPACT) == 0 then
+					ok = false
+				end
+			end
+			compact_pair[i] = ok
+		end
+	end
+end
+local frame_cmd = ffi.new("struct led_frame")
+frame_cmd.hdr.length = le16(ffi.sizeof("struct led_frame"))
+frame_cmd.hdr.addr = 0xFF
+frame_cmd.hdr.cmd = ffi.C.LED_FRAME
+frame_cmd.flags = sync and 0 or 1 -- LBUS_LED_FRAME_COMMIT
+-- LED_SET_DELTA: values as last sent, all values are sent now and then
+-- in case controllers have missed a packet
+local DELTA_FRAME = 1
+local DELTA_COMMIT = 2
+local delta_count = 6*4*3
+local delta_values = ffi.new("uint16_t[?]", delta_count)
+local delta_previous = ffi.new("uint16_t[?]", delta_count)
+local delta_full_interval = 50
+local delta_full_countdown = 0
+local commit_at = ffi.new("struct led_commit_at")
+commit_at.hdr.length = le16(ffi.sizeof("struct led_commit_at"))
+commit_at.hdr.addr = 0xFF
+commit_at.hdr.cmd = ffi.C.LED_COMMIT_AT
 
 -- convenience wrapper to do endianess conversion on all the values
 -- of an LED at once
@@ -316,10 +441,82 @@ ledapi:effect_add(-1, "COMMIT", function(t)
 	-- 1ms - and this will generate too long pauses on the light bus
 	-- as a result, so controllers will drop packages as incomplete
 	-- if those pauses happen in the middle of a packet.
-	lbus.check(lbus_ctx:lbus_tx(cmd.A, ffi.sizeof(cmd.A)*2))
-	lbus.check(lbus_ctx:lbus_tx(cmd.C, ffi.sizeof(cmd.C)*2))
-	lbus.check(lbus_ctx:lbus_tx(cmd.E, ffi.sizeof(cmd.E)*2))
-	lbus.check(lbus_ctx:lbus_tx(cmd.commit, ffi.sizeof(cmd.commit)))
+	if marks or baudrate or sync then
+		negotiate_countdown = negotiate_countdown - 1
+		if negotiate_countdown <= 0 then
+			if baudrate then
+				-- a controller that does not answer might have been
+				-- reset: only then, the request also goes out at the
+				-- safe rate, which the others see as garbage
+				for addr = 0x02, 0x07 do
+					lbus_ctx:lbus_ping(addr)
+				end
+				lbus.check(lbus_ctx:lbus_set_baudrate(baudrate, false))
+			end
+			if marks then
+				lbus.check(lbus_ctx:lbus_set_framing(FRAMING_ADDRESS_MARK))
+			end
+			if sync then
+				lbus.check(lbus_ctx:lbus_time_sync(bus_time()))
+			end
+			negotiate_countdown = negotiate_interval
+		end
+	end
+	if frame then
+		-- controllers 2..7 in order of their LED groups. This is
+		-- a single packet of more than 64 bytes, so see above.
+		local n = ffi.sizeof(cmd.A.v)
+		ffi.copy(frame_cmd.v + 0, cmd.A.v, n)
+		ffi.copy(frame_cmd.v + 4, cmd.B.v, n)
+		ffi.copy(frame_cmd.v + 8, cmd.C.v, n)
+		ffi.copy(frame_cmd.v + 12, cmd.D.v, n)
+		ffi.copy(frame_cmd.v + 16, cmd.E.v, n)
+		ffi.copy(frame_cmd.v + 20, cmd.F.v, n)
+		if delta then
+			local v = ffi.cast("uint16_t*", frame_cmd.v)
+			for i = 0, delta_count-1 do
+				delta_values[i] = le16(v[i])
+			end
+			local previous = delta_previous
+			delta_full_countdown = delta_full_countdown - 1
+			if delta_full_countdown <= 0 then
+				previous = nil
+				delta_full_countdown = delta_full_interval
+			end
+			lbus.check(lbus_ctx:lbus_led_set_delta(0xFF,
+				DELTA_FRAME + (sync and 0 or DELTA_COMMIT),
+				delta_count, previous, delta_values))
+			ffi.copy(delta_previous, delta_values, ffi.sizeof(delta_values))
+		else
+			lbus.check(lbus_ctx:lbus_tx(frame_cmd, ffi.sizeof(frame_cmd)))
+		end
+	else
+		if compact == nil then
+			compact_countdown = compact_countdown - 1
+			if compact_countdown <= 0 then
+				compact_check()
+				compact_countdown = negotiate_interval
+			end
+		end
+		local n = ffi.sizeof(cmd.A.v)
+		for i = 0, 2 do
+			if compact or (compact == nil and compact_pair[i]) then
+				ffi.copy(compact_cmd[i].X.v, set_cmd[2*i].v, n)
+				ffi.copy(compact_cmd[i].Y.v, set_cmd[2*i+1].v, n)
+				lbus.check(lbus_ctx:lbus_tx(compact_cmd[i], ffi.sizeof(compact_cmd[i])))
+			else
+				-- two LED_SET_16BIT packets, they follow each other in cmd
+				lbus.check(lbus_ctx:lbus_tx(set_cmd[2*i], ffi.sizeof(cmd.A)*2))
+			end
+		end
+		if not sync then
+			lbus.check(lbus_ctx:lbus_tx(cmd.commit, ffi.sizeof(cmd.commit)))
+		end
+	end
+	if sync then
+		commit_at.time = le32((bus_time() + COMMIT_DELAY) % 0x100000000)
+		lbus.check(lbus_ctx:lbus_tx(commit_at, ffi.sizeof(commit_at)))
+	end
 end)
 
 
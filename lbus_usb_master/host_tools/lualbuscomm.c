@@ -82,6 +82,71 @@ static int llbus_led_set_16bit(lua_State* L) {
 	return 0;
 }
 
+static int llbus_led_set_8bit(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	int offset = luaL_checkinteger(L, 3);
+	if(offset < 0 || offset > 0xFFFF)
+		return luaL_error(L, "invalid offset given");
+	if(!lua_istable(L, 4))
+		return luaL_error(L, "no value table given");
+	int len = 0;
+	uint8_t values[1024];
+	lua_pushnil(L);
+	while(len < 1024 && lua_next(L, 4) != 0) {
+		values[len++] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	test_error(L, lbus_led_set_8bit(C, dst, offset, len, values), "lbus_led_set_8bit()");
+	return 0;
+}
+
+static int llbus_led_frame(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int flags = luaL_checkinteger(L, 2);
+	if(!lua_istable(L, 3))
+		return luaL_error(L, "no value table given");
+	int len = 0;
+	uint16_t values[4096];
+	lua_pushnil(L);
+	while(len < 4096 && lua_next(L, 3) != 0) {
+		values[len++] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	test_error(L, lbus_led_frame(C, flags, len, values), "lbus_led_frame()");
+	return 0;
+}
+
+static int llbus_led_set_delta(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	int flags = luaL_checkinteger(L, 3);
+	if(!lua_istable(L, 4))
+		return luaL_error(L, "no value table given");
+	int len = 0;
+	uint16_t values[4096];
+	lua_pushnil(L);
+	while(len < 4096 && lua_next(L, 4) != 0) {
+		values[len++] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	/* optional table of previous values */
+	uint16_t previous[4096];
+	bool have_previous = lua_istable(L, 5);
+	if(have_previous) {
+		int plen = 0;
+		lua_pushnil(L);
+		while(plen < 4096 && lua_next(L, 5) != 0) {
+			previous[plen++] = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		if(plen != len)
+			return luaL_error(L, "previous and current value tables differ in size");
+	}
+	test_error(L, lbus_led_set_delta(C, dst, flags, len, have_previous ? previous : NULL, values), "lbus_led_set_delta()");
+	return 0;
+}
+
 static int llbus_led_commit(lua_State* L) {
 	lbus_ctx *C = checklbusctx(L, 1);
 	int dst = checkdst(L, 2);
@@ -89,6 +154,30 @@ static int llbus_led_commit(lua_State* L) {
 	return 0;
 }
 
+static int llbus_led_commit_at(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	uint32_t time = luaL_checknumber(L, 3);
+	test_error(L, lbus_led_commit_at(C, dst, time), "lbus_led_commit_at()");
+	return 0;
+}
+
+static int llbus_time_sync(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	uint32_t time = luaL_checknumber(L, 2);
+	test_error(L, lbus_time_sync(C, time), "lbus_time_sync()");
+	return 0;
+}
+
+static int llbus_set_timeout(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int chars = luaL_checkinteger(L, 2);
+	if(chars < 0 || chars > 0xFFFF)
+		return luaL_error(L, "invalid timeout given");
+	test_error(L, lbus_set_timeout(C, chars), "lbus_set_timeout()");
+	return 0;
+}
+
 static int llbus_ping(lua_State* L) {
 	lbus_ctx *C = checklbusctx(L, 1);
 	int dst = checkdst(L, 2);
@@ -151,6 +240,158 @@ static int llbus_get_config(lua_State* L) {
 	}
 }
 
+/* get_config_multi(dst, {type, ...}, length): returns a table of the
+ * items' data as strings, keyed by type
+ */
+static int llbus_get_config_multi(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	if(!lua_istable(L, 3))
+		return luaL_error(L, "no type table given");
+	int length = luaL_checkinteger(L, 4);
+	if(length < 0 || length > 4096)
+		return luaL_error(L, "unsupported length given");
+	int count = 0;
+	uint16_t types[LBUS_DATA_MULTI_MAX];
+	lua_pushnil(L);
+	while(lua_next(L, 3) != 0) {
+		int type = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if(count == LBUS_DATA_MULTI_MAX)
+			return luaL_error(L, "too many type IDs");
+		if(type < 1 || type > 0xFFFF)
+			return luaL_error(L, "bad type ID");
+		types[count++] = type;
+	}
+	uint8_t *buf = malloc(length);
+	if(buf == NULL)
+		return luaL_error(L, "cannot get memory");
+	int size = lbus_get_config_multi(C, dst, count, types, length, buf);
+	if(size < 0) {
+		free(buf);
+		test_error(L, size, "lbus_get_config_multi()");
+	}
+	lua_newtable(L);
+	for(int i=0; i<count; i++) {
+		const uint8_t *v;
+		int l = lbus_data_item_find(buf, size, types[i], &v);
+		if(l < 0)
+			continue;
+		lua_pushlstring(L, (const char*)v, l);
+		lua_rawseti(L, -2, types[i]);
+	}
+	free(buf);
+	return 1;
+}
+
+static int llbus_get_stats(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	bool reset = lua_toboolean(L, 3);
+	struct lbus_stats stats;
+	test_error(L, lbus_get_stats(C, dst, reset, &stats), "lbus_get_stats()");
+	lua_newtable(L);
+	lua_pushinteger(L, stats.bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, stats.packets);
+	lua_setfield(L, -2, "packets");
+	lua_pushinteger(L, stats.packets_for_us);
+	lua_setfield(L, -2, "packets_for_us");
+	lua_pushinteger(L, stats.packets_unhandled);
+	lua_setfield(L, -2, "packets_unhandled");
+	lua_pushinteger(L, stats.timeouts);
+	lua_setfield(L, -2, "timeouts");
+	lua_pushinteger(L, stats.overrun_errors);
+	lua_setfield(L, -2, "overrun_errors");
+	lua_pushinteger(L, stats.framing_errors);
+	lua_setfield(L, -2, "framing_errors");
+	lua_pushinteger(L, stats.noise_errors);
+	lua_setfield(L, -2, "noise_errors");
+	return 1;
+}
+
+/* get_capabilities(dst): returns a table with flags, max_length,
+ * baudrate_max, channels and a table of the supported commands (as keys),
+ * or nil for slaves that do not report their capabilities
+ */
+static int llbus_get_capabilities(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	struct lbus_capabilities caps;
+	if(!test_error(L, lbus_get_capabilities(C, dst, &caps), "lbus_get_capabilities()")) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_newtable(L);
+	lua_pushinteger(L, caps.flags);
+	lua_setfield(L, -2, "flags");
+	lua_pushinteger(L, caps.max_length);
+	lua_setfield(L, -2, "max_length");
+	lua_pushinteger(L, caps.baudrate_max);
+	lua_setfield(L, -2, "baudrate_max");
+	lua_pushinteger(L, caps.channels);
+	lua_setfield(L, -2, "channels");
+	lua_newtable(L);
+	for(int i=0; i<LBUS_CAP_COMMAND_BYTES*8; i++) {
+		if(lbus_cap_has_command(caps.commands, i)) {
+			lua_pushboolean(L, 1);
+			lua_rawseti(L, -2, i);
+		}
+	}
+	lua_setfield(L, -2, "commands");
+	return 1;
+}
+
+static int llbus_get_profile(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	int probe = luaL_checkinteger(L, 3);
+	bool reset = lua_toboolean(L, 4);
+	if(probe < 0 || probe >= LBUS_PROFILE_PROBES)
+		return luaL_error(L, "invalid probe");
+	struct lbus_profile prof;
+	test_error(L, lbus_get_profile(C, dst, probe, reset, &prof), "lbus_get_profile()");
+	lua_newtable(L);
+	lua_pushnumber(L, prof.total);
+	lua_setfield(L, -2, "total");
+	lua_pushinteger(L, prof.count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, prof.min);
+	lua_setfield(L, -2, "min");
+	lua_pushinteger(L, prof.max);
+	lua_setfield(L, -2, "max");
+	lua_newtable(L);
+	for(int i=0; i<LBUS_PROFILE_BUCKETS; i++) {
+		lua_pushinteger(L, prof.histogram[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_setfield(L, -2, "histogram");
+	return 1;
+}
+
+static int llbus_scan(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int first = luaL_optinteger(L, 2, 1);
+	int count = luaL_optinteger(L, 3, 127);
+	int slot = luaL_optinteger(L, 4, 0);
+	if(first < 0 || count < 1 || first + count > 0x100 || slot < 0 || slot > 0xFF)
+		return luaL_error(L, "invalid scan range given");
+	struct lbus_scan nodes[0xFF];
+	int found = test_error(L, lbus_scan(C, first, count, slot, nodes), "lbus_scan()");
+	lua_newtable(L);
+	for(int i=0; i<found; i++) {
+		lua_newtable(L);
+		lua_pushinteger(L, nodes[i].status);
+		lua_setfield(L, -2, "status");
+		lua_pushinteger(L, nodes[i].version);
+		lua_setfield(L, -2, "version");
+		lua_pushinteger(L, nodes[i].name_hash);
+		lua_setfield(L, -2, "name_hash");
+		lua_rawseti(L, -2, nodes[i].addr);
+	}
+	return 1;
+}
+
 static int llbus_set_address(lua_State* L) {
 	lbus_ctx *C = checklbusctx(L, 1);
 	int dst = checkdst(L, 2);
@@ -161,6 +402,49 @@ static int llbus_set_address(lua_State* L) {
 	return 1;
 }
 
+static int llbus_set_groups(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	if(!lua_istable(L, 3))
+		return luaL_error(L, "no group table given");
+	int count = 0;
+	uint8_t groups[LBUS_MAX_GROUPS];
+	lua_pushnil(L);
+	while(lua_next(L, 3) != 0) {
+		if(count >= LBUS_MAX_GROUPS)
+			return luaL_error(L, "too many groups given");
+		groups[count++] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pushinteger(L, test_error(L, lbus_set_groups(C, dst, count, groups), "lbus_set_groups()"));
+	return 1;
+}
+
+static int llbus_set_led_group(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	int group = luaL_checkinteger(L, 3);
+	if(group < 0 || group > 0xFFFF)
+		return luaL_error(L, "invalid group given");
+	lua_pushinteger(L, test_error(L, lbus_set_led_group(C, dst, group), "lbus_set_led_group()"));
+	return 1;
+}
+
+static int llbus_set_framing(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int framing = luaL_checkinteger(L, 2);
+	lua_pushinteger(L, test_error(L, lbus_set_framing(C, framing), "lbus_set_framing()"));
+	return 1;
+}
+
+static int llbus_set_baudrate(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	uint32_t baudrate = luaL_checkinteger(L, 2);
+	bool persist = lua_toboolean(L, 3);
+	lua_pushinteger(L, test_error(L, lbus_set_baudrate(C, baudrate, persist), "lbus_set_baudrate()"));
+	return 1;
+}
+
 static int llbus_read_memory(lua_State* L) {
 	lbus_ctx *C = checklbusctx(L, 1);
 	int dst = checkdst(L, 2);
@@ -177,6 +461,37 @@ static int llbus_read_memory(lua_State* L) {
 	return 2;
 }
 
+/* config_read(dst, type): returns the item data and its length */
+static int llbus_config_read(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	const uint32_t type = (uint32_t)luaL_checkinteger(L, 3);
+	int size = test_error(L, lbus_config_read(C, dst, type, 0, NULL), "lbus_config_read()");
+	uint8_t *buf = malloc(size > 0 ? size : 1);
+	if(buf == NULL)
+		return luaL_error(L, "cannot claim memory");
+	int r = test_error(L, lbus_config_read(C, dst, type, size, buf), "lbus_config_read()");
+	if(r > size)
+		r = size;
+	lua_pushlstring(L, (const char*)buf, r);
+	free(buf);
+	lua_pushinteger(L, r);
+	return 2;
+}
+
+/* config_write(dst, type, data): returns the status byte, 0 on success */
+static int llbus_config_write(lua_State* L) {
+	lbus_ctx *C = checklbusctx(L, 1);
+	int dst = checkdst(L, 2);
+	const uint32_t type = (uint32_t)luaL_checkinteger(L, 3);
+	size_t length;
+	const char* data = luaL_checklstring(L, 4, &length);
+	if(length > LBUS_CONFIG_MAX)
+		return luaL_error(L, "item is too large");
+	lua_pushinteger(L, test_error(L, lbus_config_write(C, dst, type, (int)length, data), "lbus_config_write()"));
+	return 1;
+}
+
 static int llbus_flash_firmware(lua_State* L) {
 	lbus_ctx *C = checklbusctx(L, 1);
 	int dst = checkdst(L, 2);
@@ -212,14 +527,31 @@ static const struct luaL_Reg lbus_methods[] = {
 	{ "__gc",			llbus_free },
 	{ "busmaster_echo",		llbus_busmaster_echo },
 	{ "led_set_16bit",		llbus_led_set_16bit },
+	{ "led_set_8bit",		llbus_led_set_8bit },
+	{ "led_frame",			llbus_led_frame },
+	{ "led_set_delta",		llbus_led_set_delta },
 	{ "led_commit",			llbus_led_commit },
+	{ "led_commit_at",		llbus_led_commit_at },
+	{ "time_sync",			llbus_time_sync },
+	{ "set_timeout",		llbus_set_timeout },
 	{ "ping",			llbus_ping },
 	{ "reset_to_bootloader",	llbus_reset_to_bootloader },
 	{ "reset_to_firmware",		llbus_reset_to_firmware },
 	{ "erase_config",		llbus_erase_config },
 	{ "get_config",			llbus_get_config },
+	{ "get_config_multi",		llbus_get_config_multi },
+	{ "get_stats",			llbus_get_stats },
+	{ "get_capabilities",		llbus_get_capabilities },
+	{ "get_profile",		llbus_get_profile },
+	{ "scan",			llbus_scan },
 	{ "set_address",		llbus_set_address },
+	{ "set_groups",			llbus_set_groups },
+	{ "set_led_group",		llbus_set_led_group },
+	{ "set_framing",		llbus_set_framing },
+	{ "set_baudrate",		llbus_set_baudrate },
 	{ "read_memory",		llbus_read_memory },
+	{ "config_read",		llbus_config_read },
+	{ "config_write",		llbus_config_write },
 	{ "flash_firmware",		llbus_flash_firmware },
 	{ "tx",				llbus_tx },
 	{ "rx",				llbus_rx },
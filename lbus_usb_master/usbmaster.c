@@ -112,6 +112,55 @@ volatile int recv_tail=0;
 #define CMD_XMIT 1
 #define CMD_RECV 2
 #define CMD_ECHO 3
+/* like CMD_XMIT, but send an address mark first */
+#define CMD_XMIT_MARK 4
+/* set framing (enum lbus_framing) */
+#define CMD_FRAMING 5
+/* set baud rate (uint32_t, little endian) */
+#define CMD_BAUDRATE 6
+
+/* The data of CMD_XMIT comes in USB packets of up to 63 bytes. The MAX485
+ * keeps driving the bus until the LBUS packet being sent is complete, as
+ * given by the length in its header, so there is no floating line between
+ * the USB packets. Any other command ends the transmission, too.
+ */
+static bool xmit_driving;
+static unsigned int xmit_pos, xmit_length;
+
+static void xmit_begin(void) {
+	if(xmit_driving)
+		return;
+	USART_CR1(LBUS_USART) &= ~USART_CR1_RE;
+	__asm__("nop");
+	gpio_set(LBUS_RE_GPIO, LBUS_RE_PIN);
+	gpio_set(LBUS_DE_GPIO, LBUS_DE_PIN);
+	for(int i=0; i<100; i++) __asm__("nop");
+	xmit_driving = true;
+}
+
+static void xmit_end(void) {
+	xmit_pos = 0;
+	if(!xmit_driving)
+		return;
+	while((USART_SR(LBUS_USART) & USART_SR_TC) == 0) __asm("nop");
+	recv_tail = recv_head; // drop current RX queue contents
+	gpio_clear(LBUS_DE_GPIO, LBUS_DE_PIN);
+	gpio_clear(LBUS_RE_GPIO, LBUS_RE_PIN);
+	for(int i=0; i<80; i++) __asm__("nop");
+	USART_CR1(LBUS_USART) |= USART_CR1_RE;
+	xmit_driving = false;
+}
+
+/* follow the LBUS packets in the data sent, by their length field */
+static void xmit_track(const uint8_t b) {
+	if(xmit_pos == 0)
+		xmit_length = b;
+	else if(xmit_pos == 1)
+		xmit_length |= b << 8;
+	if(++xmit_pos >= 2 && xmit_pos >= xmit_length)
+		xmit_pos = 0;
+}
+
 static void usbmaster_receive_cb(usbd_device *usbd_dev, uint8_t ep) {
 	(void)ep;
 	(void)usbd_dev;
@@ -123,22 +172,24 @@ static void usbmaster_receive_cb(usbd_device *usbd_dev, uint8_t ep) {
 	if(len < 1) return;
 	const uint8_t cmd = buf[0];
 
-	if(cmd == CMD_XMIT) {
-		USART_CR1(LBUS_USART) &= ~USART_CR1_RE;
-		__asm__("nop");
-		gpio_set(LBUS_RE_GPIO, LBUS_RE_PIN);
-		gpio_set(LBUS_DE_GPIO, LBUS_DE_PIN);
-		for(int i=0; i<100; i++) __asm__("nop");
+	if(cmd == CMD_XMIT || cmd == CMD_XMIT_MARK) {
+		xmit_begin();
+		if(cmd == CMD_XMIT_MARK) {
+			/* a new packet starts here */
+			xmit_pos = 0;
+			usart_send_blocking(LBUS_USART, LBUS_ADDRESS_MARK);
+		}
 		for(int i=1; i<len; i++) {
 			usart_send_blocking(LBUS_USART, buf[i]);
+			xmit_track(buf[i]);
 		}
-		while((USART_SR(LBUS_USART) & USART_SR_TC) == 0) __asm("nop");
-		recv_tail = recv_head; // drop current RX queue contents
-		gpio_clear(LBUS_DE_GPIO, LBUS_DE_PIN);
-		gpio_clear(LBUS_RE_GPIO, LBUS_RE_PIN);
-		for(int i=0; i<80; i++) __asm__("nop");
-		USART_CR1(LBUS_USART) |= USART_CR1_RE;
-	} else if(cmd == CMD_RECV) {
+		/* otherwise, the rest follows in the next USB packet */
+		if(xmit_pos == 0)
+			xmit_end();
+		return;
+	}
+	xmit_end();
+	if(cmd == CMD_RECV) {
 		if(len < 2) return;
 		const uint8_t size = buf[1];
 		TIM1_CNT = 0;
@@ -157,6 +208,19 @@ static void usbmaster_receive_cb(usbd_device *usbd_dev, uint8_t ep) {
 		TIM_CR1(TIM1) &= ~TIM_CR1_CEN;
 	} else if(cmd == CMD_ECHO) {
 		usbd_ep_write_packet(usbd_dev, 0x82, buf+1, len-1);
+	} else if(cmd == CMD_FRAMING) {
+		if(len < 2) return;
+		/* 9 bit frames for address marks */
+		if(buf[1] == LBUS_FRAMING_ADDRESS_MARK) {
+			USART_CR1(LBUS_USART) |= USART_CR1_M;
+		} else {
+			USART_CR1(LBUS_USART) &= ~USART_CR1_M;
+		}
+	} else if(cmd == CMD_BAUDRATE) {
+		if(len < 5) return;
+		const uint32_t baudrate = buf[1] | (buf[2] << 8) | (buf[3] << 16) | ((uint32_t)buf[4] << 24);
+		if(baudrate < LBUS_BAUDRATE_SAFE || baudrate > LBUS_BAUDRATE_MAX) return;
+		usart_set_baudrate(LBUS_USART, baudrate);
 	}
 }
 